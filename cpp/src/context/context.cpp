@@ -1,7 +1,9 @@
 #include "context/context.hpp"
 
 #include <algorithm>
+#include <functional>
 #include <limits>
+#include <mutex>
 #include <utility>
 
 #include "core/optics.hpp"
@@ -11,6 +13,132 @@
 
 namespace icehalo {
 
+RayPathCache::RayPathCache() : key_(0), max_path_len_(kDefaultMaxPathLength) {}
+
+
+uint64_t RayPathCache::GetKey() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return key_;
+}
+
+
+void RayPathCache::SetKey(uint64_t key) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  if (key != key_) {
+    map_.clear();
+    key_ = key;
+  }
+}
+
+
+size_t RayPathCache::Size() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return map_.size();
+}
+
+
+void RayPathCache::Clear() {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  map_.clear();
+}
+
+
+void RayPathCache::SetMaxPathLength(size_t len) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  max_path_len_ = len;
+}
+
+
+bool RayPathCache::Find(size_t hash, RayPathMap::mapped_type* result) const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  auto iter = map_.find(hash);
+  if (iter == map_.end()) {
+    return false;
+  }
+  if (result) {
+    *result = iter->second;
+  }
+  return true;
+}
+
+
+void RayPathCache::Insert(size_t hash, const RayPath& ray_path, size_t normalized_hash) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  if (map_.size() >= kMaxSize) {
+    return;
+  }
+  map_.emplace(hash, std::make_pair(ray_path, normalized_hash));
+}
+
+
+void RayPathCache::Serialize(File& file, bool with_boi) const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  if (with_boi) {
+    file.Write(ISerializable::kDefaultBoi);
+  }
+
+  file.Write(key_);
+  uint64_t num = map_.size();
+  file.Write(num);
+  for (const auto& [hash, entry] : map_) {
+    uint64_t h[2]{ hash, entry.second };
+    file.Write(h, 2);
+    uint32_t len = entry.first.len;
+    file.Write(len);
+    file.Write(entry.first.ids, len);
+  }
+}
+
+
+void RayPathCache::Deserialize(File& file, endian::Endianness endianness) {
+  endianness = CheckEndianness(file, endianness);
+  bool need_swap = (endianness != endian::kCompileEndian);
+
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  uint64_t key = 0;
+  file.Read(&key);
+  if (need_swap) {
+    endian::ByteSwap::Swap(&key);
+  }
+  if (key != key_) {
+    // Made by different crystal settings. Keep current entries.
+    return;
+  }
+
+  uint64_t num = 0;
+  file.Read(&num);
+  if (need_swap) {
+    endian::ByteSwap::Swap(&num);
+  }
+  for (uint64_t i = 0; i < num && map_.size() < kMaxSize; i++) {
+    uint64_t h[2]{};
+    uint32_t len = 0;
+    if (file.Read(h, 2) != sizeof(h) || file.Read(&len) != sizeof(len)) {
+      LOG_WARNING("Ray path cache is truncated!");
+      return;
+    }
+    if (need_swap) {
+      endian::ByteSwap::Swap(h, 2);
+      endian::ByteSwap::Swap(&len);
+    }
+    if (len > max_path_len_) {
+      LOG_WARNING("Ray path cache is corrupted!");
+      return;
+    }
+    RayPath ray_path(len);
+    if (file.Read(ray_path.ids, len) != len * sizeof(ShortIdType)) {
+      LOG_WARNING("Ray path cache is truncated!");
+      return;
+    }
+    if (need_swap) {
+      endian::ByteSwap::Swap(ray_path.ids, len);
+    }
+    ray_path.len = len;
+    map_.emplace(h[0], std::make_pair(std::move(ray_path), h[1]));
+  }
+}
+
+
 ProjectContextPtrU ProjectContext::CreateFromFile(const char* filename) {
   LOG_VERBOSE("Reading config from: %s", filename);
 
@@ -186,6 +314,7 @@ void ProjectContext::ParseCrystalSettings(const nlohmann::json& obj) {
     c.get_to(*crystal);
     crystal_store_.emplace_back(std::move(crystal));
   }
+  ray_path_cache_.SetKey(std::hash<std::string>{}(obj.at("crystal").dump()));
 
   PrintCrystalInfo();
 }
@@ -214,6 +343,9 @@ void ProjectContext::ParseMultiScatterSettings(const nlohmann::json& obj) {
     s.get_to(*scatter);
     multi_scatter_info_.emplace_back(std::move(scatter));
   }
+
+  // A path has crystal id, faces and an end mark for every scatter.
+  ray_path_cache_.SetMaxPathLength(multi_scatter_info_.size() * (kMaxRayHitNum + 2));
 }
 
 
@@ -236,4 +368,26 @@ RayPath ProjectContext::GetRayPath(const RaySegment* last_ray) {
 }
 
 
+bool ProjectContext::LoadRayPathCache() {
+  File file(data_path_.c_str(), kRayPathCacheFilename);
+  if (!file.Open(FileOpenMode::kRead)) {
+    return false;
+  }
+  ray_path_cache_.Deserialize(file, endian::kUnknownEndian);
+  file.Close();
+  return ray_path_cache_.Size() > 0;
+}
+
+
+void ProjectContext::SaveRayPathCache() const {
+  File file(data_path_.c_str(), kRayPathCacheFilename);
+  if (!file.Open(FileOpenMode::kWrite)) {
+    LOG_ERROR("Cannot write ray path cache!");
+    return;
+  }
+  ray_path_cache_.Serialize(file, true);
+  file.Close();
+}
+
+
 }  // namespace icehalo
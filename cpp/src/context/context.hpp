@@ -3,6 +3,7 @@
 
 #include <limits>
 #include <memory>
+#include <shared_mutex>
 #include <string>
 #include <vector>
 
@@ -27,6 +28,73 @@ struct WavelengthInfo {
 };
 
 
+/**
+ * @brief A thread-safe cache of ray paths, from raw path hash to (ray path, normalized hash).
+ *
+ * Distinct ray paths are mostly decided by crystal geometry, so the same paths come again for every
+ * wavelength and every repeat. SimulationData::MakeRayPathMap() looks up here before normalizing a path,
+ * and puts both the raw path and the normalized path here.
+ *
+ * The cache is bound to crystal settings by a key. If the key changes, or a serialized cache has a different
+ * key, all entries are dropped.
+ *
+ * The cache holds at most kMaxSize entries. New paths beyond that are not cached, but are still normalized
+ * by the caller as usual.
+ */
+class RayPathCache : public ISerializable {
+ public:
+  RayPathCache();
+
+  uint64_t GetKey() const;
+  void SetKey(uint64_t key);
+
+  size_t Size() const;
+  void Clear();
+
+  /**
+   * @brief Sets max length of a ray path. A serialized path longer than it is treated as corrupted.
+   */
+  void SetMaxPathLength(size_t len);
+
+  /**
+   * @brief Finds a path by its hash.
+   *
+   * @param hash
+   * @param result [output] (ray path, normalized hash). Can be nullptr.
+   * @return false if not found.
+   */
+  bool Find(size_t hash, RayPathMap::mapped_type* result) const;
+
+  /**
+   * @brief Inserts a path. An existing entry is kept as is. Nothing is inserted if the cache is full.
+   */
+  void Insert(size_t hash, const RayPath& ray_path, size_t normalized_hash);
+
+  /**
+   * @brief Serialize cache into a file.
+   *
+   * The file layout is:
+   * BOI,                     // (optional) uint32
+   * key,                     // uint64
+   * entry number,            // uint64
+   * hash, normalized hash,   // uint64 * 2, for each entry
+   * path length, path ids,   // uint32 + uint16 * length, for each entry
+   * ...
+   */
+  void Serialize(File& file, bool with_boi) const override;
+  void Deserialize(File& file, endian::Endianness endianness) override;
+
+  static constexpr size_t kMaxSize = 1 << 18;
+  static constexpr size_t kDefaultMaxPathLength = 64;
+
+ private:
+  mutable std::shared_mutex mutex_;
+  uint64_t key_;
+  size_t max_path_len_;
+  RayPathMap map_;
+};
+
+
 class ProjectContext {
  public:
   size_t GetInitRayNum() const;
@@ -46,6 +114,14 @@ class ProjectContext {
   AbstractRayPathFilter* GetRayPathFilter(ShortIdType id) const;
   RayPath GetRayPath(const RaySegment* last_ray);
 
+  /**
+   * @brief Loads ray path cache from data directory.
+   *
+   * @return false if there is no cache file, or it is made by different crystal settings.
+   */
+  bool LoadRayPathCache();
+  void SaveRayPathCache() const;
+
   static ProjectContextPtrU CreateFromFile(const char* filename);
   static ProjectContextPtrU CreateDefault();
 
@@ -58,6 +134,7 @@ class ProjectContext {
   static constexpr int kMinRayHitNum = 1;
   static constexpr int kMaxRayHitNum = 12;
   static constexpr int kDefaultRayHitNum = 8;
+  static constexpr const char* kRayPathCacheFilename = "ray_path_cache.bin";
 
   SunContextPtr sun_ctx_;
   CameraContextPtr cam_ctx_;
@@ -65,6 +142,7 @@ class ProjectContext {
   RenderContextPtr split_render_ctx_;
   std::vector<WavelengthInfo> wavelengths_;  // (wavelength, weight)
   std::vector<MultiScatterContextPtrU> multi_scatter_info_;
+  RayPathCache ray_path_cache_;  // raw hash --> (ray path, normalized hash), kept across simulations
 
  private:
   ProjectContext();
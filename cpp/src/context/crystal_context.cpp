@@ -265,30 +265,119 @@ AxisDistribution CrystalContext::GetAxisDistribution() const {
 }
 
 
-int CrystalContext::RandomSampleFace(const float* ray_dir, float* prob_buf) const {
-  int total_faces = crystal_->TotalFaces();
-  const auto* face_norm = crystal_->GetFaceNorm();
-  const auto* face_area = crystal_->GetFaceArea();
-
-  std::unique_ptr<float[]> face_prob_buf;
-  if (!prob_buf) {
-    face_prob_buf.reset(new float[total_faces]);
-    prob_buf = face_prob_buf.get();
-  }
+namespace {
+
+constexpr int kMaxFaceSampleRounds = 64;
+
+// Picks a face with probability proportional to its area. It uses only one uniform number: the integer part
+// selects a column of the alias table, and the fractional part decides between the column and its alias.
+int PickFaceByArea(const Crystal* crystal, float u) {
+  int total_faces = crystal->TotalFaces();
+  float x = u * total_faces;
+  int k = std::min(static_cast<int>(x), total_faces - 1);
+  return x - k < crystal->GetFaceAliasProb()[k] ? k : crystal->GetFaceAliasIndex()[k];
+}
+
+
+// Projected area of a face is area * cos(theta). A face is picked by area, then accepted with probability
+// cos(theta), thus the result has exactly the distribution of projected area.
+float FaceAcceptProbability(const Crystal* crystal, int face_id, const float* ray_dir) {
+  return -Dot3(crystal->GetFaceNorm() + face_id * 3, ray_dir);
+}
+
+
+// Fallback for rays that are rejected too many times. A two-pass CDF scan without buffer.
+int SampleFaceByCdf(const Crystal* crystal, const float* ray_dir, float u) {
+  int total_faces = crystal->TotalFaces();
+  const auto* face_norm = crystal->GetFaceNorm();
+  const auto* face_area = crystal->GetFaceArea();
+  auto get_weight = [=](int k) {
+    if (std::isnan(face_norm[k * 3 + 0]) || face_area[k] <= 0) {
+      return 0.0f;
+    }
+    return std::max(-Dot3(face_norm + k * 3, ray_dir) * face_area[k], 0.0f);
+  };
 
   float sum = 0;
   for (int k = 0; k < total_faces; k++) {
-    prob_buf[k] = 0;
-    if (!std::isnan(face_norm[k * 3 + 0]) && face_area[k] > 0) {
-      prob_buf[k] = std::max(-Dot3(face_norm + k * 3, ray_dir) * face_area[k], 0.0f);
-      sum += prob_buf[k];
-    }
+    sum += get_weight(k);
   }
+  u *= sum;
+  int last_valid = -1;
   for (int k = 0; k < total_faces; k++) {
-    prob_buf[k] /= sum;
+    auto w = get_weight(k);
+    if (w <= 0) {
+      continue;
+    }
+    last_valid = k;
+    if (u < w) {
+      return k;
+    }
+    u -= w;
+  }
+  return last_valid;
+}
+
+
+template <class Rng>
+int SampleFaceImpl(Rng* rng, const Crystal* crystal, const float* ray_dir) {
+  for (int i = 0; i < kMaxFaceSampleRounds; i++) {
+    auto k = PickFaceByArea(crystal, rng->GetUniform());
+    if (rng->GetUniform() < FaceAcceptProbability(crystal, k, ray_dir)) {
+      return k;
+    }
   }
+  return SampleFaceByCdf(crystal, ray_dir, rng->GetUniform());
+}
+
+}  // namespace
+
 
-  return static_cast<ShortIdType>(RandomSampler::SampleInt(prob_buf, total_faces));
+int CrystalContext::RandomSampleFace(const float* ray_dir) const {
+  return SampleFaceImpl(RandomNumberGenerator::GetInstance(), crystal_.get(), ray_dir);
+}
+
+
+int CrystalContext::RandomSampleFace(RandomStream* rng, const float* ray_dir) const {
+  return SampleFaceImpl(rng, crystal_.get(), ray_dir);
+}
+
+
+void CrystalContext::RandomSampleFace(RandomStreamBatch* rng, const float* const* ray_dir, int* face_id) const {
+  auto num = rng->Size();
+  std::unique_ptr<float[]> u{ new float[num * 2] };
+  auto* u_pick = u.get();
+  auto* u_accept = u.get() + num;
+
+  // All rays draw in lockstep rounds, so that the result is the same as RandomSampleFace(RandomStream*, ...)
+  size_t remaining = num;
+  for (size_t i = 0; i < num; i++) {
+    face_id[i] = -1;
+  }
+  for (int r = 0; r < kMaxFaceSampleRounds && remaining > 0; r++) {
+    rng->GetUniform(u_pick);
+    rng->GetUniform(u_accept);
+    for (size_t i = 0; i < num; i++) {
+      if (face_id[i] >= 0) {
+        continue;
+      }
+      float curr_dir[3]{ ray_dir[0][i], ray_dir[1][i], ray_dir[2][i] };
+      auto k = PickFaceByArea(crystal_.get(), u_pick[i]);
+      if (u_accept[i] < FaceAcceptProbability(crystal_.get(), k, curr_dir)) {
+        face_id[i] = k;
+        remaining--;
+      }
+    }
+  }
+  if (remaining > 0) {
+    rng->GetUniform(u_pick);
+    for (size_t i = 0; i < num; i++) {
+      if (face_id[i] < 0) {
+        float curr_dir[3]{ ray_dir[0][i], ray_dir[1][i], ray_dir[2][i] };
+        face_id[i] = SampleFaceByCdf(crystal_.get(), curr_dir, u_pick[i]);
+      }
+    }
+  }
 }
 
 
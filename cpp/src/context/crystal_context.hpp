@@ -19,7 +19,29 @@ class CrystalContext {
   const Crystal* GetCrystal() const;
   AxisDistribution GetAxisDistribution() const;
 
-  int RandomSampleFace(const float* ray_dir, float* prob_buf = nullptr) const;
+  /**
+   * @brief Samples an entry face for a ray, with probability proportional to the projected area of faces.
+   *
+   * A face is picked from the area alias table (see Crystal::GetFaceAliasProb()) and accepted with
+   * probability cos(theta). It costs O(1) per try, about 4 tries for a convex crystal.
+   *
+   * @param ray_dir Ray direction, in crystal frame.
+   * @return Face ID.
+   */
+  int RandomSampleFace(const float* ray_dir) const;
+  int RandomSampleFace(RandomStream* rng, const float* ray_dir) const;
+
+  /**
+   * @brief Samples entry faces for a batch of rays.
+   *
+   * The number of draws of each ray is NOT fixed, so `rng` should be a dedicated stream.
+   * The result is the same as calling RandomSampleFace(RandomStream*, const float*) for each ray.
+   *
+   * @param rng Random streams.
+   * @param ray_dir Ray directions, SoA, ray_dir[0] for x, ray_dir[1] for y and ray_dir[2] for z.
+   * @param face_id Output face IDs.
+   */
+  void RandomSampleFace(RandomStreamBatch* rng, const float* const* ray_dir, int* face_id) const;
 
   void PrintCrystal() const;
 
@@ -95,7 +95,7 @@ void from_json(const nlohmann::json& obj, GridLine& line) {
 RenderContext::RenderContext()
     : ray_color_{ 1.0f, 1.0f, 1.0f }, background_color_{ 0.0f, 0.0f, 0.0f }, intensity_(1.0f), image_width_(0),
       image_height_(0), offset_x_(0), offset_y_(0), visible_range_(VisibleRange::kUpper),
-      color_compact_level_(ColorCompactLevel::kTrueColor) {}
+      color_compact_level_(ColorCompactLevel::kTrueColor), keep_spectrum_(false), sphere_histogram_size_(0) {}
 
 
 RenderContextPtrU RenderContext::CreateDefault() {
@@ -248,6 +248,16 @@ ColorCompactLevel RenderContext::GetColorCompactLevel() const {
 }
 
 
+bool RenderContext::GetKeepSpectrum() const {
+  return keep_spectrum_;
+}
+
+
+void RenderContext::SetKeepSpectrum(bool keep) {
+  keep_spectrum_ = keep;
+}
+
+
 VisibleRange RenderContext::GetVisibleRange() const {
   return visible_range_;
 }
@@ -268,6 +278,16 @@ const std::vector<GridLine>& RenderContext::GetRadiusGrids() const {
 }
 
 
+int RenderContext::GetSphereHistogramSize() const {
+  return sphere_histogram_size_;
+}
+
+
+void RenderContext::SetSphereHistogramSize(int size) {
+  sphere_histogram_size_ = std::clamp(size, 0, kMaxSphereHistogramSize);
+}
+
+
 void to_json(nlohmann::json& obj, const RenderContext& ctx) {
   ctx.SaveColorConfig(obj);
   ctx.SaveIntensity(obj);
@@ -276,11 +296,13 @@ void to_json(nlohmann::json& obj, const RenderContext& ctx) {
   ctx.SaveVisibleRange(obj);
   ctx.SaveRenderSplitter(obj);
   ctx.SaveGridLines(obj);
+  ctx.SaveSphereHistogram(obj);
 }
 
 
 void RenderContext::SaveColorConfig(nlohmann::json& obj) const {
   obj["ray_compact_level"] = color_compact_level_;
+  obj["keep_spectrum"] = keep_spectrum_;
   obj["background_color"][0] = background_color_[0];
   obj["background_color"][1] = background_color_[1];
   obj["background_color"][2] = background_color_[2];
@@ -332,6 +354,11 @@ void RenderContext::SaveGridLines(nlohmann::json& obj) const {
 }
 
 
+void RenderContext::SaveSphereHistogram(nlohmann::json& obj) const {
+  obj["sphere_histogram_size"] = sphere_histogram_size_;
+}
+
+
 void from_json(const nlohmann::json& obj, RenderContext& ctx) {
   ctx.LoadColorConfig(obj);
   ctx.LoadImageSize(obj);
@@ -340,6 +367,7 @@ void from_json(const nlohmann::json& obj, RenderContext& ctx) {
   ctx.LoadIntensity(obj);
   ctx.LoadRenderSplitter(obj);
   ctx.LoadGridLines(obj);
+  ctx.LoadSphereHistogram(obj);
 }
 
 
@@ -347,6 +375,9 @@ void RenderContext::LoadColorConfig(const nlohmann::json& obj) {
   SetColorCompactLevel(ColorCompactLevel::kTrueColor);
   JSON_CHECK_AND_APPLY_SIMPLE_VALUE(obj, "color_compact_level", ColorCompactLevel, SetColorCompactLevel)
 
+  SetKeepSpectrum(false);
+  JSON_CHECK_AND_APPLY_SIMPLE_VALUE(obj, "keep_spectrum", bool, SetKeepSpectrum)
+
   ResetBackgroundColor();
   auto r = obj.at("background_color")[0].get<float>();
   auto g = obj.at("background_color")[1].get<float>();
@@ -402,4 +433,10 @@ void RenderContext::LoadGridLines(const nlohmann::json& obj) {
   JSON_CHECK_AND_UPDATE_SIMPLE_VALUE(obj, "radius_grid", radius_rid_)
 }
 
+
+void RenderContext::LoadSphereHistogram(const nlohmann::json& obj) {
+  SetSphereHistogramSize(0);
+  JSON_CHECK_AND_APPLY_SIMPLE_VALUE(obj, "sphere_histogram_size", int, SetSphereHistogramSize)
+}
+
 }  // namespace icehalo
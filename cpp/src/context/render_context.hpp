@@ -137,12 +137,31 @@ class RenderContext {
   ColorCompactLevel GetColorCompactLevel() const;
   void SetColorCompactLevel(ColorCompactLevel level);
 
+  /**
+   * @brief Whether to keep one image per wavelength in true color mode.
+   *
+   * By default rays are folded into CIE XYZ (3 floats per pixel) as they are loaded, so memory does not grow
+   * with the number of wavelengths. If it is true, the raw spectral cube is kept, as in other compact levels.
+   */
+  bool GetKeepSpectrum() const;
+  void SetKeepSpectrum(bool keep);
+
   VisibleRange GetVisibleRange() const;
   void SetVisibleRange(VisibleRange r);
 
   const std::vector<GridLine>& GetElevationGrids() const;
   const std::vector<GridLine>& GetRadiusGrids() const;
 
+  /**
+   * @brief Resolution of direction-space histogram.
+   *
+   * If it is positive, rays are first binned into an N x N equal-area grid on the sphere (see
+   * SphereToEqualAreaSquare()), and the image is resampled from the grid at render time. Then a new view
+   * of the same data needs no projection of rays. If it is 0, every ray is projected onto image directly.
+   */
+  int GetSphereHistogramSize() const;
+  void SetSphereHistogramSize(int size);
+
   static RenderContextPtrU CreateDefault();
 
   static constexpr float kDefaultIntensity = 1.0f;
@@ -151,6 +170,7 @@ class RenderContext {
   static constexpr int kDefaultImageSize = 800;
   static constexpr int kMaxImageSize = 65535;
   static constexpr int kMaxTopHaloNumber = 300;
+  static constexpr int kMaxSphereHistogramSize = 8192;
 
   friend void to_json(nlohmann::json& obj, const RenderContext& ctx);
   friend void from_json(const nlohmann::json& obj, RenderContext& ctx);
@@ -165,6 +185,7 @@ class RenderContext {
   void LoadVisibleRange(const nlohmann::json& obj);
   void LoadRenderSplitter(const nlohmann::json& obj);
   void LoadGridLines(const nlohmann::json& obj);
+  void LoadSphereHistogram(const nlohmann::json& obj);
 
   void SaveColorConfig(nlohmann::json& obj) const;
   void SaveIntensity(nlohmann::json& obj) const;
@@ -173,6 +194,7 @@ class RenderContext {
   void SaveVisibleRange(nlohmann::json& obj) const;
   void SaveRenderSplitter(nlohmann::json& obj) const;
   void SaveGridLines(nlohmann::json& obj) const;
+  void SaveSphereHistogram(nlohmann::json& obj) const;
 
   float ray_color_[3];
   float background_color_[3];
@@ -183,9 +205,11 @@ class RenderContext {
   int offset_y_;
   VisibleRange visible_range_;
   ColorCompactLevel color_compact_level_;
+  bool keep_spectrum_;
   RenderSplitter splitter_;
   std::vector<GridLine> elevation_grid_;
   std::vector<GridLine> radius_rid_;
+  int sphere_histogram_size_;
 };
 
 }  // namespace icehalo
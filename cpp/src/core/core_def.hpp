@@ -10,6 +10,7 @@ constexpr ShortIdType kInvalidId = 0xffff;
 
 struct RayInfo;
 struct RaySegment;
+struct RayStorage;
 
 struct RayPath;
 using RayPathMap = std::unordered_map<size_t, std::pair<RayPath, size_t>>;
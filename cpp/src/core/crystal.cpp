@@ -10,7 +10,6 @@
 #include "context/context.hpp"
 #include "core/optics.hpp"
 #include "util/log.hpp"
-#include "util/obj_pool.hpp"
 
 namespace icehalo {
 
@@ -48,12 +47,16 @@ Crystal::Crystal(std::vector<Vec3f> vertexes,     // vertex
                  std::vector<TriangleIdx> faces,  // face indices
                  CrystalType type)                // crystal type
     : type_(type), vertexes_(std::move(vertexes)), faces_(std::move(faces)), face_number_period_(-1),
-      face_bases_(nullptr), face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr) {
+      face_bases_(nullptr), face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr),
+      face_packed_(nullptr), face_packed_stride_(0), is_convex_(false) {
   InitBasicData();
   InitPrimaryFaceNumber();
   PruneRedundantFaces();
   RefineFaceNumber();
   MergeFaces();
+  InitPackedData();
+  InitPlaneData();
+  InitFaceAliasTable();
 }
 
 
@@ -63,9 +66,13 @@ Crystal::Crystal(std::vector<Vec3f> vertexes,                 // vertex
                  CrystalType type)                            // crystal type
     : type_(type), vertexes_(std::move(vertexes)), faces_(std::move(faces)),
       face_number_table_(std::move(face_number_table)), face_number_period_(-1), face_bases_(nullptr),
-      face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr) {
+      face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr), face_packed_(nullptr),
+      face_packed_stride_(0), is_convex_(false) {
   InitBasicData();
   MergeFaces();
+  InitPackedData();
+  InitPlaneData();
+  InitFaceAliasTable();
 }
 
 
@@ -109,6 +116,46 @@ const float* Crystal::GetFaceArea() const {
 }
 
 
+const float* Crystal::GetFacePackedData() const {
+  return face_packed_.get();
+}
+
+
+int Crystal::GetFacePackedStride() const {
+  return face_packed_stride_;
+}
+
+
+bool Crystal::IsConvex() const {
+  return is_convex_;
+}
+
+
+int Crystal::TotalPlanes() const {
+  return static_cast<int>(plane_faces_.size());
+}
+
+
+const float* Crystal::GetPlaneData() const {
+  return plane_data_.data();
+}
+
+
+const std::vector<std::vector<int>>& Crystal::GetPlaneFaces() const {
+  return plane_faces_;
+}
+
+
+const float* Crystal::GetFaceAliasProb() const {
+  return face_alias_prob_.data();
+}
+
+
+const int* Crystal::GetFaceAliasIndex() const {
+  return face_alias_idx_.data();
+}
+
+
 int Crystal::GetFaceNumberPeriod() const {
   return face_number_period_;
 }
@@ -477,6 +524,120 @@ void Crystal::MergeFaces() {
   }
 }
 
+
+void Crystal::InitPackedData() {
+  int face_num = TotalFaces();
+  face_packed_stride_ = (face_num + kFacePackedAlign - 1) / kFacePackedAlign * kFacePackedAlign;
+  face_packed_.reset(new float[kFacePackedRows * face_packed_stride_]{});
+
+  auto* packed_ptr = face_packed_.get();
+  auto stride = face_packed_stride_;
+  for (int i = 0; i < face_num; i++) {
+    for (int j = 0; j < 3; j++) {
+      packed_ptr[(0 + j) * stride + i] = face_vertexes_[i * 9 + j];
+      packed_ptr[(3 + j) * stride + i] = face_bases_[i * 6 + j];
+      packed_ptr[(6 + j) * stride + i] = face_bases_[i * 6 + 3 + j];
+      packed_ptr[(9 + j) * stride + i] = face_norm_[i * 3 + j];
+    }
+  }
+}
+
+
+void Crystal::InitPlaneData() {
+  plane_data_.clear();
+  plane_faces_.clear();
+
+  // 1. Group triangles into planes
+  int face_num = TotalFaces();
+  for (int i = 0; i < face_num; i++) {
+    const float* curr_norm = face_norm_.get() + i * 3;
+    float curr_d = Dot3(curr_norm, face_vertexes_.get() + i * 9);
+    size_t plane_idx = 0;
+    for (; plane_idx < plane_faces_.size(); plane_idx++) {
+      const float* plane = plane_data_.data() + plane_idx * 4;
+      if (Dot3(plane, curr_norm) > 1 - math::kFloatEps && FloatEqual(plane[3], curr_d)) {
+        break;
+      }
+    }
+    if (plane_idx == plane_faces_.size()) {
+      plane_data_.insert(plane_data_.end(), { curr_norm[0], curr_norm[1], curr_norm[2], curr_d });
+      plane_faces_.emplace_back();
+    }
+    plane_faces_[plane_idx].emplace_back(i);
+  }
+
+  // 2. Check convexity. A crystal is convex iff all vertexes are on the inner side of all planes.
+  is_convex_ = !plane_faces_.empty();
+  for (size_t i = 0; i < plane_faces_.size() && is_convex_; i++) {
+    const float* plane = plane_data_.data() + i * 4;
+    for (const auto& v : vertexes_) {
+      if (Dot3(plane, v.val()) - plane[3] > math::kFloatEps) {
+        is_convex_ = false;
+        break;
+      }
+    }
+  }
+}
+
+
+// Vose's alias method.
+void Crystal::InitFaceAliasTable() {
+  int face_num = TotalFaces();
+  face_alias_prob_.assign(face_num, 0.0f);
+  face_alias_idx_.resize(face_num);
+  if (face_num <= 0) {
+    return;
+  }
+
+  std::vector<double> weight(face_num, 0.0);
+  double sum = 0;
+  int max_idx = 0;
+  for (int i = 0; i < face_num; i++) {
+    if (!std::isnan(face_norm_[i * 3 + 0]) && face_area_[i] > 0) {
+      weight[i] = face_area_[i];
+      sum += weight[i];
+    }
+    if (weight[i] > weight[max_idx]) {
+      max_idx = i;
+    }
+  }
+  if (sum <= 0) {
+    for (int i = 0; i < face_num; i++) {
+      face_alias_idx_[i] = i;
+    }
+    return;
+  }
+
+  std::vector<int> small;
+  std::vector<int> large;
+  for (int i = 0; i < face_num; i++) {
+    weight[i] = weight[i] * face_num / sum;
+    face_alias_idx_[i] = i;
+    (weight[i] < 1.0 ? small : large).emplace_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    int s = small.back();
+    int l = large.back();
+    small.pop_back();
+    face_alias_prob_[s] = static_cast<float>(weight[s]);
+    face_alias_idx_[s] = l;
+    weight[l] -= 1.0 - weight[s];
+    if (weight[l] < 1.0) {
+      large.pop_back();
+      small.emplace_back(l);
+    }
+  }
+  // Remaining ones are full columns (only differ from 1 by rounding errors).
+  for (auto i : large) {
+    face_alias_prob_[i] = 1.0f;
+  }
+  for (auto i : small) {
+    face_alias_prob_[i] = weight[i] > 0 ? 1.0f : 0.0f;
+    face_alias_idx_[i] = max_idx;
+  }
+}
+
+
 bool Crystal::IsCoplanar(size_t idx1, size_t idx2) const {
   const auto* face_norm_ptr = face_norm_.get();
   return Dot3(face_norm_ptr + idx1 * 3, face_norm_ptr + idx2 * 3) > 1 - math::kFloatEps;
@@ -1045,18 +1206,14 @@ void MakeSymmetryExtensionHelper(const RayPath& curr_ray_path, const CrystalCont
 }
 
 
-RayPath::RayPath()
-    : len(0), capacity(kDefaultCapacity), ids(IdPool::GetInstance()->AllocateObjectArray(capacity)),
-      is_permanent(false) {}
+RayPath::RayPath() : len(0), capacity(kDefaultCapacity), ids(new ShortIdType[capacity]) {}
 
 
-RayPath::RayPath(size_t reserve_len)
-    : len(0), capacity(reserve_len), ids(IdPool::GetInstance()->AllocateObjectArray(capacity)), is_permanent(false) {}
+RayPath::RayPath(size_t reserve_len) : len(0), capacity(reserve_len), ids(new ShortIdType[capacity]) {}
 
 
 RayPath::RayPath(std::initializer_list<ShortIdType> ids)
-    : len(ids.size()), capacity(ids.size()), ids(IdPool::GetInstance()->AllocateObjectArray(capacity)),
-      is_permanent(false) {
+    : len(ids.size()), capacity(ids.size()), ids(new ShortIdType[capacity]) {
   size_t i = 0;
   for (const auto& id : ids) {
     this->ids[i++] = id;
@@ -1065,18 +1222,12 @@ RayPath::RayPath(std::initializer_list<ShortIdType> ids)
 
 
 RayPath::RayPath(const icehalo::RayPath& other)
-    : len(other.len), capacity(other.capacity), ids(nullptr), is_permanent(other.is_permanent) {
-  if (is_permanent) {
-    ids = new ShortIdType[capacity];
-  } else {
-    ids = IdPool::GetInstance()->AllocateObjectArray(capacity);
-  }
+    : len(other.len), capacity(other.capacity), ids(new ShortIdType[capacity]) {
   std::memcpy(ids, other.ids, sizeof(ShortIdType) * len);
 }
 
 
-RayPath::RayPath(RayPath&& other) noexcept
-    : len(other.len), capacity(other.capacity), ids(other.ids), is_permanent(other.is_permanent) {
+RayPath::RayPath(RayPath&& other) noexcept : len(other.len), capacity(other.capacity), ids(other.ids) {
   other.len = 0;
   other.capacity = 0;
   other.ids = nullptr;
@@ -1084,9 +1235,7 @@ RayPath::RayPath(RayPath&& other) noexcept
 
 
 RayPath::~RayPath() {
-  if (is_permanent) {
-    delete[] ids;
-  }
+  delete[] ids;
 }
 
 
@@ -1095,17 +1244,13 @@ RayPath& RayPath::operator=(const RayPath& other) noexcept {
     return *this;
   }
 
-  len = other.len;
-  capacity = other.capacity;
-  if (other.is_permanent) {
+  if (capacity < other.len) {
+    delete[] ids;
+    capacity = other.capacity;
     ids = new ShortIdType[capacity];
-  } else {
-    ids = IdPool::GetInstance()->AllocateObjectArray(capacity);
   }
+  len = other.len;
   std::memcpy(ids, other.ids, sizeof(ShortIdType) * len);
-  if (ids[len - 1] != kInvalidId || len > capacity) {
-    LOG_WARNING("RayPath copy ass. ids wrong!");
-  }
   return *this;
 }
 
@@ -1115,10 +1260,10 @@ RayPath& RayPath::operator=(RayPath&& other) noexcept {
     return *this;
   }
 
+  delete[] ids;
   len = other.len;
   capacity = other.capacity;
   ids = other.ids;
-  is_permanent = other.is_permanent;
   other.len = 0;
   other.capacity = 0;
   other.ids = nullptr;
@@ -1128,18 +1273,11 @@ RayPath& RayPath::operator=(RayPath&& other) noexcept {
 
 RayPath& RayPath::operator<<(ShortIdType id) {
   if (len >= capacity) {
-    ShortIdType* new_ids = nullptr;
-    if (is_permanent) {
-      new_ids = new ShortIdType[capacity * 2];
-    } else {
-      new_ids = IdPool::GetInstance()->AllocateObjectArray(capacity * 2);
-    }
+    capacity = std::max(capacity * 2, kDefaultCapacity);
+    auto* new_ids = new ShortIdType[capacity];
     std::memcpy(new_ids, ids, sizeof(ShortIdType) * len);
-    if (is_permanent) {
-      delete[] ids;
-    }
+    delete[] ids;
     ids = new_ids;
-    capacity *= 2;
   }
   ids[len++] = id;
   return *this;
@@ -1167,18 +1305,11 @@ void RayPath::Clear() {
 
 void RayPath::PrependId(ShortIdType id) {
   if (len >= capacity) {
-    ShortIdType* new_ids = nullptr;
-    if (is_permanent) {
-      new_ids = new ShortIdType[capacity * 2];
-    } else {
-      new_ids = IdPool ::GetInstance()->AllocateObjectArray(capacity * 2);
-    }
+    capacity = std::max(capacity * 2, kDefaultCapacity);
+    auto* new_ids = new ShortIdType[capacity];
     std::memcpy(new_ids + 1, ids, sizeof(ShortIdType) * len);
-    if (is_permanent) {
-      delete[] ids;
-    }
+    delete[] ids;
     ids = new_ids;
-    capacity *= 2;
   } else {
     for (size_t i = 0; i < len; i++) {
       ids[len - i] = ids[len - i - 1];
@@ -1189,17 +1320,6 @@ void RayPath::PrependId(ShortIdType id) {
 }
 
 
-RayPath RayPath::MakePermanentCopy() const {
-  RayPath copy(0);
-  copy.len = len;
-  copy.capacity = capacity;
-  copy.is_permanent = true;
-  copy.ids = new ShortIdType[capacity];
-  std::memcpy(copy.ids, ids, sizeof(ShortIdType) * len);
-  return copy;
-}
-
-
 std::vector<RayPath> MakeSymmetryExtension(const RayPath& curr_ray_path, const CrystalContext* crystal_ctx,
                                            uint8_t symmetry_flag) {
   std::vector<RayPath> result{};
@@ -44,7 +44,53 @@ class Crystal {
   const float* GetFaceArea() const;
   int GetFaceNumberPeriod() const;
 
+  /**
+   * @brief Get face data in packed (SoA) layout, used by wide SIMD intersection kernels.
+   *
+   * The data contains kFacePackedRows rows, each row has GetFacePackedStride() floats:
+   * ~~~
+   * v0.x, v0.y, v0.z,  // first vertex of each face
+   * e1.x, e1.y, e1.z,  // v1 - v0
+   * e2.x, e2.y, e2.z,  // v2 - v0
+   * n.x, n.y, n.z,     // face normal
+   * ~~~
+   * Padding faces (from TotalFaces() to the stride) are all zero, thus never hit.
+   */
+  const float* GetFacePackedData() const;
+  int GetFacePackedStride() const;
+
+  /**
+   * @brief Whether the crystal is a convex polyhedron. All built-in crystals are convex.
+   */
+  bool IsConvex() const;
+
+  /**
+   * @brief Get plane equations of the crystal.
+   *
+   * Coplanar triangles are merged into one plane. Each plane has 4 floats, (n.x, n.y, n.z, d), such that
+   * for a point p on the plane, dot(n, p) = d. The normal is pointing outside.
+   */
+  int TotalPlanes() const;
+  const float* GetPlaneData() const;
+
+  /**
+   * @brief Get triangle face indices of each plane, in ascending order.
+   */
+  const std::vector<std::vector<int>>& GetPlaneFaces() const;
+
+  /**
+   * @brief Get the alias table of faces, weighted by face area.
+   *
+   * Both arrays have TotalFaces() elements. To pick a face with probability proportional to its area, take a
+   * uniform column k, and keep it with probability GetFaceAliasProb()[k], otherwise use GetFaceAliasIndex()[k].
+   * Faces with invalid normal or zero area are never picked.
+   */
+  const float* GetFaceAliasProb() const;
+  const int* GetFaceAliasIndex() const;
+
   static constexpr float kC = 1.629f;
+  static constexpr int kFacePackedRows = 12;
+  static constexpr int kFacePackedAlign = 16;
 
   /*! @brief Create a regular hexagon prism crystal
    *
@@ -170,6 +216,9 @@ class Crystal {
   void PruneRedundantFaces();
   void RefineFaceNumber();
   void MergeFaces();
+  void InitPackedData();
+  void InitPlaneData();
+  void InitFaceAliasTable();
 
   bool IsCoplanar(size_t idx1, size_t idx2) const;
   bool IsCounterCoplanar(size_t idx1, size_t idx2) const;
@@ -188,6 +237,15 @@ class Crystal {
   std::unique_ptr<float[]> face_vertexes_;
   std::unique_ptr<float[]> face_norm_;
   std::unique_ptr<float[]> face_area_;
+  std::unique_ptr<float[]> face_packed_;
+  int face_packed_stride_;
+
+  bool is_convex_;
+  std::vector<float> plane_data_;
+  std::vector<std::vector<int>> plane_faces_;
+
+  std::vector<float> face_alias_prob_;
+  std::vector<int> face_alias_idx_;
 
  private:
   /*! @brief Constructor, given vertexes and faces
@@ -225,13 +283,18 @@ enum Symmetry : uint8_t {
 };
 
 
+/**
+ * @brief A sequence of crystal IDs and face numbers. See RayPathRecorder.
+ *
+ * It owns its ids. Ray paths are only made for distinct paths (or for filters), not for every ray, so they
+ * are allocated from heap, rather than from a pool shared by all simulations.
+ */
 struct RayPath {
   static constexpr size_t kDefaultCapacity = 7;
 
   size_t len;
   size_t capacity;
   ShortIdType* ids;
-  bool is_permanent;
 
   RayPath();
   explicit RayPath(size_t reserve_len);
@@ -242,7 +305,6 @@ struct RayPath {
 
   void Clear();
   void PrependId(ShortIdType id);
-  RayPath MakePermanentCopy() const;
 
   // convenience for the range-based for loop
   ShortIdType* begin() const noexcept { return ids; }
@@ -183,7 +183,7 @@ void NoneRayPathFilter::LoadFromJson(const nlohmann::json& /* obj */) {}
 
 
 void SpecificRayPathFilter::AddPath(const RayPath& path) {
-  ray_paths_.emplace_back(path.MakePermanentCopy());
+  ray_paths_.emplace_back(path);
 }
 
 
@@ -5,6 +5,7 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cstring>
 
 
 namespace icehalo {
@@ -66,35 +67,44 @@ void Vec3FromTo(const float* vec1, const float* vec2, float* vec) {
 }
 
 
-void RotateZ(const float* lon_lat_roll, const float* input_vec, float* output_vec, size_t data_num) {
-  return RotateZ(lon_lat_roll, input_vec, output_vec, 3, 3, data_num);
-}
-
-
-void RotateZ(const float* lon_lat_roll,  // longitude, latitude, roll
-             const float* input_vec,     // input data
-             float* output_vec,          // output data
-             size_t input_step, size_t output_step, size_t data_num) {
+void RotateZMatrix(const float* lon_lat_roll, float* matrix) {
   using std::cos;
   using std::sin;
 
-  const float ax[] = {
-    -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-    -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
-    cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
-    cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
-    sin(lon_lat_roll[1]),
-    0
-  };
+  matrix[0] =
+      -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]);
+  matrix[1] =
+      cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]);
+  matrix[2] = cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]);
+  matrix[3] =
+      -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]);
+  matrix[4] =
+      -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]);
+  matrix[5] = cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]);
+  matrix[6] = cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]);
+  matrix[7] = cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]);
+  matrix[8] = sin(lon_lat_roll[1]);
+}
+
+
+namespace {
+
+// Multiply every input vector with a 3x3 matrix, or its transpose.
+void MultiplyMatrix3(const float* matrix, bool transpose,  // matrix
+                     const float* input_vec, float* output_vec, size_t input_step, size_t output_step,
+                     size_t data_num) {
+  // Row k of (transposed) matrix is {ax[k * 3 + 0], ax[k * 3 + 1], ax[k * 3 + 2]}
+  float ax[9];
+  for (int k = 0; k < 3; k++) {
+    for (int j = 0; j < 3; j++) {
+      ax[k * 3 + j] = transpose ? matrix[j * 3 + k] : matrix[k * 3 + j];
+    }
+  }
 
 #if defined(__AVX__) && defined(__SSE4_1__)
-  __m128 AX0 = _mm_loadu_ps(ax + 0);
-  __m128 AX1 = _mm_loadu_ps(ax + 3);
-  __m128 AX2 = _mm_loadu_ps(ax + 6);
+  __m128 AX0 = _mm_setr_ps(ax[0], ax[1], ax[2], 0.0f);
+  __m128 AX1 = _mm_setr_ps(ax[3], ax[4], ax[5], 0.0f);
+  __m128 AX2 = _mm_setr_ps(ax[6], ax[7], ax[8], 0.0f);
 
   for (size_t i = 0; i < data_num; i++) {
     float* tmp_out = output_vec + i * output_step;
@@ -119,50 +129,178 @@ void RotateZ(const float* lon_lat_roll,  // longitude, latitude, roll
 #endif
 }
 
+}  // namespace
+
+
+void RotateZ(const float* lon_lat_roll, const float* input_vec, float* output_vec, size_t data_num) {
+  return RotateZ(lon_lat_roll, input_vec, output_vec, 3, 3, data_num);
+}
+
+
+void RotateZ(const float* lon_lat_roll,  // longitude, latitude, roll
+             const float* input_vec,     // input data
+             float* output_vec,          // output data
+             size_t input_step, size_t output_step, size_t data_num) {
+  float matrix[9];
+  RotateZMatrix(lon_lat_roll, matrix);
+  MultiplyMatrix3(matrix, false, input_vec, output_vec, input_step, output_step, data_num);
+}
+
 
 void RotateZBack(const float* lon_lat_roll, const float* input_vec, float* output_vec, size_t data_num) {
-  using std::cos;
-  using std::sin;
+  float matrix[9];
+  RotateZMatrix(lon_lat_roll, matrix);
+  MultiplyMatrix3(matrix, true, input_vec, output_vec, 3, 3, data_num);
+}
 
-  const float ax[] = {
-    -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
-    cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
-    cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
-    sin(lon_lat_roll[1]),
-    0
-  };
 
-#if defined(__AVX__) && defined(__SSE4_1__)
-  __m128 AX0 = _mm_loadu_ps(ax + 0);
-  __m128 AX1 = _mm_loadu_ps(ax + 3);
-  __m128 AX2 = _mm_loadu_ps(ax + 6);
+void RotateWithMatrix(const float* matrix, const float* input_vec, float* output_vec, size_t data_num) {
+  MultiplyMatrix3(matrix, false, input_vec, output_vec, 3, 3, data_num);
+}
 
-  for (size_t i = 0; i < data_num; i++) {
-    float* tmp_out = output_vec + i * 3;
 
-    __m128 INPUT_V = _mm_loadu_ps(input_vec + i * 3);
-    auto DP = _mm_dp_ps(INPUT_V, AX0, 0x71);
-    tmp_out[0] = DP[0];
-    DP = _mm_dp_ps(INPUT_V, AX1, 0x71);
-    tmp_out[1] = DP[0];
-    DP = _mm_dp_ps(INPUT_V, AX2, 0x71);
-    tmp_out[2] = DP[0];
+void RotateBackWithMatrix(const float* matrix, const float* input_vec, float* output_vec, size_t data_num) {
+  MultiplyMatrix3(matrix, true, input_vec, output_vec, 3, 3, data_num);
+}
+
+
+void SphereToEqualAreaSquare(const float* dir, float* uv) {
+  float ax = std::abs(dir[0]);
+  float ay = std::abs(dir[1]);
+  float r = std::sqrt(std::max(1.0f - std::abs(dir[2]), 0.0f));
+  float phi = FastAtan2(ay, ax) * 2.0f / math::kPi;  // [0, 1] in the first quadrant
+
+  float v = phi * r;
+  float u = r - v;
+  if (dir[2] < 0) {
+    std::swap(u, v);
+    u = 1.0f - u;
+    v = 1.0f - v;
   }
-#else
-  // Then do the matrix multiplication (using Dot3 actually)
-  for (size_t i = 0; i < data_num; i++) {
-    const float* tmp_v = input_vec + i * 3;
-    float* tmp_out = output_vec + i * 3;
-    for (int j = 0; j < 3; j++) {
-      tmp_out[j] = Dot3(tmp_v, ax + j * 3);
+  u = std::copysign(u, dir[0]);
+  v = std::copysign(v, dir[1]);
+  uv[0] = (u + 1.0f) / 2.0f;
+  uv[1] = (v + 1.0f) / 2.0f;
+}
+
+
+void EqualAreaSquareToSphere(const float* uv, float* dir) {
+  float u = uv[0] * 2.0f - 1.0f;
+  float v = uv[1] * 2.0f - 1.0f;
+  float au = std::abs(u);
+  float av = std::abs(v);
+
+  float signed_d = 1.0f - (au + av);
+  float r = 1.0f - std::abs(signed_d);
+  float phi = (r == 0 ? 1.0f : (av - au) / r + 1.0f) * math::kPi / 4.0f;
+  float s = r * std::sqrt(std::max(2.0f - r * r, 0.0f));
+  dir[0] = std::copysign(std::cos(phi), u) * s;
+  dir[1] = std::copysign(std::sin(phi), v) * s;
+  dir[2] = std::copysign(1.0f - r * r, signed_d);
+}
+
+
+void EncodeOctahedral(const float* dir, uint16_t* oct) {
+  constexpr float kMaxVal = 65535.0f;
+  float l1 = std::abs(dir[0]) + std::abs(dir[1]) + std::abs(dir[2]);
+  float x = l1 > 0 ? dir[0] / l1 : 0.0f;
+  float y = l1 > 0 ? dir[1] / l1 : 0.0f;
+  if (dir[2] < 0) {
+    // Fold the lower hemisphere onto the corners.
+    float fx = std::copysign(1.0f - std::abs(y), x);
+    float fy = std::copysign(1.0f - std::abs(x), y);
+    x = fx;
+    y = fy;
+  }
+  oct[0] = static_cast<uint16_t>(std::lround(std::clamp((x + 1.0f) / 2.0f, 0.0f, 1.0f) * kMaxVal));
+  oct[1] = static_cast<uint16_t>(std::lround(std::clamp((y + 1.0f) / 2.0f, 0.0f, 1.0f) * kMaxVal));
+}
+
+
+void DecodeOctahedral(const uint16_t* oct, float* dir) {
+  constexpr float kMaxVal = 65535.0f;
+  float x = oct[0] / kMaxVal * 2.0f - 1.0f;
+  float y = oct[1] / kMaxVal * 2.0f - 1.0f;
+  float z = 1.0f - std::abs(x) - std::abs(y);
+  if (z < 0) {
+    float fx = std::copysign(1.0f - std::abs(y), x);
+    float fy = std::copysign(1.0f - std::abs(x), y);
+    x = fx;
+    y = fy;
+  }
+  dir[0] = x;
+  dir[1] = y;
+  dir[2] = z;
+  Normalize3(dir);
+}
+
+
+uint16_t FloatToHalf(float f) {
+  uint32_t x = 0;
+  std::memcpy(&x, &f, sizeof(float));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t abs_x = x & 0x7fffffff;
+
+  if (abs_x >= 0x7f800000) {
+    // Inf or NaN
+    return static_cast<uint16_t>(sign | 0x7c00 | (abs_x > 0x7f800000 ? 0x200 : 0));
+  }
+  if (abs_x >= 0x477ff000) {
+    // Overflow, after rounding
+    return static_cast<uint16_t>(sign | 0x7c00);
+  }
+  if (abs_x < 0x38800000) {
+    // Subnormal or zero. Shift the mantissa with the implicit leading 1, and round to nearest even.
+    if (abs_x < 0x33000000) {
+      return static_cast<uint16_t>(sign);
+    }
+    uint32_t e = abs_x >> 23;
+    uint32_t m = (abs_x & 0x7fffff) | 0x800000;
+    uint32_t shift = 126 - e;
+    uint32_t h = m >> shift;
+    uint32_t rem = m & ((1u << shift) - 1);
+    uint32_t half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1))) {
+      h++;
     }
+    return static_cast<uint16_t>(sign | h);
   }
-#endif
+
+  // Normal. Rebias exponent, and round to nearest even. A carry goes into exponent correctly.
+  uint32_t h = ((abs_x - 0x38000000) >> 13);
+  uint32_t rem = abs_x & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+    h++;
+  }
+  return static_cast<uint16_t>(sign | h);
+}
+
+
+float HalfToFloat(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t e = (h >> 10) & 0x1f;
+  uint32_t m = h & 0x3ff;
+
+  uint32_t x = 0;
+  if (e == 0x1f) {
+    x = sign | 0x7f800000 | (m << 13);
+  } else if (e != 0) {
+    x = sign | ((e + 112) << 23) | (m << 13);
+  } else if (m != 0) {
+    // Subnormal. Normalize it.
+    e = 113;
+    while (!(m & 0x400)) {
+      m <<= 1;
+      e--;
+    }
+    x = sign | (e << 23) | ((m & 0x3ff) << 13);
+  } else {
+    x = sign;
+  }
+
+  float f = 0;
+  std::memcpy(&f, &x, sizeof(float));
+  return f;
 }
 
 
@@ -638,9 +776,189 @@ void RandomNumberGenerator::Reset() {
 }
 
 
-void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num) {
-  auto* rng = RandomNumberGenerator::GetInstance();
+RandomStream::RandomStream(uint32_t seed, uint32_t wavelength, uint32_t scatter_idx, uint64_t ray_idx,
+                           uint32_t sub_stream)
+    : key_{ seed, wavelength },
+      counter_{ 0, (scatter_idx << 8) | (sub_stream & 0xff), static_cast<uint32_t>(ray_idx & 0xffffffff),
+                static_cast<uint32_t>(ray_idx >> 32) },
+      block_{}, block_idx_(kBlockSize), gauss_spare_(0), has_gauss_spare_(false) {}
+
+
+uint32_t RandomStream::GetDefaultSeed() {
+#ifdef RANDOM_SEED
+  static const auto seed = static_cast<uint32_t>(std::chrono::system_clock::now().time_since_epoch().count());
+  return seed;
+#else
+  return kDefaultRandomSeed;
+#endif
+}
+
+
+uint32_t RandomStream::GetRunSeed(uint32_t seed, uint32_t run_idx) {
+  constexpr uint32_t kWeyl = 0x9E3779B9;
+  return seed + run_idx * kWeyl;
+}
+
+
+void RandomStream::Philox4x32(const uint32_t* counter, const uint32_t* key, uint32_t* out) {
+  constexpr uint64_t kMul0 = 0xD2511F53;
+  constexpr uint64_t kMul1 = 0xCD9E8D57;
+  constexpr uint32_t kWeyl0 = 0x9E3779B9;
+  constexpr uint32_t kWeyl1 = 0xBB67AE85;
+  constexpr int kRounds = 10;
+
+  uint32_t c[4]{ counter[0], counter[1], counter[2], counter[3] };
+  uint32_t k[2]{ key[0], key[1] };
+  for (int i = 0; i < kRounds; i++) {
+    uint64_t p0 = kMul0 * c[0];
+    uint64_t p1 = kMul1 * c[2];
+    uint32_t tmp[4]{
+      static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0],
+      static_cast<uint32_t>(p1),
+      static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1],
+      static_cast<uint32_t>(p0),
+    };
+    std::copy(tmp, tmp + 4, c);
+    k[0] += kWeyl0;
+    k[1] += kWeyl1;
+  }
+  std::copy(c, c + 4, out);
+}
+
+
+void RandomStream::NextBlock() {
+  Philox4x32(counter_, key_, block_);
+  counter_[0]++;
+  block_idx_ = 0;
+}
+
+
+float RandomStream::GetUniform() {
+  if (block_idx_ >= kBlockSize) {
+    NextBlock();
+  }
+  // Take high 24 bits, in [0, 1)
+  return static_cast<float>(block_[block_idx_++] >> 8) * (1.0f / 16777216.0f);
+}
+
+
+float RandomStream::GetGaussian() {
+  if (has_gauss_spare_) {
+    has_gauss_spare_ = false;
+    return gauss_spare_;
+  }
+
+  // Box-Muller. Use 1 - u to avoid log(0).
+  float u = 1.0f - GetUniform();
+  float v = GetUniform();
+  float r = std::sqrt(-2.0f * std::log(u));
+  float q = 2 * math::kPi * v;
+  gauss_spare_ = r * std::sin(q);
+  has_gauss_spare_ = true;
+  return r * std::cos(q);
+}
+
+
+float RandomStream::Get(DistributionType dist, float mean, float std) {
+  switch (dist) {
+    case DistributionType::kUniform:
+      return (GetUniform() - 0.5f) * 2 * std + mean;
+    case DistributionType::kGaussian:
+      return GetGaussian() * std + mean;
+    default:
+      return 0.0f;
+  }
+}
+
+
+RandomStreamBatch::RandomStreamBatch(uint32_t seed, uint32_t wavelength, uint32_t scatter_idx, uint64_t ray_idx,
+                                     size_t num, uint32_t sub_stream)
+    : key_{ seed, wavelength }, counter_{ 0, (scatter_idx << 8) | (sub_stream & 0xff) }, ray_idx_(ray_idx),
+      num_(num), block_(new uint32_t[num * RandomStream::kBlockSize]), block_idx_(RandomStream::kBlockSize),
+      gauss_spare_(new float[num]), has_gauss_spare_(false) {}
+
+
+size_t RandomStreamBatch::Size() const {
+  return num_;
+}
+
+
+void RandomStreamBatch::NextBlock() {
+  for (size_t i = 0; i < num_; i++) {
+    auto ray_idx = ray_idx_ + i;
+    uint32_t counter[4]{ counter_[0], counter_[1], static_cast<uint32_t>(ray_idx & 0xffffffff),
+                         static_cast<uint32_t>(ray_idx >> 32) };
+    uint32_t out[RandomStream::kBlockSize];
+    RandomStream::Philox4x32(counter, key_, out);
+    for (int k = 0; k < RandomStream::kBlockSize; k++) {
+      block_[k * num_ + i] = out[k];
+    }
+  }
+  counter_[0]++;
+  block_idx_ = 0;
+}
+
+
+void RandomStreamBatch::GetUniform(float* out) {
+  if (block_idx_ >= RandomStream::kBlockSize) {
+    NextBlock();
+  }
+  const auto* block = block_.get() + block_idx_ * num_;
+  for (size_t i = 0; i < num_; i++) {
+    out[i] = static_cast<float>(block[i] >> 8) * (1.0f / 16777216.0f);
+  }
+  block_idx_++;
+}
+
+
+void RandomStreamBatch::GetGaussian(float* out) {
+  auto* spare = gauss_spare_.get();
+  if (has_gauss_spare_) {
+    has_gauss_spare_ = false;
+    std::copy(spare, spare + num_, out);
+    return;
+  }
+
+  // Box-Muller, the same as RandomStream::GetGaussian()
+  GetUniform(out);
+  GetUniform(spare);
+  for (size_t i = 0; i < num_; i++) {
+    float u = 1.0f - out[i];
+    float v = spare[i];
+    float r = std::sqrt(-2.0f * std::log(u));
+    float q = 2 * math::kPi * v;
+    spare[i] = r * std::sin(q);
+    out[i] = r * std::cos(q);
+  }
+  has_gauss_spare_ = true;
+}
+
+
+void RandomStreamBatch::Get(DistributionType dist, float mean, float std, float* out) {
+  switch (dist) {
+    case DistributionType::kUniform:
+      GetUniform(out);
+      for (size_t i = 0; i < num_; i++) {
+        out[i] = (out[i] - 0.5f) * 2 * std + mean;
+      }
+      break;
+    case DistributionType::kGaussian:
+      GetGaussian(out);
+      for (size_t i = 0; i < num_; i++) {
+        out[i] = out[i] * std + mean;
+      }
+      break;
+    default:
+      std::fill(out, out + num_, 0.0f);
+      break;
+  }
+}
 
+
+namespace {
+
+template <class Rng>
+void SampleSphericalPointsCartImpl(Rng* rng, const float* dir, float std, float* data, size_t num) {
   float lon = std::atan2(dir[1], dir[0]);
   float lat = std::asin(dir[2] / Norm3(dir));
   float rot[3] = { lon, lat, 0 };
@@ -661,8 +979,8 @@ void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float
 }
 
 
-void RandomSampler::SampleSphericalPointsSph(float* data, size_t num, size_t step) {
-  auto* rng = RandomNumberGenerator::GetInstance();
+template <class Rng>
+void SampleSphericalPointsSphImpl(Rng* rng, float* data, size_t num, size_t step) {
   for (size_t i = 0; i < num; i++) {
     float u = rng->GetUniform() * 2 - 1;
     float lambda = rng->GetUniform() * 2 * math::kPi;
@@ -673,8 +991,8 @@ void RandomSampler::SampleSphericalPointsSph(float* data, size_t num, size_t ste
 }
 
 
-void RandomSampler::SampleSphericalPointsSph(const AxisDistribution& axis_dist, float* data, size_t num) {
-  auto* rng = RandomNumberGenerator::GetInstance();
+template <class Rng>
+void SampleSphericalPointsSphImpl(Rng* rng, const AxisDistribution& axis_dist, float* data, size_t num) {
   for (size_t i = 0; i < num; i++) {
     float phi = rng->Get(axis_dist.latitude_dist.type,                       // distribute
                          axis_dist.latitude_dist.mean * math::kDegreeToRad,  // mean
@@ -700,8 +1018,8 @@ void RandomSampler::SampleSphericalPointsSph(const AxisDistribution& axis_dist,
 }
 
 
-void RandomSampler::SampleTriangularPoints(const float* vertexes, float* data, size_t num) {
-  auto* rng = RandomNumberGenerator::GetInstance();
+template <class Rng>
+void SampleTriangularPointsImpl(Rng* rng, const float* vertexes, float* data, size_t num) {
   for (size_t i = 0; i < num; i++) {
     float a = rng->GetUniform();
     float b = rng->GetUniform();
@@ -718,9 +1036,8 @@ void RandomSampler::SampleTriangularPoints(const float* vertexes, float* data, s
 }
 
 
-int RandomSampler::SampleInt(const float* p, int max) {
-  auto* rng = RandomNumberGenerator::GetInstance();
-
+template <class Rng>
+int SampleIntImpl(Rng* rng, const float* p, int max) {
   float current_cum_p = 0;
   float current_p = rng->GetUniform();
 
@@ -735,11 +1052,213 @@ int RandomSampler::SampleInt(const float* p, int max) {
 }
 
 
-int RandomSampler::SampleInt(int max) {
-  auto* rng = RandomNumberGenerator::GetInstance();
+template <class Rng>
+int SampleIntImpl(Rng* rng, int max) {
   return std::min(static_cast<int>(rng->GetUniform() * max), max - 1);
 }
 
+}  // namespace
+
+
+void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num) {
+  SampleSphericalPointsCartImpl(RandomNumberGenerator::GetInstance(), dir, std, data, num);
+}
+
+
+void RandomSampler::SampleSphericalPointsCart(RandomStream* rng, const float* dir, float std, float* data,
+                                              size_t num) {
+  SampleSphericalPointsCartImpl(rng, dir, std, data, num);
+}
+
+
+void RandomSampler::SampleSphericalPointsSph(float* data, size_t num, size_t step) {
+  SampleSphericalPointsSphImpl(RandomNumberGenerator::GetInstance(), data, num, step);
+}
+
+
+void RandomSampler::SampleSphericalPointsSph(RandomStream* rng, float* data, size_t num, size_t step) {
+  SampleSphericalPointsSphImpl(rng, data, num, step);
+}
+
+
+void RandomSampler::SampleSphericalPointsSph(const AxisDistribution& axis_dist, float* data, size_t num) {
+  SampleSphericalPointsSphImpl(RandomNumberGenerator::GetInstance(), axis_dist, data, num);
+}
+
+
+void RandomSampler::SampleSphericalPointsSph(RandomStream* rng, const AxisDistribution& axis_dist, float* data,
+                                             size_t num) {
+  SampleSphericalPointsSphImpl(rng, axis_dist, data, num);
+}
+
+
+void RandomSampler::SampleTriangularPoints(const float* vertexes, float* data, size_t num) {
+  SampleTriangularPointsImpl(RandomNumberGenerator::GetInstance(), vertexes, data, num);
+}
+
+
+void RandomSampler::SampleTriangularPoints(RandomStream* rng, const float* vertexes, float* data, size_t num) {
+  SampleTriangularPointsImpl(rng, vertexes, data, num);
+}
+
+
+int RandomSampler::SampleInt(const float* p, int max) {
+  return SampleIntImpl(RandomNumberGenerator::GetInstance(), p, max);
+}
+
+
+int RandomSampler::SampleInt(RandomStream* rng, const float* p, int max) {
+  return SampleIntImpl(rng, p, max);
+}
+
+
+int RandomSampler::SampleInt(int max) {
+  return SampleIntImpl(RandomNumberGenerator::GetInstance(), max);
+}
+
+
+int RandomSampler::SampleInt(RandomStream* rng, int max) {
+  return SampleIntImpl(rng, max);
+}
+
+
+void RandomSampler::SampleSphericalPointsCart(RandomStreamBatch* rng, const float* dir, float std,
+                                              float* const* data) {
+  auto num = rng->Size();
+  float lon = std::atan2(dir[1], dir[0]);
+  float lat = std::asin(dir[2] / Norm3(dir));
+  float rot[3] = { lon, lat, 0 };
+
+  std::unique_ptr<float[]> tmp_u{ new float[num * 2] };
+  auto* u_dz = tmp_u.get();
+  auto* u_q = tmp_u.get() + num;
+  rng->GetUniform(u_dz);
+  rng->GetUniform(u_q);
+
+  std::unique_ptr<float[]> tmp_dir{ new float[num * 3 + 1]{} };  // One more for SIMD loading
+  double dz = 2 * std::sin(std / 2.0 * math::kDegreeToRad) * std::sin(std / 2.0 * math::kDegreeToRad);
+  for (size_t i = 0; i < num; i++) {
+    double udz = u_dz[i] * dz;
+    double q = u_q[i] * 2 * math::kPi;
+
+    double r = std::sqrt((2.0f - udz) * udz);
+    tmp_dir[i * 3 + 0] = static_cast<float>(std::cos(q) * r);
+    tmp_dir[i * 3 + 1] = static_cast<float>(std::sin(q) * r);
+    tmp_dir[i * 3 + 2] = static_cast<float>(1.0 - udz);
+  }
+
+  std::unique_ptr<float[]> tmp_out{ new float[num * 3] };
+  RotateZBack(rot, tmp_dir.get(), tmp_out.get(), num);
+  for (size_t i = 0; i < num; i++) {
+    for (int j = 0; j < 3; j++) {
+      data[j][i] = tmp_out[i * 3 + j];
+    }
+  }
+}
+
+
+void RandomSampler::SampleSphericalPointsSph(RandomStreamBatch* rng, float* const* data) {
+  auto num = rng->Size();
+  auto* lon = data[0];
+  auto* lat = data[1];
+  rng->GetUniform(lat);
+  rng->GetUniform(lon);
+  for (size_t i = 0; i < num; i++) {
+    float u = lat[i] * 2 - 1;
+    lon[i] = lon[i] * 2 * math::kPi;
+    lat[i] = std::asin(u);
+  }
+}
+
+
+void RandomSampler::SampleSphericalPointsSph(RandomStreamBatch* rng, const AxisDistribution& axis_dist,
+                                             float* const* data) {
+  auto num = rng->Size();
+  auto* lon = data[0];
+  auto* lat = data[1];
+  rng->Get(axis_dist.latitude_dist.type,                       // distribute
+           axis_dist.latitude_dist.mean * math::kDegreeToRad,  // mean
+           axis_dist.latitude_dist.std * math::kDegreeToRad,   // standard deviation
+           lat);
+  for (size_t i = 0; i < num; i++) {
+    float phi = lat[i];
+    if (phi > math::kPi / 2) {
+      phi = math::kPi - phi;
+    }
+    if (phi < -math::kPi / 2) {
+      phi = -math::kPi - phi;
+    }
+    lat[i] = phi;
+  }
+
+  if (axis_dist.azimuth_dist.type == DistributionType::kUniform) {
+    rng->GetUniform(lon);
+    for (size_t i = 0; i < num; i++) {
+      lon[i] = lon[i] * 2 * math::kPi;
+    }
+  } else {
+    rng->Get(axis_dist.azimuth_dist.type,                       // distribution
+             axis_dist.azimuth_dist.mean * math::kDegreeToRad,  // mean
+             axis_dist.azimuth_dist.std * math::kDegreeToRad,   // standard deviation
+             lon);
+  }
+}
+
+
+void RandomSampler::SampleTriangularPoints(RandomStreamBatch* rng, const float* vertexes, const int* idx,
+                                           float* const* data) {
+  auto num = rng->Size();
+  std::unique_ptr<float[]> tmp_u{ new float[num * 2] };
+  auto* u_a = tmp_u.get();
+  auto* u_b = tmp_u.get() + num;
+  rng->GetUniform(u_a);
+  rng->GetUniform(u_b);
+
+  for (size_t i = 0; i < num; i++) {
+    float a = u_a[i];
+    float b = u_b[i];
+    if (a + b > 1.0f) {
+      a = 1.0f - a;
+      b = 1.0f - b;
+    }
+
+    const auto* v = vertexes + idx[i] * 9;
+    for (int j = 0; j < 3; j++) {
+      data[j][i] = (v[j + 3] - v[j]) * a + (v[j + 6] - v[j]) * b + v[j];
+    }
+  }
+}
+
+
+void RandomSampler::SampleInt(RandomStreamBatch* rng, const float* p, int max, int* out) {
+  auto num = rng->Size();
+  std::unique_ptr<float[]> tmp_u{ new float[num] };
+  rng->GetUniform(tmp_u.get());
+
+  for (size_t i = 0; i < num; i++) {
+    const auto* curr_p = p + i * max;
+    float current_cum_p = 0;
+    out[i] = max - 1;
+    for (int k = 0; k < max; k++) {
+      current_cum_p += curr_p[k];
+      if (tmp_u[i] < current_cum_p) {
+        out[i] = k;
+        break;
+      }
+    }
+  }
+}
+
+
+void RandomSampler::SampleInt(RandomStreamBatch* rng, int max, int* out) {
+  auto num = rng->Size();
+  std::unique_ptr<float[]> tmp_u{ new float[num] };
+  rng->GetUniform(tmp_u.get());
+  for (size_t i = 0; i < num; i++) {
+    out[i] = std::min(static_cast<int>(tmp_u[i] * max), max - 1);
+  }
+}
+
 
 AxisDistribution::AxisDistribution()
     : azimuth_dist{ DistributionType::kUniform, 0, 0 }, latitude_dist{ DistributionType::kUniform, 0, 0 }, roll_dist{
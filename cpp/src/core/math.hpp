@@ -168,6 +168,107 @@ class RandomNumberGenerator {
 };
 
 
+/**
+ * @brief A counter-based random number stream, using Philox4x32-10.
+ *
+ * Different from RandomNumberGenerator, it has no hidden state. Every number is a pure function of
+ * (seed, wavelength, scatter index, ray index, sub-stream, draw count), so a ray gets exactly the same
+ * random numbers, no matter which thread handles it and how many threads are there.
+ *
+ * A stream is small (a few words) and cheap to construct, so it is designed to be created on stack
+ * for every ray.
+ */
+class RandomStream {
+ public:
+  /**
+   * @brief Creates a stream.
+   *
+   * @param seed Global seed. See RandomStream::GetDefaultSeed().
+   * @param wavelength Wavelength, in nm.
+   * @param scatter_idx Index of multi-scatter.
+   * @param ray_idx Index of ray in current scatter.
+   * @param sub_stream Use different sub-streams for different stages on the same ray.
+   */
+  RandomStream(uint32_t seed, uint32_t wavelength, uint32_t scatter_idx, uint64_t ray_idx, uint32_t sub_stream = 0);
+
+  float GetGaussian();
+  float GetUniform();
+  float Get(DistributionType dist, float mean, float std);
+
+  /**
+   * @brief Gets the seed shared by all streams. It is the same as RandomNumberGenerator, i.e. a fixed value,
+   *        or depends on system time if RANDOM_SEED is defined.
+   */
+  static uint32_t GetDefaultSeed();
+
+  /**
+   * @brief Gets the seed for a repeated run, so that every run with the same wavelength draws different numbers.
+   *        The seed of run 0 is \p seed itself.
+   */
+  static uint32_t GetRunSeed(uint32_t seed, uint32_t run_idx);
+
+  /**
+   * @brief The Philox4x32-10 bijection. It maps a 128-bit counter to 128-bit random bits, with a 64-bit key.
+   */
+  static void Philox4x32(const uint32_t* counter, const uint32_t* key, uint32_t* out);
+
+  static constexpr int kBlockSize = 4;
+
+ private:
+  void NextBlock();
+
+  uint32_t key_[2];
+  uint32_t counter_[4];  //!< {draw block, scatter_idx << 8 | sub_stream, ray_idx low, ray_idx high}
+  uint32_t block_[kBlockSize];
+  int block_idx_;
+  float gauss_spare_;
+  bool has_gauss_spare_;
+
+  static constexpr uint32_t kDefaultRandomSeed = 1;
+};
+
+
+/**
+ * @brief A batch of RandomStream, for consecutive rays [ray_idx, ray_idx + num).
+ *
+ * All streams in a batch draw numbers in lockstep, and numbers are written in SoA layout, i.e. one
+ * number for every ray at once. The numbers for ray `ray_idx + i` are exactly the same as those from
+ * `RandomStream{ seed, wavelength, scatter_idx, ray_idx + i, sub_stream }`, so batched code and
+ * per-ray code give identical results.
+ */
+class RandomStreamBatch {
+ public:
+  RandomStreamBatch(uint32_t seed, uint32_t wavelength, uint32_t scatter_idx, uint64_t ray_idx, size_t num,
+                    uint32_t sub_stream = 0);
+
+  size_t Size() const;
+
+  void GetGaussian(float* out);
+  void GetUniform(float* out);
+  void Get(DistributionType dist, float mean, float std, float* out);
+
+ private:
+  void NextBlock();
+
+  uint32_t key_[2];
+  uint32_t counter_[2];  //!< {draw block, scatter_idx << 8 | sub_stream}
+  uint64_t ray_idx_;
+  size_t num_;
+  std::unique_ptr<uint32_t[]> block_;  //!< SoA, block_[k * num_ + i] for the k-th word of ray i
+  int block_idx_;
+  std::unique_ptr<float[]> gauss_spare_;
+  bool has_gauss_spare_;
+};
+
+
+/**
+ * @brief Random samplers.
+ *
+ * Every method has three versions. The one without RandomStream uses RandomNumberGenerator of calling thread.
+ * The one with RandomStream draws numbers from the given stream, and is reproducible regardless of threads.
+ * The one with RandomStreamBatch samples for a batch of rays at once, and writes outputs in SoA layout.
+ * It gives the same results as calling the RandomStream version for every ray.
+ */
 class RandomSampler {
  public:
   /*! @brief Generate points distributed uniformly on sphere around a give point, in Cartesian form.
@@ -178,6 +279,8 @@ class RandomSampler {
    * @param num number of points.
    */
   static void SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num = 1);
+  static void SampleSphericalPointsCart(RandomStream* rng, const float* dir, float std, float* data, size_t num = 1);
+  static void SampleSphericalPointsCart(RandomStreamBatch* rng, const float* dir, float std, float* const* data);
 
   /*! @brief Generate points distributed uniformly on sphere, in spherical form, (lon, lat).
    *
@@ -185,6 +288,8 @@ class RandomSampler {
    * @param num
    */
   static void SampleSphericalPointsSph(float* data, size_t num = 1, size_t step = 3);
+  static void SampleSphericalPointsSph(RandomStream* rng, float* data, size_t num = 1, size_t step = 3);
+  static void SampleSphericalPointsSph(RandomStreamBatch* rng, float* const* data);
 
   /*! @brief Generate points distributed on sphere surface up to latitude, in spherical form, (lon, lat).
    *
@@ -193,6 +298,9 @@ class RandomSampler {
    * @param num number of points.
    */
   static void SampleSphericalPointsSph(const AxisDistribution& axis_dist, float* data, size_t num = 1);
+  static void SampleSphericalPointsSph(RandomStream* rng, const AxisDistribution& axis_dist, float* data,
+                                       size_t num = 1);
+  static void SampleSphericalPointsSph(RandomStreamBatch* rng, const AxisDistribution& axis_dist, float* const* data);
 
   /*! @brief Generate points evenly distributed on a triangle, in Cartesian form, xyz.
    *
@@ -201,6 +309,16 @@ class RandomSampler {
    * @param num number of points.
    */
   static void SampleTriangularPoints(const float* vertexes, float* data, size_t num = 1);
+  static void SampleTriangularPoints(RandomStream* rng, const float* vertexes, float* data, size_t num = 1);
+
+  /*! @brief Generate one point on a triangle for every ray, in Cartesian form, xyz.
+   *
+   * @param rng random streams.
+   * @param vertexes vertexes of all triangles, 9 floats for each.
+   * @param idx triangle index for every ray.
+   * @param data output data, SoA, data[0] for x, data[1] for y and data[2] for z.
+   */
+  static void SampleTriangularPoints(RandomStreamBatch* rng, const float* vertexes, const int* idx, float* const* data);
 
   /*! @brief Random choose an integer index from [0, max), proportional to probabilities in p.
    *
@@ -209,6 +327,16 @@ class RandomSampler {
    * @return chosen index.
    */
   static int SampleInt(const float* p, int max);
+  static int SampleInt(RandomStream* rng, const float* p, int max);
+
+  /*! @brief Random choose an integer index from [0, max) for every ray, proportional to its probabilities.
+   *
+   * @param rng random streams.
+   * @param p probabilities, `max` values for every ray.
+   * @param max range bound.
+   * @param out chosen indices.
+   */
+  static void SampleInt(RandomStreamBatch* rng, const float* p, int max, int* out);
 
   /*! @brief Random choose an integer from [0, max)
    *
@@ -216,6 +344,8 @@ class RandomSampler {
    * @return chosen integer.
    */
   static int SampleInt(int max);
+  static int SampleInt(RandomStream* rng, int max);
+  static void SampleInt(RandomStreamBatch* rng, int max, int* out);
 
   RandomSampler() = delete;
 };
@@ -237,6 +367,90 @@ void RotateZ(const float* lon_lat_roll, const float* input_vec, float* output_ve
              size_t output_step, size_t data_num = 1);
 void RotateZBack(const float* lon_lat_roll, const float* input_vec, float* output_vec, size_t data_num = 1);
 
+/**
+ * @brief Computes the rotation matrix used by RotateZ(), i.e. output = matrix * input.
+ *
+ * @param lon_lat_roll longitude, latitude and roll, in rad.
+ * @param matrix output 3x3 matrix, row major.
+ */
+void RotateZMatrix(const float* lon_lat_roll, float* matrix);
+
+/**
+ * @brief Same as RotateZ() and RotateZBack(), but with a precomputed matrix from RotateZMatrix().
+ *
+ * It avoids evaluating sin / cos for every call.
+ */
+void RotateWithMatrix(const float* matrix, const float* input_vec, float* output_vec, size_t data_num = 1);
+void RotateBackWithMatrix(const float* matrix, const float* input_vec, float* output_vec, size_t data_num = 1);
+
+/**
+ * @brief Polynomial approximation of atan2 (Abramowitz & Stegun 4.4.49), error is less than 1e-7 rad.
+ *
+ * Different from std::atan2, it has no branch, so loops calling it can be vectorized.
+ */
+inline float FastAtan2(float y, float x) {
+  constexpr float kC1 = 0.9999993329f;
+  constexpr float kC3 = -0.3332985605f;
+  constexpr float kC5 = 0.1994653599f;
+  constexpr float kC7 = -0.1390853351f;
+  constexpr float kC9 = 0.0964200441f;
+  constexpr float kC11 = -0.0559098861f;
+  constexpr float kC13 = 0.0218612288f;
+  constexpr float kC15 = -0.0040540580f;
+
+  float ax = std::abs(x);
+  float ay = std::abs(y);
+  float max_v = ax > ay ? ax : ay;
+  float min_v = ax > ay ? ay : ax;
+  float a = max_v > 0 ? min_v / max_v : 0.0f;
+  float s = a * a;
+  float r = a * (kC1 + s * (kC3 + s * (kC5 + s * (kC7 + s * (kC9 + s * (kC11 + s * (kC13 + s * kC15)))))));
+  r = ay > ax ? math::kPi / 2 - r : r;
+  r = std::signbit(x) ? math::kPi - r : r;
+  return std::copysign(r, y);
+}
+
+/**
+ * @brief Maps a unit vector to square [0, 1] x [0, 1], with the equal-area octahedral mapping (Clarberg 2008).
+ *
+ * Equal areas on sphere are mapped to equal areas on the square, so a uniform grid on the square is an
+ * equal solid angle partition of sphere.
+ *
+ * @param dir input unit vector.
+ * @param uv output coordinates on square.
+ */
+void SphereToEqualAreaSquare(const float* dir, float* uv);
+
+/**
+ * @brief Inverse of SphereToEqualAreaSquare().
+ */
+void EqualAreaSquareToSphere(const float* uv, float* dir);
+
+/**
+ * @brief Quantizes a unit vector into 2 x 16 bits, with the octahedral mapping (Cigolle 2014).
+ *
+ * The max angular error is about 0.003 degree.
+ *
+ * @param dir input unit vector.
+ * @param oct output quantized coordinates on the unfolded octahedron.
+ */
+void EncodeOctahedral(const float* dir, uint16_t* oct);
+
+/**
+ * @brief Inverse of EncodeOctahedral(). Output vector is normalized.
+ */
+void DecodeOctahedral(const uint16_t* oct, float* dir);
+
+/**
+ * @brief Converts a float to IEEE 754 half precision, rounding to nearest even.
+ */
+uint16_t FloatToHalf(float f);
+
+/**
+ * @brief Converts an IEEE 754 half precision number to float.
+ */
+float HalfToFloat(uint16_t h);
+
 std::vector<Vec3f> FindInnerPoints(const HalfSpaceSet& hss);
 void SortAndRemoveDuplicate(std::vector<Vec3f>* pts);
 std::vector<int> FindCoplanarPoints(const std::vector<Vec3f>& pts, const Vec3f& n0, float d0);
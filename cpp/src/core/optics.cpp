@@ -1,8 +1,6 @@
 #include "optics.hpp"
 
 #include <immintrin.h>
-#include <smmintrin.h>
-#include <xmmintrin.h>
 
 #include <algorithm>
 #include <cmath>
@@ -129,23 +127,23 @@ RaySegment::RaySegment(const float* pt, const float* dir, float w, int face_id)
       face_id(face_id), state(RaySegmentState::kOnGoing), recorder{} {}
 
 
-void RaySegment::Serialize(File& file, bool with_boi) const {
+void RaySegment::Serialize(File& file, bool with_boi, const RayStorage& storage) const {
   if (with_boi) {
     file.Write(ISerializable::kDefaultBoi);
   }
 
   uint32_t chunk_id = 0;
   uint32_t obj_id = 0;
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(next_reflect);
+  std::tie(chunk_id, obj_id) = storage.ray_seg_pool.GetObjectSerializeIndex(next_reflect);
   file.Write(chunk_id);
   file.Write(obj_id);
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(next_refract);
+  std::tie(chunk_id, obj_id) = storage.ray_seg_pool.GetObjectSerializeIndex(next_refract);
   file.Write(chunk_id);
   file.Write(obj_id);
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(prev);
+  std::tie(chunk_id, obj_id) = storage.ray_seg_pool.GetObjectSerializeIndex(prev);
   file.Write(chunk_id);
   file.Write(obj_id);
-  std::tie(chunk_id, obj_id) = RayInfoPool::GetInstance()->GetObjectSerializeIndex(root_ctx);
+  std::tie(chunk_id, obj_id) = storage.ray_info_pool.GetObjectSerializeIndex(root_ctx);
   file.Write(chunk_id);
   file.Write(obj_id);
 
@@ -160,7 +158,7 @@ void RaySegment::Serialize(File& file, bool with_boi) const {
 
 
 void RaySegment::Deserialize(File& file, endian::Endianness endianness) {
-  endianness = CheckEndianness(file, endianness);
+  endianness = ISerializable::CheckEndianness(file, endianness);
   bool need_swap = (endianness != endian::kCompileEndian);
 
   uint32_t chunk_id = 0;
@@ -260,25 +258,30 @@ void Optics::HitSurface(const Crystal* crystal, float n, size_t num,
 }
 
 
-RayInfo::RayInfo() : first_ray_segment(nullptr), prev_ray_segment(nullptr), crystal_id(-1), main_axis{ 0, 0, 0 } {}
+RayInfo::RayInfo()
+    : first_ray_segment(nullptr), prev_ray_segment(nullptr), crystal_id(-1), main_axis{ 0, 0, 0 },
+      axis_mat{ 1, 0, 0, 0, 1, 0, 0, 0, 1 }, prev_path_recorder{} {}
 
 
 RayInfo::RayInfo(RaySegment* seg, int crystal_id, const float* main_axis)
-    : first_ray_segment(seg), prev_ray_segment(nullptr), crystal_id(crystal_id), main_axis(main_axis) {}
+    : first_ray_segment(seg), prev_ray_segment(nullptr), crystal_id(crystal_id), main_axis(main_axis), axis_mat{},
+      prev_path_recorder{} {
+  RotateZMatrix(main_axis, axis_mat);
+}
 
 
-void RayInfo::Serialize(File& file, bool with_boi) const {
+void RayInfo::Serialize(File& file, bool with_boi, const RayStorage& storage) const {
   if (with_boi) {
     file.Write(ISerializable::kDefaultBoi);
   }
 
   uint32_t chunk_id = 0;
   uint32_t obj_id = 0;
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(first_ray_segment);
+  std::tie(chunk_id, obj_id) = storage.ray_seg_pool.GetObjectSerializeIndex(first_ray_segment);
   file.Write(chunk_id);
   file.Write(obj_id);
 
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(prev_ray_segment);
+  std::tie(chunk_id, obj_id) = storage.ray_seg_pool.GetObjectSerializeIndex(prev_ray_segment);
   file.Write(chunk_id);
   file.Write(obj_id);
 
@@ -289,7 +292,7 @@ void RayInfo::Serialize(File& file, bool with_boi) const {
 
 
 void RayInfo::Deserialize(File& file, endian::Endianness endianness) {
-  endianness = CheckEndianness(file, endianness);
+  endianness = ISerializable::CheckEndianness(file, endianness);
   bool need_swap = (endianness != endian::kCompileEndian);
 
   uint32_t chunk_id = 0;
@@ -321,6 +324,7 @@ void RayInfo::Deserialize(File& file, endian::Endianness endianness) {
     endian::ByteSwap::Swap(vec3f_buf, 3);
   }
   main_axis.val(vec3f_buf);
+  RotateZMatrix(vec3f_buf, axis_mat);
 }
 
 
@@ -332,22 +336,21 @@ void Optics::Propagate(const Crystal* crystal, size_t num,
   }
 
   auto total_faces = crystal->TotalFaces();
-  const auto* face_bases = crystal->GetFaceBaseVector();
-  const auto* face_vertexes = crystal->GetFaceVertex();
-  const auto* face_norms = crystal->GetFaceNorm();
+  auto face_stride = crystal->GetFacePackedStride();
+  const auto* face_packed = crystal->GetFacePackedData();
+  bool is_convex = crystal->IsConvex();
   for (size_t i = 0; i < num; i++) {
     if (w_in[i] < ProjectContext::kPropMinW) {
       continue;
     }
-#if defined(__SSE4_1__) && defined(__AVX__)
-    IntersectLineWithTrianglesSimd(pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2], total_faces,  //
-                                   face_bases, face_vertexes, face_norms,                              //
-                                   pt_out + i * 3, face_id_out + i);                                   // output
-#else
-    IntersectLineWithTriangles(pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2], total_faces,  //
-                               face_bases, face_vertexes, face_norms,                              //
-                               pt_out + i * 3, face_id_out + i);                                   // output
-#endif
+    if (is_convex) {
+      IntersectLineWithConvexCrystal(crystal, pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2],  //
+                                     pt_out + i * 3, face_id_out + i);                               // output
+      continue;
+    }
+    IntersectLineWithTrianglesPacked(pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2], total_faces,  //
+                                     face_stride, face_packed,                                           //
+                                     pt_out + i * 3, face_id_out + i);                                   // output
   }
 }
 
@@ -442,164 +445,673 @@ void Optics::IntersectLineWithTriangles(const float* pt, const float* dir,  // i
 }
 
 
-void Optics::IntersectLineWithTrianglesSimd(const float* pt, const float* dir,  // input
-                                            int face_id, int face_num,          // input
-                                            const float* face_bases,            // input
-                                            const float* face_points,           // input
-                                            const float* face_norm,             // input
-                                            float* p, int* idx) {               // output
+namespace {
+
+/*
+ * All packed kernels below solve the same equation as IntersectLineWithTriangles:
+ *
+ *   pt + t * dir = v0 + u * e1 + v * e2
+ *
+ * with Moller-Trumbore method:
+ *
+ *   h = dir x e2,  a = e1 . h,  s = pt - v0,  q = s x e1,
+ *   u = (s . h) / a,  v = (dir . q) / a,  t = (e2 . q) / a
+ *
+ * a equals to -c in IntersectLineWithTriangles, so the same threshold applies. If there are several faces
+ * with the same t, the one with smallest index wins, which is consistent with the plain version.
+ */
+void FinishPackedIntersection(int lane_num, const float* best_t, const int* best_idx,  // input
+                              const float* pt, const float* dir,                      // input
+                              float* p, int* idx) {                                   // output
   float min_t = std::numeric_limits<float>::max();
-  const float* norm_in = face_norm + face_id * 3;
+  int min_idx = -1;
+  for (int i = 0; i < lane_num; i++) {
+    if (best_idx[i] < 0) {
+      continue;
+    }
+    if (best_t[i] < min_t || (best_t[i] == min_t && best_idx[i] < min_idx)) {
+      min_t = best_t[i];
+      min_idx = best_idx[i];
+    }
+  }
+  if (min_idx < 0) {
+    return;
+  }
+  p[0] = pt[0] + min_t * dir[0];
+  p[1] = pt[1] + min_t * dir[1];
+  p[2] = pt[2] + min_t * dir[2];
+  *idx = min_idx;
+}
 
-  __m128 DIR = _mm_loadu_ps(dir);
-  __m128 PT = _mm_loadu_ps(pt);
-  __m128 NORM_IN = _mm_loadu_ps(norm_in);
-  auto DN_IN = _mm_dp_ps(DIR, NORM_IN, 0x71);
 
+void IntersectPackedPlain(const float* pt, const float* dir,   // input
+                          int face_id, int face_num,           // input
+                          int stride, const float* packed,     // input
+                          float* p, int* idx) {                // output
+  const float* v0 = packed;
+  const float* e1 = packed + 3 * stride;
+  const float* e2 = packed + 6 * stride;
+  const float* n = packed + 9 * stride;
+  float dn_in = dir[0] * n[face_id] + dir[1] * n[stride + face_id] + dir[2] * n[2 * stride + face_id];
+
+  float min_t = std::numeric_limits<float>::max();
+  int min_idx = -1;
   for (int i = 0; i < face_num; i++) {
-    const float* curr_face_point = face_points + i * 9;
-    const float* curr_face_base = face_bases + i * 6;
-    const float* curr_face_norm = face_norm + i * 3;
+    float dn = dir[0] * n[i] + dir[1] * n[stride + i] + dir[2] * n[2 * stride + i];
+    if (dn * dn_in >= 0) {
+      continue;
+    }
 
-    __m128 CURR_FACE_NORM = _mm_loadu_ps(curr_face_norm);
+    float h[3]{ dir[1] * e2[2 * stride + i] - dir[2] * e2[stride + i],  //
+                dir[2] * e2[i] - dir[0] * e2[2 * stride + i],           //
+                dir[0] * e2[stride + i] - dir[1] * e2[i] };
+    float a = e1[i] * h[0] + e1[stride + i] * h[1] + e1[2 * stride + i] * h[2];
+    if (FloatEqualZero(a)) {
+      continue;
+    }
 
-    auto DN_CURR = _mm_dp_ps(DIR, CURR_FACE_NORM, 0x71);
-    __m128 FLAG = _mm_mul_ps(DN_IN, DN_CURR);
+    float s[3]{ pt[0] - v0[i], pt[1] - v0[stride + i], pt[2] - v0[2 * stride + i] };
+    float q[3]{ s[1] * e1[2 * stride + i] - s[2] * e1[stride + i],  //
+                s[2] * e1[i] - s[0] * e1[2 * stride + i],           //
+                s[0] * e1[stride + i] - s[1] * e1[i] };
+    float t = (e2[i] * q[0] + e2[stride + i] * q[1] + e2[2 * stride + i] * q[2]) / a;
+    float u = (s[0] * h[0] + s[1] * h[1] + s[2] * h[2]) / a;
+    float v = (dir[0] * q[0] + dir[1] * q[1] + dir[2] * q[2]) / a;
+    if (t > math::kFloatEps && t < min_t && u >= 0 && v >= 0 && u + v <= 1) {
+      min_t = t;
+      min_idx = i;
+    }
+  }
+  FinishPackedIntersection(1, &min_t, &min_idx, pt, dir, p, idx);
+}
 
-    if (FLAG[0] >= 0) {
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ICEHALO_PACKED_DISPATCH
+
+__attribute__((target("avx2"))) void IntersectPackedAvx2(const float* pt, const float* dir,  // input
+                                                         int face_id, int face_num,          // input
+                                                         int stride, const float* packed,    // input
+                                                         float* p, int* idx) {               // output
+  const float* n = packed + 9 * stride;
+  float dn_in = dir[0] * n[face_id] + dir[1] * n[stride + face_id] + dir[2] * n[2 * stride + face_id];
+
+  const __m256 kZero = _mm256_setzero_ps();
+  const __m256 kOne = _mm256_set1_ps(1.0f);
+  const __m256 kEps = _mm256_set1_ps(math::kFloatEps);
+  const __m256 kNegEps = _mm256_set1_ps(-math::kFloatEps);
+  const __m256i kLaneStep = _mm256_set1_epi32(8);
+
+  __m256 DX = _mm256_set1_ps(dir[0]);
+  __m256 DY = _mm256_set1_ps(dir[1]);
+  __m256 DZ = _mm256_set1_ps(dir[2]);
+  __m256 DN_IN = _mm256_set1_ps(dn_in);
+
+  __m256 best_t = _mm256_set1_ps(std::numeric_limits<float>::max());
+  __m256i best_idx = _mm256_set1_epi32(-1);
+  __m256i lane_idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  for (int i = 0; i < face_num; i += 8, lane_idx = _mm256_add_epi32(lane_idx, kLaneStep)) {
+    __m256 NX = _mm256_loadu_ps(packed + 9 * stride + i);
+    __m256 NY = _mm256_loadu_ps(packed + 10 * stride + i);
+    __m256 NZ = _mm256_loadu_ps(packed + 11 * stride + i);
+    __m256 DN = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(DX, NX), _mm256_mul_ps(DY, NY)), _mm256_mul_ps(DZ, NZ));
+    __m256 mask = _mm256_cmp_ps(_mm256_mul_ps(DN, DN_IN), kZero, _CMP_LT_OQ);
+    if (_mm256_testz_ps(mask, mask)) {
       continue;
     }
 
-    /* Here use permute to get the production of curr_face_base.
-     * The original plain code is:
-     *
-     *   float ff04 = curr_face_base[0] * curr_face_base[4];
-     *   float ff05 = curr_face_base[0] * curr_face_base[5];
-     *   float ff13 = curr_face_base[1] * curr_face_base[3];
-     *   float ff15 = curr_face_base[1] * curr_face_base[5];
-     *   float ff23 = curr_face_base[2] * curr_face_base[3];
-     *   float ff24 = curr_face_base[2] * curr_face_base[4];
-     *
-     *        |<-- high -- low -->|
-     * index: 5   4   3   2   1   0
-     * index: 1   0   2   4   3   5
-     */
-    __m128 CURR_FB0 = _mm_loadu_ps(curr_face_base + 0);
-    __m128 CURR_FB1 = _mm_loadu_ps(curr_face_base + 3);
-    __m128 FF0 = _mm_mul_ps(CURR_FB0, _mm_permute_ps(CURR_FB1, 0xD2));
-    __m128 FF1 = _mm_mul_ps(CURR_FB1, _mm_permute_ps(CURR_FB0, 0xD2));
-
-    /*
-     * The original plain code is:
-     *
-     *   float c = dir[0] * ff15 + dir[1] * ff23 + dir[2] * ff04 -
-     *             dir[0] * ff24 - dir[1] * ff05 - dir[2] * ff13;
-     *
-     *      |<-- high ------ low -->|
-     * dir: 2   1   0   -   2   1   0
-     * ff1: 1   0   2  ff0: 1   0   2
-     */
-    auto SUB_PERM_FF = _mm_permute_ps(_mm_sub_ps(FF1, FF0), 0xD2);
-    auto C = _mm_dp_ps(DIR, SUB_PERM_FF, 0x71);
-
-    if (FloatEqualZero(C[0])) {
+    __m256 E1X = _mm256_loadu_ps(packed + 3 * stride + i);
+    __m256 E1Y = _mm256_loadu_ps(packed + 4 * stride + i);
+    __m256 E1Z = _mm256_loadu_ps(packed + 5 * stride + i);
+    __m256 E2X = _mm256_loadu_ps(packed + 6 * stride + i);
+    __m256 E2Y = _mm256_loadu_ps(packed + 7 * stride + i);
+    __m256 E2Z = _mm256_loadu_ps(packed + 8 * stride + i);
+
+    // h = dir x e2, a = e1 . h
+    __m256 HX = _mm256_sub_ps(_mm256_mul_ps(DY, E2Z), _mm256_mul_ps(DZ, E2Y));
+    __m256 HY = _mm256_sub_ps(_mm256_mul_ps(DZ, E2X), _mm256_mul_ps(DX, E2Z));
+    __m256 HZ = _mm256_sub_ps(_mm256_mul_ps(DX, E2Y), _mm256_mul_ps(DY, E2X));
+    __m256 A = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(E1X, HX), _mm256_mul_ps(E1Y, HY)), _mm256_mul_ps(E1Z, HZ));
+    mask = _mm256_and_ps(mask, _mm256_or_ps(_mm256_cmp_ps(A, kEps, _CMP_GE_OQ), _mm256_cmp_ps(A, kNegEps, _CMP_LE_OQ)));
+
+    // s = pt - v0, q = s x e1
+    __m256 SX = _mm256_sub_ps(_mm256_set1_ps(pt[0]), _mm256_loadu_ps(packed + 0 * stride + i));
+    __m256 SY = _mm256_sub_ps(_mm256_set1_ps(pt[1]), _mm256_loadu_ps(packed + 1 * stride + i));
+    __m256 SZ = _mm256_sub_ps(_mm256_set1_ps(pt[2]), _mm256_loadu_ps(packed + 2 * stride + i));
+    __m256 QX = _mm256_sub_ps(_mm256_mul_ps(SY, E1Z), _mm256_mul_ps(SZ, E1Y));
+    __m256 QY = _mm256_sub_ps(_mm256_mul_ps(SZ, E1X), _mm256_mul_ps(SX, E1Z));
+    __m256 QZ = _mm256_sub_ps(_mm256_mul_ps(SX, E1Y), _mm256_mul_ps(SY, E1X));
+
+    __m256 T = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(E2X, QX), _mm256_mul_ps(E2Y, QY)), _mm256_mul_ps(E2Z, QZ));
+    __m256 U = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(SX, HX), _mm256_mul_ps(SY, HY)), _mm256_mul_ps(SZ, HZ));
+    __m256 V = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(DX, QX), _mm256_mul_ps(DY, QY)), _mm256_mul_ps(DZ, QZ));
+    T = _mm256_div_ps(T, A);
+    U = _mm256_div_ps(U, A);
+    V = _mm256_div_ps(V, A);
+
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(T, kEps, _CMP_GT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(T, best_t, _CMP_LT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(U, kZero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(V, kZero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(U, V), kOne, _CMP_LE_OQ));
+
+    best_t = _mm256_blendv_ps(best_t, T, mask);
+    best_idx = _mm256_castps_si256(
+        _mm256_blendv_ps(_mm256_castsi256_ps(best_idx), _mm256_castsi256_ps(lane_idx), mask));
+  }
+
+  alignas(32) float best_t_buf[8];
+  alignas(32) int best_idx_buf[8];
+  _mm256_store_ps(best_t_buf, best_t);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(best_idx_buf), best_idx);
+  FinishPackedIntersection(8, best_t_buf, best_idx_buf, pt, dir, p, idx);
+}
+
+
+__attribute__((target("avx512f"))) void IntersectPackedAvx512(const float* pt, const float* dir,  // input
+                                                              int face_id, int face_num,          // input
+                                                              int stride, const float* packed,    // input
+                                                              float* p, int* idx) {               // output
+  const float* n = packed + 9 * stride;
+  float dn_in = dir[0] * n[face_id] + dir[1] * n[stride + face_id] + dir[2] * n[2 * stride + face_id];
+
+  const __m512 kZero = _mm512_setzero_ps();
+  const __m512 kOne = _mm512_set1_ps(1.0f);
+  const __m512 kEps = _mm512_set1_ps(math::kFloatEps);
+  const __m512i kLaneStep = _mm512_set1_epi32(16);
+
+  __m512 DX = _mm512_set1_ps(dir[0]);
+  __m512 DY = _mm512_set1_ps(dir[1]);
+  __m512 DZ = _mm512_set1_ps(dir[2]);
+  __m512 DN_IN = _mm512_set1_ps(dn_in);
+
+  __m512 best_t = _mm512_set1_ps(std::numeric_limits<float>::max());
+  __m512i best_idx = _mm512_set1_epi32(-1);
+  __m512i lane_idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+  for (int i = 0; i < face_num; i += 16, lane_idx = _mm512_add_epi32(lane_idx, kLaneStep)) {
+    __m512 NX = _mm512_loadu_ps(packed + 9 * stride + i);
+    __m512 NY = _mm512_loadu_ps(packed + 10 * stride + i);
+    __m512 NZ = _mm512_loadu_ps(packed + 11 * stride + i);
+    __m512 DN = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(DX, NX), _mm512_mul_ps(DY, NY)), _mm512_mul_ps(DZ, NZ));
+    __mmask16 mask = _mm512_cmp_ps_mask(_mm512_mul_ps(DN, DN_IN), kZero, _CMP_LT_OQ);
+    if (!mask) {
       continue;
     }
 
+    __m512 E1X = _mm512_loadu_ps(packed + 3 * stride + i);
+    __m512 E1Y = _mm512_loadu_ps(packed + 4 * stride + i);
+    __m512 E1Z = _mm512_loadu_ps(packed + 5 * stride + i);
+    __m512 E2X = _mm512_loadu_ps(packed + 6 * stride + i);
+    __m512 E2Y = _mm512_loadu_ps(packed + 7 * stride + i);
+    __m512 E2Z = _mm512_loadu_ps(packed + 8 * stride + i);
+
+    // h = dir x e2, a = e1 . h
+    __m512 HX = _mm512_sub_ps(_mm512_mul_ps(DY, E2Z), _mm512_mul_ps(DZ, E2Y));
+    __m512 HY = _mm512_sub_ps(_mm512_mul_ps(DZ, E2X), _mm512_mul_ps(DX, E2Z));
+    __m512 HZ = _mm512_sub_ps(_mm512_mul_ps(DX, E2Y), _mm512_mul_ps(DY, E2X));
+    __m512 A = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(E1X, HX), _mm512_mul_ps(E1Y, HY)), _mm512_mul_ps(E1Z, HZ));
+    mask = _mm512_mask_cmp_ps_mask(mask, _mm512_abs_ps(A), kEps, _CMP_GE_OQ);
+
+    // s = pt - v0, q = s x e1
+    __m512 SX = _mm512_sub_ps(_mm512_set1_ps(pt[0]), _mm512_loadu_ps(packed + 0 * stride + i));
+    __m512 SY = _mm512_sub_ps(_mm512_set1_ps(pt[1]), _mm512_loadu_ps(packed + 1 * stride + i));
+    __m512 SZ = _mm512_sub_ps(_mm512_set1_ps(pt[2]), _mm512_loadu_ps(packed + 2 * stride + i));
+    __m512 QX = _mm512_sub_ps(_mm512_mul_ps(SY, E1Z), _mm512_mul_ps(SZ, E1Y));
+    __m512 QY = _mm512_sub_ps(_mm512_mul_ps(SZ, E1X), _mm512_mul_ps(SX, E1Z));
+    __m512 QZ = _mm512_sub_ps(_mm512_mul_ps(SX, E1Y), _mm512_mul_ps(SY, E1X));
+
+    __m512 T = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(E2X, QX), _mm512_mul_ps(E2Y, QY)), _mm512_mul_ps(E2Z, QZ));
+    __m512 U = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(SX, HX), _mm512_mul_ps(SY, HY)), _mm512_mul_ps(SZ, HZ));
+    __m512 V = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(DX, QX), _mm512_mul_ps(DY, QY)), _mm512_mul_ps(DZ, QZ));
+    T = _mm512_div_ps(T, A);
+    U = _mm512_div_ps(U, A);
+    V = _mm512_div_ps(V, A);
+
+    mask = _mm512_mask_cmp_ps_mask(mask, T, kEps, _CMP_GT_OQ);
+    mask = _mm512_mask_cmp_ps_mask(mask, T, best_t, _CMP_LT_OQ);
+    mask = _mm512_mask_cmp_ps_mask(mask, U, kZero, _CMP_GE_OQ);
+    mask = _mm512_mask_cmp_ps_mask(mask, V, kZero, _CMP_GE_OQ);
+    mask = _mm512_mask_cmp_ps_mask(mask, _mm512_add_ps(U, V), kOne, _CMP_LE_OQ);
+
+    best_t = _mm512_mask_blend_ps(mask, best_t, T);
+    best_idx = _mm512_mask_blend_epi32(mask, best_idx, lane_idx);
+  }
 
-    /*
-     *   float a = ff15 * curr_face_point[0] + ff23 * curr_face_point[1] + ff04 * curr_face_point[2] -
-     *             ff24 * curr_face_point[0] - ff05 * curr_face_point[1] - ff13 * curr_face_point[2];
-     *   float b = pt[0] * ff15 + pt[1] * ff23 + pt[2] * ff04 -
-     *             pt[0] * ff24 - pt[1] * ff05 - pt[2] * ff13;
-     *
-     *        |<-- high ------ low -->|
-     * fp/pt: 2   1   0   -   2   1   0
-     * ff1  : 1   0   2  ff0: 1   0   2
-     */
-    __m128 CURR_FACE_POINT = _mm_loadu_ps(curr_face_point);
-    auto A = _mm_dp_ps(SUB_PERM_FF, CURR_FACE_POINT, 0x71);
-    auto B = _mm_dp_ps(SUB_PERM_FF, PT, 0x71);
-    float t = (A[0] - B[0]) / C[0];
-    if (t <= math::kFloatEps) {
+  alignas(64) float best_t_buf[16];
+  alignas(64) int best_idx_buf[16];
+  _mm512_store_ps(best_t_buf, best_t);
+  _mm512_store_si512(best_idx_buf, best_idx);
+  FinishPackedIntersection(16, best_t_buf, best_idx_buf, pt, dir, p, idx);
+}
+#endif
+
+
+/*
+ * Packet kernels test a packet of rays (8 for AVX2, 16 for AVX-512) against faces one by one.
+ * Ray data are copied into lanes first. A lane with zero dn_in will never hit any face, which is used for
+ * absorbed rays and the tail of a slice.
+ */
+constexpr int kMaxPacketWidth = 16;
+
+struct RayPacketLanes {
+  alignas(64) float pt[3][kMaxPacketWidth];
+  alignas(64) float dir[3][kMaxPacketWidth];
+  alignas(64) float dn_in[kMaxPacketWidth];
+  alignas(64) float best_t[kMaxPacketWidth];
+  alignas(64) int best_idx[kMaxPacketWidth];
+};
+
+
+#ifdef ICEHALO_PACKED_DISPATCH
+__attribute__((target("avx2"))) void IntersectPacketAvx2(RayPacketLanes* lanes, int face_num,  // input
+                                                         int stride, const float* packed) {    // input
+  const __m256 kZero = _mm256_setzero_ps();
+  const __m256 kOne = _mm256_set1_ps(1.0f);
+  const __m256 kEps = _mm256_set1_ps(math::kFloatEps);
+  const __m256 kNegEps = _mm256_set1_ps(-math::kFloatEps);
+
+  __m256 PX = _mm256_load_ps(lanes->pt[0]);
+  __m256 PY = _mm256_load_ps(lanes->pt[1]);
+  __m256 PZ = _mm256_load_ps(lanes->pt[2]);
+  __m256 DX = _mm256_load_ps(lanes->dir[0]);
+  __m256 DY = _mm256_load_ps(lanes->dir[1]);
+  __m256 DZ = _mm256_load_ps(lanes->dir[2]);
+  __m256 DN_IN = _mm256_load_ps(lanes->dn_in);
+
+  __m256 best_t = _mm256_set1_ps(std::numeric_limits<float>::max());
+  __m256i best_idx = _mm256_set1_epi32(-1);
+
+  for (int i = 0; i < face_num; i++) {
+    __m256 DN = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(DX, _mm256_set1_ps(packed[9 * stride + i])),
+                                            _mm256_mul_ps(DY, _mm256_set1_ps(packed[10 * stride + i]))),
+                              _mm256_mul_ps(DZ, _mm256_set1_ps(packed[11 * stride + i])));
+    __m256 mask = _mm256_cmp_ps(_mm256_mul_ps(DN, DN_IN), kZero, _CMP_LT_OQ);
+    if (_mm256_testz_ps(mask, mask)) {
       continue;
     }
 
-    /*
-     *   float dp01 = dir[0] * pt[1];
-     *   float dp02 = dir[0] * pt[2];
-     *   float dp10 = dir[1] * pt[0];
-     *   float dp12 = dir[1] * pt[2];
-     *   float dp20 = dir[2] * pt[0];
-     *   float dp21 = dir[2] * pt[1];
-     *
-     *      |<-- high -|-- low -->|
-     * dir: 2   1   0  |  2   1   0
-     * pt : 1   0   2  |  0   2   1
-     */
-    __m128 DP0 = _mm_mul_ps(DIR, _mm_permute_ps(PT, 0xC9));
-    __m128 DP1 = _mm_mul_ps(DIR, _mm_permute_ps(PT, 0xD2));
-    __m128 SUB_PERM_DP = _mm_sub_ps(_mm_permute_ps(DP0, 0xC9), _mm_permute_ps(DP1, 0xD2));
-
-    /*
-     *   a = dp12 * curr_face_base[3] + dp20 * curr_face_base[4] + dp01 * curr_face_base[5] -
-     *       dp21 * curr_face_base[3] - dp02 * curr_face_base[4] - dp10 * curr_face_base[5];
-     *   b = dir[0] * curr_face_base[4] * curr_face_point[2] + dir[1] * curr_face_base[5] * curr_face_point[0] +
-     *       dir[2] * curr_face_base[3] * curr_face_point[1] - dir[0] * curr_face_base[5] * curr_face_point[1] -
-     *       dir[1] * curr_face_base[3] * curr_face_point[2] - dir[2] * curr_face_base[4] * curr_face_point[0];
-     *
-     * a:
-     *      |<-- high ---|--- low -->|
-     * fb1: 5   4   3  - |   5   4   3
-     * dp0: 0   2   1  dp1:  1   0   2
-     *
-     * b:
-     *      |<-- high --|--- low -->|
-     * dir: 2   1   0   |   2   1   0
-     * fb1: 3   5   4   |   4   3   5
-     * fp : 1   0   2   |   0   2   1
-     */
-    A = _mm_dp_ps(CURR_FB1, SUB_PERM_DP, 0x71);
-    B = _mm_dp_ps(DIR,
-                  _mm_sub_ps(_mm_mul_ps(_mm_permute_ps(CURR_FB1, 0xC9), _mm_permute_ps(CURR_FACE_POINT, 0xD2)),
-                             _mm_mul_ps(_mm_permute_ps(CURR_FB1, 0xD2), _mm_permute_ps(CURR_FACE_POINT, 0xC9))),
-                  0x71);
-    float alpha = (A[0] + B[0]) / C[0];
-    if (alpha < 0 || alpha > 1) {
+    __m256 E1X = _mm256_set1_ps(packed[3 * stride + i]);
+    __m256 E1Y = _mm256_set1_ps(packed[4 * stride + i]);
+    __m256 E1Z = _mm256_set1_ps(packed[5 * stride + i]);
+    __m256 E2X = _mm256_set1_ps(packed[6 * stride + i]);
+    __m256 E2Y = _mm256_set1_ps(packed[7 * stride + i]);
+    __m256 E2Z = _mm256_set1_ps(packed[8 * stride + i]);
+
+    // h = dir x e2, a = e1 . h
+    __m256 HX = _mm256_sub_ps(_mm256_mul_ps(DY, E2Z), _mm256_mul_ps(DZ, E2Y));
+    __m256 HY = _mm256_sub_ps(_mm256_mul_ps(DZ, E2X), _mm256_mul_ps(DX, E2Z));
+    __m256 HZ = _mm256_sub_ps(_mm256_mul_ps(DX, E2Y), _mm256_mul_ps(DY, E2X));
+    __m256 A = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(E1X, HX), _mm256_mul_ps(E1Y, HY)), _mm256_mul_ps(E1Z, HZ));
+    mask = _mm256_and_ps(mask, _mm256_or_ps(_mm256_cmp_ps(A, kEps, _CMP_GE_OQ), _mm256_cmp_ps(A, kNegEps, _CMP_LE_OQ)));
+
+    // s = pt - v0, q = s x e1
+    __m256 SX = _mm256_sub_ps(PX, _mm256_set1_ps(packed[0 * stride + i]));
+    __m256 SY = _mm256_sub_ps(PY, _mm256_set1_ps(packed[1 * stride + i]));
+    __m256 SZ = _mm256_sub_ps(PZ, _mm256_set1_ps(packed[2 * stride + i]));
+    __m256 QX = _mm256_sub_ps(_mm256_mul_ps(SY, E1Z), _mm256_mul_ps(SZ, E1Y));
+    __m256 QY = _mm256_sub_ps(_mm256_mul_ps(SZ, E1X), _mm256_mul_ps(SX, E1Z));
+    __m256 QZ = _mm256_sub_ps(_mm256_mul_ps(SX, E1Y), _mm256_mul_ps(SY, E1X));
+
+    __m256 T = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(E2X, QX), _mm256_mul_ps(E2Y, QY)), _mm256_mul_ps(E2Z, QZ));
+    __m256 U = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(SX, HX), _mm256_mul_ps(SY, HY)), _mm256_mul_ps(SZ, HZ));
+    __m256 V = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(DX, QX), _mm256_mul_ps(DY, QY)), _mm256_mul_ps(DZ, QZ));
+    T = _mm256_div_ps(T, A);
+    U = _mm256_div_ps(U, A);
+    V = _mm256_div_ps(V, A);
+
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(T, kEps, _CMP_GT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(T, best_t, _CMP_LT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(U, kZero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(V, kZero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(U, V), kOne, _CMP_LE_OQ));
+
+    best_t = _mm256_blendv_ps(best_t, T, mask);
+    best_idx = _mm256_castps_si256(
+        _mm256_blendv_ps(_mm256_castsi256_ps(best_idx), _mm256_castsi256_ps(_mm256_set1_epi32(i)), mask));
+  }
+
+  _mm256_store_ps(lanes->best_t, best_t);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes->best_idx), best_idx);
+}
+
+
+__attribute__((target("avx512f"))) void IntersectPacketAvx512(RayPacketLanes* lanes, int face_num,  // input
+                                                              int stride, const float* packed) {    // input
+  const __m512 kZero = _mm512_setzero_ps();
+  const __m512 kOne = _mm512_set1_ps(1.0f);
+  const __m512 kEps = _mm512_set1_ps(math::kFloatEps);
+
+  __m512 PX = _mm512_load_ps(lanes->pt[0]);
+  __m512 PY = _mm512_load_ps(lanes->pt[1]);
+  __m512 PZ = _mm512_load_ps(lanes->pt[2]);
+  __m512 DX = _mm512_load_ps(lanes->dir[0]);
+  __m512 DY = _mm512_load_ps(lanes->dir[1]);
+  __m512 DZ = _mm512_load_ps(lanes->dir[2]);
+  __m512 DN_IN = _mm512_load_ps(lanes->dn_in);
+
+  __m512 best_t = _mm512_set1_ps(std::numeric_limits<float>::max());
+  __m512i best_idx = _mm512_set1_epi32(-1);
+
+  for (int i = 0; i < face_num; i++) {
+    __m512 DN = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(DX, _mm512_set1_ps(packed[9 * stride + i])),
+                                            _mm512_mul_ps(DY, _mm512_set1_ps(packed[10 * stride + i]))),
+                              _mm512_mul_ps(DZ, _mm512_set1_ps(packed[11 * stride + i])));
+    __mmask16 mask = _mm512_cmp_ps_mask(_mm512_mul_ps(DN, DN_IN), kZero, _CMP_LT_OQ);
+    if (!mask) {
       continue;
     }
 
-    /*
-     *   a = dp12 * curr_face_base[0] + dp20 * curr_face_base[1] + dp01 * curr_face_base[2] -
-     *       dp21 * curr_face_base[0] - dp02 * curr_face_base[1] - dp10 * curr_face_base[2];
-     *   b = dir[0] * curr_face_base[1] * curr_face_point[2] + dir[1] * curr_face_base[2] * curr_face_point[0] +
-     *       dir[2] * curr_face_base[0] * curr_face_point[1] - dir[0] * curr_face_base[2] * curr_face_point[1] -
-     *       dir[1] * curr_face_base[0] * curr_face_point[2] - dir[2] * curr_face_base[1] * curr_face_point[0];
-     *
-     * a:
-     *      |<-- high ---|--- low -->|
-     * fb0: 2   1   0    |   2   1   0
-     * dp1: 0   2   1  dp0:  1   0   2
-     *
-     * b:
-     *      |<-- high --|--- low -->|
-     * dir: 2   1   0   |   2   1   0
-     * fb0: 0   2   1   |   1   0   2
-     * fp : 1   0   2   |   0   2   1
-     */
-    A = _mm_dp_ps(CURR_FB0, SUB_PERM_DP, 0x71);
-    B = _mm_dp_ps(DIR,
-                  _mm_sub_ps(_mm_mul_ps(_mm_permute_ps(CURR_FB0, 0xC9), _mm_permute_ps(CURR_FACE_POINT, 0xD2)),
-                             _mm_mul_ps(_mm_permute_ps(CURR_FB0, 0xD2), _mm_permute_ps(CURR_FACE_POINT, 0xC9))),
-                  0x71);
-    float beta = -(A[0] + B[0]) / C[0];
+    __m512 E1X = _mm512_set1_ps(packed[3 * stride + i]);
+    __m512 E1Y = _mm512_set1_ps(packed[4 * stride + i]);
+    __m512 E1Z = _mm512_set1_ps(packed[5 * stride + i]);
+    __m512 E2X = _mm512_set1_ps(packed[6 * stride + i]);
+    __m512 E2Y = _mm512_set1_ps(packed[7 * stride + i]);
+    __m512 E2Z = _mm512_set1_ps(packed[8 * stride + i]);
+
+    // h = dir x e2, a = e1 . h
+    __m512 HX = _mm512_sub_ps(_mm512_mul_ps(DY, E2Z), _mm512_mul_ps(DZ, E2Y));
+    __m512 HY = _mm512_sub_ps(_mm512_mul_ps(DZ, E2X), _mm512_mul_ps(DX, E2Z));
+    __m512 HZ = _mm512_sub_ps(_mm512_mul_ps(DX, E2Y), _mm512_mul_ps(DY, E2X));
+    __m512 A = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(E1X, HX), _mm512_mul_ps(E1Y, HY)), _mm512_mul_ps(E1Z, HZ));
+    mask = _mm512_mask_cmp_ps_mask(mask, _mm512_abs_ps(A), kEps, _CMP_GE_OQ);
+
+    // s = pt - v0, q = s x e1
+    __m512 SX = _mm512_sub_ps(PX, _mm512_set1_ps(packed[0 * stride + i]));
+    __m512 SY = _mm512_sub_ps(PY, _mm512_set1_ps(packed[1 * stride + i]));
+    __m512 SZ = _mm512_sub_ps(PZ, _mm512_set1_ps(packed[2 * stride + i]));
+    __m512 QX = _mm512_sub_ps(_mm512_mul_ps(SY, E1Z), _mm512_mul_ps(SZ, E1Y));
+    __m512 QY = _mm512_sub_ps(_mm512_mul_ps(SZ, E1X), _mm512_mul_ps(SX, E1Z));
+    __m512 QZ = _mm512_sub_ps(_mm512_mul_ps(SX, E1Y), _mm512_mul_ps(SY, E1X));
+
+    __m512 T = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(E2X, QX), _mm512_mul_ps(E2Y, QY)), _mm512_mul_ps(E2Z, QZ));
+    __m512 U = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(SX, HX), _mm512_mul_ps(SY, HY)), _mm512_mul_ps(SZ, HZ));
+    __m512 V = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(DX, QX), _mm512_mul_ps(DY, QY)), _mm512_mul_ps(DZ, QZ));
+    T = _mm512_div_ps(T, A);
+    U = _mm512_div_ps(U, A);
+    V = _mm512_div_ps(V, A);
+
+    mask = _mm512_mask_cmp_ps_mask(mask, T, kEps, _CMP_GT_OQ);
+    mask = _mm512_mask_cmp_ps_mask(mask, T, best_t, _CMP_LT_OQ);
+    mask = _mm512_mask_cmp_ps_mask(mask, U, kZero, _CMP_GE_OQ);
+    mask = _mm512_mask_cmp_ps_mask(mask, V, kZero, _CMP_GE_OQ);
+    mask = _mm512_mask_cmp_ps_mask(mask, _mm512_add_ps(U, V), kOne, _CMP_LE_OQ);
+
+    best_t = _mm512_mask_blend_ps(mask, best_t, T);
+    best_idx = _mm512_mask_blend_epi32(mask, best_idx, _mm512_set1_epi32(i));
+  }
 
-    if (t < min_t && alpha >= 0 && beta >= 0 && alpha + beta <= 1) {
+  _mm512_store_ps(lanes->best_t, best_t);
+  _mm512_store_si512(lanes->best_idx, best_idx);
+}
+#endif
+
+
+/*
+ * For a convex crystal, a ray inside leaves it through the nearest plane in front of it. The plane
+ * loop is branch free, so that compiler can vectorize it along lanes.
+ */
+void ClipPacketWithPlanes(RayPacketLanes* lanes, int plane_num, const float* planes) {
+  for (int k = 0; k < kMaxPacketWidth; k++) {
+    lanes->best_t[k] = std::numeric_limits<float>::max();
+    lanes->best_idx[k] = -1;
+  }
+  for (int i = 0; i < plane_num; i++) {
+    const float* curr_plane = planes + i * 4;
+    for (int k = 0; k < kMaxPacketWidth; k++) {
+      float dn = lanes->dir[0][k] * curr_plane[0] + lanes->dir[1][k] * curr_plane[1] +
+                 lanes->dir[2][k] * curr_plane[2];
+      float pn = lanes->pt[0][k] * curr_plane[0] + lanes->pt[1][k] * curr_plane[1] + lanes->pt[2][k] * curr_plane[2];
+      float t = (curr_plane[3] - pn) / dn;
+      bool hit = lanes->dn_in[k] < 0 && dn > 0 && t > math::kFloatEps && t < lanes->best_t[k];
+      lanes->best_t[k] = hit ? t : lanes->best_t[k];
+      lanes->best_idx[k] = hit ? i : lanes->best_idx[k];
+    }
+  }
+}
+
+
+/*
+ * Find the triangle of a plane that contains point p. If p is on a common edge, the one with smaller
+ * index wins, which is consistent with IntersectLineWithTriangles.
+ */
+int FindFaceInPlane(const Crystal* crystal, int plane_idx, const float* p) {
+  const auto& faces = crystal->GetPlaneFaces()[plane_idx];
+  if (faces.size() == 1) {
+    return faces[0];
+  }
+
+  const float* norm = crystal->GetPlaneData() + plane_idx * 4;
+  const float* face_vertexes = crystal->GetFaceVertex();
+  for (auto f : faces) {
+    bool inside = true;
+    for (int j = 0; j < 3 && inside; j++) {
+      const float* v0 = face_vertexes + f * 9 + j * 3;
+      const float* v1 = face_vertexes + f * 9 + (j + 1) % 3 * 3;
+      float edge[3];
+      float vp[3];
+      float c[3];
+      Vec3FromTo(v0, v1, edge);
+      Vec3FromTo(v0, p, vp);
+      Cross3(edge, vp, c);
+      inside = Dot3(c, norm) >= -math::kFloatEps;
+    }
+    if (inside) {
+      return f;
+    }
+  }
+  return faces[0];
+}
+
+
+enum class SimdLevel {
+  kPlain,
+  kAvx2,
+  kAvx512,
+};
+
+SimdLevel DetectSimdLevel() {
+#ifdef ICEHALO_PACKED_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return SimdLevel::kAvx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return SimdLevel::kAvx2;
+  }
+#endif
+  return SimdLevel::kPlain;
+}
+
+
+using IntersectPackedFunc = void (*)(const float*, const float*, int, int, int, const float*, float*, int*);
+
+IntersectPackedFunc SelectIntersectPackedFunc() {
+#ifdef ICEHALO_PACKED_DISPATCH
+  switch (DetectSimdLevel()) {
+    case SimdLevel::kAvx512:
+      return IntersectPackedAvx512;
+    case SimdLevel::kAvx2:
+      return IntersectPackedAvx2;
+    case SimdLevel::kPlain:
+      break;
+  }
+#endif
+  return IntersectPackedPlain;
+}
+
+
+struct IntersectPacketKernel {
+  int width;
+  void (*func)(RayPacketLanes*, int, int, const float*);
+};
+
+IntersectPacketKernel SelectIntersectPacketKernel() {
+#ifdef ICEHALO_PACKED_DISPATCH
+  switch (DetectSimdLevel()) {
+    case SimdLevel::kAvx512:
+      return { 16, IntersectPacketAvx512 };
+    case SimdLevel::kAvx2:
+      return { 8, IntersectPacketAvx2 };
+    case SimdLevel::kPlain:
+      break;
+  }
+#endif
+  return { 0, nullptr };
+}
+
+}  // namespace
+
+
+void Optics::IntersectLineWithTrianglesPacked(const float* pt, const float* dir,  // input
+                                              int face_id, int face_num,          // input
+                                              int face_stride,                    // input
+                                              const float* face_packed,           // input
+                                              float* p, int* idx) {               // output
+  static const IntersectPackedFunc kIntersectFunc = SelectIntersectPackedFunc();
+  kIntersectFunc(pt, dir, face_id, face_num, face_stride, face_packed, p, idx);
+}
+
+
+void Optics::IntersectLineWithConvexCrystal(const Crystal* crystal,             // input
+                                            const float* pt, const float* dir,  // input
+                                            int face_id,                        // input
+                                            float* p, int* idx) {               // output
+  const float* planes = crystal->GetPlaneData();
+  const float* norm_in = crystal->GetFaceNorm() + face_id * 3;
+  if (Dot3(dir, norm_in) >= 0) {
+    return;
+  }
+
+  float min_t = std::numeric_limits<float>::max();
+  int min_plane = -1;
+  for (int i = 0; i < crystal->TotalPlanes(); i++) {
+    const float* curr_plane = planes + i * 4;
+    float dn = Dot3(dir, curr_plane);
+    if (dn <= 0) {
+      continue;
+    }
+    float t = (curr_plane[3] - Dot3(pt, curr_plane)) / dn;
+    if (t > math::kFloatEps && t < min_t) {
       min_t = t;
-      p[0] = pt[0] + t * dir[0];
-      p[1] = pt[1] + t * dir[1];
-      p[2] = pt[2] + t * dir[2];
-      *idx = i;
+      min_plane = i;
+    }
+  }
+  if (min_plane < 0) {
+    return;
+  }
+
+  p[0] = pt[0] + min_t * dir[0];
+  p[1] = pt[1] + min_t * dir[1];
+  p[2] = pt[2] + min_t * dir[2];
+  *idx = FindFaceInPlane(crystal, min_plane, p);
+}
+
+
+void Optics::HitSurfacePacket(const Crystal* crystal, float n, size_t num,                           // input
+                              const float* const* dir_in, const int* face_id_in, const float* w_in,  // input
+                              float* const* dir_out, float* w_out) {                                 // output
+  const auto* face_norm = crystal->GetFaceNorm();
+
+  for (size_t i = 0; i < num; i++) {
+    const float* tmp_norm = face_norm + face_id_in[i] * 3;
+    float tmp_dir[3]{ dir_in[0][i], dir_in[1][i], dir_in[2][i] };
+
+    float cos_theta = Dot3(tmp_dir, tmp_norm);
+    float rr = cos_theta > 0 ? n : 1.0f / n;
+    float d = (1.0f - rr * rr) / (cos_theta * cos_theta) + rr * rr;
+
+    bool is_total_reflected = d <= 0.0f;
+
+    w_out[2 * i + 0] = GetReflectRatio(cos_theta, rr) * w_in[i];
+    w_out[2 * i + 1] = is_total_reflected ? -1 : w_in[i] - w_out[2 * i + 0];
+
+    for (int j = 0; j < 3; j++) {
+      float reflection = tmp_dir[j] - 2 * cos_theta * tmp_norm[j];
+      dir_out[j][2 * i + 0] = reflection;
+      dir_out[j][2 * i + 1] =
+          is_total_reflected ? reflection : rr * tmp_dir[j] - (rr - std::sqrt(d)) * cos_theta * tmp_norm[j];
+    }
+  }
+}
+
+
+void Optics::PropagatePacket(const Crystal* crystal, size_t num,                     // input
+                             const float* const* pt_in, const float* const* dir_in,  // input
+                             const float* w_in, const int* face_id_in,               // input
+                             float* const* pt_out, int* face_id_out) {               // output
+  static const IntersectPacketKernel kKernel = SelectIntersectPacketKernel();
+
+  auto total_faces = crystal->TotalFaces();
+  auto face_stride = crystal->GetFacePackedStride();
+  const auto* face_packed = crystal->GetFacePackedData();
+
+  bool is_convex = crystal->IsConvex();
+  if (!kKernel.func && !is_convex) {
+    for (size_t i = 0; i < num; i++) {
+      face_id_out[i] = -1;
+      if (w_in[i] < ProjectContext::kPropMinW) {
+        continue;
+      }
+      float pt[3]{ pt_in[0][i / 2], pt_in[1][i / 2], pt_in[2][i / 2] };
+      float dir[3]{ dir_in[0][i], dir_in[1][i], dir_in[2][i] };
+      float p[3];
+      IntersectLineWithTrianglesPacked(pt, dir, face_id_in[i / 2], total_faces,  //
+                                       face_stride, face_packed, p, face_id_out + i);
+      if (face_id_out[i] >= 0) {
+        pt_out[0][i] = p[0];
+        pt_out[1][i] = p[1];
+        pt_out[2][i] = p[2];
+      }
+    }
+    return;
+  }
+
+  const float* face_norm = face_packed + 9 * face_stride;
+  int width = is_convex ? kMaxPacketWidth : kKernel.width;
+  RayPacketLanes lanes;
+  for (size_t i0 = 0; i0 < num; i0 += width) {
+    auto lane_num = std::min(num - i0, static_cast<size_t>(width));
+    for (int k = 0; k < width; k++) {
+      auto i = i0 + k;
+      if (static_cast<size_t>(k) >= lane_num || w_in[i] < ProjectContext::kPropMinW) {
+        for (int j = 0; j < 3; j++) {
+          lanes.pt[j][k] = 0.0f;
+          lanes.dir[j][k] = 0.0f;
+        }
+        lanes.dn_in[k] = 0.0f;
+        continue;
+      }
+      auto face_id = face_id_in[i / 2];
+      for (int j = 0; j < 3; j++) {
+        lanes.pt[j][k] = pt_in[j][i / 2];
+        lanes.dir[j][k] = dir_in[j][i];
+      }
+      lanes.dn_in[k] = lanes.dir[0][k] * face_norm[face_id] + lanes.dir[1][k] * face_norm[face_stride + face_id] +
+                       lanes.dir[2][k] * face_norm[2 * face_stride + face_id];
+    }
+
+    if (is_convex) {
+      ClipPacketWithPlanes(&lanes, crystal->TotalPlanes(), crystal->GetPlaneData());
+    } else {
+      kKernel.func(&lanes, total_faces, face_stride, face_packed);
+    }
+
+    for (size_t k = 0; k < lane_num; k++) {
+      auto i = i0 + k;
+      face_id_out[i] = lanes.best_idx[k];
+      if (lanes.best_idx[k] < 0) {
+        continue;
+      }
+      float p[3];
+      for (int j = 0; j < 3; j++) {
+        p[j] = lanes.pt[j][k] + lanes.best_t[k] * lanes.dir[j][k];
+        pt_out[j][i] = p[j];
+      }
+      if (is_convex) {
+        face_id_out[i] = FindFaceInPlane(crystal, lanes.best_idx[k], p);
+      }
     }
   }
 }
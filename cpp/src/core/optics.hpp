@@ -77,7 +77,7 @@ class RayPathRecorder : public ISerializable {
 };
 
 
-struct RaySegment : public ISerializable {
+struct RaySegment {
   RaySegment();
   RaySegment(const float* pt, const float* dir, float w, int face_id);
 
@@ -102,14 +102,15 @@ struct RaySegment : public ISerializable {
    *
    * @param file
    * @param with_boi
+   * @param storage The storage where this ray segment and the objects it points to live.
    */
-  void Serialize(File& file, bool with_boi) const override;
+  void Serialize(File& file, bool with_boi, const RayStorage& storage) const;
 
   /**
    * @brief Deserialize (load data) from a file.
    *
    * Since there are 4 pointer members in this struct, and they cannot be serialized plainly, we store
-   * 2 uint32 data instead (see RaySegment::Serialize(File&, bool) ). The caller should further call
+   * 2 uint32 data instead (see RaySegment::Serialize() ). The caller should further call
    * ObjectPool<T>::GetPointerFromSerializeData(T*) to get real pointer.
    *
    * @warning ObjectPool<T>::GetPointerFromSerializeData(T*) must be called **AFTER** the entire
@@ -118,7 +119,7 @@ struct RaySegment : public ISerializable {
    * @param file
    * @param endianness
    */
-  void Deserialize(File& file, endian::Endianness endianness) override;
+  void Deserialize(File& file, endian::Endianness endianness);
 
   RaySegment* next_reflect;
   RaySegment* next_refract;
@@ -134,7 +135,7 @@ struct RaySegment : public ISerializable {
 };
 
 
-struct RayInfo : public ISerializable {
+struct RayInfo {
   RayInfo();
   RayInfo(RaySegment* seg, int crystal_id, const float* main_axis);
 
@@ -150,16 +151,20 @@ struct RayInfo : public ISerializable {
    * int32,                 // crystal ID
    * float * 3,             // main_axis
    *
+   * RayInfo::axis_mat is not stored. It is recomputed from main_axis when deserializing.
+   * RayInfo::prev_path_recorder is not stored either. It is restored by SimulationData::Deserialize().
+   *
    * @param file
    * @param with_boi
+   * @param storage The storage where this ray info and the objects it points to live.
    */
-  void Serialize(File& file, bool with_boi) const override;
+  void Serialize(File& file, bool with_boi, const RayStorage& storage) const;
 
   /**
    * @brief Deserialize (load data) from a file.
    *
    * Since there are 2 pointer members in this struct, and they cannot be serialized plainly, we store
-   * 2 uint32 data (see RaySegment::Serialize(File&, bool) ) instead. The caller should further call
+   * 2 uint32 data (see RaySegment::Serialize() ) instead. The caller should further call
    * ObjectPool<T>::GetPointerFromSerializeData(T*) to get real ray segment pointer.
    *
    * @warning ObjectPool<T>::GetPointerFromSerializeData(T*) must be called **AFTER** the entire
@@ -168,12 +173,14 @@ struct RayInfo : public ISerializable {
    * @param file
    * @param endianness
    */
-  void Deserialize(File& file, endian::Endianness endianness) override;
+  void Deserialize(File& file, endian::Endianness endianness);
 
   RaySegment* first_ray_segment;
   RaySegment* prev_ray_segment;
   int32_t crystal_id;
   Vec3f main_axis;
+  float axis_mat[9];                   //!< Rotation matrix of main_axis, see RotateZMatrix()
+  RayPathRecorder prev_path_recorder;  //!< Whole path of prev_ray_segment, across all previous scatters
 };
 
 
@@ -187,6 +194,29 @@ class Optics {
                         const float* pt_in, const float* dir_in, const float* w_in, const int* face_id_in,  // input
                         float* pt_out, int* face_id_out);                                                   // output
 
+  /**
+   * @brief Packet version of HitSurface.
+   *
+   * Vectors are in SoA layout, i.e. `dir_in[0]`, `dir_in[1]`, `dir_in[2]` are arrays of x, y, z
+   * components respectively. Output rays are interleaved in the same way as HitSurface: reflection of
+   * the i-th ray is at 2i, and refraction is at 2i+1.
+   */
+  static void HitSurfacePacket(const Crystal* crystal, float n, size_t num,                           // input
+                               const float* const* dir_in, const int* face_id_in, const float* w_in,  // input
+                               float* const* dir_out, float* w_out);                                  // output
+
+  /**
+   * @brief Packet version of Propagate.
+   *
+   * Vectors are in SoA layout, see HitSurfacePacket. Same as Propagate, `pt_in` and `face_id_in` are
+   * indexed by i/2. Rays are tested against faces 16 (AVX-512) or 8 (AVX2) at a time. For convex crystals,
+   * rays are clipped by planes instead, see IntersectLineWithConvexCrystal.
+   */
+  static void PropagatePacket(const Crystal* crystal, size_t num,                     // input
+                              const float* const* pt_in, const float* const* dir_in,  // input
+                              const float* w_in, const int* face_id_in,               // input
+                              float* const* pt_out, int* face_id_out);                // output
+
   static float GetReflectRatio(float cos_angle, float rr);
 
   /*! \brief Intersect a line with many faces and find the nearest intersection point.
@@ -206,11 +236,42 @@ class Optics {
                                          const float* face_norm,             // input
                                          float* p, int* idx);                // output
 
-  static void IntersectLineWithTrianglesSimd(const float* pt, const float* dir,  // input
-                                             int face_id, int face_num,          // input
-                                             const float* face_bases,            //
-                                             const float* face_points,           //
-                                             const float* face_norm,             //
+  /*! \brief Intersect a line with many faces, using packed face data.
+   *
+   * Same as IntersectLineWithTriangles, but tests 16 (AVX-512) or 8 (AVX2) faces at a time. The kernel
+   * is selected once at runtime according to CPU features, and falls back to a plain loop otherwise.
+   *
+   * \param pt a point on the line, 3 floats
+   * \param dir the direction of the line, 3 floats
+   * \param face_id the face where the line comes in
+   * \param face_num the face number
+   * \param face_stride the row length of packed data, see Crystal::GetFacePackedStride()
+   * \param face_packed the packed face data, see Crystal::GetFacePackedData()
+   * \param p output argument, the intersection point
+   * \param idx output argument, the face index of the intersection point
+   */
+  static void IntersectLineWithTrianglesPacked(const float* pt, const float* dir,  // input
+                                               int face_id, int face_num,          // input
+                                               int face_stride,                    // input
+                                               const float* face_packed,           // input
+                                               float* p, int* idx);                // output
+
+  /*! \brief Find where a line leaves a convex crystal, with slab clipping over its planes.
+   *
+   * Only one dot product per plane is needed, comparing with IntersectLineWithTriangles. The result is
+   * the same as IntersectLineWithTriangles if the crystal is convex (see Crystal::IsConvex()), i.e. if
+   * the line goes outward from face_id, no intersection will be found.
+   *
+   * \param crystal the crystal, must be convex
+   * \param pt a point on the line, 3 floats
+   * \param dir the direction of the line, 3 floats
+   * \param face_id the face where the line comes in
+   * \param p output argument, the intersection point
+   * \param idx output argument, the face index of the intersection point
+   */
+  static void IntersectLineWithConvexCrystal(const Crystal* crystal,             // input
+                                             const float* pt, const float* dir,  // input
+                                             int face_id,                        // input
                                              float* p, int* idx);                // output
 };
 
@@ -1,6 +1,12 @@
 #include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
 #include <opencv2/opencv.hpp>
+#include <string>
+#include <thread>
 
 #include "context/context.hpp"
 #include "process/render.hpp"
@@ -10,12 +16,85 @@
 
 
 constexpr size_t kBufSize = 1024;
+constexpr float kRayPathCacheSaveInterval = 60;  // In seconds
 char str_buf[kBufSize];
 
 std::vector<icehalo::Renderer> split_renderer_candidates;
 std::vector<std::set<size_t>> renderer_ray_set;
 
 
+/**
+ * @brief Encode and write images on a background thread, so that ray tracing does not wait for it.
+ *
+ * Only the latest pending image of each path is kept. An older one that has not been written is dropped.
+ * Every image is written to a temporary file and then renamed, so that a reader never sees a partial file.
+ */
+class ImageWriter {
+ public:
+  ImageWriter() : writing_(false), stop_flag_(false), worker_(&ImageWriter::WorkingFunction, this) {}
+
+  ImageWriter(const ImageWriter& other) = delete;
+  ImageWriter& operator=(const ImageWriter& other) = delete;
+
+  ~ImageWriter() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      stop_flag_ = true;
+    }
+    cv_.notify_all();
+    worker_.join();
+  }
+
+  // Copy the RGB buffer and return immediately.
+  void Submit(const std::string& path, const uint8_t* rgb_data, int width, int height) {
+    cv::Mat img(height, width, CV_8UC3);
+    std::memcpy(img.data, rgb_data, width * height * 3);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      pending_[path] = std::move(img);
+    }
+    cv_.notify_all();
+  }
+
+  // Wait until all pending images are written.
+  void Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [=] { return pending_.empty() && !writing_; });
+  }
+
+ private:
+  void WorkingFunction() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [=] { return stop_flag_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        break;
+      }
+      auto node = pending_.extract(pending_.begin());
+      writing_ = true;
+      lock.unlock();
+
+      auto tmp_path = node.key() + ".tmp.png";
+      cv::cvtColor(node.mapped(), node.mapped(), cv::COLOR_RGB2BGR);
+      if (!cv::imwrite(tmp_path, node.mapped()) || std::rename(tmp_path.c_str(), node.key().c_str()) != 0) {
+        LOG_ERROR("Cannot write image %s!", node.key().c_str());
+      }
+
+      lock.lock();
+      writing_ = false;
+      cv_.notify_all();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<std::string, cv::Mat> pending_;
+  bool writing_;
+  bool stop_flag_;
+  std::thread worker_;
+};
+
+
 void PrintRayPath(const icehalo::RayPath& ray_path, char* buf, size_t size) {
   bool crystal_flag = true;
   size_t offset = 0;
@@ -128,6 +207,7 @@ int main(int argc, char* argv[]) {
   parser.AddArgument("-d", 0, "debug", "display debug info");
   parser.AddArgument("-n", 1, "repeat-number", "repeat number (-1 means infinity)");
   parser.AddArgument("-f", 1, "config-file", "config file");
+  parser.AddArgument("-p", 1, "preview-interval", "write a preview image every N seconds (0 means no preview)");
   icehalo::ArgParseResult arg_parse_result;
   try {
     arg_parse_result = parser.Parse(argc, argv);
@@ -146,7 +226,7 @@ int main(int argc, char* argv[]) {
     icehalo::Logger::GetInstance()->AddDestination(stdout_filter, stdout_dest);
   }
 
-  icehalo::ThreadingPoolPtr threading_pool = icehalo::ThreadingPool::CreatePool();
+  icehalo::ThreadingPoolPtr threading_pool = icehalo::ThreadingPool::GetDefaultPool();
 
   auto start = std::chrono::system_clock::now();
   icehalo::ProjectContextPtr proj_ctx = icehalo::ProjectContext::CreateFromFile(config_filename);
@@ -161,8 +241,13 @@ int main(int argc, char* argv[]) {
 
   auto& split_render_ctx = proj_ctx->split_render_ctx_;
   size_t split_img_num = 0;
+  size_t cached_path_num = 0;
   if (split_render_ctx) {
     split_img_num = PrepareSplitRender(proj_ctx, split_render_ctx, threading_pool);
+    if (proj_ctx->LoadRayPathCache()) {
+      cached_path_num = proj_ctx->ray_path_cache_.Size();
+      LOG_INFO("Loaded %zu cached ray paths", cached_path_num);
+    }
   }
 
   auto t = std::chrono::system_clock::now();
@@ -180,22 +265,41 @@ int main(int argc, char* argv[]) {
   if (arg_parse_result.count("-n")) {
     repeat_num = std::strtol(arg_parse_result.at("-n")[0].c_str(), nullptr, 10);
   }
+  float preview_interval = 0;
+  if (arg_parse_result.count("-p")) {
+    preview_interval = std::strtof(arg_parse_result.at("-p")[0].c_str(), nullptr);
+  }
+
+  auto img_wid = proj_ctx->render_ctx_->GetImageWidth();
+  auto img_hei = proj_ctx->render_ctx_->GetImageHeight();
+  ImageWriter image_writer;
+  auto last_preview = std::chrono::system_clock::now();
+  auto last_cache_save = last_preview;
 
+  // Ray tracing is pipelined. Next wavelength is traced in background, while current one is being collected.
   size_t total_ray_num = 0;
   long curr_repeat = 0;
+  simulator.SetCurrentWavelengthIndex(0);
+  simulator.RunAsync();
   while (true) {
     const auto& wavelengths = proj_ctx->wavelengths_;
+    bool last_repeat = repeat_num > 0 && curr_repeat + 1 >= repeat_num;
     for (size_t i = 0; i < wavelengths.size(); i++) {
       LOG_INFO("starting at wavelength: %d", wavelengths[i].wavelength);
-      simulator.SetCurrentWavelengthIndex(i);
 
       auto t0 = std::chrono::system_clock::now();
-      simulator.Run();
+      simulator.WaitFinish();
       auto t1 = std::chrono::system_clock::now();
       diff = t1 - t0;
-      LOG_INFO("Ray tracing: %.2fms", diff.count());
+      LOG_INFO("Waiting for ray tracing: %.2fms", diff.count());
 
       auto simulation_data = simulator.GetSimulationRayData();
+      if (i + 1 < wavelengths.size() || !last_repeat) {
+        simulator.SetCurrentWavelengthIndex((i + 1) % wavelengths.size());
+        simulator.RunAsync();
+      }
+
+      t0 = std::chrono::system_clock::now();
       if (split_render_ctx) {
         auto [ray_info_list, exit_ray_data] = RenderSplitHalos(simulation_data, proj_ctx, split_render_ctx);
         if (exit_ray_data.buf_ray_num == 0) {
@@ -220,25 +324,38 @@ int main(int argc, char* argv[]) {
       auto t2 = std::chrono::system_clock::now();
       diff = t2 - t0;
       LOG_INFO("Collecting rays: %.2fms", diff.count());
+
+      // Progressive preview. Only the main image is rendered here, and it is encoded in background.
+      diff = t2 - last_preview;
+      if (preview_interval > 0 && diff.count() >= preview_interval * 1000) {
+        renderer.Render();
+        image_writer.Submit(proj_ctx->GetMainImagePath(), renderer.GetImageBuffer(), img_wid, img_hei);
+        last_preview = t2;
+      }
     }
 
     renderer.Render();
-
-    cv::Mat img(proj_ctx->render_ctx_->GetImageHeight(), proj_ctx->render_ctx_->GetImageWidth(), CV_8UC3,
-                renderer.GetImageBuffer());
-    cv::cvtColor(img, img, cv::COLOR_RGB2BGR);
-    cv::imwrite(proj_ctx->GetMainImagePath(), img);
+    image_writer.Submit(proj_ctx->GetMainImagePath(), renderer.GetImageBuffer(), img_wid, img_hei);
+    last_preview = std::chrono::system_clock::now();
 
     if (split_render_ctx) {
       for (auto& r : split_renderer_candidates) {
         r.Render();
       }
       for (size_t i = 0; i < std::min(split_renderer_candidates.size(), split_img_num); i++) {
-        cv::Mat halo_img(proj_ctx->split_render_ctx_->GetImageHeight(), proj_ctx->split_render_ctx_->GetImageWidth(),
-                         CV_8UC3, split_renderer_candidates[i].GetImageBuffer());
-        cv::cvtColor(halo_img, halo_img, cv::COLOR_RGB2BGR);
         std::snprintf(str_buf, kBufSize, "halo_%03zu.png", i);
-        cv::imwrite(icehalo::PathJoin(proj_ctx->GetDataDirectory(), str_buf), halo_img);
+        image_writer.Submit(icehalo::PathJoin(proj_ctx->GetDataDirectory(), str_buf),
+                            split_renderer_candidates[i].GetImageBuffer(), split_render_ctx->GetImageWidth(),
+                            split_render_ctx->GetImageHeight());
+      }
+
+      // Save ray path cache when new paths come, but not too often. An endless run is usually killed at any time.
+      auto t3 = std::chrono::system_clock::now();
+      std::chrono::duration<float> save_diff = t3 - last_cache_save;
+      if (proj_ctx->ray_path_cache_.Size() != cached_path_num && save_diff.count() >= kRayPathCacheSaveInterval) {
+        proj_ctx->SaveRayPathCache();
+        cached_path_num = proj_ctx->ray_path_cache_.Size();
+        last_cache_save = t3;
       }
     }
 
@@ -254,6 +371,11 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  image_writer.Flush();
+  if (split_render_ctx && proj_ctx->ray_path_cache_.Size() != cached_path_num) {
+    proj_ctx->SaveRayPathCache();
+  }
+
   auto end = std::chrono::system_clock::now();
   diff = end - start;
   LOG_INFO("Total: %.3fs\n", diff.count() / 1e3);
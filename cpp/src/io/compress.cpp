@@ -0,0 +1,185 @@
+#include "io/compress.hpp"
+
+#include <cstring>
+#include <memory>
+
+namespace icehalo {
+
+namespace {
+
+constexpr int kHashLog = 16;
+constexpr size_t kMinMatch = 4;
+constexpr size_t kMaxOffset = 65535;
+constexpr size_t kLastLiterals = 5;     // The last 5 bytes are always literals
+constexpr size_t kMatchFindLimit = 12;  // The last match starts at least 12 bytes before the end
+
+
+inline uint32_t Read32(const uint8_t* p) {
+  uint32_t x = 0;
+  std::memcpy(&x, p, sizeof(uint32_t));
+  return x;
+}
+
+
+inline uint32_t Hash(uint32_t x) {
+  return (x * 2654435761u) >> (32 - kHashLog);
+}
+
+
+inline uint8_t* WriteLength(uint8_t* op, size_t len) {
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = static_cast<uint8_t>(len);
+  return op;
+}
+
+
+// Returns false if the length runs out of input.
+inline bool ReadLength(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+  uint8_t b = 0;
+  do {
+    if (*ip >= iend) {
+      return false;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+
+// Writes a sequence of literals [anchor, anchor + lit_len), followed by a match. Use match_len = 0 for
+// the last sequence, which has no match. Returns nullptr if it does not fit.
+uint8_t* WriteSequence(const uint8_t* anchor, size_t lit_len, size_t offset, size_t match_len, uint8_t* op,
+                       const uint8_t* oend) {
+  size_t max_bytes = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+  if (max_bytes > static_cast<size_t>(oend - op)) {
+    return nullptr;
+  }
+
+  uint8_t* token = op++;
+  *token = static_cast<uint8_t>((lit_len < 15 ? lit_len : 15) << 4);
+  if (lit_len >= 15) {
+    op = WriteLength(op, lit_len - 15);
+  }
+  std::memcpy(op, anchor, lit_len);
+  op += lit_len;
+  if (match_len == 0) {
+    return op;
+  }
+
+  *op++ = static_cast<uint8_t>(offset & 0xff);
+  *op++ = static_cast<uint8_t>(offset >> 8);
+  size_t ml = match_len - kMinMatch;
+  *token |= static_cast<uint8_t>(ml < 15 ? ml : 15);
+  if (ml >= 15) {
+    op = WriteLength(op, ml - 15);
+  }
+  return op;
+}
+
+}  // namespace
+
+
+size_t Lz4Compress(const uint8_t* src, size_t src_bytes, uint8_t* dst, size_t dst_capacity) {
+  std::unique_ptr<uint32_t[]> table{ new uint32_t[1 << kHashLog]{} };
+
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+  const uint8_t* iend = src + src_bytes;
+  const uint8_t* match_limit = src_bytes > kLastLiterals ? iend - kLastLiterals : src;
+  const uint8_t* mf_limit = src_bytes > kMatchFindLimit ? iend - kMatchFindLimit : src;
+  uint8_t* op = dst;
+  const uint8_t* oend = dst + dst_capacity;
+
+  while (ip < mf_limit) {
+    auto seq = Read32(ip);
+    auto h = Hash(seq);
+    const uint8_t* ref = src + table[h];
+    table[h] = static_cast<uint32_t>(ip - src);
+    if (ref >= ip || static_cast<size_t>(ip - ref) > kMaxOffset || Read32(ref) != seq) {
+      ip++;
+      continue;
+    }
+
+    // Extend the match forwards, and then backwards over pending literals.
+    const uint8_t* mp = ip + kMinMatch;
+    const uint8_t* rp = ref + kMinMatch;
+    while (mp < match_limit && *mp == *rp) {
+      mp++;
+      rp++;
+    }
+    while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+
+    op = WriteSequence(anchor, ip - anchor, ip - ref, mp - ip, op, oend);
+    if (!op) {
+      return 0;
+    }
+    ip = mp;
+    anchor = ip;
+  }
+
+  op = WriteSequence(anchor, iend - anchor, 0, 0, op, oend);
+  return op ? op - dst : 0;
+}
+
+
+bool Lz4Decompress(const uint8_t* src, size_t src_bytes, uint8_t* dst, size_t dst_bytes) {
+  const uint8_t* ip = src;
+  const uint8_t* iend = src + src_bytes;
+  uint8_t* op = dst;
+  uint8_t* oend = dst + dst_bytes;
+
+  while (ip < iend) {
+    auto token = *ip++;
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && !ReadLength(&ip, iend, &lit_len)) {
+      return false;
+    }
+    if (lit_len > static_cast<size_t>(iend - ip) || lit_len > static_cast<size_t>(oend - op)) {
+      return false;
+    }
+    std::memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if (ip == iend) {
+      // The last sequence has only literals.
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return false;
+    }
+    size_t offset = ip[0] | static_cast<size_t>(ip[1]) << 8;
+    ip += 2;
+    if (offset == 0 || offset > static_cast<size_t>(op - dst)) {
+      return false;
+    }
+    size_t match_len = token & 0x0f;
+    if (match_len == 15 && !ReadLength(&ip, iend, &match_len)) {
+      return false;
+    }
+    match_len += kMinMatch;
+    if (match_len > static_cast<size_t>(oend - op)) {
+      return false;
+    }
+
+    const uint8_t* mp = op - offset;
+    if (offset >= match_len) {
+      std::memcpy(op, mp, match_len);
+      op += match_len;
+    } else {
+      // Overlapped copy repeats the last `offset` bytes.
+      for (size_t i = 0; i < match_len; i++) {
+        *op++ = *mp++;
+      }
+    }
+  }
+  return op == oend;
+}
+
+}  // namespace icehalo
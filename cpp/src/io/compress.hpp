@@ -0,0 +1,43 @@
+#ifndef SRC_IO_COMPRESS_H_
+#define SRC_IO_COMPRESS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace icehalo {
+
+/**
+ * @brief Max size of compressed data for an input of `n` bytes, see Lz4Compress().
+ */
+constexpr size_t Lz4CompressBound(size_t n) {
+  return n + n / 255 + 16;
+}
+
+/**
+ * @brief Compresses a block in LZ4 block format.
+ *
+ * It is a plain greedy compressor with a single hash table. It is fast, and does fairly well on
+ * simulation data, which have lots of repeated path records and similar floats.
+ *
+ * @param src
+ * @param src_bytes
+ * @param dst [output]
+ * @param dst_capacity
+ * @return Compressed bytes. 0 if the result does not fit in `dst_capacity`.
+ */
+size_t Lz4Compress(const uint8_t* src, size_t src_bytes, uint8_t* dst, size_t dst_capacity);
+
+/**
+ * @brief Decompresses a block in LZ4 block format. All reads and writes are bound checked.
+ *
+ * @param src
+ * @param src_bytes
+ * @param dst [output]
+ * @param dst_bytes The exact size of decompressed data.
+ * @return false if the input is corrupted, or it does not decompress to exactly `dst_bytes`.
+ */
+bool Lz4Decompress(const uint8_t* src, size_t src_bytes, uint8_t* dst, size_t dst_bytes);
+
+}  // namespace icehalo
+
+#endif  // SRC_IO_COMPRESS_H_
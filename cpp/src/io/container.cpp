@@ -0,0 +1,228 @@
+#include "io/container.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(OS_MAC) || defined(OS_LINUX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "io/serialize.hpp"
+#include "util/log.hpp"
+
+namespace icehalo {
+
+namespace {
+
+constexpr size_t AlignUp(size_t n) {
+  return (n + kContainerAlignment - 1) / kContainerAlignment * kContainerAlignment;
+}
+
+
+void SwapElements(uint8_t* data, size_t elem_bytes, size_t num) {
+  for (size_t i = 0; i < num; i++) {
+    std::reverse(data + i * elem_bytes, data + (i + 1) * elem_bytes);
+  }
+}
+
+
+template <class T>
+void SwapField(T* x) {
+  SwapElements(reinterpret_cast<uint8_t*>(x), sizeof(T), 1);
+}
+
+}  // namespace
+
+
+MappedFile::MappedFile(const char* filename) : data_(nullptr), bytes_(0) {
+#if defined(OS_MAC) || defined(OS_LINUX)
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      data_ = static_cast<const uint8_t*>(p);
+      bytes_ = static_cast<size_t>(st.st_size);
+    }
+  }
+  close(fd);
+#else
+  File file(filename);
+  if (!file.Open(FileOpenMode::kRead)) {
+    return;
+  }
+  auto bytes = file.GetBytes();
+  buffer_.reset(new uint64_t[(bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t)]);
+  file.Read(reinterpret_cast<uint8_t*>(buffer_.get()), bytes);
+  file.Close();
+  data_ = reinterpret_cast<const uint8_t*>(buffer_.get());
+  bytes_ = bytes;
+#endif
+}
+
+
+MappedFile::~MappedFile() {
+#if defined(OS_MAC) || defined(OS_LINUX)
+  if (data_) {
+    munmap(const_cast<uint8_t*>(data_), bytes_);
+  }
+#endif
+}
+
+
+bool MappedFile::IsValid() const {
+  return data_ != nullptr;
+}
+
+
+const uint8_t* MappedFile::GetData() const {
+  return data_;
+}
+
+
+size_t MappedFile::GetBytes() const {
+  return bytes_;
+}
+
+
+size_t ContainerWriter::Write(File& file) const {
+  ContainerHeader header{};
+  header.magic = kContainerMagic;
+  header.boi = ISerializable::kDefaultBoi;
+  header.version = kContainerVersion;
+  header.section_num = static_cast<uint32_t>(sections_.size());
+
+  std::vector<ContainerSection> section_table;
+  size_t offset = AlignUp(sizeof(ContainerHeader) + sizeof(ContainerSection) * sections_.size());
+  for (const auto& s : sections_) {
+    section_table.emplace_back(ContainerSection{ s.tag, static_cast<uint32_t>(s.elem_bytes), s.elem_num, offset, 0 });
+    offset += AlignUp(s.elem_bytes * s.elem_num);
+  }
+  header.file_bytes = offset;
+
+  static const uint8_t kPadding[kContainerAlignment]{};
+  size_t count = file.Write(header);
+  count += file.Write(section_table.data(), section_table.size());
+  for (size_t i = 0; i < sections_.size(); i++) {
+    count += file.Write(kPadding, section_table[i].offset - count);
+    count += file.Write(static_cast<const uint8_t*>(sections_[i].data),
+                        sections_[i].elem_bytes * sections_[i].elem_num);
+  }
+  count += file.Write(kPadding, header.file_bytes - count);
+  return count;
+}
+
+
+ContainerReader::ContainerReader() : version_(0), native_endian_(true) {}
+
+
+bool ContainerReader::Open(const char* filename) {
+  file_.reset();
+  sections_.clear();
+
+  auto file = std::make_shared<MappedFile>(filename);
+  if (!file->IsValid() || file->GetBytes() < sizeof(ContainerHeader)) {
+    LOG_ERROR("Cannot map file %s!", filename);
+    return false;
+  }
+  auto bytes = file->GetBytes();
+
+  ContainerHeader header{};
+  std::memcpy(&header, file->GetData(), sizeof(ContainerHeader));
+  bool native_endian = (header.boi == ISerializable::kDefaultBoi);
+  if (!native_endian) {
+    SwapField(&header.magic);
+    SwapField(&header.boi);
+    SwapField(&header.version);
+    SwapField(&header.section_num);
+    SwapField(&header.file_bytes);
+  }
+  if (header.magic != kContainerMagic || header.boi != ISerializable::kDefaultBoi) {
+    LOG_ERROR("%s is not a container file!", filename);
+    return false;
+  }
+  if (header.version > kContainerVersion) {
+    LOG_ERROR("Container version %u of %s is not supported!", header.version, filename);
+    return false;
+  }
+  if (header.file_bytes > bytes ||
+      sizeof(ContainerHeader) + sizeof(ContainerSection) * static_cast<size_t>(header.section_num) > bytes) {
+    LOG_ERROR("Container %s is truncated!", filename);
+    return false;
+  }
+
+  std::vector<ContainerSection> sections(header.section_num);
+  std::memcpy(sections.data(), file->GetData() + sizeof(ContainerHeader),
+              sizeof(ContainerSection) * sections.size());
+  for (auto& s : sections) {
+    if (!native_endian) {
+      SwapField(&s.tag);
+      SwapField(&s.elem_bytes);
+      SwapField(&s.elem_num);
+      SwapField(&s.offset);
+    }
+    if (s.offset > bytes || (s.elem_bytes > 0 && s.elem_num > (bytes - s.offset) / s.elem_bytes)) {
+      LOG_ERROR("Section %08x of container %s is out of range!", s.tag, filename);
+      return false;
+    }
+    // Arrays are used in place, so any element type must be properly aligned.
+    if (s.offset % kContainerAlignment != 0) {
+      LOG_ERROR("Section %08x of container %s is not aligned!", s.tag, filename);
+      return false;
+    }
+  }
+
+  file_ = std::move(file);
+  version_ = header.version;
+  native_endian_ = native_endian;
+  sections_ = std::move(sections);
+  return true;
+}
+
+
+uint32_t ContainerReader::GetVersion() const {
+  return version_;
+}
+
+
+bool ContainerReader::IsNativeEndian() const {
+  return native_endian_;
+}
+
+
+MappedFilePtr ContainerReader::GetMappedFile() const {
+  return file_;
+}
+
+
+const ContainerSection* ContainerReader::FindSection(uint32_t tag) const {
+  for (const auto& s : sections_) {
+    if (s.tag == tag) {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+
+size_t ContainerReader::ReadArray(uint32_t tag, size_t elem_bytes, void* out, size_t max_num) const {
+  const auto* section = FindSection(tag);
+  if (!section || section->elem_bytes != elem_bytes) {
+    return 0;
+  }
+
+  auto num = std::min(static_cast<size_t>(section->elem_num), max_num);
+  std::memcpy(out, file_->GetData() + section->offset, num * elem_bytes);
+  if (!native_endian_) {
+    SwapElements(static_cast<uint8_t*>(out), elem_bytes, num);
+  }
+  return num;
+}
+
+}  // namespace icehalo
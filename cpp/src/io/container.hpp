@@ -0,0 +1,197 @@
+#ifndef SRC_IO_CONTAINER_H_
+#define SRC_IO_CONTAINER_H_
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "io/file.hpp"
+
+namespace icehalo {
+
+/**
+ * @brief A read-only file mapped into memory.
+ *
+ * On Linux and macOS it is mapped with `mmap`, so pages are loaded on demand and shared with page cache.
+ * On other platforms the whole file is read into memory at once.
+ */
+class MappedFile {
+ public:
+  explicit MappedFile(const char* filename);
+  MappedFile(const MappedFile& other) = delete;
+  ~MappedFile();
+
+  MappedFile& operator=(const MappedFile& other) = delete;
+
+  bool IsValid() const;
+  const uint8_t* GetData() const;
+  size_t GetBytes() const;
+
+ private:
+  const uint8_t* data_;
+  size_t bytes_;
+  std::unique_ptr<uint64_t[]> buffer_;  //!< Used when mmap is not available. uint64 for alignment.
+};
+
+using MappedFilePtr = std::shared_ptr<MappedFile>;
+
+
+constexpr uint32_t MakeSectionTag(char a, char b, char c, char d) {
+  return static_cast<uint32_t>(static_cast<uint8_t>(a)) | static_cast<uint32_t>(static_cast<uint8_t>(b)) << 8 |
+         static_cast<uint32_t>(static_cast<uint8_t>(c)) << 16 | static_cast<uint32_t>(static_cast<uint8_t>(d)) << 24;
+}
+
+
+struct ContainerHeader {
+  uint32_t magic;        //!< kContainerMagic
+  uint32_t boi;          //!< ISerializable::kDefaultBoi, in byte order of the file
+  uint32_t version;      //!< kContainerVersion
+  uint32_t section_num;  //!< Number of entries in section table
+  uint64_t file_bytes;   //!< Total bytes of the file
+  uint64_t reserved;
+};
+
+struct ContainerSection {
+  uint32_t tag;         //!< See MakeSectionTag()
+  uint32_t elem_bytes;  //!< Bytes of one element. Elements are byte swapped as a whole
+  uint64_t elem_num;    //!< Number of elements
+  uint64_t offset;      //!< Offset from the file beginning, aligned to kContainerAlignment
+  uint64_t reserved;
+};
+
+constexpr uint32_t kContainerMagic = MakeSectionTag('I', 'H', 'C', 'T');
+constexpr uint32_t kContainerVersion = 1;
+constexpr size_t kContainerAlignment = 64;
+
+static_assert(sizeof(ContainerHeader) == 32, "ContainerHeader must be packed as 32 bytes!");
+static_assert(sizeof(ContainerSection) == 32, "ContainerSection must be packed as 32 bytes!");
+
+
+/**
+ * @brief Writes raw arrays into a container file.
+ *
+ * A container is a versioned binary file made of tagged sections, and every section is a raw array
+ * of fixed size elements. It is designed to be memory mapped, see ContainerReader.
+ *
+ * The file layout is:
+ * header,                      // ContainerHeader
+ * section table,               // ContainerSection * N
+ * padding,                     // up to kContainerAlignment
+ * section data,                // raw array, padded to kContainerAlignment
+ * ...
+ *
+ * Arrays are written in native byte order (little endian on all supported platforms), and the byte
+ * order is tagged by the BOI in header.
+ */
+class ContainerWriter {
+ public:
+  /**
+   * @brief Adds a section. Data are not copied, so they must be kept until ContainerWriter::Write().
+   *
+   * @param tag Section tag. See MakeSectionTag().
+   * @param data
+   * @param num The number of elements.
+   */
+  template <class T>
+  void AddSection(uint32_t tag, const T* data, size_t num) {
+    static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be put in a container!");
+    sections_.emplace_back(PendingSection{ tag, sizeof(T), num, data });
+  }
+
+  /**
+   * @brief Writes all sections to a file, which should be opened for writing.
+   *
+   * @param file
+   * @return Bytes written.
+   */
+  size_t Write(File& file) const;
+
+ private:
+  struct PendingSection {
+    uint32_t tag;
+    size_t elem_bytes;
+    size_t elem_num;
+    const void* data;
+  };
+
+  std::vector<PendingSection> sections_;
+};
+
+
+/**
+ * @brief Reads a container file written by ContainerWriter.
+ *
+ * The file is memory mapped. If it is in native byte order, arrays can be used in place with
+ * ContainerReader::GetArray(), without any copy. Otherwise ContainerReader::ReadArray() copies and swaps them.
+ */
+class ContainerReader {
+ public:
+  ContainerReader();
+
+  /**
+   * @brief Maps a file and checks its header and section table.
+   *
+   * @param filename
+   * @return false if the file cannot be mapped, or it is not a valid container, e.g. a section is out of range
+   *         or its offset is not aligned to kContainerAlignment.
+   */
+  bool Open(const char* filename);
+
+  uint32_t GetVersion() const;
+  bool IsNativeEndian() const;
+  MappedFilePtr GetMappedFile() const;
+
+  /**
+   * @brief Finds a section by its tag.
+   *
+   * @return nullptr if not found. Fields are always in native byte order.
+   */
+  const ContainerSection* FindSection(uint32_t tag) const;
+
+  /**
+   * @brief Gets an array in place.
+   *
+   * @param tag
+   * @param num [output] The number of elements. Can be nullptr.
+   * @return nullptr if the section is not found, its element size does not match, or the file is not
+   *         in native byte order.
+   */
+  template <class T>
+  const T* GetArray(uint32_t tag, size_t* num) const {
+    static_assert(alignof(T) <= kContainerAlignment, "Sections are only aligned to kContainerAlignment!");
+    const auto* section = FindSection(tag);
+    if (!section || section->elem_bytes != sizeof(T) || !IsNativeEndian()) {
+      return nullptr;
+    }
+    if (num) {
+      *num = section->elem_num;
+    }
+    return reinterpret_cast<const T*>(file_->GetData() + section->offset);
+  }
+
+  /**
+   * @brief Copies an array in native byte order.
+   *
+   * @param tag
+   * @param out [output] At least `max_num` elements.
+   * @param max_num
+   * @return The number of elements copied. 0 if the section is not found or its element size does not match.
+   */
+  template <class T>
+  size_t ReadArray(uint32_t tag, T* out, size_t max_num) const {
+    return ReadArray(tag, sizeof(T), out, max_num);
+  }
+
+ private:
+  size_t ReadArray(uint32_t tag, size_t elem_bytes, void* out, size_t max_num) const;
+
+  MappedFilePtr file_;
+  uint32_t version_;
+  bool native_endian_;
+  std::vector<ContainerSection> sections_;
+};
+
+}  // namespace icehalo
+
+#endif  // SRC_IO_CONTAINER_H_
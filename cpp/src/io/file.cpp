@@ -2,10 +2,58 @@
 
 #include <algorithm>
 #include <cstdio>
+#include <stdexcept>
+
+#include "io/compress.hpp"
 
 
 namespace icehalo {
 
+namespace {
+
+constexpr uint8_t kCompressionMagic[4]{ 'I', 'H', 'C', 'Z' };
+constexpr size_t kCompressionHeaderBytes = 16;
+constexpr size_t kFrameHeaderBytes = 8;
+
+
+void PutLittle32(uint8_t* p, uint32_t x) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = static_cast<uint8_t>(x >> (i * 8));
+  }
+}
+
+
+uint32_t GetLittle32(const uint8_t* p) {
+  uint32_t x = 0;
+  for (int i = 0; i < 4; i++) {
+    x |= static_cast<uint32_t>(p[i]) << (i * 8);
+  }
+  return x;
+}
+
+
+// Sniff compression from the file header. Files without it are raw, and are rewound to the beginning.
+// Returns false if the header is not supported.
+bool SniffCompression(std::FILE* file, size_t max_frame_bytes, FileCompression* compression) {
+  uint8_t header[kCompressionHeaderBytes]{};
+  *compression = FileCompression::kNone;
+  if (std::fread(header, 1, kCompressionHeaderBytes, file) != kCompressionHeaderBytes ||
+      std::memcmp(header, kCompressionMagic, sizeof(kCompressionMagic)) != 0) {
+    std::fseek(file, 0, SEEK_SET);
+    return true;
+  }
+  if (GetLittle32(header + 4) > File::kCompressionVersion ||
+      GetLittle32(header + 8) != static_cast<uint32_t>(FileCompression::kLz4Block) ||
+      GetLittle32(header + 12) > max_frame_bytes) {
+    return false;
+  }
+  *compression = FileCompression::kLz4Block;
+  return true;
+}
+
+}  // namespace
+
+
 bool FileExists(const char* filename) {
   boost::filesystem::path p(filename);
   return exists(p);
@@ -13,15 +61,24 @@ bool FileExists(const char* filename) {
 
 
 std::vector<File> ListDataFiles(const char* dir) {
+  std::vector<File> files;
+  for (const auto& x : ListFiles(dir, ".bin")) {
+    files.emplace_back(x.c_str());
+  }
+  return files;
+}
+
+
+std::vector<std::string> ListFiles(const char* dir, const char* extension) {
   namespace f = boost::filesystem;
 
-  std::vector<File> files;
+  std::vector<std::string> files;
   f::path p(dir);
   std::vector<f::path> paths;
   copy(f::directory_iterator(p), f::directory_iterator(), back_inserter(paths));
   for (auto& x : paths) {
-    if (x.extension() == ".bin") {
-      files.emplace_back(x.c_str());
+    if (x.extension() == extension) {
+      files.emplace_back(x.string());
     }
   }
 
@@ -37,19 +94,22 @@ std::string PathJoin(const std::string& p1, const std::string& p2) {
 
 
 File::File(const char* filename)
-    : file_(nullptr), state_(FileState::kClosed), buffer_{ new char[kBufferSize] }, buffer_offset_(0), path_(filename) {
-}
+    : file_(nullptr), state_(FileState::kClosed), buffer_{ new char[kBufferSize] }, buffer_offset_(0), buffer_bytes_(0),
+      path_(filename), compression_(FileCompression::kNone), frame_offset_(0), frame_bytes_(0) {}
 
 
 File::File(const char* path, const char* filename)
-    : file_(nullptr), state_(FileState::kClosed), buffer_{ new char[kBufferSize] }, buffer_offset_(0), path_(path) {
+    : file_(nullptr), state_(FileState::kClosed), buffer_{ new char[kBufferSize] }, buffer_offset_(0), buffer_bytes_(0),
+      path_(path), compression_(FileCompression::kNone), frame_offset_(0), frame_bytes_(0) {
   path_ /= filename;
 }
 
 
 File::File(icehalo::File&& other) noexcept
     : file_(other.file_), state_(other.state_), buffer_(std::move(other.buffer_)), buffer_offset_(other.buffer_offset_),
-      path_(std::move(other.path_)) {}
+      buffer_bytes_(other.buffer_bytes_), path_(std::move(other.path_)), compression_(other.compression_),
+      frame_buffer_(std::move(other.frame_buffer_)), stored_buffer_(std::move(other.stored_buffer_)),
+      frame_offset_(other.frame_offset_), frame_bytes_(other.frame_bytes_) {}
 
 
 File& File::operator=(File&& other) {
@@ -58,7 +118,13 @@ File& File::operator=(File&& other) {
     state_ = other.state_;
     buffer_ = std::move(other.buffer_);
     buffer_offset_ = other.buffer_offset_;
+    buffer_bytes_ = other.buffer_bytes_;
     path_ = std::move(other.path_);
+    compression_ = other.compression_;
+    frame_buffer_ = std::move(other.frame_buffer_);
+    stored_buffer_ = std::move(other.stored_buffer_);
+    frame_offset_ = other.frame_offset_;
+    frame_bytes_ = other.frame_bytes_;
   }
   return *this;
 }
@@ -69,7 +135,7 @@ File::~File() {
 }
 
 
-bool File::Open(FileOpenMode mode) {
+bool File::Open(FileOpenMode mode, FileCompression compression) {
   if (!boost::filesystem::exists(path_.parent_path())) {
     boost::filesystem::create_directories(path_.parent_path());
   }
@@ -91,11 +157,51 @@ bool File::Open(FileOpenMode mode) {
       break;
   }
 
+  bool new_file = mode == FileOpenMode::kWrite || !boost::filesystem::exists(path_) || GetBytes() == 0;
+  if (!new_file && mode == FileOpenMode::kAppend) {
+    // Keep compression of the existing file, or frames and raw bytes are mixed up.
+    auto* f = std::fopen(path_.c_str(), "rb");
+    bool supported = f && SniffCompression(f, kBufferSize, &compression);
+    if (f) {
+      std::fclose(f);
+    }
+    if (!supported) {
+      state_ = FileState::kClosed;
+      return false;
+    }
+  }
   file_ = std::fopen(path_.c_str(), m);
   if (!file_) {
     state_ = FileState::kClosed;
+    return false;
+  }
+
+  buffer_offset_ = 0;
+  buffer_bytes_ = 0;
+  frame_offset_ = 0;
+  frame_bytes_ = 0;
+  uint8_t header[kCompressionHeaderBytes]{};
+  if (state_ == FileState::kWriting) {
+    compression_ = compression;
+    if (compression_ != FileCompression::kNone && new_file) {
+      std::memcpy(header, kCompressionMagic, sizeof(kCompressionMagic));
+      PutLittle32(header + 4, kCompressionVersion);
+      PutLittle32(header + 8, static_cast<uint32_t>(compression_));
+      PutLittle32(header + 12, static_cast<uint32_t>(kBufferSize));
+      std::fwrite(header, 1, kCompressionHeaderBytes, file_);
+    }
+  } else if (!SniffCompression(file_, kBufferSize, &compression_)) {
+    std::fclose(file_);
+    file_ = nullptr;
+    state_ = FileState::kClosed;
+    return false;
   }
-  return state_ != FileState::kClosed;
+
+  if (compression_ != FileCompression::kNone && !stored_buffer_) {
+    stored_buffer_.reset(new uint8_t[Lz4CompressBound(kBufferSize)]);
+    frame_buffer_.reset(new char[kBufferSize]);
+  }
+  return true;
 }
 
 
@@ -103,11 +209,88 @@ void File::Flush() {
   if (state_ != FileState::kWriting) {
     return;
   }
-  std::fwrite(buffer_.get(), 1, buffer_offset_, file_);
+  WriteBuffer();
+}
+
+
+void File::WriteBuffer() {
+  if (buffer_offset_ == 0) {
+    return;
+  }
+  if (compression_ == FileCompression::kNone) {
+    std::fwrite(buffer_.get(), 1, buffer_offset_, file_);
+    buffer_offset_ = 0;
+    return;
+  }
+
+  auto stored_bytes = Lz4Compress(reinterpret_cast<const uint8_t*>(buffer_.get()), buffer_offset_,
+                                  stored_buffer_.get(), buffer_offset_);
+  uint8_t frame_header[kFrameHeaderBytes];
+  PutLittle32(frame_header, static_cast<uint32_t>(buffer_offset_));
+  if (stored_bytes == 0 || stored_bytes >= buffer_offset_) {
+    // Not compressible. Store raw.
+    PutLittle32(frame_header + 4, static_cast<uint32_t>(buffer_offset_));
+    std::fwrite(frame_header, 1, kFrameHeaderBytes, file_);
+    std::fwrite(buffer_.get(), 1, buffer_offset_, file_);
+  } else {
+    PutLittle32(frame_header + 4, static_cast<uint32_t>(stored_bytes));
+    std::fwrite(frame_header, 1, kFrameHeaderBytes, file_);
+    std::fwrite(stored_buffer_.get(), 1, stored_bytes, file_);
+  }
   buffer_offset_ = 0;
 }
 
 
+size_t File::ReadBuffer(char* dst, size_t bytes) {
+  if (compression_ == FileCompression::kNone) {
+    return std::fread(dst, 1, bytes, file_);
+  }
+
+  size_t count = 0;
+  while (count < bytes) {
+    if (frame_offset_ >= frame_bytes_ && !ReadFrame()) {
+      break;
+    }
+    auto num = std::min(bytes - count, frame_bytes_ - frame_offset_);
+    std::memcpy(dst + count, frame_buffer_.get() + frame_offset_, num);
+    frame_offset_ += num;
+    count += num;
+  }
+  return count;
+}
+
+
+bool File::ReadFrame() {
+  frame_offset_ = 0;
+  frame_bytes_ = 0;
+  uint8_t frame_header[kFrameHeaderBytes];
+  if (std::fread(frame_header, 1, kFrameHeaderBytes, file_) != kFrameHeaderBytes) {
+    return false;
+  }
+
+  auto raw_bytes = GetLittle32(frame_header);
+  auto stored_bytes = GetLittle32(frame_header + 4);
+  if (raw_bytes > kBufferSize || stored_bytes > raw_bytes) {
+    throw std::runtime_error("Compressed frame is corrupted!");
+  }
+  if (stored_bytes == raw_bytes) {
+    if (std::fread(frame_buffer_.get(), 1, raw_bytes, file_) != raw_bytes) {
+      throw std::runtime_error("Compressed frame is truncated!");
+    }
+  } else {
+    if (std::fread(stored_buffer_.get(), 1, stored_bytes, file_) != stored_bytes) {
+      throw std::runtime_error("Compressed frame is truncated!");
+    }
+    if (!Lz4Decompress(stored_buffer_.get(), stored_bytes, reinterpret_cast<uint8_t*>(frame_buffer_.get()),
+                       raw_bytes)) {
+      throw std::runtime_error("Compressed frame is corrupted!");
+    }
+  }
+  frame_bytes_ = raw_bytes;
+  return true;
+}
+
+
 bool File::Close() {
   if (state_ != FileState::kClosed) {
     Flush();
@@ -115,11 +298,17 @@ bool File::Close() {
     file_ = nullptr;
     state_ = FileState::kClosed;
     buffer_offset_ = 0;
+    buffer_bytes_ = 0;
   }
   return true;
 }
 
 
+FileCompression File::GetCompression() const {
+  return compression_;
+}
+
+
 size_t File::GetBytes() {
   auto size = file_size(path_);
   if (size == static_cast<uintmax_t>(-1)) {
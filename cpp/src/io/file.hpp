@@ -1,6 +1,9 @@
 #ifndef SRC_IO_FILE_H_
 #define SRC_IO_FILE_H_
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -118,6 +121,23 @@ enum class FileState {
 };
 
 
+enum class FileCompression : uint32_t {
+  kNone = 0,
+  kLz4Block = 1,  //!< Each frame is an LZ4 block. See Lz4Compress()
+};
+
+
+/**
+ * @brief A buffered binary file, optionally block compressed.
+ *
+ * A compressed file starts with a 16-byte header (magic "IHCZ", version, codec and max frame bytes), followed
+ * by frames. Each frame is a header of (raw bytes, stored bytes) and its data, and is one write buffer compressed
+ * independently, so frames can be decoded in any order. A frame is stored raw if it does not compress.
+ * All headers are little endian.
+ *
+ * Compression is selected when opening for writing, and is sniffed from the file header when opening
+ * for reading. It is transparent to Read() and Write().
+ */
 class File {
  public:
   explicit File(const char* filename);
@@ -129,11 +149,28 @@ class File {
   File& operator=(const File& other) = delete;
   File& operator=(File&& other);
 
-  bool Open(FileOpenMode mode = FileOpenMode::kRead);
+  /**
+   * @brief Opens the file.
+   *
+   * @param mode
+   * @param compression Only used for writing. When appending to an existing file, compression of that file
+   *                    is kept, and this argument is ignored.
+   * @return false if the file cannot be opened.
+   */
+  bool Open(FileOpenMode mode = FileOpenMode::kRead, FileCompression compression = FileCompression::kNone);
   bool Close();
 
+  /**
+   * @brief Gets bytes on disk, i.e. compressed bytes for a compressed file.
+   */
   size_t GetBytes();
+  FileCompression GetCompression() const;
 
+  /**
+   * @brief Reads n elements.
+   *
+   * @return bytes read. It is less than `n * sizeof(T)` if the file ends.
+   */
   template <class T>
   size_t Read(T* buffer, size_t n = 1);
 
@@ -145,13 +182,26 @@ class File {
 
   void Flush();
 
+  static constexpr uint32_t kCompressionVersion = 1;
+
  private:
+  void WriteBuffer();
+  size_t ReadBuffer(char* dst, size_t bytes);
+  bool ReadFrame();
+
   std::FILE* file_;
   FileState state_;
   std::unique_ptr<char[]> buffer_;
   size_t buffer_offset_;
+  size_t buffer_bytes_;  //!< Valid bytes in buffer, for reading
   boost::filesystem::path path_;
 
+  FileCompression compression_;
+  std::unique_ptr<char[]> frame_buffer_;     //!< Decompressed frame, for reading
+  std::unique_ptr<uint8_t[]> stored_buffer_;  //!< Compressed frame
+  size_t frame_offset_;
+  size_t frame_bytes_;
+
   static constexpr size_t kBufferSize = 2 * 1024 * 1024;
 };
 
@@ -166,23 +216,29 @@ size_t File::Read(T* buffer, size_t n) {
     return 0;
   }
 
-  if (buffer_offset_ == 0) {
-    std::fread(buffer_.get(), 1, kBufferSize, file_);
+  if (buffer_bytes_ == 0) {
+    buffer_bytes_ = ReadBuffer(buffer_.get(), kBufferSize);
   }
 
   constexpr size_t kTypeSize = sizeof(T);
   size_t count = 0;
   char* p = reinterpret_cast<char*>(buffer);
-  for (size_t i = 0; i < n; i++) {
+  while (n > 0) {
     if (buffer_offset_ + kTypeSize >= kBufferSize) {
-      size_t remained_bytes = kBufferSize - buffer_offset_;
+      size_t remained_bytes = buffer_bytes_ - buffer_offset_;
       std::memcpy(buffer_.get(), buffer_.get() + buffer_offset_, remained_bytes);
-      std::fread(buffer_.get() + remained_bytes, 1, kBufferSize - remained_bytes, file_);
+      buffer_bytes_ = remained_bytes + ReadBuffer(buffer_.get() + remained_bytes, kBufferSize - remained_bytes);
       buffer_offset_ = 0;
     }
-    std::memcpy(p + i * kTypeSize, buffer_.get() + buffer_offset_, kTypeSize);
-    buffer_offset_ += kTypeSize;
-    count += kTypeSize;
+    // Copy as many elements as the buffer holds at a time.
+    size_t num = std::min(n, (std::min(buffer_bytes_, kBufferSize - 1) - buffer_offset_) / kTypeSize);
+    if (num == 0) {  // End of file
+      break;
+    }
+    std::memcpy(p + count, buffer_.get() + buffer_offset_, num * kTypeSize);
+    buffer_offset_ += num * kTypeSize;
+    count += num * kTypeSize;
+    n -= num;
   }
 
   return count;
@@ -198,8 +254,7 @@ size_t File::Write(T data) {
   constexpr size_t kTypeSize = sizeof(T);
   size_t count = 0;
   if (buffer_offset_ + kTypeSize >= kBufferSize) {
-    std::fwrite(buffer_.get(), 1, buffer_offset_, file_);
-    buffer_offset_ = 0;
+    WriteBuffer();
   }
   std::memcpy(buffer_.get() + buffer_offset_, &data, kTypeSize);
   buffer_offset_ += kTypeSize;
@@ -216,14 +271,17 @@ size_t File::Write(const T* data, size_t n) {
 
   constexpr size_t kTypeSize = sizeof(T);
   size_t count = 0;
-  for (size_t i = 0; i < n; i++) {
+  const char* p = reinterpret_cast<const char*>(data);
+  while (n > 0) {
     if (buffer_offset_ + kTypeSize >= kBufferSize) {
-      std::fwrite(buffer_.get(), 1, buffer_offset_, file_);
-      buffer_offset_ = 0;
+      WriteBuffer();
     }
-    std::memcpy(buffer_.get() + buffer_offset_, data + i, kTypeSize);
-    buffer_offset_ += kTypeSize;
-    count += kTypeSize;
+    // Copy as many elements as the buffer holds at a time.
+    size_t num = std::min(n, (kBufferSize - 1 - buffer_offset_) / kTypeSize);
+    std::memcpy(buffer_.get() + buffer_offset_, p + count, num * kTypeSize);
+    buffer_offset_ += num * kTypeSize;
+    count += num * kTypeSize;
+    n -= num;
   }
 
   return count;
@@ -233,6 +291,14 @@ bool FileExists(const char* filename);
 
 std::vector<File> ListDataFiles(const char* dir);
 
+/**
+ * @brief Lists paths of all files in a directory with given extension.
+ *
+ * @param dir
+ * @param extension Extension, including the dot, e.g. ".bin".
+ */
+std::vector<std::string> ListFiles(const char* dir, const char* extension);
+
 std::string PathJoin(const std::string& p1, const std::string& p2);
 
 }  // namespace icehalo
@@ -1,5 +1,6 @@
 #include "render.hpp"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <limits>
@@ -14,232 +15,189 @@
 
 namespace icehalo {
 
-void EqualAreaFishEye(Pose3f cam_pose,               // Camera rotation. [lon, lat, roll]
-                      float hov,                     // Half field of view.
-                      size_t data_number,            // Data number
-                      const float* dir,              // Ray directions, [x, y, z]
-                      int img_wid, int img_hei,      // Image size
-                      float* img_xy,                 // Image coordinates
-                      VisibleRange visible_range) {  // Visible range
-  float img_r = std::max(img_wid, img_hei) / 2.0f;
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-
+Projector::Projector(LensType lens_type, Pose3f cam_pose, float hov, int img_wid, int img_hei,
+                     VisibleRange visible_range)
+    : lens_type_(lens_type), visible_range_(visible_range), img_wid_(img_wid), img_hei_(img_hei), rot_{},
+      img_r_(0), lens_k_(0) {
+  switch (lens_type_) {
+    case LensType::kLinear:
+      lens_k_ = img_wid_ / 2.0f / std::tan(hov * math::kDegreeToRad);
+      break;
+    case LensType::kEqualArea:
+      img_r_ = std::max(img_wid_, img_hei_) / 2.0f;
+      lens_k_ = img_r_ / 2.0f / std::sin(hov / 2.0f * math::kDegreeToRad);
+      break;
+    case LensType::kEquidistant:
+      img_r_ = std::max(img_wid_, img_hei_) / 2.0f;
+      lens_k_ = img_r_ / (hov * math::kDegreeToRad);
+      break;
+    case LensType::kDualEqualArea:
+      img_r_ = std::min(img_wid_ / 2, img_hei_) / 2.0f;
+      lens_k_ = img_r_ / 2.0f / std::sin(45.0f * math::kDegreeToRad);
+      cam_pose = Pose3f{ 90.0f, 90.0f, 0.0f };
+      break;
+    case LensType::kDualEquidistant:
+      img_r_ = std::min(img_wid_ / 2, img_hei_) / 2.0f;
+      lens_k_ = img_r_;
+      cam_pose = Pose3f{ 90.0f, 90.0f, 0.0f };
+      break;
+    case LensType::kEquirectangular:
+      img_r_ = std::min(img_wid_ / 2, img_hei_) / 2.0f;
+      lens_k_ = img_r_ * 2.0f / math::kPi;
+      cam_pose = Pose3f{ 90.0f - cam_pose.lon(), 90.0f, 0.0f };
+      break;
+  }
   cam_pose.ToRad();
+  RotateZMatrix(cam_pose.val(), rot_);
+}
 
-  RotateZ(cam_pose.val(), dir, dir_copy.get(), 4, 3, data_number);
-  for (size_t i = 0; i < data_number; i++) {
-    if (std::abs(Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else if (visible_range == VisibleRange::kFront && dir_copy[i * 3 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else if (visible_range == VisibleRange::kUpper && dir[i * 4 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else if (visible_range == VisibleRange::kLower && dir[i * 4 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else {
-      float lon = std::atan2(-dir_copy[i * 3 + 1], -dir_copy[i * 3 + 0]);
-      float lat = std::asin(-dir_copy[i * 3 + 2] / Norm3(dir_copy.get() + i * 3));
-      float proj_r = img_r / 2.0f / std::sin(hov / 2.0f * math::kDegreeToRad);
-      float r = 2.0f * proj_r * std::sin((math::kPi / 2.0f - lat) / 2.0f);
 
-      img_xy[i * 2 + 0] = r * std::cos(lon) + img_wid / 2.0f - 0.5f;
-      img_xy[i * 2 + 1] = -r * std::sin(lon) + img_hei / 2.0f - 0.5f;  // y increase downside on image
-    }
-  }
+LensType Projector::GetLensType() const {
+  return lens_type_;
 }
 
 
-void EquidistantFishEye(Pose3f cam_pose,               // Camera rotation. [lon, lat, roll]
-                        float hov,                     // Half field of view.
-                        size_t data_number,            // Data number
-                        const float* dir,              // Ray directions, [x, y, z]
-                        int img_wid, int img_hei,      // Image size
-                        float* img_xy,                 // Image coordinates
-                        VisibleRange visible_range) {  // Visible range
-  float img_r = std::max(img_wid, img_hei) / 2.0f;
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-
-  cam_pose.ToRad();
+float Projector::GetAngularResolution() const {
+  // All lens are r = lens_k_ * theta near the center, except dual equidistant
+  return lens_type_ == LensType::kDualEquidistant ? math::kPi / 2.0f / lens_k_ : 1.0f / lens_k_;
+}
 
-  RotateZ(cam_pose.val(), dir, dir_copy.get(), 4, 3, data_number);
-  for (size_t i = 0; i < data_number; i++) {
-    if (std::abs(Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else if (visible_range == VisibleRange::kFront && dir_copy[i * 3 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else if (visible_range == VisibleRange::kUpper && dir[i * 4 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else if (visible_range == VisibleRange::kLower && dir[i * 4 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else {
-      float lon = std::atan2(-dir_copy[i * 3 + 1], -dir_copy[i * 3 + 0]);
-      float lat = std::asin(-dir_copy[i * 3 + 2] / Norm3(dir_copy.get() + i * 3));
-      float r = (math::kPi / 2.0f - lat) / (hov * math::kDegreeToRad) * img_r;
 
-      img_xy[i * 2 + 0] = r * std::cos(lon) + img_wid / 2.0f - 0.5f;
-      img_xy[i * 2 + 1] = -r * std::sin(lon) + img_hei / 2.0f - 0.5f;  // y increase downside on image
+void Projector::Project(size_t num, const float* dir, size_t dir_step, float* img_xy) const {
+  float x[kBatchSize];
+  float y[kBatchSize];
+  float z[kBatchSize];
+  const float* batch_dir[3]{ x, y, z };
+  for (size_t start = 0; start < num; start += kBatchSize) {
+    auto curr_num = std::min(num - start, kBatchSize);
+    for (size_t i = 0; i < curr_num; i++) {
+      const auto* d = dir + (start + i) * dir_step;
+      x[i] = d[0];
+      y[i] = d[1];
+      z[i] = d[2];
     }
+    ProjectBatch(curr_num, batch_dir, img_xy + start * 2, img_xy + start * 2 + 1, 2);
   }
 }
 
 
-void DualEqualAreaFishEye(Pose3f /* cam_rot */,                // Not used
-                          float /* hov */,                     // Not used
-                          size_t data_number,                  // Data number
-                          const float* dir,                    // Ray directions, [x, y, z]
-                          int img_wid, int img_hei,            // Image size
-                          float* img_xy,                       // Image coordinates
-                          VisibleRange /* visible_range */) {  // Not used
-  float img_r = std::min(img_wid / 2, img_hei) / 2.0f;
-  float proj_r = img_r / 2.0f / std::sin(45.0f * math::kDegreeToRad);
-
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-
-  Pose3f cam_pose(90.0f, 90.0f, 0.0f);
-  cam_pose.ToRad();
-
-  RotateZ(cam_pose.val(), dir, dir_copy.get(), 4, 3, data_number);
-  for (size_t i = 0; i < data_number; i++) {
-    if (std::abs(Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else {
-      float lon = std::atan2(-dir_copy[i * 3 + 1], -dir_copy[i * 3 + 0]);
-      float lat = std::asin(-dir_copy[i * 3 + 2] / Norm3(dir_copy.get() + i * 3));
-      if (lat < 0) {
-        lon = math::kPi - lon;
-      }
-      float r = 2.0f * proj_r * std::sin((math::kPi / 2.0f - std::abs(lat)) / 2.0f);
-
-      img_xy[i * 2 + 0] = r * std::cos(lon) + img_r + (lat > 0 ? -0.5f : 2 * img_r - 0.5f);
-      img_xy[i * 2 + 1] = -r * std::sin(lon) + img_r - 0.5f;  // y increase downside on image
+void Projector::Project(size_t num, const size_t* idx, const float* dir, size_t dir_step, float* img_xy) const {
+  float x[kBatchSize];
+  float y[kBatchSize];
+  float z[kBatchSize];
+  const float* batch_dir[3]{ x, y, z };
+  for (size_t start = 0; start < num; start += kBatchSize) {
+    auto curr_num = std::min(num - start, kBatchSize);
+    for (size_t i = 0; i < curr_num; i++) {
+      const auto* d = dir + idx[start + i] * dir_step;
+      x[i] = d[0];
+      y[i] = d[1];
+      z[i] = d[2];
     }
+    ProjectBatch(curr_num, batch_dir, img_xy + start * 2, img_xy + start * 2 + 1, 2);
   }
 }
 
 
-void DualEquidistantFishEye(Pose3f /* cam_rot */,                // Not used
-                            float /* hov */,                     // Not used
-                            size_t data_number,                  // Data number
-                            const float* dir,                    // Ray directions, [x, y, z]
-                            int img_wid, int img_hei,            // Image size
-                            float* img_xy,                       // Image coordinates
-                            VisibleRange /* visible_range */) {  // Not used
-  float img_r = std::min(img_wid / 2, img_hei) / 2.0f;
-
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-
-  Pose3f cam_pose(90.0f, 90.0f, 0.0f);
-  cam_pose.ToRad();
-
-  RotateZ(cam_pose.val(), dir, dir_copy.get(), 4, 3, data_number);
-  for (size_t i = 0; i < data_number; i++) {
-    if (std::abs(Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else {
-      float lon = std::atan2(-dir_copy[i * 3 + 1], -dir_copy[i * 3 + 0]);
-      float lat = std::asin(-dir_copy[i * 3 + 2] / Norm3(dir_copy.get() + i * 3));
-      if (lat < 0) {
-        lon = math::kPi - lon;
-      }
-      float r = (1.0f - std::abs(lat) * 2.0f / math::kPi) * img_r;
-
-      img_xy[i * 2 + 0] = r * std::cos(lon) + img_r + (lat > 0 ? -0.5f : 2 * img_r - 0.5f);
-      img_xy[i * 2 + 1] = -r * std::sin(lon) + img_r - 0.5f;  // y increase downside on image
-    }
+void Projector::Project(size_t num, const float* const* dir, float* const* img_xy) const {
+  for (size_t start = 0; start < num; start += kBatchSize) {
+    auto curr_num = std::min(num - start, kBatchSize);
+    const float* batch_dir[3]{ dir[0] + start, dir[1] + start, dir[2] + start };
+    ProjectBatch(curr_num, batch_dir, img_xy[0] + start, img_xy[1] + start, 1);
   }
 }
 
 
-void Linear(Pose3f cam_pose,               // Camera rotation. [lon, lat, roll]
-            float hov,                     // Half field of view.
-            size_t data_number,            // Data number
-            const float* dir,              // Ray directions, [x, y, z]
-            int img_wid, int img_hei,      // Image size
-            float* img_xy,                 // Image coordinates
-            VisibleRange visible_range) {  // Visible range
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
+// Every lens is written as a plain loop without branch, so the compiler can vectorize it.
+// Longitude is never computed for fisheye lens: cos(lon) and sin(lon) are just -x / rho and -y / rho, where
+// rho = sqrt(x^2 + y^2). For the same reason, sin((pi / 2 - lat) / 2) is sqrt((1 + z) / 2) for unit vector.
+void Projector::ProjectBatch(size_t num, const float* const* dir, float* img_x, float* img_y,
+                             size_t img_step) const {
+  constexpr float kNan = std::numeric_limits<float>::quiet_NaN();
 
-  cam_pose.ToRad();
-
-  RotateZ(cam_pose.val(), dir, dir_copy.get(), 4, 3, data_number);
-  for (size_t i = 0; i < data_number; i++) {
-    if (dir_copy[i * 3 + 2] > 0 || std::abs(Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else if (visible_range == VisibleRange::kFront && dir_copy[i * 3 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else if (visible_range == VisibleRange::kUpper && dir[i * 4 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else if (visible_range == VisibleRange::kLower && dir[i * 4 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else {
-      float x = dir_copy[i * 3 + 0] / dir_copy[i * 3 + 2];
-      float y = dir_copy[i * 3 + 1] / dir_copy[i * 3 + 2];
+  float rx[kBatchSize];
+  float ry[kBatchSize];
+  float rz[kBatchSize];
+  float rho[kBatchSize];
+  float norm[kBatchSize];
+  bool valid[kBatchSize];
+  for (size_t i = 0; i < num; i++) {
+    float x = dir[0][i];
+    float y = dir[1][i];
+    float z = dir[2][i];
+    rx[i] = rot_[0] * x + rot_[1] * y + rot_[2] * z;
+    ry[i] = rot_[3] * x + rot_[4] * y + rot_[5] * z;
+    rz[i] = rot_[6] * x + rot_[7] * y + rot_[8] * z;
+    rho[i] = std::sqrt(rx[i] * rx[i] + ry[i] * ry[i]);
+    norm[i] = std::sqrt(rho[i] * rho[i] + rz[i] * rz[i]);
+    valid[i] = std::abs(norm[i] - 1.0f) <= 1e-4f;
+  }
 
-      img_xy[i * 2 + 0] = img_wid / 2.0f + img_wid / 2.0f * x / std::tan(hov * math::kDegreeToRad);
-      img_xy[i * 2 + 1] = img_hei / 2.0f - img_wid / 2.0f * y / std::tan(hov * math::kDegreeToRad);
+  if (lens_type_ == LensType::kLinear || lens_type_ == LensType::kEqualArea ||
+      lens_type_ == LensType::kEquidistant) {
+    for (size_t i = 0; i < num; i++) {
+      bool visible = !(visible_range_ == VisibleRange::kFront && rz[i] > 0) &&
+                     !(visible_range_ == VisibleRange::kUpper && dir[2][i] > 0) &&
+                     !(visible_range_ == VisibleRange::kLower && dir[2][i] < 0);
+      valid[i] = valid[i] && visible && !(lens_type_ == LensType::kLinear && rz[i] > 0);
     }
   }
-}
-
-
-void Equirectangular(Pose3f cam_pose,                     // Not used
-                     float /* hov */,                     // Not used
-                     size_t data_number,                  // Data number
-                     const float* dir,                    // Ray directions [x, y, z]
-                     int img_wid, int img_hei,            // Image size
-                     float* img_xy,                       // Image coordinates
-                     VisibleRange /* visible_range */) {  // Not used
-  float img_r = std::min(img_wid / 2, img_hei) / 2.0f;
-
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-
-  cam_pose.val(90.0f - cam_pose.lon(), 90.0f, 0.0f);
-  cam_pose.ToRad();
 
-  RotateZ(cam_pose.val(), dir, dir_copy.get(), 4, 3, data_number);
-  for (size_t i = 0; i < data_number; i++) {
-    if (std::abs(Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<float>::quiet_NaN();
-      img_xy[i * 2 + 1] = std::numeric_limits<float>::quiet_NaN();
-    } else {
-      float lon = std::atan2(-dir_copy[i * 3 + 1], -dir_copy[i * 3 + 0]);
-      float lat = std::asin(-dir_copy[i * 3 + 2] / Norm3(dir_copy.get() + i * 3));
-      img_xy[i * 2 + 0] = static_cast<int>(img_wid / 2.0f + lon / math::kPi * 2 * img_r - 0.5f);
-      img_xy[i * 2 + 1] = static_cast<int>(img_hei / 2.0f - lat / math::kPi * 2 * img_r - 0.5f);
-    }
+  auto cx = img_wid_ / 2.0f;
+  auto cy = img_hei_ / 2.0f;
+  switch (lens_type_) {
+    case LensType::kLinear:
+      for (size_t i = 0; i < num; i++) {
+        float x = cx + lens_k_ * rx[i] / rz[i];
+        float y = cy - lens_k_ * ry[i] / rz[i];
+        img_x[i * img_step] = valid[i] ? x : kNan;
+        img_y[i * img_step] = valid[i] ? y : kNan;
+      }
+      break;
+    case LensType::kEqualArea:
+    case LensType::kEquidistant:
+      for (size_t i = 0; i < num; i++) {
+        float cos_lon = rho[i] > 0 ? -rx[i] / rho[i] : 1.0f;
+        float sin_lon = rho[i] > 0 ? -ry[i] / rho[i] : 0.0f;
+        float r = lens_type_ == LensType::kEqualArea ? 2.0f * lens_k_ * std::sqrt((1.0f + rz[i] / norm[i]) / 2.0f) :
+                                                       lens_k_ * FastAtan2(rho[i], -rz[i]);
+        img_x[i * img_step] = valid[i] ? r * cos_lon + cx - 0.5f : kNan;
+        img_y[i * img_step] = valid[i] ? -r * sin_lon + cy - 0.5f : kNan;  // y increase downside on image
+      }
+      break;
+    case LensType::kDualEqualArea:
+    case LensType::kDualEquidistant:
+      for (size_t i = 0; i < num; i++) {
+        // Upper semi-sphere goes to the left circle, and lower one goes to the right (mirrored) circle.
+        bool upper = rz[i] < 0;
+        float cos_lon = rho[i] > 0 ? -rx[i] / rho[i] : 1.0f;
+        float sin_lon = rho[i] > 0 ? -ry[i] / rho[i] : 0.0f;
+        cos_lon = rz[i] > 0 ? -cos_lon : cos_lon;
+        float r = lens_type_ == LensType::kDualEqualArea ?
+                      2.0f * lens_k_ * std::sqrt((1.0f - std::abs(rz[i]) / norm[i]) / 2.0f) :
+                      (1.0f - FastAtan2(std::abs(rz[i]), rho[i]) * 2.0f / math::kPi) * lens_k_;
+        img_x[i * img_step] = valid[i] ? r * cos_lon + img_r_ + (upper ? -0.5f : 2 * img_r_ - 0.5f) : kNan;
+        img_y[i * img_step] = valid[i] ? -r * sin_lon + img_r_ - 0.5f : kNan;  // y increase downside on image
+      }
+      break;
+    case LensType::kEquirectangular:
+      for (size_t i = 0; i < num; i++) {
+        float lon = FastAtan2(-ry[i], -rx[i]);
+        float lat = FastAtan2(-rz[i], rho[i]);
+        img_x[i * img_step] = valid[i] ? static_cast<int>(cx + lon * lens_k_ - 0.5f) : kNan;
+        img_y[i * img_step] = valid[i] ? static_cast<int>(cy - lat * lens_k_ - 0.5f) : kNan;
+      }
+      break;
   }
 }
 
 
 ProjectionFunction GetProjectionFunction(LensType lens_type) {
-  static EnumMap<LensType, ProjectionFunction> projection_functions = {
-    { LensType::kLinear, &Linear },
-    { LensType::kEqualArea, &EqualAreaFishEye },
-    { LensType::kEquidistant, &EquidistantFishEye },
-    { LensType::kDualEquidistant, &DualEquidistantFishEye },
-    { LensType::kDualEqualArea, &DualEqualAreaFishEye },
-    { LensType::kEquirectangular, &Equirectangular },
+  return [=](Pose3f cam_pose, float hov, size_t data_number, const float* dir, int img_wid, int img_hei,
+             float* img_xy, VisibleRange visible_range) {
+    Projector projector{ lens_type, cam_pose, hov, img_wid, img_hei, visible_range };
+    projector.Project(data_number, dir, 4, img_xy);
   };
-
-  if (projection_functions.count(lens_type)) {
-    return projection_functions[lens_type];
-  } else {
-    return {};
-  }
 }
 
 
@@ -253,21 +211,9 @@ void SrgbGamma(float* linear_rgb, size_t num) {
   }
 }
 
-void SpecToRgbJob(int i, const std::vector<ImageSpectrumData>& spec_data, float factor, const float* background_color,
-                  const float* ray_color, uint8_t* rgb_data) {
-  /* Step 1. Spectrum to XYZ */
-  float xyz[3]{};
-  for (const auto& [wl, val] : spec_data) {
-    if (wl < kMinWavelength || wl > kMaxWaveLength) {
-      continue;
-    }
-    float v = val[i] * factor;
-    xyz[0] += kCmfX[wl - kMinWavelength] * v;
-    xyz[1] += kCmfY[wl - kMinWavelength] * v;
-    xyz[2] += kCmfZ[wl - kMinWavelength] * v;
-  }
-
-  /* Step 2. XYZ to linear RGB */
+// XYZ to sRGB, for one pixel. The xyz will be modified.
+void XyzToRgbJob(float* xyz, const float* background_color, const float* ray_color, uint8_t* rgb_data) {
+  /* Step 1. XYZ to linear RGB */
   float gray[3];
   for (int j = 0; j < 3; j++) {
     gray[j] = kWhitePointD65[j] * xyz[1];
@@ -292,7 +238,7 @@ void SpecToRgbJob(int i, const std::vector<ImageSpectrumData>& spec_data, float
       xyz[j] = (xyz[j] - gray[j]) * r + gray[j];
     }
   } else {
-    std::memcpy(xyz, gray, sizeof(xyz));
+    std::memcpy(xyz, gray, sizeof(gray));
   }
   float rgb[3]{};
   for (int j = 0; j < 3; j++) {
@@ -306,11 +252,30 @@ void SpecToRgbJob(int i, const std::vector<ImageSpectrumData>& spec_data, float
     rgb[j] += background_color[j];
   }
 
-  /* Step 3. Convert linear sRGB to sRGB */
+  /* Step 2. Convert linear sRGB to sRGB */
   SrgbGamma(rgb, 3);
   for (int j = 0; j < 3; j++) {
-    rgb_data[i * 3 + j] = static_cast<uint8_t>(rgb[j] * std::numeric_limits<uint8_t>::max());
+    rgb_data[j] = static_cast<uint8_t>(rgb[j] * std::numeric_limits<uint8_t>::max());
+  }
+}
+
+
+void SpecToRgbJob(int i, const std::vector<ImageSpectrumData>& spec_data, float factor, const float* background_color,
+                  const float* ray_color, uint8_t* rgb_data) {
+  /* Step 1. Spectrum to XYZ */
+  float xyz[3]{};
+  for (const auto& [wl, val] : spec_data) {
+    if (wl < kMinWavelength || wl > kMaxWaveLength) {
+      continue;
+    }
+    float v = val[i] * factor;
+    xyz[0] += kCmfX[wl - kMinWavelength] * v;
+    xyz[1] += kCmfY[wl - kMinWavelength] * v;
+    xyz[2] += kCmfZ[wl - kMinWavelength] * v;
   }
+
+  /* Step 2. XYZ to sRGB */
+  XyzToRgbJob(xyz, background_color, ray_color, rgb_data + i * 3);
 }
 
 
@@ -319,12 +284,27 @@ void RenderSpecToRgb(const ThreadingPoolPtr& threading_pool,
                      size_t data_number, float factor,                       //
                      const float* background_color, const float* ray_color,  // background and ray color
                      uint8_t* rgb_data) {                                    // rgb data, data_number * 3
-  threading_pool->CommitRangeStepJobsAndWait(0, data_number, [=, &spec_data](int /* thread_id */, int i) {
+  threading_pool->ParallelFor(0, data_number, 0, [=, &spec_data](int /* thread_id */, int i) {
     SpecToRgbJob(i, spec_data, factor, background_color, ray_color, rgb_data);
   });
 }
 
 
+void RenderXyzToRgb(const ThreadingPoolPtr& threading_pool,
+                    const float* xyz_data,                                  // xyz data, data_number * 3. Can be null
+                    size_t data_number, float factor,                       //
+                    const float* background_color, const float* ray_color,  // background and ray color
+                    uint8_t* rgb_data) {                                    // rgb data, data_number * 3
+  threading_pool->ParallelFor(0, data_number, 0, [=](int /* thread_id */, int i) {
+    float xyz[3]{};
+    for (int j = 0; xyz_data && j < 3; j++) {
+      xyz[j] = xyz_data[i * 3 + j] * factor;
+    }
+    XyzToRgbJob(xyz, background_color, ray_color, rgb_data + i * 3);
+  });
+}
+
+
 void RenderSpecToGray(const ThreadingPoolPtr& threading_pool,
                       const std::vector<ImageSpectrumData>& spec_data,  // spec_data: wavelength_number * data_number
                       size_t data_number, float factor,                 //
@@ -334,7 +314,7 @@ void RenderSpecToGray(const ThreadingPoolPtr& threading_pool,
     return;
   }
   auto* curr_spec_data = spec_data[index].second.get();
-  threading_pool->CommitRangeStepJobsAndWait(0, data_number, [=](int /* thread_id */, int i) {
+  threading_pool->ParallelFor(0, data_number, 0, [=](int /* thread_id */, int i) {
     /* Step 1. Spectrum to XYZ */
     float y = curr_spec_data[i] * factor;
 
@@ -363,16 +343,71 @@ void RenderSpecToGray(const ThreadingPoolPtr& threading_pool,
 }
 
 
+namespace {
+
+// Returns pixel index of image coordinates, or -1 if it is invisible or outside of the image.
+int GetPixelIndex(const float* xy, int offset_x, int offset_y, int img_wid, int img_hei) {
+  if (std::isnan(xy[0]) || std::isnan(xy[1])) {
+    return -1;
+  }
+  int x = static_cast<int>(xy[0]) + offset_x;
+  int y = static_cast<int>(xy[1]) + offset_y;
+  if (x < 0 || x >= img_wid || y < 0 || y >= img_hei) {
+    return -1;
+  }
+  return y * img_wid + x;
+}
+
+
+// Returns bin index of a direction in an N x N equal-area histogram, or -1 if it is not a unit vector.
+int GetSphereBinIndex(const float* dir, int sphere_size) {
+  if (!(std::abs(Norm3(dir) - 1.0f) <= 1e-4f)) {
+    return -1;
+  }
+  float uv[2];
+  SphereToEqualAreaSquare(dir, uv);
+  int x = std::min(static_cast<int>(uv[0] * sphere_size), sphere_size - 1);
+  int y = std::min(static_cast<int>(uv[1] * sphere_size), sphere_size - 1);
+  return y * sphere_size + x;
+}
+
+
+float* FindOrCreateData(std::vector<ImageSpectrumData>* data, int identifier, size_t size) {
+  auto iter =
+      std::find_if(data->begin(), data->end(), [=](const ImageSpectrumData& d) { return d.first == identifier; });
+  if (iter == data->end()) {
+    data->emplace_back(identifier, new float[size]{});
+    iter = data->end() - 1;
+  }
+  return iter->second.get();
+}
+
+
+float* FindOrCreateData(std::unique_ptr<float[]>* data, size_t size) {
+  if (!*data) {
+    data->reset(new float[size]{});
+  }
+  return data->get();
+}
+
+}  // namespace
+
+
 Renderer::Renderer()
     : cam_ctx_{}, render_ctx_{}, sun_ctx_{}, output_image_buffer_{}, total_w_(0),
-      threading_pool_(ThreadingPool::CreatePool()) {}
+      threading_pool_(ThreadingPool::GetDefaultPool()) {}
 
 
 Renderer::Renderer(Renderer&& other) noexcept
     : cam_ctx_(std::move(other.cam_ctx_)), render_ctx_(std::move(other.render_ctx_)),
       sun_ctx_(std::move(other.sun_ctx_)), output_image_buffer_(std::move(other.output_image_buffer_)),
       spectrum_data_(std::move(other.spectrum_data_)),
-      spectrum_data_compensation_(std::move(other.spectrum_data_compensation_)), total_w_(other.total_w_),
+      spectrum_data_compensation_(std::move(other.spectrum_data_compensation_)),
+      sphere_data_(std::move(other.sphere_data_)),
+      sphere_data_compensation_(std::move(other.sphere_data_compensation_)), xyz_data_(std::move(other.xyz_data_)),
+      xyz_data_compensation_(std::move(other.xyz_data_compensation_)),
+      sphere_xyz_data_(std::move(other.sphere_xyz_data_)),
+      sphere_xyz_data_compensation_(std::move(other.sphere_xyz_data_compensation_)), total_w_(other.total_w_),
       threading_pool_(std::move(other.threading_pool_)) {}
 
 
@@ -383,6 +418,12 @@ Renderer& Renderer::operator=(Renderer&& other) noexcept {
   output_image_buffer_ = std::move(other.output_image_buffer_);
   spectrum_data_ = std::move(other.spectrum_data_);
   spectrum_data_compensation_ = std::move(other.spectrum_data_compensation_);
+  sphere_data_ = std::move(other.sphere_data_);
+  sphere_data_compensation_ = std::move(other.sphere_data_compensation_);
+  xyz_data_ = std::move(other.xyz_data_);
+  xyz_data_compensation_ = std::move(other.xyz_data_compensation_);
+  sphere_xyz_data_ = std::move(other.sphere_xyz_data_);
+  sphere_xyz_data_compensation_ = std::move(other.sphere_xyz_data_compensation_);
   total_w_ = other.total_w_;
   threading_pool_ = std::move(other.threading_pool_);
   return *this;
@@ -428,118 +469,282 @@ void Renderer::LoadRayData(int identifier, const RayCollectionInfo& collection_i
     return;
   }
 
-  auto img_hei = render_ctx_->GetImageHeight();
-  auto img_wid = render_ctx_->GetImageWidth();
-
-  auto data_iter = std::find_if(spectrum_data_.begin(), spectrum_data_.end(),
-                                [=](const ImageSpectrumData& d) { return d.first == identifier; });
-  if (data_iter == spectrum_data_.end()) {
-    spectrum_data_.emplace_back(identifier, new float[img_hei * img_wid]{});
-    data_iter = spectrum_data_.end() - 1;
-  }
-  auto* current_data = data_iter->second.get();
-
-  auto data_cmp_iter = std::find_if(spectrum_data_compensation_.begin(), spectrum_data_compensation_.end(),
-                                    [=](const ImageSpectrumData& d) { return d.first == identifier; });
-  if (data_cmp_iter == spectrum_data_compensation_.end()) {
-    spectrum_data_compensation_.emplace_back(identifier, new float[img_hei * img_wid]{});
-    data_cmp_iter = spectrum_data_compensation_.end() - 1;
+  // Rays go to image directly, or go to direction-space histogram.
+  auto grid_wid = render_ctx_->GetImageWidth();
+  auto grid_hei = render_ctx_->GetImageHeight();
+  auto* data = &spectrum_data_;
+  auto* data_compensation = &spectrum_data_compensation_;
+  auto* xyz_data = &xyz_data_;
+  auto* xyz_data_compensation = &xyz_data_compensation_;
+  auto sphere_size = render_ctx_->GetSphereHistogramSize();
+  if (sphere_size > 0) {
+    grid_wid = sphere_size;
+    grid_hei = sphere_size;
+    data = &sphere_data_;
+    data_compensation = &sphere_data_compensation_;
+    xyz_data = &sphere_xyz_data_;
+    xyz_data_compensation = &sphere_xyz_data_compensation_;
   }
-  auto* current_data_compensation = data_cmp_iter->second.get();
 
-  if (collection_info.is_partial_data) {
-    LoadPartialRayData(collection_info.idx, final_ray_data, current_data, current_data_compensation);
+  // In XYZ mode, every ray is folded into 3 channels with color matching functions of this wavelength.
+  int channel_num = 1;
+  float* current_data = nullptr;
+  float* current_data_compensation = nullptr;
+  float cmf[3]{};
+  const float* channel_weight = nullptr;
+  if (UseXyzData()) {
+    channel_num = 3;
+    current_data = FindOrCreateData(xyz_data, grid_wid * grid_hei * 3);
+    current_data_compensation = FindOrCreateData(xyz_data_compensation, grid_wid * grid_hei * 3);
+    cmf[0] = kCmfX[wavelength - kMinWavelength];
+    cmf[1] = kCmfY[wavelength - kMinWavelength];
+    cmf[2] = kCmfZ[wavelength - kMinWavelength];
+    channel_weight = cmf;
   } else {
-    LoadFullRayData(final_ray_data, current_data, current_data_compensation);
+    current_data = FindOrCreateData(data, identifier, grid_wid * grid_hei);
+    current_data_compensation = FindOrCreateData(data_compensation, identifier, grid_wid * grid_hei);
   }
 
+  const auto* idx = collection_info.is_partial_data ? collection_info.idx.data() : nullptr;
+  auto num = collection_info.is_partial_data ? collection_info.idx.size() : final_ray_data.buf_ray_num;
+  std::unique_ptr<int[]> pixel{ new int[num] };
+  std::unique_ptr<float[]> val{ new float[num] };
+  MapRayData(num, idx, final_ray_data, pixel.get(), val.get());
+  AccumulatePixels(num, pixel.get(), val.get(), grid_wid, grid_hei, channel_num, channel_weight,  //
+                   current_data, current_data_compensation);
+
   total_w_ += final_ray_data.init_ray_num * weight;
 }
 
 
-void Renderer::LoadPartialRayData(const std::vector<size_t>& idx, const SimpleRayData& final_ray_data,
-                                  float* current_data, float* current_data_compensation) {
+void Renderer::MapRayData(size_t num, const size_t* idx, const SimpleRayData& final_ray_data, int* pixel,
+                          float* val) {
   auto img_hei = render_ctx_->GetImageHeight();
   auto img_wid = render_ctx_->GetImageWidth();
+  auto sphere_size = render_ctx_->GetSphereHistogramSize();
 
-  auto projection_type = cam_ctx_->GetLensType();
-  auto pf = GetProjectionFunction(projection_type);
-  if (!pf) {
-    LOG_ERROR("Unknown projection type!");
-    return;
-  }
-
-  const auto* final_ray_buf = final_ray_data.buf.get();
+  auto projector = CreateProjector();
+  const auto* final_ray_buf = final_ray_data.GetRayBuffer();
   auto weight = final_ray_data.wavelength_weight;
-  auto num = idx.size();
-  threading_pool_->CommitRangeSliceJobsAndWait(0, num, [=](int /* thread_id */, int start_idx, int end_idx) {
-    size_t current_num = end_idx - start_idx;
-    std::unique_ptr<float[]> tmp_xy{ new float[current_num * 2] };
-    for (size_t j = 0; j < current_num; j++) {
-      pf(cam_ctx_->GetCameraTargetDirection(), cam_ctx_->GetFov(), 1, final_ray_buf + idx[start_idx + j] * 4, img_wid,
-         img_hei, tmp_xy.get() + j * 2, render_ctx_->GetVisibleRange());
-
-      if (std::isnan(tmp_xy[j * 2 + 0]) || std::isnan(tmp_xy[j * 2 + 1])) {
-        continue;
+  auto offset = GetPixelOffset(projector.GetLensType());
+  threading_pool_->ParallelFor(0, num, 0, [=, &projector](int /* thread_id */, int start_idx, int end_idx) {
+    float tmp_xy[Projector::kBatchSize * 2];
+    for (int start = start_idx; start < end_idx; start += Projector::kBatchSize) {
+      auto current_num = std::min(static_cast<size_t>(end_idx - start), Projector::kBatchSize);
+      if (sphere_size <= 0 && idx) {
+        projector.Project(current_num, idx + start, final_ray_buf, 4, tmp_xy);
+      } else if (sphere_size <= 0) {
+        projector.Project(current_num, final_ray_buf + start * 4, 4, tmp_xy);
       }
-      int x = static_cast<int>(tmp_xy[j * 2 + 0]);
-      int y = static_cast<int>(tmp_xy[j * 2 + 1]);
-      if (projection_type != LensType::kDualEqualArea && projection_type != LensType::kDualEquidistant &&
-          projection_type != LensType::kEquirectangular) {
-        x += render_ctx_->GetImageOffsetX();
-        y += render_ctx_->GetImageOffsetY();
-      }
-      if (x < 0 || x >= static_cast<int>(img_wid) || y < 0 || y >= static_cast<int>(img_hei)) {
-        continue;
+      for (size_t j = 0; j < current_num; j++) {
+        auto ray_idx = idx ? idx[start + j] : start + j;
+        if (sphere_size > 0) {
+          pixel[start + j] = GetSphereBinIndex(final_ray_buf + ray_idx * 4, sphere_size);
+        } else {
+          pixel[start + j] = GetPixelIndex(tmp_xy + j * 2, offset.first, offset.second, img_wid, img_hei);
+        }
+        val[start + j] = final_ray_buf[ray_idx * 4 + 3] * weight;
       }
-      auto tmp_val = final_ray_buf[(start_idx + j) * 4 + 3] * weight - current_data_compensation[y * img_wid + x];
-      auto tmp_sum = current_data[y * img_wid + x] + tmp_val;
-      current_data_compensation[y * img_wid + x] = tmp_sum - current_data[y * img_wid + x] - tmp_val;
-      current_data[y * img_wid + x] = tmp_sum;
     }
   });
 }
 
 
-void Renderer::LoadFullRayData(const SimpleRayData& final_ray_data, float* current_data,
-                               float* current_data_compensation) {
+// Resample direction-space histogram to image, with current camera.
+// Every bin is split into sub_num x sub_num cells, such that a cell is not larger than a pixel, and each cell
+// carries an equal part of the bin value to the pixel where its center projects to. Bins are equal-area, so are
+// the cells. Bins are processed in chunks, so that memory for cells is bounded by kMaxSphereReprojectCells.
+void Renderer::ReprojectSphereData() {
   auto img_hei = render_ctx_->GetImageHeight();
   auto img_wid = render_ctx_->GetImageWidth();
+  auto sphere_size = render_ctx_->GetSphereHistogramSize();
+
+  auto projector = CreateProjector();
+  auto offset = GetPixelOffset(projector.GetLensType());
+  auto bin_angle = std::sqrt(4 * math::kPi) / sphere_size;
+  auto sub_num = static_cast<int>(std::ceil(bin_angle / projector.GetAngularResolution()));
+  sub_num = std::clamp(sub_num, 1, kMaxSphereSubSample);
+  auto cell_per_bin = static_cast<size_t>(sub_num * sub_num);
+  auto bin_num = static_cast<size_t>(sphere_size) * sphere_size;
+  auto chunk_bin_num = std::max(kMaxSphereReprojectCells / cell_per_bin, size_t{ 1 });
+
+  spectrum_data_.clear();
+  spectrum_data_compensation_.clear();
+  bool use_xyz = UseXyzData();
+  int channel_num = 1;
+  if (use_xyz) {
+    // 3 channels of a cell are splatted together.
+    channel_num = 3;
+    xyz_data_.reset(new float[img_wid * img_hei * 3]{});
+    xyz_data_compensation_.reset(new float[img_wid * img_hei * 3]{});
+    if (!sphere_xyz_data_) {
+      return;
+    }
+  }
+
+  std::unique_ptr<int[]> pixel{ new int[chunk_bin_num * cell_per_bin] };
+  auto* pixel_ptr = pixel.get();
+  std::unique_ptr<float[]> val{ new float[chunk_bin_num * cell_per_bin * channel_num] };
+  auto* val_ptr = val.get();
+  for (size_t bin_start = 0; bin_start < bin_num; bin_start += chunk_bin_num) {
+    auto curr_bin_num = std::min(chunk_bin_num, bin_num - bin_start);
+    auto cell_num = curr_bin_num * cell_per_bin;
+
+    // 1. Map cells to pixels. It is the same for all wavelengths.
+    auto map_cells = [=, &projector](int /* thread_id */, int start_idx, int end_idx) {
+      float dir[Projector::kBatchSize * 3];
+      float xy[Projector::kBatchSize * 2];
+      auto start_cell = start_idx * cell_per_bin;
+      auto end_cell = end_idx * cell_per_bin;
+      for (auto start = start_cell; start < end_cell; start += Projector::kBatchSize) {
+        auto current_num = std::min(end_cell - start, Projector::kBatchSize);
+        for (size_t j = 0; j < current_num; j++) {
+          auto bin = bin_start + (start + j) / cell_per_bin;
+          auto sub = (start + j) % cell_per_bin;
+          float uv[2]{ (bin % sphere_size + (sub % sub_num + 0.5f) / sub_num) / sphere_size,
+                       (bin / sphere_size + (sub / sub_num + 0.5f) / sub_num) / sphere_size };
+          EqualAreaSquareToSphere(uv, dir + j * 3);
+        }
+        projector.Project(current_num, dir, 3, xy);
+        for (size_t j = 0; j < current_num; j++) {
+          pixel_ptr[start + j] = GetPixelIndex(xy + j * 2, offset.first, offset.second, img_wid, img_hei);
+        }
+      }
+    };
+    threading_pool_->ParallelFor(0, curr_bin_num, 0, map_cells);
+
+    // 2. Splat cells for each wavelength
+    if (use_xyz) {
+      const auto* sphere_data = sphere_xyz_data_.get() + bin_start * 3;
+      threading_pool_->ParallelFor(0, cell_num, 0, [=](int /* thread_id */, int i) {
+        auto cell = static_cast<size_t>(i);
+        for (size_t j = 0; j < 3; j++) {
+          val_ptr[cell * 3 + j] = sphere_data[cell / cell_per_bin * 3 + j] / cell_per_bin;
+        }
+      });
+      AccumulatePixels(cell_num, pixel_ptr, val_ptr, img_wid, img_hei, 3, nullptr,  //
+                       xyz_data_.get(), xyz_data_compensation_.get());
+      continue;
+    }
+
+    for (const auto& [identifier, data] : sphere_data_) {
+      auto* current_data = FindOrCreateData(&spectrum_data_, identifier, img_wid * img_hei);
+      auto* current_data_compensation = FindOrCreateData(&spectrum_data_compensation_, identifier, img_wid * img_hei);
+      const auto* sphere_data = data.get() + bin_start;
+      threading_pool_->ParallelFor(0, cell_num, 0, [=](int /* thread_id */, int i) {
+        auto cell = static_cast<size_t>(i);
+        val_ptr[cell] = sphere_data[cell / cell_per_bin] / cell_per_bin;
+      });
+      AccumulatePixels(cell_num, pixel_ptr, val_ptr, img_wid, img_hei, 1, nullptr,  //
+                       current_data, current_data_compensation);
+    }
+  }
+}
+
+
+bool Renderer::UseXyzData() const {
+  return render_ctx_->GetColorCompactLevel() == ColorCompactLevel::kTrueColor && !render_ctx_->GetKeepSpectrum();
+}
+
 
-  auto projection_type = cam_ctx_->GetLensType();
-  auto pf = GetProjectionFunction(projection_type);
-  if (!pf) {
-    LOG_ERROR("Unknown projection type!");
+Projector Renderer::CreateProjector() const {
+  return Projector{ cam_ctx_->GetLensType(),    cam_ctx_->GetCameraTargetDirection(), cam_ctx_->GetFov(),
+                    render_ctx_->GetImageWidth(), render_ctx_->GetImageHeight(),
+                    render_ctx_->GetVisibleRange() };
+}
+
+
+std::pair<int, int> Renderer::GetPixelOffset(LensType projection_type) const {
+  if (projection_type == LensType::kDualEqualArea || projection_type == LensType::kDualEquidistant ||
+      projection_type == LensType::kEquirectangular) {
+    return { 0, 0 };
+  }
+  return { render_ctx_->GetImageOffsetX(), render_ctx_->GetImageOffsetY() };
+}
+
+
+// Accumulate values into pixels of an image (or a histogram), with Kahan summation.
+// 1. Bin rays into tiles (bands of grid rows), by a counting sort. The sort is stable, so rays in one tile
+//    keep their original order.
+// 2. Each tile is owned by only one worker, which accumulates its rays sequentially.
+// Thus there is no race on pixels, and the result does not depend on how many threads are used.
+//
+// Every pixel has channel_num floats. If channel_weight is given, val[i] * channel_weight[c] goes to channel c,
+// else val holds channel_num values for each ray.
+void Renderer::AccumulatePixels(size_t num, const int* pixel, const float* val, int grid_wid, int grid_hei,
+                                int channel_num, const float* channel_weight, float* current_data,
+                                float* current_data_compensation) {
+  if (num == 0) {
     return;
   }
 
-  auto num = final_ray_data.buf_ray_num;
-  const auto* final_ray_buf = final_ray_data.buf.get();
-  auto weight = final_ray_data.wavelength_weight;
-  threading_pool_->CommitRangeSliceJobsAndWait(0, num, [=](int /* thread_id */, int start_idx, int end_idx) {
-    size_t current_num = end_idx - start_idx;
-    std::unique_ptr<float[]> tmp_xy{ new float[current_num * 2] };
-    pf(cam_ctx_->GetCameraTargetDirection(), cam_ctx_->GetFov(), current_num, final_ray_buf + start_idx * 4, img_wid,
-       img_hei, tmp_xy.get(), render_ctx_->GetVisibleRange());
-
-    for (size_t j = 0; j < current_num; j++) {
-      if (std::isnan(tmp_xy[j * 2 + 0]) || std::isnan(tmp_xy[j * 2 + 1])) {
-        continue;
+  auto val_step = channel_weight ? 1 : channel_num;
+
+  int tile_size = grid_wid * kAccumulateTileRows;
+  int tile_num = (grid_hei + kAccumulateTileRows - 1) / kAccumulateTileRows;
+
+  // Chunks are fixed, independent of work stealing.
+  auto pool_size = threading_pool_->GetPoolSize();
+  size_t chunk_grain = std::max(num / (pool_size * ThreadingPool::kDefaultChunksPerWorker), size_t{ 1024 });
+  int chunk_num = static_cast<int>((num + chunk_grain - 1) / chunk_grain);
+
+  // 1.1 Count rays of every tile in every chunk
+  std::vector<size_t> tile_offset(static_cast<size_t>(chunk_num) * tile_num + 1, 0);
+  auto* tile_offset_ptr = tile_offset.data();
+  threading_pool_->ParallelFor(0, chunk_num, 1, [=](int /* thread_id */, int c) {
+    auto* curr_count = tile_offset_ptr + c * tile_num;
+    auto end = std::min((c + 1) * chunk_grain, num);
+    for (auto i = c * chunk_grain; i < end; i++) {
+      if (pixel[i] >= 0) {
+        curr_count[pixel[i] / tile_size]++;
       }
-      int x = static_cast<int>(tmp_xy[j * 2 + 0]);
-      int y = static_cast<int>(tmp_xy[j * 2 + 1]);
-      if (projection_type != LensType::kDualEqualArea && projection_type != LensType::kDualEquidistant &&
-          projection_type != LensType::kEquirectangular) {
-        x += render_ctx_->GetImageOffsetX();
-        y += render_ctx_->GetImageOffsetY();
+    }
+  });
+
+  // 1.2 Exclusive scan, tile major, chunk minor
+  std::vector<size_t> tile_start(tile_num + 1, 0);
+  size_t total = 0;
+  for (int t = 0; t < tile_num; t++) {
+    tile_start[t] = total;
+    for (int c = 0; c < chunk_num; c++) {
+      auto cnt = tile_offset[c * tile_num + t];
+      tile_offset[c * tile_num + t] = total;
+      total += cnt;
+    }
+  }
+  tile_start[tile_num] = total;
+
+  // 1.3 Scatter
+  std::unique_ptr<int[]> sorted_pixel{ new int[total] };
+  std::unique_ptr<float[]> sorted_val{ new float[total * val_step] };
+  auto* sorted_pixel_ptr = sorted_pixel.get();
+  auto* sorted_val_ptr = sorted_val.get();
+  threading_pool_->ParallelFor(0, chunk_num, 1, [=](int /* thread_id */, int c) {
+    auto* curr_offset = tile_offset_ptr + c * tile_num;
+    auto end = std::min((c + 1) * chunk_grain, num);
+    for (auto i = c * chunk_grain; i < end; i++) {
+      if (pixel[i] >= 0) {
+        auto pos = curr_offset[pixel[i] / tile_size]++;
+        sorted_pixel_ptr[pos] = pixel[i];
+        for (int j = 0; j < val_step; j++) {
+          sorted_val_ptr[pos * val_step + j] = val[i * val_step + j];
+        }
       }
-      if (x < 0 || x >= static_cast<int>(img_wid) || y < 0 || y >= static_cast<int>(img_hei)) {
-        continue;
+    }
+  });
+
+  // 2. Accumulate tile by tile
+  const auto* tile_start_ptr = tile_start.data();
+  threading_pool_->ParallelFor(0, tile_num, 1, [=](int /* thread_id */, int t) {
+    for (auto i = tile_start_ptr[t]; i < tile_start_ptr[t + 1]; i++) {
+      for (int j = 0; j < channel_num; j++) {
+        auto p = sorted_pixel_ptr[i] * channel_num + j;
+        auto v = channel_weight ? sorted_val_ptr[i] * channel_weight[j] : sorted_val_ptr[i * val_step + j];
+        auto tmp_val = v - current_data_compensation[p];
+        auto tmp_sum = current_data[p] + tmp_val;
+        current_data_compensation[p] = tmp_sum - current_data[p] - tmp_val;
+        current_data[p] = tmp_sum;
       }
-      auto tmp_val = final_ray_buf[(start_idx + j) * 4 + 3] * weight - current_data_compensation[y * img_wid + x];
-      auto tmp_sum = current_data[y * img_wid + x] + tmp_val;
-      current_data_compensation[y * img_wid + x] = tmp_sum - current_data[y * img_wid + x] - tmp_val;
-      current_data[y * img_wid + x] = tmp_sum;
     }
   });
 }
@@ -550,6 +755,12 @@ void Renderer::Render() {
     throw std::invalid_argument("Render context is not set!");
   }
 
+  if (render_ctx_->GetSphereHistogramSize() > 0) {
+    if (!cam_ctx_) {
+      throw std::invalid_argument("Camera context is not set!");
+    }
+    ReprojectSphereData();
+  }
   RenderHaloImage();
   DrawGrids();
 }
@@ -563,7 +774,10 @@ void Renderer::RenderHaloImage() {
   auto factor = static_cast<float>(img_hei * img_wid / 160.0 / total_w_ * render_ctx_->GetIntensity());
   auto color_compact_level = render_ctx_->GetColorCompactLevel();
 
-  if (color_compact_level == ColorCompactLevel::kTrueColor) {
+  if (UseXyzData()) {
+    RenderXyzToRgb(threading_pool_, xyz_data_.get(), img_wid * img_hei, factor, background_color, ray_color,
+                   output_image_buffer_.get());
+  } else if (color_compact_level == ColorCompactLevel::kTrueColor) {
     RenderSpecToRgb(threading_pool_, spectrum_data_, img_wid * img_hei, factor, background_color, ray_color,
                     output_image_buffer_.get());
   } else {
@@ -683,18 +897,9 @@ void Renderer::DrawGrids() {
 
 
 void Renderer::DrawElevationGrids() {
-  auto projection_type = cam_ctx_->GetLensType();
-  auto pf = GetProjectionFunction(projection_type);
-  if (!pf) {
-    LOG_ERROR("Unknown projection type!");
-    return;
-  }
-
-  auto cam_pose = cam_ctx_->GetCameraTargetDirection();
-  auto hov = cam_ctx_->GetFov();
+  auto projector = CreateProjector();
   auto img_wid = render_ctx_->GetImageWidth();
   auto img_hei = render_ctx_->GetImageHeight();
-  auto visible_range = render_ctx_->GetVisibleRange();
   auto need_offset =
       (cam_ctx_->GetLensType() != LensType::kDualEqualArea && cam_ctx_->GetLensType() != LensType::kDualEquidistant &&
        cam_ctx_->GetLensType() != LensType::kEquirectangular);
@@ -722,7 +927,7 @@ void Renderer::DrawElevationGrids() {
       curr_dir[0] = std::cos(azi * math::kDegreeToRad) * std::cos(g.value * math::kDegreeToRad);
       curr_dir[1] = std::sin(azi * math::kDegreeToRad) * std::cos(g.value * math::kDegreeToRad);
       curr_dir[2] = std::sin(g.value * math::kDegreeToRad);
-      pf(cam_pose, hov, 1, curr_dir, img_wid, img_hei, curr_xy, visible_range);
+      projector.Project(1, curr_dir, 3, curr_xy);
       if (need_offset) {
         curr_xy[0] += render_ctx_->GetImageOffsetX();
         curr_xy[1] += render_ctx_->GetImageOffsetY();
@@ -752,18 +957,9 @@ void Renderer::DrawElevationGrids() {
 
 
 void Renderer::DrawRadiusGrids() {
-  auto projection_type = cam_ctx_->GetLensType();
-  auto pf = GetProjectionFunction(projection_type);
-  if (!pf) {
-    LOG_ERROR("Unknown projection type!");
-    return;
-  }
-
-  auto cam_pose = cam_ctx_->GetCameraTargetDirection();
-  auto hov = cam_ctx_->GetFov();
+  auto projector = CreateProjector();
   auto img_wid = render_ctx_->GetImageWidth();
   auto img_hei = render_ctx_->GetImageHeight();
-  auto visible_range = render_ctx_->GetVisibleRange();
   auto need_offset =
       (cam_ctx_->GetLensType() != LensType::kDualEqualArea && cam_ctx_->GetLensType() != LensType::kDualEquidistant &&
        cam_ctx_->GetLensType() != LensType::kEquirectangular);
@@ -785,7 +981,7 @@ void Renderer::DrawRadiusGrids() {
       central_dir[1] = -std::sin(ang * math::kDegreeToRad) * std::sin(g.value * math::kDegreeToRad);
       central_dir[2] = -std::cos(g.value * math::kDegreeToRad);
       RotateZBack(sun_pose.val(), central_dir, curr_dir);
-      pf(cam_pose, hov, 1, curr_dir, img_wid, img_hei, curr_xy, visible_range);
+      projector.Project(1, curr_dir, 3, curr_xy);
       if (need_offset) {
         curr_xy[0] += render_ctx_->GetImageOffsetX();
         curr_xy[1] += render_ctx_->GetImageOffsetY();
@@ -825,4 +1021,11 @@ uint8_t* Renderer::GetImageBuffer() const {
 }
 
 
+const float* Renderer::GetSpectrumData(int identifier) const {
+  auto iter = std::find_if(spectrum_data_.begin(), spectrum_data_.end(),
+                           [=](const ImageSpectrumData& d) { return d.first == identifier; });
+  return iter == spectrum_data_.end() ? nullptr : iter->second.get();
+}
+
+
 }  // namespace icehalo
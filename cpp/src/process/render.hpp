@@ -2,6 +2,8 @@
 #define SRC_CORE_RENDER_H_
 
 #include <functional>
+#include <utility>
+#include <vector>
 
 #include "context/context.hpp"
 #include "core/core_def.hpp"
@@ -32,6 +34,64 @@ using ProjectionFunction = std::function<void(Pose3f cam_pose,           // Came
 ProjectionFunction GetProjectionFunction(LensType lens_type);
 
 
+/**
+ * @brief Projects ray directions onto an image, for a given camera.
+ *
+ * It is built once per camera. The camera rotation matrix and lens constants are computed in constructor,
+ * so projection needs no heap allocation and no trigonometric function for camera pose.
+ * Rays that are invisible (or out of the lens) get NaN coordinates.
+ */
+class Projector {
+ public:
+  Projector(LensType lens_type, Pose3f cam_pose,  // Camera rotation (lon, lat, roll), in degree.
+            float hov,                            // Half field of view, in degree
+            int img_wid, int img_hei,             // Image size
+            VisibleRange visible_range);          // Which semi-sphere can be visible
+
+  LensType GetLensType() const;
+
+  /**
+   * @brief Approximate angle of a pixel near image center, in rad.
+   */
+  float GetAngularResolution() const;
+
+  /**
+   * @brief Projects AoS ray directions.
+   *
+   * @param num Number of rays.
+   * @param dir Ray directions. The i-th ray is (dir[i * dir_step], dir[i * dir_step + 1], dir[i * dir_step + 2]).
+   * @param dir_step Step of dir.
+   * @param img_xy Output image coordinates, [x, y] for each ray.
+   */
+  void Project(size_t num, const float* dir, size_t dir_step, float* img_xy) const;
+
+  /**
+   * @brief Same as above, but the i-th ray is gathered from `dir + idx[i] * dir_step`.
+   */
+  void Project(size_t num, const size_t* idx, const float* dir, size_t dir_step, float* img_xy) const;
+
+  /**
+   * @brief Projects SoA ray directions, dir[0] for x, dir[1] for y and dir[2] for z.
+   *        Output img_xy[0] for x and img_xy[1] for y.
+   */
+  void Project(size_t num, const float* const* dir, float* const* img_xy) const;
+
+  static constexpr size_t kBatchSize = 64;
+
+ private:
+  void ProjectBatch(size_t num, const float* const* dir,                   // input, at most kBatchSize
+                    float* img_x, float* img_y, size_t img_step) const;  // output
+
+  LensType lens_type_;
+  VisibleRange visible_range_;
+  int img_wid_;
+  int img_hei_;
+  float rot_[9];
+  float img_r_;
+  float lens_k_;
+};
+
+
 using ImageSpectrumData = std::pair<int, std::unique_ptr<float[]>>;
 
 constexpr int kMinWavelength = 360;
@@ -67,23 +127,46 @@ class Renderer {
    *     2.1 If `ray_color[0]` is less than 0, then use true color
    *     2.3 Else use `ray_color`
    * 3. Else ignore other ray color settings and background color settings
+   *
+   * In true color mode, rays are folded into CIE XYZ when they are loaded, unless RenderContext::GetKeepSpectrum()
+   * is true.
+   *
+   * If RenderContext::GetSphereHistogramSize() is positive, the image is resampled from the direction-space
+   * histogram with the current camera first. So another view of the same data can be rendered by calling
+   * SetCameraContext() and then Render() again.
    */
   void Render();
   uint8_t* GetImageBuffer() const;
 
+  /**
+   * @brief Gets the accumulated image data of a wavelength (or identifier), one float for each pixel.
+   *
+   * @return nullptr if there is no such data, e.g. rays are folded into CIE XYZ. See Renderer::Render().
+   */
+  const float* GetSpectrumData(int identifier) const;
+
   static constexpr int kImageBits = 24;
   static constexpr float kLineD2ExclusionLimitRatio = 0.1;
 
  private:
-  void LoadPartialRayData(const std::vector<size_t>& idx, const SimpleRayData& final_ray_data, float* current_data,
-                          float* current_data_compensation);
-  void LoadFullRayData(const SimpleRayData& final_ray_data, float* current_data, float* current_data_compensation);
+  void MapRayData(size_t num, const size_t* idx, const SimpleRayData& final_ray_data,  // input
+                  int* pixel, float* val);                                              // output
+  void ReprojectSphereData();
+  Projector CreateProjector() const;
+  std::pair<int, int> GetPixelOffset(LensType projection_type) const;
+  void AccumulatePixels(size_t num, const int* pixel, const float* val, int grid_wid, int grid_hei,  // input
+                        int channel_num, const float* channel_weight,                                // input
+                        float* current_data, float* current_data_compensation);                     // output
+  bool UseXyzData() const;
 
   void RenderHaloImage();
   void DrawGrids();
   void DrawElevationGrids();
   void DrawRadiusGrids();
 
+  static constexpr int kAccumulateTileRows = 16;
+  static constexpr int kMaxSphereSubSample = 8;
+  static constexpr size_t kMaxSphereReprojectCells = 1 << 22;  //!< Cells in one chunk of reprojection
   static constexpr int kLineD2Lower = 2;
   static constexpr int kLineD2Upper = 20;
   static constexpr float kDefaultLineStep = 1.0f;
@@ -96,6 +179,12 @@ class Renderer {
   std::unique_ptr<uint8_t[]> output_image_buffer_;
   std::vector<ImageSpectrumData> spectrum_data_;
   std::vector<ImageSpectrumData> spectrum_data_compensation_;
+  std::vector<ImageSpectrumData> sphere_data_;
+  std::vector<ImageSpectrumData> sphere_data_compensation_;
+  std::unique_ptr<float[]> xyz_data_;  // X, Y, Z for each pixel
+  std::unique_ptr<float[]> xyz_data_compensation_;
+  std::unique_ptr<float[]> sphere_xyz_data_;  // X, Y, Z for each bin
+  std::unique_ptr<float[]> sphere_xyz_data_compensation_;
   float total_w_;
   ThreadingPoolPtr threading_pool_;
 };
@@ -1,7 +1,10 @@
 #include "simulation.hpp"
 
+#include <algorithm>
 #include <cstdio>
 #include <functional>
+#include <new>
+#include <numeric>
 #include <stack>
 #include <utility>
 
@@ -12,8 +15,36 @@
 
 namespace icehalo {
 
+namespace {
+
+constexpr uint32_t kRayWavelengthTag = MakeSectionTag('R', 'W', 'L', ' ');
+constexpr uint32_t kRayWeightTag = MakeSectionTag('R', 'W', 'T', ' ');
+constexpr uint32_t kRayNumTag = MakeSectionTag('R', 'N', 'U', 'M');
+constexpr uint32_t kRayInitNumTag = MakeSectionTag('R', 'I', 'N', 'I');
+constexpr uint32_t kRayBufTag = MakeSectionTag('R', 'B', 'U', 'F');
+constexpr uint32_t kCompactRayDirTag = MakeSectionTag('C', 'D', 'I', 'R');
+constexpr uint32_t kCompactRayWeightTag = MakeSectionTag('C', 'W', 'T', ' ');
+constexpr uint32_t kCompactRayHashTag = MakeSectionTag('C', 'H', 'S', 'H');
+
+
+// Recorder of the whole path of a ray segment, across all scatters.
+RayPathRecorder GetWholePathRecorder(const RaySegment* r) {
+  auto recorder = r->root_ctx->prev_path_recorder;
+  recorder << r->recorder;
+  return recorder;
+}
+
+
+size_t GetRayPathHash(const RaySegment* r) {
+  return GetWholePathRecorder(r).Hash();
+}
+
+}  // namespace
+
+
 SimpleRayData::SimpleRayData(size_t num)
-    : wavelength(0), wavelength_weight(1.0f), buf{ new float[num * 4] }, buf_ray_num(num), init_ray_num(0) {}
+    : wavelength(0), wavelength_weight(1.0f), buf{ new float[num * 4] }, buf_ray_num(num), init_ray_num(0),
+      mapped_buf_(nullptr) {}
 
 
 void SimpleRayData::Serialize(File& file, bool with_boi) const {
@@ -26,11 +57,7 @@ void SimpleRayData::Serialize(File& file, bool with_boi) const {
   file.Write(static_cast<uint64_t>(buf_ray_num));
   file.Write(static_cast<uint64_t>(init_ray_num));
 
-  float* p = buf.get();
-  for (size_t i = 0; i < buf_ray_num; i++) {
-    file.Write(p, 4);
-    p += 4;
-  }
+  file.Write(GetRayBuffer(), buf_ray_num * 4);
 }
 
 
@@ -60,19 +87,113 @@ void SimpleRayData::Deserialize(File& file, endian::Endianness endianness) {
   }
   init_ray_num = num;
 
+  mapped_file_.reset();
+  mapped_buf_ = nullptr;
   buf.reset(new float[buf_ray_num * 4]);
-  float* p = buf.get();
-  for (size_t i = 0; i < buf_ray_num; i++) {
-    file.Read(p, 4);
-    if (need_swap) {
-      endian::ByteSwap::Swap(p, 4);
+  file.Read(buf.get(), buf_ray_num * 4);
+  if (need_swap) {
+    endian::ByteSwap::Swap(buf.get(), buf_ray_num * 4);
+  }
+}
+
+
+const float* SimpleRayData::GetRayBuffer() const {
+  return mapped_buf_ ? mapped_buf_ : buf.get();
+}
+
+
+void SimpleRayData::AddToContainer(ContainerWriter* writer) const {
+  writer->AddSection(kRayWavelengthTag, &wavelength, 1);
+  writer->AddSection(kRayWeightTag, &wavelength_weight, 1);
+  writer->AddSection(kRayNumTag, &buf_ray_num, 1);
+  writer->AddSection(kRayInitNumTag, &init_ray_num, 1);
+  writer->AddSection(kRayBufTag, GetRayBuffer(), buf_ray_num * 4);
+}
+
+
+bool SimpleRayData::LoadFromContainer(const ContainerReader& reader) {
+  size_t ray_num = 0;
+  if (!reader.ReadArray(kRayWavelengthTag, &wavelength, 1) || !reader.ReadArray(kRayWeightTag, &wavelength_weight, 1) ||
+      !reader.ReadArray(kRayNumTag, &ray_num, 1) || !reader.ReadArray(kRayInitNumTag, &init_ray_num, 1)) {
+    return false;
+  }
+  const auto* section = reader.FindSection(kRayBufTag);
+  if (!section || section->elem_bytes != sizeof(float) || section->elem_num != ray_num * 4) {
+    return false;
+  }
+  buf_ray_num = ray_num;
+
+  mapped_file_.reset();
+  mapped_buf_ = reader.GetArray<float>(kRayBufTag, nullptr);
+  if (mapped_buf_) {
+    mapped_file_ = reader.GetMappedFile();
+    buf.reset();
+  } else {
+    buf.reset(new float[buf_ray_num * 4]);
+    reader.ReadArray(kRayBufTag, buf.get(), buf_ray_num * 4);
+  }
+  return true;
+}
+
+
+CompactRayData::CompactRayData()
+    : wavelength(0), wavelength_weight(1.0f), ray_num(0), init_ray_num(0), dir{}, w{}, path_hash{} {}
+
+
+SimpleRayData CompactRayData::Decode() const {
+  SimpleRayData ray_data(ray_num);
+  ray_data.wavelength = wavelength;
+  ray_data.wavelength_weight = wavelength_weight;
+  ray_data.init_ray_num = init_ray_num;
+  float* p = ray_data.buf.get();
+  for (size_t i = 0; i < ray_num; i++) {
+    DecodeOctahedral(dir.data() + i * 2, p + i * 4);
+    p[i * 4 + 3] = HalfToFloat(w[i]);
+  }
+  return ray_data;
+}
+
+
+void CompactRayData::AddToContainer(ContainerWriter* writer) const {
+  writer->AddSection(kRayWavelengthTag, &wavelength, 1);
+  writer->AddSection(kRayWeightTag, &wavelength_weight, 1);
+  writer->AddSection(kRayNumTag, &ray_num, 1);
+  writer->AddSection(kRayInitNumTag, &init_ray_num, 1);
+  writer->AddSection(kCompactRayDirTag, dir.data(), ray_num * 2);
+  writer->AddSection(kCompactRayWeightTag, w.data(), ray_num);
+  if (!path_hash.empty()) {
+    writer->AddSection(kCompactRayHashTag, path_hash.data(), ray_num);
+  }
+}
+
+
+bool CompactRayData::LoadFromContainer(const ContainerReader& reader) {
+  if (!reader.ReadArray(kRayWavelengthTag, &wavelength, 1) || !reader.ReadArray(kRayWeightTag, &wavelength_weight, 1) ||
+      !reader.ReadArray(kRayNumTag, &ray_num, 1) || !reader.ReadArray(kRayInitNumTag, &init_ray_num, 1)) {
+    return false;
+  }
+
+  dir.resize(ray_num * 2);
+  w.resize(ray_num);
+  if (reader.ReadArray(kCompactRayDirTag, dir.data(), dir.size()) != dir.size() ||
+      reader.ReadArray(kCompactRayWeightTag, w.data(), w.size()) != w.size()) {
+    return false;
+  }
+
+  path_hash.clear();
+  if (reader.FindSection(kCompactRayHashTag)) {
+    path_hash.resize(ray_num);
+    if (reader.ReadArray(kCompactRayHashTag, path_hash.data(), path_hash.size()) != path_hash.size()) {
+      return false;
     }
-    p += 4;
   }
+  return true;
 }
 
 
-SimulationData::SimulationData() : wavelength_info_(), threading_pool_(ThreadingPool::CreatePool()) {}
+SimulationData::SimulationData()
+    : wavelength_info_(), threading_pool_(ThreadingPool::GetDefaultPool()),
+      ray_storage_(std::make_shared<RayStorage>()) {}
 
 
 void SimulationData::SetThreadingPool(ThreadingPoolPtr threading_pool) {
@@ -80,12 +201,18 @@ void SimulationData::SetThreadingPool(ThreadingPoolPtr threading_pool) {
 }
 
 
+RayStorage* SimulationData::GetRayStorage() const {
+  return ray_storage_.get();
+}
+
+
 void SimulationData::Clear() {
   rays_.clear();
   exit_ray_segments_.clear();
   exit_ray_seg_num_.clear();
   ray_path_map_.clear();
   wavelength_info_ = {};
+  ray_storage_->Clear();
 }
 
 
@@ -103,11 +230,12 @@ void SimulationData::AddRay(RayInfo* ray) {
 }
 
 
-void SimulationData::AddExitRaySegment(RaySegment* r) {
-  exit_ray_segments_.back().emplace_back(r);
-  if (r->state == RaySegmentState::kFinished) {
-    exit_ray_seg_num_.back()++;
-  }
+RaySegment** SimulationData::AppendExitRaySegments(size_t num) {
+  auto& exit_ray_segments = exit_ray_segments_.back();
+  auto curr_num = exit_ray_segments.size();
+  exit_ray_segments.resize(curr_num + num);
+  exit_ray_seg_num_.back() += num;
+  return exit_ray_segments.data() + curr_num;
 }
 
 
@@ -127,13 +255,12 @@ std::tuple<RayCollectionInfo, SimpleRayData> SimulationData::CollectFinalRayData
   float* p = final_ray_data.buf.get();
   for (const auto& sr : exit_ray_segments_) {
     const auto* sr_data = sr.data();
-    threading_pool_->CommitRangeStepJobsAndWait(0, sr.size(), [=](int /* thread_id */, int i) {
+    threading_pool_->ParallelFor(0, sr.size(), 0, [=](int /* thread_id */, int i) {
       const auto& r = sr_data[i];
       if (r->state != RaySegmentState::kFinished) {
         return;
       }
-      const auto* axis = r->root_ctx->main_axis.val();
-      RotateZBack(axis, r->dir.val(), p + i * 4);
+      RotateBackWithMatrix(r->root_ctx->axis_mat, r->dir.val(), p + i * 4);
       p[i * 4 + 3] = r->w;
     });
     for (const auto& r : sr) {
@@ -148,6 +275,46 @@ std::tuple<RayCollectionInfo, SimpleRayData> SimulationData::CollectFinalRayData
 }
 
 
+CompactRayData SimulationData::CollectCompactRayData(bool with_path_hash) {
+  // Only finished rays are kept, in the same order as CollectFinalRayData().
+  std::vector<RaySegment*> finished_rays;
+  for (const auto& sr : exit_ray_segments_) {
+    for (const auto& r : sr) {
+      if (r->state == RaySegmentState::kFinished) {
+        finished_rays.emplace_back(r);
+      }
+    }
+  }
+
+  CompactRayData compact_data;
+  compact_data.wavelength = wavelength_info_.wavelength;
+  compact_data.wavelength_weight = wavelength_info_.weight;
+  compact_data.init_ray_num = rays_.empty() ? 0 : rays_[0].size();
+  compact_data.ray_num = finished_rays.size();
+  compact_data.dir.resize(finished_rays.size() * 2);
+  compact_data.w.resize(finished_rays.size());
+  if (with_path_hash) {
+    compact_data.path_hash.resize(finished_rays.size());
+  }
+
+  auto* const* rays = finished_rays.data();
+  auto* dir = compact_data.dir.data();
+  auto* w = compact_data.w.data();
+  auto* path_hash = with_path_hash ? compact_data.path_hash.data() : nullptr;
+  threading_pool_->ParallelFor(0, finished_rays.size(), 0, [=](int /* thread_id */, int i) {
+    auto* r = rays[i];
+    float world_dir[3];
+    RotateBackWithMatrix(r->root_ctx->axis_mat, r->dir.val(), world_dir);
+    EncodeOctahedral(world_dir, dir + i * 2);
+    w[i] = FloatToHalf(r->w);
+    if (path_hash) {
+      path_hash[i] = GetRayPathHash(r);
+    }
+  });
+  return compact_data;
+}
+
+
 std::tuple<RayCollectionInfoList, SimpleRayData> SimulationData::CollectSplitRayData(const ProjectContextPtr& ctx,
                                                                                      const RenderSplitter& splitter) {
   switch (splitter.type) {
@@ -170,46 +337,20 @@ std::tuple<RayCollectionInfoList, SimpleRayData> SimulationData::CollectSplitHal
   }
 
   MakeRayPathMap(ctx);
-  auto idx_list = GenerateIdxList();
-
-  auto threading_pool = ThreadingPool::CreatePool();
-  size_t hash_table_init_size = num / 3;
-  std::unordered_map<size_t, RayCollectionInfo> ray_collection_info_map;
-  ray_collection_info_map.reserve(hash_table_init_size);
-
-  for (size_t i = 0; i < exit_ray_segments_.size(); i++) {
-    const auto& sr = exit_ray_segments_[i];
-    const auto& curr_idx_list = idx_list[i];
-    for (size_t j = 0; j < sr.size(); j++) {
-      const auto& r = sr[j];
-      if (r->state != RaySegmentState::kFinished) {
-        continue;
-      }
-
-      // 1. Get hash for the whole path
-      RayPathRecorder recorder;
-      RaySegment* p = r;
-      while (p) {
-        p->recorder >> recorder;
-        p = p->root_ctx->prev_ray_segment;
-      }
-      auto ray_path_hash = recorder.Hash();
 
-      // 3. Fill collection data
-      auto normalized_hash = ray_path_map_.at(ray_path_hash).second;
-      if (!ray_collection_info_map.count(normalized_hash)) {
-        RayCollectionInfo tmp_collection{};
-        tmp_collection.identifier = normalized_hash;
-        tmp_collection.is_partial_data = true;
-        ray_collection_info_map.emplace(normalized_hash, std::move(tmp_collection));
+  // 1. Finished rays. A ray's position here is its index in result_ray_data.
+  std::vector<RaySegment*> finished_rays;
+  finished_rays.reserve(num);
+  for (const auto& sr : exit_ray_segments_) {
+    for (const auto& r : sr) {
+      if (r->state == RaySegmentState::kFinished) {
+        finished_rays.emplace_back(r);
       }
-      auto& collection_info = ray_collection_info_map[normalized_hash];
-      collection_info.idx.emplace_back(curr_idx_list[j]);
-      collection_info.total_energy += r->w;
     }
   }
+  auto finished_num = static_cast<int>(finished_rays.size());
 
-  // 4. Fill in result_ray_data
+  // 2. Get normalized hash of every ray, and fill in result_ray_data
   SimpleRayData result_ray_data(num);
   result_ray_data.buf_ray_num = num;
   result_ray_data.wavelength = wavelength_info_.wavelength;
@@ -217,32 +358,107 @@ std::tuple<RayCollectionInfoList, SimpleRayData> SimulationData::CollectSplitHal
   if (!rays_.empty()) {
     result_ray_data.init_ray_num = rays_[0].size();
   }
+
+  std::vector<size_t> normalized_hash(finished_rays.size());
+  const auto* rays = finished_rays.data();
+  const auto* ray_path_map = &ray_path_map_;
+  auto* hash_p = normalized_hash.data();
   float* result_buf_p = result_ray_data.buf.get();
+  threading_pool_->ParallelFor(0, finished_num, 0, [=](int /* thread_id */, int i) {
+    auto* r = rays[i];
+    hash_p[i] = ray_path_map->at(GetRayPathHash(r)).second;
+    auto* p = result_buf_p + i * 4;
+    RotateBackWithMatrix(r->root_ctx->axis_mat, r->dir.val(), p);
+    p[3] = r->w;
+  });
 
-  for (size_t i = 0; i < exit_ray_segments_.size(); i++) {
-    const auto& sr = exit_ray_segments_[i];
-    threading_pool->CommitRangeStepJobsAndWait(0, sr.size(), [=, &idx_list, &sr](int /* thread_id */, int j) {
-      const auto& r = sr[j];
-      if (r->state != RaySegmentState::kFinished) {
-        return;
-      }
+  // 3. Partition rays into shards by hash. It is a stable radix pass, so rays in a shard keep their order.
+  constexpr int kShardBits = 6;
+  constexpr int kShardNum = 1 << kShardBits;
+  auto shard_of = [=](int i) { return static_cast<int>((hash_p[i] * 0x9e3779b97f4a7c15ull) >> (64 - kShardBits)); };
+  int block_num = static_cast<int>(threading_pool_->GetPoolSize()) * ThreadingPool::kDefaultChunksPerWorker;
+  int block_size = std::max((finished_num + block_num - 1) / block_num, 1);
+
+  std::vector<int> shard_offset(block_num * kShardNum + 1, 0);
+  auto* offset_p = shard_offset.data();
+  threading_pool_->ParallelFor(0, block_num, 1, [=](int /* thread_id */, int b) {
+    auto* cnt = offset_p + b * kShardNum;
+    for (int i = b * block_size; i < std::min((b + 1) * block_size, finished_num); i++) {
+      cnt[shard_of(i)]++;
+    }
+  });
 
-      auto* p = result_buf_p + idx_list[i][j] * 4;
-      const auto* axis = r->root_ctx->main_axis.val();
-      RotateZBack(axis, r->dir.val(), p);
-      p[3] = r->w;
-    });
+  // Shard-major order: all rays of shard 0 (from block 0, 1, ...), then shard 1, ...
+  std::vector<int> shard_begin(kShardNum + 1, 0);
+  int offset = 0;
+  for (int s = 0; s < kShardNum; s++) {
+    shard_begin[s] = offset;
+    for (int b = 0; b < block_num; b++) {
+      auto cnt = shard_offset[b * kShardNum + s];
+      shard_offset[b * kShardNum + s] = offset;
+      offset += cnt;
+    }
   }
+  shard_begin[kShardNum] = offset;
+
+  std::vector<int> sharded_idx(finished_rays.size());
+  auto* sharded_idx_p = sharded_idx.data();
+  threading_pool_->ParallelFor(0, block_num, 1, [=](int /* thread_id */, int b) {
+    auto* pos = offset_p + b * kShardNum;
+    for (int i = b * block_size; i < std::min((b + 1) * block_size, finished_num); i++) {
+      sharded_idx_p[pos[shard_of(i)]++] = i;
+    }
+  });
+
+  // 4. Group by normalized hash within every shard. A group never crosses shards.
+  std::vector<RayCollectionInfoList> shard_collections(kShardNum);
+  auto* shard_collections_p = shard_collections.data();
+  const auto* shard_begin_p = shard_begin.data();
+  threading_pool_->ParallelFor(0, kShardNum, 1, [=](int /* thread_id */, int s) {
+    std::unordered_map<size_t, size_t> group_of_hash;
+    std::vector<size_t> group_of_ray(shard_begin_p[s + 1] - shard_begin_p[s]);
+    std::vector<size_t> group_size;
+    auto& collections = shard_collections_p[s];
+    for (int k = shard_begin_p[s]; k < shard_begin_p[s + 1]; k++) {
+      auto h = hash_p[sharded_idx_p[k]];
+      auto iter = group_of_hash.find(h);
+      if (iter == group_of_hash.end()) {
+        iter = group_of_hash.emplace(h, collections.size()).first;
+        RayCollectionInfo tmp_collection{};
+        tmp_collection.identifier = h;
+        tmp_collection.is_partial_data = true;
+        collections.emplace_back(std::move(tmp_collection));
+        group_size.emplace_back(0);
+      }
+      group_of_ray[k - shard_begin_p[s]] = iter->second;
+      group_size[iter->second]++;
+    }
+
+    for (size_t g = 0; g < collections.size(); g++) {
+      collections[g].idx.reserve(group_size[g]);
+    }
+    for (int k = shard_begin_p[s]; k < shard_begin_p[s + 1]; k++) {
+      auto i = sharded_idx_p[k];
+      auto& collection_info = collections[group_of_ray[k - shard_begin_p[s]]];
+      collection_info.idx.emplace_back(i);
+      collection_info.total_energy += rays[i]->w;
+    }
+  });
 
   // 5. Make result
   RayCollectionInfoList ray_collection_info_list{};
-  for (auto& kv : ray_collection_info_map) {
-    ray_collection_info_list.emplace_back(std::move(kv.second));
+  for (auto& collections : shard_collections) {
+    for (auto& c : collections) {
+      ray_collection_info_list.emplace_back(std::move(c));
+    }
   }
 
-  // 6. Sort
+  // 6. Sort. Ties are broken by identifier, so that the result does not depend on sharding.
   std::sort(ray_collection_info_list.begin(), ray_collection_info_list.end(),
-            [](const RayCollectionInfo& a, const RayCollectionInfo& b) { return a.total_energy > b.total_energy; });
+            [](const RayCollectionInfo& a, const RayCollectionInfo& b) {
+              return a.total_energy > b.total_energy ||
+                     (a.total_energy == b.total_energy && a.identifier < b.identifier);
+            });
 
   // return the final result
   return std::make_tuple(std::move(ray_collection_info_list), std::move(result_ray_data));
@@ -329,8 +545,7 @@ std::tuple<RayCollectionInfoList, SimpleRayData> SimulationData::CollectSplitFil
       }
 
       // 7. Fill in result_ray_data
-      const auto* axis = r->root_ctx->main_axis.val();
-      RotateZBack(axis, r->dir.val(), result_buf_p);
+      RotateBackWithMatrix(r->root_ctx->axis_mat, r->dir.val(), result_buf_p);
       result_buf_p[3] = r->w;
       result_buf_p += 4;
 
@@ -352,12 +567,11 @@ void SimulationData::MakeRayPathMap(const ProjectContextPtr& proj_ctx) {
     return;
   }
 
-  auto threading_pool = ThreadingPool::CreatePool();
-  auto pool_size = threading_pool->GetPoolSize();
+  auto pool_size = threading_pool_->GetPoolSize();
   std::vector<decltype(ray_path_map_)> tmp_ray_path_maps(pool_size);
 
   for (const auto& sr : exit_ray_segments_) {
-    threading_pool->CommitRangeStepJobsAndWait(0, sr.size(), [=, &tmp_ray_path_maps, &sr](int pool_idx, int i) {
+    threading_pool_->ParallelFor(0, sr.size(), 0, [=, &tmp_ray_path_maps, &sr](int pool_idx, int i) {
       auto& tmp_map = tmp_ray_path_maps.at(pool_idx);
       const auto& r = sr[i];
       if (r->state != RaySegmentState::kFinished) {
@@ -365,20 +579,26 @@ void SimulationData::MakeRayPathMap(const ProjectContextPtr& proj_ctx) {
       }
 
       // 1. Get hash for the whole path
-      RayPathRecorder recorder;
-      RaySegment* p = r;
-      while (p) {
-        p->recorder >> recorder;
-        p = p->root_ctx->prev_ray_segment;
-      }
-      auto ray_path_hash = recorder.Hash();
+      auto ray_path_hash = GetRayPathHash(r);
       if (tmp_map.count(ray_path_hash)) {
         return;
       }
 
-      // 2. Normalize ray path
+      // 2. Look up in cache, which is kept across simulations
+      auto& cache = proj_ctx->ray_path_cache_;
+      RayPathMap::mapped_type curr_entry;
+      RayPathMap::mapped_type normalized_entry;
+      if (cache.Find(ray_path_hash, &curr_entry) && cache.Find(curr_entry.second, &normalized_entry)) {
+        tmp_map.emplace(curr_entry.second, std::move(normalized_entry));
+        tmp_map.emplace(ray_path_hash, std::move(curr_entry));
+        return;
+      }
+
+      // 3. Normalize ray path
       auto curr_path = proj_ctx->GetRayPath(r);
       auto [normalized_path, normalized_hash] = NormalizeRayPath(curr_path, proj_ctx, RenderSplitter::kDefaultSymmetry);
+      cache.Insert(normalized_hash, normalized_path, normalized_hash);
+      cache.Insert(ray_path_hash, curr_path, normalized_hash);
       tmp_map.emplace(ray_path_hash, std::make_pair(std::move(curr_path), normalized_hash));
       tmp_map.emplace(normalized_hash, std::make_pair(std::move(normalized_path), normalized_hash));
     });
@@ -392,24 +612,6 @@ void SimulationData::MakeRayPathMap(const ProjectContextPtr& proj_ctx) {
 }
 
 
-std::vector<std::vector<size_t>> SimulationData::GenerateIdxList() const {
-  size_t ray_seg_idx = 0;
-  std::vector<std::vector<size_t>> idx_list;
-  for (const auto& sr : exit_ray_segments_) {
-    idx_list.emplace_back(std::vector<size_t>(sr.size()));
-    for (size_t i = 0; i < sr.size(); i++) {
-      idx_list.back()[i] = ray_seg_idx;
-      const auto& r = sr[i];
-      if (r->state != RaySegmentState::kFinished) {
-        continue;
-      }
-      ray_seg_idx++;
-    }
-  }
-  return idx_list;
-}
-
-
 #ifdef FOR_TEST
 const std::vector<std::vector<RaySegment*>>& SimulationData::GetExitRaySegments() const {
   return exit_ray_segments_;
@@ -426,36 +628,33 @@ void SimulationData::Serialize(File& file, bool with_boi) const {
   file.Write(wl);
   file.Write(wavelength_info_.weight);
 
-  auto* ray_info_pool = RayInfoPool::GetInstance();
-  auto* ray_seg_pool = RaySegmentPool::GetInstance();
-  ray_info_pool->Serialize(file, false);
-  ray_seg_pool->Serialize(file, false);
+  ray_storage_->Serialize(file);
+  const auto* ray_info_pool = &ray_storage_->ray_info_pool;
+  const auto* ray_seg_pool = &ray_storage_->ray_seg_pool;
 
+  // Indices are (chunk ID, object ID) pairs, written as a whole array for each scatter.
+  std::vector<uint32_t> idx;
   uint32_t multi_scatters = rays_.size();
   file.Write(multi_scatters);
   for (const auto& sc : rays_) {
     uint32_t num = sc.size();
     file.Write(num);
-    for (const auto& r : sc) {
-      uint32_t chunk_id = 0;
-      uint32_t obj_id = 0;
-      std::tie(chunk_id, obj_id) = ray_info_pool->GetObjectSerializeIndex(r);
-      file.Write(chunk_id);
-      file.Write(obj_id);
+    idx.resize(num * 2);
+    for (size_t i = 0; i < num; i++) {
+      std::tie(idx[i * 2 + 0], idx[i * 2 + 1]) = ray_info_pool->GetObjectSerializeIndex(sc[i]);
     }
+    file.Write(idx.data(), idx.size());
   }
   multi_scatters = exit_ray_segments_.size();
   file.Write(multi_scatters);
   for (const auto& sc : exit_ray_segments_) {
     uint32_t num = sc.size();
     file.Write(num);
-    for (const auto& r : sc) {
-      uint32_t chunk_id = 0;
-      uint32_t obj_id = 0;
-      std::tie(chunk_id, obj_id) = ray_seg_pool->GetObjectSerializeIndex(r);
-      file.Write(chunk_id);
-      file.Write(obj_id);
+    idx.resize(num * 2);
+    for (size_t i = 0; i < num; i++) {
+      std::tie(idx[i * 2 + 0], idx[i * 2 + 1]) = ray_seg_pool->GetObjectSerializeIndex(sc[i]);
     }
+    file.Write(idx.data(), idx.size());
   }
   for (const auto& n : exit_ray_seg_num_) {
     uint64_t num = n;
@@ -482,21 +681,25 @@ void SimulationData::Deserialize(File& file, endian::Endianness endianness) {
     endian::ByteSwap::Swap(&wavelength_info_.weight);
   }
 
-  auto* ray_info_pool = RayInfoPool::GetInstance();
-  auto* ray_seg_pool = RaySegmentPool::GetInstance();
-  ray_info_pool->Deserialize(file, endianness);
-  ray_seg_pool->Deserialize(file, endianness);
+  ray_storage_->Deserialize(file, endianness);
+  auto* ray_info_pool = &ray_storage_->ray_info_pool;
+  auto* ray_seg_pool = &ray_storage_->ray_seg_pool;
 
-  ray_info_pool->Map([=](RayInfo& r) {
-    r.first_ray_segment = ray_seg_pool->GetPointerFromSerializeData(r.first_ray_segment);
-    r.prev_ray_segment = ray_seg_pool->GetPointerFromSerializeData(r.prev_ray_segment);
-  });
-  ray_seg_pool->Map([=](RaySegment& r) {
-    r.next_reflect = ray_seg_pool->GetPointerFromSerializeData(r.next_reflect);
-    r.next_refract = ray_seg_pool->GetPointerFromSerializeData(r.next_refract);
-    r.prev = ray_seg_pool->GetPointerFromSerializeData(r.prev);
-    r.root_ctx = ray_info_pool->GetPointerFromSerializeData(r.root_ctx);
-  });
+  // Read indices of one scatter as a whole array.
+  std::vector<uint32_t> idx;
+  auto read_idx = [&file, &idx, need_swap]() {
+    uint32_t num = 0;
+    file.Read(&num);
+    if (need_swap) {
+      endian::ByteSwap::Swap(&num);
+    }
+    idx.resize(num * 2);
+    file.Read(idx.data(), idx.size());
+    if (need_swap) {
+      endian::ByteSwap::Swap(idx.data(), idx.size());
+    }
+    return num;
+  };
 
   uint32_t multi_scatters = 0;
   file.Read(&multi_scatters);
@@ -505,21 +708,23 @@ void SimulationData::Deserialize(File& file, endian::Endianness endianness) {
   }
   for (size_t k = 0; k < multi_scatters; k++) {
     rays_.emplace_back();
-    uint32_t num = 0;
-    file.Read(&num);
-    if (need_swap) {
-      endian::ByteSwap::Swap(&num);
-    }
+    auto num = read_idx();
+    rays_.back().reserve(num);
     for (size_t i = 0; i < num; i++) {
-      uint32_t chunk_id = 0;
-      uint32_t obj_id = 0;
-      file.Read(&chunk_id);
-      file.Read(&obj_id);
-      if (need_swap) {
-        endian::ByteSwap::Swap(&chunk_id);
-        endian::ByteSwap::Swap(&obj_id);
+      rays_.back().emplace_back(ray_info_pool->GetPointerFromSerializeData(idx[i * 2 + 0], idx[i * 2 + 1]));
+    }
+  }
+
+  // Whole paths of previous scatters are not stored. Rebuild them in scatter order, so that the recorder of
+  // previous scatter is ready when used. Only live rays are visited.
+  for (const auto& rays : rays_) {
+    for (auto* r : rays) {
+      const auto* prev_r = r->prev_ray_segment;
+      if (prev_r && prev_r->root_ctx) {
+        r->prev_path_recorder = GetWholePathRecorder(prev_r);
+      } else {
+        r->prev_path_recorder.Clear();
       }
-      rays_.back().emplace_back(ray_info_pool->GetPointerFromSerializeData(chunk_id, obj_id));
     }
   }
 
@@ -529,22 +734,10 @@ void SimulationData::Deserialize(File& file, endian::Endianness endianness) {
   }
   for (size_t k = 0; k < multi_scatters; k++) {
     exit_ray_segments_.emplace_back();
-    uint32_t num = 0;
-    file.Read(&num);
-    if (need_swap) {
-      endian::ByteSwap::Swap(&num);
-    }
+    auto num = read_idx();
+    exit_ray_segments_.back().reserve(num);
     for (size_t i = 0; i < num; i++) {
-      uint32_t chunk_id = 0;
-      uint32_t obj_id = 0;
-      file.Read(&chunk_id);
-      file.Read(&obj_id);
-      if (need_swap) {
-        endian::ByteSwap::Swap(&chunk_id);
-        endian::ByteSwap::Swap(&obj_id);
-      }
-      auto* r = ray_seg_pool->GetPointerFromSerializeData(chunk_id, obj_id);
-      exit_ray_segments_.back().emplace_back(r);
+      exit_ray_segments_.back().emplace_back(ray_seg_pool->GetPointerFromSerializeData(idx[i * 2 + 0], idx[i * 2 + 1]));
     }
   }
   for (size_t k = 0; k < multi_scatters; k++) {
@@ -558,7 +751,38 @@ void SimulationData::Deserialize(File& file, endian::Endianness endianness) {
 }
 
 
-Simulator::BufferData::BufferData() : pt{}, dir{}, w{}, face_id{}, ray_seg{}, ray_num(0) {}
+namespace {
+
+template <class T>
+T* AllocateAligned(size_t num, size_t alignment) {
+  return static_cast<T*>(::operator new[](num * sizeof(T), std::align_val_t{ alignment }));
+}
+
+
+template <class T>
+void DeleteAligned(T* ptr, size_t alignment) {
+  ::operator delete[](ptr, std::align_val_t{ alignment });
+}
+
+
+// Sub-streams of RandomStream, for different stages on the same ray.
+constexpr uint32_t kSunRayStream = 0;
+constexpr uint32_t kEntryRayStream = 1;
+constexpr uint32_t kMultiScatterStream = 2;
+constexpr uint32_t kShuffleStream = 3;
+constexpr uint32_t kEntryFaceStream = 4;
+
+
+// Grain of stream compaction. It is independent of work stealing, so results keep the same order.
+size_t GetCompactionGrain(size_t num, size_t pool_size) {
+  auto chunk_num = std::max(pool_size * ThreadingPool::kDefaultChunksPerWorker, static_cast<size_t>(1));
+  return std::max((num + chunk_num - 1) / chunk_num, static_cast<size_t>(1));
+}
+
+}  // namespace
+
+
+Simulator::BufferData::BufferData() : pt{}, dir{}, w{}, face_id{}, ray_seg{}, exit_ray_seg(nullptr), ray_num(0) {}
 
 
 Simulator::BufferData::~BufferData() {
@@ -570,19 +794,23 @@ void Simulator::BufferData::Clear() {
   for (int i = 0; i < 2; i++) {
     DeleteBuffer(i);
   }
+  DeleteAligned(exit_ray_seg, kAlignment);
+  exit_ray_seg = nullptr;
   ray_num = 0;
 }
 
 
 void Simulator::BufferData::DeleteBuffer(int idx) {
-  delete[] pt[idx];
-  delete[] dir[idx];
-  delete[] w[idx];
-  delete[] face_id[idx];
-  delete[] ray_seg[idx];
-
-  pt[idx] = nullptr;
-  dir[idx] = nullptr;
+  for (int j = 0; j < 3; j++) {
+    DeleteAligned(pt[idx][j], kAlignment);
+    DeleteAligned(dir[idx][j], kAlignment);
+    pt[idx][j] = nullptr;
+    dir[idx][j] = nullptr;
+  }
+  DeleteAligned(w[idx], kAlignment);
+  DeleteAligned(face_id[idx], kAlignment);
+  DeleteAligned(ray_seg[idx], kAlignment);
+
   w[idx] = nullptr;
   face_id[idx] = nullptr;
   ray_seg[idx] = nullptr;
@@ -591,16 +819,22 @@ void Simulator::BufferData::DeleteBuffer(int idx) {
 
 void Simulator::BufferData::Allocate(size_t ray_number) {
   for (int i = 0; i < 2; i++) {
-    auto* tmp_pt = new float[ray_number * 3];
-    auto* tmp_dir = new float[ray_number * 3];
-    auto* tmp_w = new float[ray_number];
-    auto* tmp_face_id = new int[ray_number];
-    auto* tmp_ray_seg = new RaySegment*[ray_number];
+    float* tmp_pt[3];
+    float* tmp_dir[3];
+    for (int j = 0; j < 3; j++) {
+      tmp_pt[j] = AllocateAligned<float>(ray_number, kAlignment);
+      tmp_dir[j] = AllocateAligned<float>(ray_number, kAlignment);
+    }
+    auto* tmp_w = AllocateAligned<float>(ray_number, kAlignment);
+    auto* tmp_face_id = AllocateAligned<int>(ray_number, kAlignment);
+    auto* tmp_ray_seg = AllocateAligned<RaySegment*>(ray_number, kAlignment);
 
-    if (pt[i]) {
+    if (w[i]) {
       size_t n = std::min(this->ray_num, ray_number);
-      std::memcpy(tmp_pt, pt[i], sizeof(float) * 3 * n);
-      std::memcpy(tmp_dir, dir[i], sizeof(float) * 3 * n);
+      for (int j = 0; j < 3; j++) {
+        std::memcpy(tmp_pt[j], pt[i][j], sizeof(float) * n);
+        std::memcpy(tmp_dir[j], dir[i][j], sizeof(float) * n);
+      }
       std::memcpy(tmp_w, w[i], sizeof(float) * n);
       std::memcpy(tmp_face_id, face_id[i], sizeof(int) * n);
       std::memcpy(tmp_ray_seg, ray_seg[i], sizeof(void*) * n);
@@ -608,12 +842,16 @@ void Simulator::BufferData::Allocate(size_t ray_number) {
       DeleteBuffer(i);
     }
 
-    pt[i] = tmp_pt;
-    dir[i] = tmp_dir;
+    for (int j = 0; j < 3; j++) {
+      pt[i][j] = tmp_pt[j];
+      dir[i][j] = tmp_dir[j];
+    }
     w[i] = tmp_w;
     face_id[i] = tmp_face_id;
     ray_seg[i] = tmp_ray_seg;
   }
+  DeleteAligned(exit_ray_seg, kAlignment);
+  exit_ray_seg = AllocateAligned<RaySegment*>(ray_number, kAlignment);
   this->ray_num = ray_number;
 }
 
@@ -622,17 +860,17 @@ void Simulator::BufferData::Allocate(size_t ray_number) {
 void Simulator::BufferData::Print() {
   LOG_DEBUG("pt[0]                    dir[0]                   w[0]");
   for (decltype(ray_num) i = 0; i < ray_num; i++) {
-    LOG_DEBUG("%+.4f,%+.4f,%+.4f  %+.4f,%+.4f,%+.4f  %+.4f",            //
-              pt[0][i * 3 + 0], pt[0][i * 3 + 1], pt[0][i * 3 + 2],     // pt
-              dir[0][i * 3 + 0], dir[0][i * 3 + 1], dir[0][i * 3 + 2],  // dir
+    LOG_DEBUG("%+.4f,%+.4f,%+.4f  %+.4f,%+.4f,%+.4f  %+.4f",  //
+              pt[0][0][i], pt[0][1][i], pt[0][2][i],          // pt
+              dir[0][0][i], dir[0][1][i], dir[0][2][i],       // dir
               w[0][i]);
   }
 
   LOG_DEBUG("pt[1]                    dir[1]                   w[1]");
   for (decltype(ray_num) i = 0; i < ray_num; i++) {
-    LOG_DEBUG("%+.4f,%+.4f,%+.4f  %+.4f,%+.4f,%+.4f  %+.4f",            //
-              pt[1][i * 3 + 0], pt[1][i * 3 + 1], pt[1][i * 3 + 2],     // pt
-              dir[1][i * 3 + 0], dir[1][i * 3 + 1], dir[1][i * 3 + 2],  // dir
+    LOG_DEBUG("%+.4f,%+.4f,%+.4f  %+.4f,%+.4f,%+.4f  %+.4f",  //
+              pt[1][0][i], pt[1][1][i], pt[1][2][i],          // pt
+              dir[1][0][i], dir[1][1][i], dir[1][2][i],       // dir
               w[1][i]);
   }
 }
@@ -673,12 +911,20 @@ void Simulator::EntryRayData::Allocate(size_t ray_number) {
 
 
 Simulator::Simulator(ProjectContextPtr context)
-    : context_(std::move(context)), threading_pool_(ThreadingPool::CreatePool()), current_wavelength_index_(-1),
-      total_ray_num_(0), active_ray_num_(0), buffer_size_(0), entry_ray_offset_(0) {
+    : context_(std::move(context)), threading_pool_(ThreadingPool::GetDefaultPool()), tracing_data_(nullptr),
+      current_wavelength_index_(-1), total_ray_num_(0), active_ray_num_(0), buffer_size_(0), entry_ray_offset_(0),
+      scatter_idx_(0), seed_(RandomStream::GetDefaultSeed()), run_idx_(0), run_seed_(seed_) {
   simulation_ray_data_.SetThreadingPool(threading_pool_);
 }
 
 
+Simulator::~Simulator() {
+  if (run_future_.valid()) {
+    run_future_.wait();
+  }
+}
+
+
 void Simulator::SetCurrentWavelengthIndex(int index) {
   if (index < 0 || static_cast<size_t>(index) >= context_->wavelengths_.size()) {
     current_wavelength_index_ = -1;
@@ -692,21 +938,65 @@ void Simulator::SetCurrentWavelengthIndex(int index) {
 void Simulator::SetThreadingPool(ThreadingPoolPtr threading_pool) {
   threading_pool_ = std::move(threading_pool);
   simulation_ray_data_.SetThreadingPool(threading_pool_);
+  if (back_simulation_ray_data_) {
+    back_simulation_ray_data_->SetThreadingPool(threading_pool_);
+  }
+}
+
+
+void Simulator::SetSeed(uint32_t seed) {
+  WaitFinish();
+  seed_ = seed;
+  run_idx_ = 0;
 }
 
 
 // Start simulation
 void Simulator::Run() {
+  WaitFinish();
+  NextRun();
+  Trace(&simulation_ray_data_);
+}
+
+
+void Simulator::RunAsync() {
+  WaitFinish();
+  if (!back_simulation_ray_data_) {
+    back_simulation_ray_data_ = std::make_unique<SimulationData>();
+    back_simulation_ray_data_->SetThreadingPool(threading_pool_);
+  }
+  NextRun();
+  run_future_ = std::async(std::launch::async, [this] { Trace(back_simulation_ray_data_.get()); });
+}
+
+
+void Simulator::WaitFinish() {
+  if (!run_future_.valid()) {
+    return;
+  }
+  run_future_.get();
+  std::swap(simulation_ray_data_, *back_simulation_ray_data_);
+}
+
+
+// Each run draws random numbers with its own seed. Called before a run starts, so that a background run is not
+// affected.
+void Simulator::NextRun() {
+  run_seed_ = RandomStream::GetRunSeed(seed_, run_idx_);
+  run_idx_++;
+}
+
+
+// Trace rays into data. All ray segments and ray infos are allocated from its storage.
+void Simulator::Trace(SimulationData* data) {
 #ifndef FOR_TEST
   if (context_->GetInitRayNum() < ProjectContext::kMinInitRayNum) {
     return;
   }
 #endif
 
-  simulation_ray_data_.Clear();
-  RaySegmentPool::GetInstance()->Clear();
-  RayInfoPool::GetInstance()->Clear();
-  IdPool::GetInstance()->Clear();
+  tracing_data_ = data;
+  tracing_data_->Clear();
   entry_ray_data_.Clear();
   entry_ray_offset_ = 0;
 
@@ -714,13 +1004,14 @@ void Simulator::Run() {
     LOG_INFO("NOTE! wavelength is not set!");
     return;
   }
-  simulation_ray_data_.wavelength_info_ = context_->wavelengths_[current_wavelength_index_];
+  tracing_data_->wavelength_info_ = context_->wavelengths_[current_wavelength_index_];
 
   InitSunRays();
 
   const auto& multi_scatter_info = context_->multi_scatter_info_;
   for (size_t i = 0; i < multi_scatter_info.size(); i++) {
-    simulation_ray_data_.PrepareNewScatter(total_ray_num_);
+    scatter_idx_ = static_cast<uint32_t>(i);
+    tracing_data_->PrepareNewScatter(total_ray_num_);
 
     for (const auto& c : multi_scatter_info[i]->GetCrystalInfo()) {
       active_ray_num_ = static_cast<size_t>(c.population * total_ray_num_);
@@ -729,9 +1020,14 @@ void Simulator::Run() {
         buffer_size_ = total_ray_num_ * kBufferSizeFactor;
         buffer_.Allocate(buffer_size_);
       }
-      InitEntryRays(context_->GetCrystalContext(c.crystal_id));
+      const auto* crystal_ctx = context_->GetCrystalContext(c.crystal_id);
+      InitEntryRays(crystal_ctx);
       entry_ray_offset_ += active_ray_num_;
-      TraceRays(context_->GetCrystalContext(c.crystal_id), context_->GetRayPathFilter(c.filter_id));
+
+      // Filters in context are shared by all simulators. Apply symmetry on a copy.
+      auto filter = context_->GetRayPathFilter(c.filter_id)->MakeCopy();
+      filter->ApplySymmetry(crystal_ctx);
+      TraceRays(crystal_ctx, filter.get());
     }
 
     if (i != multi_scatter_info.size() - 1) {
@@ -752,7 +1048,9 @@ void Simulator::InitSunRays() {
     entry_ray_data_.Allocate(total_ray_num_);
   }
 
-  RandomSampler::SampleSphericalPointsCart(sun_ray_dir, sun_r, entry_ray_data_.ray_dir, entry_ray_data_.ray_num);
+  RandomStream rng{ run_seed_, static_cast<uint32_t>(tracing_data_->wavelength_info_.wavelength), 0, 0,
+                    kSunRayStream };
+  RandomSampler::SampleSphericalPointsCart(&rng, sun_ray_dir, sun_r, entry_ray_data_.ray_dir, entry_ray_data_.ray_num);
   for (size_t i = 0; i < entry_ray_data_.ray_num; i++) {
     entry_ray_data_.ray_seg[i] = nullptr;
   }
@@ -766,65 +1064,98 @@ void Simulator::InitEntryRays(const CrystalContext* ctx) {
   const auto* crystal = ctx->GetCrystal();
   auto crystal_id = ctx->GetId();
   const auto* face_vertex = crystal->GetFaceVertex();
-  auto total_face = ctx->GetCrystal()->TotalFaces();
 
-  auto* ray_seg_pool = RaySegmentPool::GetInstance();
-  auto* ray_info_pool = RayInfoPool::GetInstance();
+  auto* ray_seg_pool = &tracing_data_->GetRayStorage()->ray_seg_pool;
+  auto* ray_info_pool = &tracing_data_->GetRayStorage()->ray_info_pool;
 
-  std::unique_ptr<float[]> axis_rot{ new float[active_ray_num_ * 3] };
+  std::unique_ptr<float[]> axis_rot{ new float[active_ray_num_ * 3] };  // lon, lat, roll for each ray
   auto* axis_rot_ptr = axis_rot.get();
-  std::unique_ptr<float[]> face_prob_buf{ new float[total_face * active_ray_num_] };
-  auto* face_prob_buf_ptr = face_prob_buf.get();
-  threading_pool_->CommitRangeStepJobsAndWait(0, active_ray_num_, [=](int /* thread_id */, int i) {
-    InitMainAxis(ctx, axis_rot_ptr + i * 3);
-    RotateZ(axis_rot_ptr + i * 3, entry_ray_data_.ray_dir + (i + entry_ray_offset_) * 3, buffer_.dir[0] + i * 3);
-
-    buffer_.face_id[0][i] = ctx->RandomSampleFace(buffer_.dir[0] + i * 3, face_prob_buf_ptr + i * total_face);
-    RandomSampler::SampleTriangularPoints(face_vertex + buffer_.face_id[0][i] * 9, buffer_.pt[0] + i * 3);
+  std::unique_ptr<float[]> axis_sph{ new float[active_ray_num_ * 3] };  // SoA, lon[N], lat[N], roll[N]
+  auto* axis_sph_ptr = axis_sph.get();
+  auto seed = run_seed_;
+  auto wavelength = static_cast<uint32_t>(tracing_data_->wavelength_info_.wavelength);
+  threading_pool_->ParallelFor(0, active_ray_num_, 0, [=](int /* thread_id */, int start, int end) {
+    RandomStreamBatch rng{
+      seed, wavelength, scatter_idx_, entry_ray_offset_ + start, static_cast<size_t>(end - start), kEntryRayStream
+    };
+
+    float* axis[3]{ axis_sph_ptr + start, axis_sph_ptr + active_ray_num_ + start,
+                    axis_sph_ptr + active_ray_num_ * 2 + start };
+    InitMainAxis(&rng, ctx, axis);
+    for (int i = start; i < end; i++) {
+      float tmp_dir[3];
+      auto* curr_axis = axis_rot_ptr + i * 3;
+      for (int j = 0; j < 3; j++) {
+        curr_axis[j] = axis[j][i - start];
+      }
+      RotateZ(curr_axis, entry_ray_data_.ray_dir + (i + entry_ray_offset_) * 3, tmp_dir);
+      for (int j = 0; j < 3; j++) {
+        buffer_.dir[0][j][i] = tmp_dir[j];
+      }
+    }
 
-    auto* prev_r = entry_ray_data_.ray_seg[entry_ray_offset_ + i];
-    buffer_.w[0][i] = prev_r ? prev_r->w : 1.0f;
+    const float* dir[3]{ buffer_.dir[0][0] + start, buffer_.dir[0][1] + start, buffer_.dir[0][2] + start };
+    RandomStreamBatch face_rng{
+      seed, wavelength, scatter_idx_, entry_ray_offset_ + start, static_cast<size_t>(end - start), kEntryFaceStream
+    };
+    ctx->RandomSampleFace(&face_rng, dir, buffer_.face_id[0] + start);
+    float* pt[3]{ buffer_.pt[0][0] + start, buffer_.pt[0][1] + start, buffer_.pt[0][2] + start };
+    RandomSampler::SampleTriangularPoints(&rng, face_vertex, buffer_.face_id[0] + start, pt);
+
+    for (int i = start; i < end; i++) {
+      float tmp_pt[3]{ buffer_.pt[0][0][i], buffer_.pt[0][1][i], buffer_.pt[0][2][i] };
+      float tmp_dir[3]{ buffer_.dir[0][0][i], buffer_.dir[0][1][i], buffer_.dir[0][2][i] };
+      auto* prev_r = entry_ray_data_.ray_seg[entry_ray_offset_ + i];
+      buffer_.w[0][i] = prev_r ? prev_r->w : 1.0f;
+
+      auto* r = ray_seg_pool->GetLocalObject(tmp_pt, tmp_dir, buffer_.w[0][i], buffer_.face_id[0][i]);
+      buffer_.ray_seg[0][i] = r;
+      r->root_ctx = ray_info_pool->GetLocalObject(r, crystal_id, axis_rot_ptr + i * 3);
+      r->root_ctx->prev_ray_segment = prev_r;
+      if (prev_r) {
+        r->root_ctx->prev_path_recorder = GetWholePathRecorder(prev_r);
+      }
+      r->recorder << crystal_id;
+    }
   });
 
   for (size_t i = 0; i < active_ray_num_; i++) {
-    auto* prev_r = entry_ray_data_.ray_seg[entry_ray_offset_ + i];
-    auto* r =
-        ray_seg_pool->GetObject(buffer_.pt[0] + i * 3, buffer_.dir[0] + i * 3, buffer_.w[0][i], buffer_.face_id[0][i]);
-    buffer_.ray_seg[0][i] = r;
-    r->root_ctx = ray_info_pool->GetObject(r, crystal_id, axis_rot_ptr + i * 3);
-    r->root_ctx->prev_ray_segment = prev_r;
-    r->recorder << crystal_id;
-    simulation_ray_data_.AddRay(r->root_ctx);
+    tracing_data_->AddRay(buffer_.ray_seg[0][i]->root_ctx);
   }
 }
 
 
 // Init crystal main axis.
 // Random sample points on a sphere with given parameters.
-void Simulator::InitMainAxis(const CrystalContext* ctx, float* axis) {
-  auto* rng = RandomNumberGenerator::GetInstance();
-
+void Simulator::InitMainAxis(RandomStreamBatch* rng, const CrystalContext* ctx, float* const* axis) {
   auto axis_dist = ctx->GetAxisDistribution();
   if (axis_dist.latitude_dist.type == DistributionType::kUniform) {
     // Random sample on full sphere, ignore other parameters.
-    RandomSampler::SampleSphericalPointsSph(axis);
+    RandomSampler::SampleSphericalPointsSph(rng, axis);
   } else {
-    RandomSampler::SampleSphericalPointsSph(axis_dist, axis);
+    RandomSampler::SampleSphericalPointsSph(rng, axis_dist, axis);
   }
 
+  auto num = rng->Size();
+  auto* roll = axis[2];
   if (axis_dist.roll_dist.type == DistributionType::kUniform) {
     // Random roll, ignore other parameters.
-    axis[2] = rng->GetUniform() * 2 * math::kPi;
+    rng->GetUniform(roll);
+    for (size_t i = 0; i < num; i++) {
+      roll[i] = roll[i] * 2 * math::kPi;
+    }
   } else {
-    axis[2] =
-        rng->Get(axis_dist.roll_dist.type, axis_dist.roll_dist.mean, axis_dist.roll_dist.std) * math::kDegreeToRad;
+    rng->Get(axis_dist.roll_dist.type, axis_dist.roll_dist.mean, axis_dist.roll_dist.std, roll);
+    for (size_t i = 0; i < num; i++) {
+      roll[i] *= math::kDegreeToRad;
+    }
   }
 }
 
 
 // Restore and shuffle resulted rays, and fill into dir[0].
 void Simulator::PrepareMultiScatterRays(float prob) {
-  auto last_exit_ray_seg_num = simulation_ray_data_.GetLastExitRaySegments().size();
+  auto last_exit_ray_seg_num = tracing_data_->GetLastExitRaySegments().size();
   if (buffer_size_ < last_exit_ray_seg_num * 2) {
     LOG_DEBUG("Allocate buffer in PrepareMultiScatterRays()");
     buffer_size_ = last_exit_ray_seg_num * 2;
@@ -834,27 +1165,31 @@ void Simulator::PrepareMultiScatterRays(float prob) {
     entry_ray_data_.Allocate(last_exit_ray_seg_num);
   }
 
-  auto* rng = RandomNumberGenerator::GetInstance();
+  auto seed = run_seed_;
+  auto wavelength = static_cast<uint32_t>(tracing_data_->wavelength_info_.wavelength);
+  const auto& last_exit_ray_segments = tracing_data_->GetLastExitRaySegments();
   size_t idx = 0;
-  for (const auto r : simulation_ray_data_.GetLastExitRaySegments()) {
+  for (size_t i = 0; i < last_exit_ray_segments.size(); i++) {
+    auto* r = last_exit_ray_segments[i];
     if (r->w < context_->kScatMinW) {
       r->state = RaySegmentState::kAirAbsorbed;
       continue;
     }
-    if (rng->GetUniform() > prob) {
+    RandomStream rng{ seed, wavelength, scatter_idx_, i, kMultiScatterStream };
+    if (rng.GetUniform() > prob) {
       continue;
     }
     r->state = RaySegmentState::kContinued;
-    const auto* axis_rot = r->root_ctx->main_axis.val();
-    RotateZBack(axis_rot, r->dir.val(), entry_ray_data_.ray_dir + idx * 3);
+    RotateBackWithMatrix(r->root_ctx->axis_mat, r->dir.val(), entry_ray_data_.ray_dir + idx * 3);
     entry_ray_data_.ray_seg[idx] = r;
     idx++;
   }
   total_ray_num_ = idx;
 
   // Shuffle
+  RandomStream rng{ seed, wavelength, scatter_idx_, 0, kShuffleStream };
   for (size_t i = 0; i < total_ray_num_; i++) {
-    int tmp_idx = RandomSampler::SampleInt(static_cast<int>(total_ray_num_ - i));
+    int tmp_idx = RandomSampler::SampleInt(&rng, static_cast<int>(total_ray_num_ - i));
 
     float tmp_dir[3];
     std::memcpy(tmp_dir, entry_ray_data_.ray_dir + (i + tmp_idx) * 3, sizeof(float) * 3);
@@ -870,23 +1205,29 @@ void Simulator::PrepareMultiScatterRays(float prob) {
 
 // Trace rays.
 // Start from dir[0] and pt[0].
-void Simulator::TraceRays(const CrystalContext* crystal_ctx, AbstractRayPathFilter* filter) {
+void Simulator::TraceRays(const CrystalContext* crystal_ctx, const AbstractRayPathFilter* filter) {
   const auto* crystal = crystal_ctx->GetCrystal();
   int max_recursion_num = context_->GetRayHitNum();
-  auto n = static_cast<float>(IceRefractiveIndex::Get(simulation_ray_data_.wavelength_info_.wavelength));
+  auto n = static_cast<float>(IceRefractiveIndex::Get(tracing_data_->wavelength_info_.wavelength));
   for (int i = 0; i < max_recursion_num; i++) {
     if (buffer_size_ < active_ray_num_ * 2) {
       LOG_DEBUG("Allocate buffer in TraceRays()");
       buffer_size_ = active_ray_num_ * kBufferSizeFactor;
       buffer_.Allocate(buffer_size_);
     }
-    threading_pool_->CommitRangeStepJobsAndWait(0, active_ray_num_, [=](int /* thread_id */, int i) {
-      Optics::HitSurface(crystal, n, 1,                                                        //
-                         buffer_.dir[0] + i * 3, buffer_.face_id[0] + i, buffer_.w[0] + i,     //
-                         buffer_.dir[1] + i * 6, buffer_.w[1] + i * 2);                        //
-      Optics::Propagate(crystal, 1 * 2, buffer_.pt[0] + i * 3,                                 //
-                        buffer_.dir[1] + i * 6, buffer_.w[1] + i * 2, buffer_.face_id[0] + i,  //
-                        buffer_.pt[1] + i * 6, buffer_.face_id[1] + i * 2);                    //
+    threading_pool_->ParallelFor(0, active_ray_num_, 0, [=](int /* thread_id */, int start, int end) {
+      const float* pt_in[3]{ buffer_.pt[0][0] + start, buffer_.pt[0][1] + start, buffer_.pt[0][2] + start };
+      const float* dir_in[3]{ buffer_.dir[0][0] + start, buffer_.dir[0][1] + start, buffer_.dir[0][2] + start };
+      float* pt_out[3]{ buffer_.pt[1][0] + start * 2, buffer_.pt[1][1] + start * 2, buffer_.pt[1][2] + start * 2 };
+      float* dir_out[3]{ buffer_.dir[1][0] + start * 2, buffer_.dir[1][1] + start * 2,
+                         buffer_.dir[1][2] + start * 2 };
+      size_t num = end - start;
+      Optics::HitSurfacePacket(crystal, n, num,                                         //
+                               dir_in, buffer_.face_id[0] + start, buffer_.w[0] + start,  //
+                               dir_out, buffer_.w[1] + start * 2);                        //
+      Optics::PropagatePacket(crystal, num * 2, pt_in,                                       //
+                              dir_out, buffer_.w[1] + start * 2, buffer_.face_id[0] + start,  //
+                              pt_out, buffer_.face_id[1] + start * 2);                        //
     });
     StoreRaySegments(crystal_ctx, filter);
     RefreshBuffer();  // active_ray_num_ is updated.
@@ -895,63 +1236,116 @@ void Simulator::TraceRays(const CrystalContext* crystal_ctx, AbstractRayPathFilt
 
 
 // Save rays
-void Simulator::StoreRaySegments(const CrystalContext* crystal_ctx, AbstractRayPathFilter* filter) {
+// Exit ray segments are compacted per chunk into buffer_.exit_ray_seg, and then scattered to
+// tracing_data_, so they keep the same order regardless of threads.
+void Simulator::StoreRaySegments(const CrystalContext* crystal_ctx, const AbstractRayPathFilter* filter) {
   const auto* crystal = crystal_ctx->GetCrystal();
-  filter->ApplySymmetry(crystal_ctx);
-  auto* ray_pool = RaySegmentPool::GetInstance();
-  auto* r_array = ray_pool->AllocateObjectArray(active_ray_num_ * 2);
-  for (size_t i = 0; i < active_ray_num_ * 2; i++) {
-    if (buffer_.w[1][i] <= 0) {  // Refractive rays in total reflection case
-      continue;
-    }
+  auto* ray_pool = &tracing_data_->GetRayStorage()->ray_seg_pool;
+
+  auto num = active_ray_num_ * 2;
+  auto grain = GetCompactionGrain(num, threading_pool_->GetPoolSize());
+  auto chunk_num = (num + grain - 1) / grain;
+  compact_offset_.assign(chunk_num + 1, 0);
+  auto* offset = compact_offset_.data();
+
+  // 1. Make ray segments, and count exit ray segments for each chunk.
+  threading_pool_->ParallelFor(0, num, grain, [=](int /* thread_id */, int start, int end) {
+    size_t exit_num = 0;
+    for (int i = start; i < end; i++) {
+      if (buffer_.w[1][i] <= 0) {  // Refractive rays in total reflection case
+        buffer_.ray_seg[1][i] = nullptr;
+        continue;
+      }
 
-    auto* r = new (r_array + i)
-        RaySegment(buffer_.pt[0] + i / 2 * 3, buffer_.dir[1] + i * 3, buffer_.w[1][i], buffer_.face_id[0][i / 2]);
-    if (buffer_.face_id[1][i] < 0) {
-      r->state = RaySegmentState::kFinished;
-    }
-    if (r->w < ProjectContext::kPropMinW) {
-      r->state = RaySegmentState::kCrystalAbsorbed;
-    }
+      float tmp_pt[3]{ buffer_.pt[0][0][i / 2], buffer_.pt[0][1][i / 2], buffer_.pt[0][2][i / 2] };
+      float tmp_dir[3]{ buffer_.dir[1][0][i], buffer_.dir[1][1][i], buffer_.dir[1][2][i] };
+      auto* r = ray_pool->GetLocalObject(tmp_pt, tmp_dir, buffer_.w[1][i], buffer_.face_id[0][i / 2]);
+      if (buffer_.face_id[1][i] < 0) {
+        r->state = RaySegmentState::kFinished;
+      }
+      if (r->w < ProjectContext::kPropMinW) {
+        r->state = RaySegmentState::kCrystalAbsorbed;
+      }
 
-    auto* prev_ray_seg = buffer_.ray_seg[0][i / 2];
-    if (i % 2 == 0) {
-      prev_ray_seg->next_reflect = r;
-    } else {
-      prev_ray_seg->next_refract = r;
-    }
-    r->prev = prev_ray_seg;
-    r->recorder = prev_ray_seg->recorder;
-    r->recorder << crystal->FaceNumber(r->face_id);
-    if (r->state == RaySegmentState::kFinished) {
-      r->recorder << kInvalidId;
-    }
-    r->root_ctx = prev_ray_seg->root_ctx;
-    buffer_.ray_seg[1][i] = r;
+      auto* prev_ray_seg = buffer_.ray_seg[0][i / 2];
+      if (i % 2 == 0) {
+        prev_ray_seg->next_reflect = r;
+      } else {
+        prev_ray_seg->next_refract = r;
+      }
+      r->prev = prev_ray_seg;
+      r->recorder = prev_ray_seg->recorder;
+      r->recorder << crystal->FaceNumber(r->face_id);
+      if (r->state == RaySegmentState::kFinished) {
+        r->recorder << kInvalidId;
+      }
+      r->root_ctx = prev_ray_seg->root_ctx;
+      buffer_.ray_seg[1][i] = r;
 
-    if (r->state == RaySegmentState::kFinished && filter->Filter(crystal, r)) {
-      simulation_ray_data_.AddExitRaySegment(r);
+      if (r->state == RaySegmentState::kFinished && filter->Filter(crystal, r)) {
+        buffer_.exit_ray_seg[start + exit_num] = r;
+        exit_num++;
+      }
     }
-  }
+    offset[start / grain + 1] = exit_num;
+  });
+
+  // 2. Exclusive scan
+  std::partial_sum(offset, offset + chunk_num + 1, offset);
+
+  // 3. Scatter
+  auto** exit_ray_seg = tracing_data_->AppendExitRaySegments(offset[chunk_num]);
+  threading_pool_->ParallelFor(0, num, grain, [=](int /* thread_id */, int start, int /* end */) {
+    auto c = start / grain;
+    std::copy(buffer_.exit_ray_seg + start, buffer_.exit_ray_seg + start + (offset[c + 1] - offset[c]),
+              exit_ray_seg + offset[c]);
+  });
 }
 
 
 // Squeeze data, copy into another buffer_ (from buf[1] to buf[0])
 // Update active_ray_num_.
 void Simulator::RefreshBuffer() {
-  size_t idx = 0;
-  for (size_t i = 0; i < active_ray_num_ * 2; i++) {
-    if (buffer_.face_id[1][i] < 0 || buffer_.w[1][i] < ProjectContext::kPropMinW) {
-      continue;
+  auto num = active_ray_num_ * 2;
+  auto grain = GetCompactionGrain(num, threading_pool_->GetPoolSize());
+  auto chunk_num = (num + grain - 1) / grain;
+  compact_offset_.assign(chunk_num + 1, 0);
+  auto* offset = compact_offset_.data();
+
+  auto is_active = [=](size_t i) {
+    return buffer_.face_id[1][i] >= 0 && buffer_.w[1][i] >= ProjectContext::kPropMinW;
+  };
+
+  // 1. Count active rays for each chunk.
+  threading_pool_->ParallelFor(0, num, grain, [=](int /* thread_id */, int start, int end) {
+    size_t active_num = 0;
+    for (int i = start; i < end; i++) {
+      active_num += is_active(i) ? 1 : 0;
     }
-    std::memcpy(buffer_.pt[0] + idx * 3, buffer_.pt[1] + i * 3, sizeof(float) * 3);
-    std::memcpy(buffer_.dir[0] + idx * 3, buffer_.dir[1] + i * 3, sizeof(float) * 3);
-    buffer_.w[0][idx] = buffer_.w[1][i];
-    buffer_.face_id[0][idx] = buffer_.face_id[1][i];
-    buffer_.ray_seg[0][idx] = buffer_.ray_seg[1][i];
-    idx++;
-  }
-  active_ray_num_ = idx;
+    offset[start / grain + 1] = active_num;
+  });
+
+  // 2. Exclusive scan
+  std::partial_sum(offset, offset + chunk_num + 1, offset);
+
+  // 3. Scatter
+  threading_pool_->ParallelFor(0, num, grain, [=](int /* thread_id */, int start, int end) {
+    auto idx = offset[start / grain];
+    for (int i = start; i < end; i++) {
+      if (!is_active(i)) {
+        continue;
+      }
+      for (int j = 0; j < 3; j++) {
+        buffer_.pt[0][j][idx] = buffer_.pt[1][j][i];
+        buffer_.dir[0][j][idx] = buffer_.dir[1][j][i];
+      }
+      buffer_.w[0][idx] = buffer_.w[1][i];
+      buffer_.face_id[0][idx] = buffer_.face_id[1][i];
+      buffer_.ray_seg[0][idx] = buffer_.ray_seg[1][i];
+      idx++;
+    }
+  });
+  active_ray_num_ = offset[chunk_num];
 }
 
 
@@ -1,12 +1,15 @@
 #ifndef SRC_CORE_SIMULATION_H_
 #define SRC_CORE_SIMULATION_H_
 
+#include <future>
 #include <vector>
 
 #include "context/context.hpp"
 #include "core/crystal.hpp"
 #include "core/optics.hpp"
+#include "io/container.hpp"
 #include "io/serialize.hpp"
+#include "util/obj_pool.hpp"
 #include "util/threading_pool.hpp"
 
 namespace icehalo {
@@ -47,6 +50,79 @@ struct SimpleRayData : public ISerializable {
    * @param endianness
    */
   void Deserialize(File& file, endian::Endianness endianness) override;
+
+  /**
+   * @brief Gets ray data, (x, y, z, w) for each ray.
+   *
+   * It is `buf` normally, or points into a mapped file after SimpleRayData::LoadFromContainer().
+   */
+  const float* GetRayBuffer() const;
+
+  /**
+   * @brief Adds self as sections of a container.
+   *
+   * Data are not copied, so this object must be kept until the container is written.
+   *
+   * @param writer
+   */
+  void AddToContainer(ContainerWriter* writer) const;
+
+  /**
+   * @brief Loads from a container.
+   *
+   * If the container is in native byte order, ray data are not copied. `buf` is released, and
+   * SimpleRayData::GetRayBuffer() points into the mapped file, which is kept alive by this object.
+   *
+   * @param reader
+   * @return false if any section is missing.
+   */
+  bool LoadFromContainer(const ContainerReader& reader);
+
+ private:
+  MappedFilePtr mapped_file_;
+  const float* mapped_buf_;
+};
+
+
+/**
+ * @brief Finished exit rays in world frame, quantized for archiving.
+ *
+ * A ray takes 6 bytes, with its direction in 2 x 16 bits (see EncodeOctahedral()) and its weight in
+ * half precision (see FloatToHalf()), or 14 bytes with its path hash. It is much smaller than the whole
+ * SimulationData, and has everything needed for rendering. Use CompactRayData::Decode() to render it.
+ */
+struct CompactRayData {
+  CompactRayData();
+
+  int wavelength;
+  float wavelength_weight;
+  size_t ray_num;
+  size_t init_ray_num;
+  std::vector<uint16_t> dir;        //!< 2 x uint16 for each ray
+  std::vector<uint16_t> w;          //!< Half precision
+  std::vector<uint64_t> path_hash;  //!< Hash of the whole path. Empty if not collected
+
+  /**
+   * @brief Decodes into (x, y, z, w) for each ray.
+   */
+  SimpleRayData Decode() const;
+
+  /**
+   * @brief Adds self as sections of a container.
+   *
+   * Data are not copied, so this object must be kept until the container is written.
+   *
+   * @param writer
+   */
+  void AddToContainer(ContainerWriter* writer) const;
+
+  /**
+   * @brief Loads from a container.
+   *
+   * @param reader
+   * @return false if any section is missing.
+   */
+  bool LoadFromContainer(const ContainerReader& reader);
 };
 
 
@@ -60,6 +136,15 @@ struct RayCollectionInfo {
 using RayCollectionInfoList = std::vector<RayCollectionInfo>;
 
 
+/**
+ * @brief Ray data of one simulation run.
+ *
+ * Every SimulationData owns its ray storage, so that different simulators (or the front and back data of one
+ * simulator) can be traced and read at the same time. The storage costs nothing until the first ray is added.
+ * Then it grows by chunks of 1M ray segments or ray infos (about 100 MB per chunk), and keeps all chunks until
+ * this SimulationData is destroyed. Hence the peak memory is paid once per instance: a Simulator keeps one
+ * instance, plus another one after its first Simulator::RunAsync().
+ */
 class SimulationData : public ISerializable {
  public:
   SimulationData();
@@ -69,15 +154,41 @@ class SimulationData : public ISerializable {
 
   void SetThreadingPool(ThreadingPoolPtr threading_pool);
 
+  /**
+   * @brief Gets the storage of ray segments and ray infos.
+   *
+   * Every SimulationData owns its storage, which is shared by its copies.
+   */
+  RayStorage* GetRayStorage() const;
+
+  /**
+   * @brief Clears all data, including the ray storage.
+   */
   void Clear();
   void PrepareNewScatter(size_t ray_num);
   void AddRay(RayInfo* ray);
 
   std::tuple<RayCollectionInfo, SimpleRayData> CollectFinalRayData();
+
+  /**
+   * @brief Collects finished exit rays into compact format, for archiving.
+   *
+   * @param with_path_hash Whether to collect the hash of whole path (across all scatters) for every ray.
+   */
+  CompactRayData CollectCompactRayData(bool with_path_hash);
+
   std::tuple<RayCollectionInfoList, SimpleRayData> CollectSplitRayData(const ProjectContextPtr& ctx,
                                                                        const RenderSplitter& splitter);
 
-  void AddExitRaySegment(RaySegment* r);
+  /**
+   * @brief Appends `num` slots to the exit ray segment list of current scatter.
+   *
+   * The caller must fill all slots with finished ray segments, possibly from multiple threads.
+   *
+   * @param num The number of exit ray segments.
+   * @return The first slot.
+   */
+  RaySegment** AppendExitRaySegments(size_t num);
   const std::vector<RaySegment*>& GetLastExitRaySegments() const;
 #ifdef FOR_TEST
   const std::vector<std::vector<RaySegment*>>& GetExitRaySegments() const;
@@ -87,12 +198,10 @@ class SimulationData : public ISerializable {
    * @brief Serialize self to a file.
    *
    * This class only holds pointers to ray segments and ray infos, rather than objects themselves.
-   * To serialize data completely, this method will serialize ray segment pool and ray info
-   * pool first.
+   * To serialize data completely, this method will serialize its ray storage first.
    *
    * The layout of file is:
-   * ray info pool,         // ray info pool
-   * ray seg pool,          // ray seg pool
+   * ray storage,           // see RayStorage::Serialize()
    * uint32,                // multi-scatters, K
    * {
    *   uint32,              // ray numbers, N
@@ -112,10 +221,10 @@ class SimulationData : public ISerializable {
    * @brief Deserialize (load data) from a file.
    *
    * This class only holds pointers to ray segments and ray infos, rather than objects themselves.
-   * To load data correctly, this method will deserialize ray segment pool and ray info
-   * pool first, i.e. it will clear all existing data in ray segment pool and ray info pool.
+   * To load data correctly, this method will deserialize its ray storage first, i.e. it will clear all
+   * existing data in the storage.
    *
-   * @warning It will clear all existing data in ray segment pool and ray info pool.
+   * @warning It will clear all existing data in its ray storage.
    *
    * @param file
    * @param endianness
@@ -127,25 +236,76 @@ class SimulationData : public ISerializable {
   std::tuple<RayCollectionInfoList, SimpleRayData> CollectSplitHaloRayData(const ProjectContextPtr& ctx);
   std::tuple<RayCollectionInfoList, SimpleRayData> CollectSplitFilterRayData(const ProjectContextPtr& ctx,
                                                                              const RenderSplitter& splitter);
-  std::vector<std::vector<size_t>> GenerateIdxList() const;
 
   std::vector<std::vector<RayInfo*>> rays_;
   std::vector<std::vector<RaySegment*>> exit_ray_segments_;
   std::vector<size_t> exit_ray_seg_num_;
   ThreadingPoolPtr threading_pool_;
+  RayStoragePtr ray_storage_;
 };
 
 class Simulator {
  public:
   explicit Simulator(ProjectContextPtr context);
   Simulator(const Simulator& other) = delete;
-  ~Simulator() = default;
+  ~Simulator();
 
   Simulator& operator=(const Simulator& other) = delete;
 
+  /**
+   * @brief Sets wavelength for next run.
+   *
+   * @warning Do not call it when an asynchronous run is not finished. See Simulator::RunAsync().
+   */
   void SetCurrentWavelengthIndex(int index);
   void SetThreadingPool(ThreadingPoolPtr threading_pool);
+
+  /**
+   * @brief Sets random seed, and restarts counting runs.
+   *
+   * Every run (Simulator::Run() or Simulator::RunAsync()) draws random numbers with a new run index, so repeated
+   * runs of the same wavelength trace different rays. Runs after this call are the same as those after another
+   * call with the same seed. Default seed is RandomStream::GetDefaultSeed().
+   */
+  void SetSeed(uint32_t seed);
+
+  /**
+   * @brief Runs simulation, and waits until finished. The result replaces the last one.
+   */
   void Run();
+
+  /**
+   * @brief Starts simulation in background, and returns immediately.
+   *
+   * Simulation data are double buffered. A background run traces rays into the back buffer, with its own ray
+   * storage, so the last result (got by Simulator::GetSimulationRayData()) keeps valid, and can be collected
+   * and rendered at the same time. Call Simulator::WaitFinish() to wait for it and to make its result current.
+   * It is a pipeline, that the collection of one wavelength overlaps with the tracing of next wavelength.
+   *
+   * ~~~{.cpp}
+   * simulator.SetCurrentWavelengthIndex(0);
+   * simulator.RunAsync();
+   * for (size_t i = 0; i < wavelength_num; i++) {
+   *   simulator.WaitFinish();
+   *   const auto& data = simulator.GetSimulationRayData();  // result of wavelength i
+   *   if (i + 1 < wavelength_num) {
+   *     simulator.SetCurrentWavelengthIndex(i + 1);
+   *     simulator.RunAsync();
+   *   }
+   *   // collect and render data.
+   * }
+   * ~~~
+   *
+   * @note The threading pool can be shared with others. See ThreadingPool::ParallelFor().
+   */
+  void RunAsync();
+
+  /**
+   * @brief Waits for the background run to finish, and makes its result current. It does nothing if there is
+   *        no background run.
+   */
+  void WaitFinish();
+
   const SimulationData& GetSimulationRayData();
 
 #ifdef FOR_TEST
@@ -184,11 +344,14 @@ class Simulator {
     void Print();
 #endif
 
-    float* pt[2];
-    float* dir[2];
+    static constexpr size_t kAlignment = 64;
+
+    float* pt[2][3];   // SoA layout, pt[k][0] for x, pt[k][1] for y and pt[k][2] for z
+    float* dir[2][3];  // SoA layout, same as pt
     float* w[2];
     int* face_id[2];
     RaySegment** ray_seg[2];
+    RaySegment** exit_ray_seg;  // Scratch for exit ray segments. Only valid in Simulator::StoreRaySegments()
 
     size_t ray_num;
 
@@ -197,21 +360,26 @@ class Simulator {
   };
 
 
-  static void InitMainAxis(const CrystalContext* ctx, float* axis);
+  static void InitMainAxis(RandomStreamBatch* rng, const CrystalContext* ctx, float* const* axis);
 
+  void NextRun();
+  void Trace(SimulationData* data);
   void InitSunRays();
   void InitEntryRays(const CrystalContext* ctx);
-  void TraceRays(const CrystalContext* crystal_ctx, AbstractRayPathFilter* filter);
+  void TraceRays(const CrystalContext* crystal_ctx, const AbstractRayPathFilter* filter);
   void PrepareMultiScatterRays(float prob);
-  void StoreRaySegments(const CrystalContext* crystal_ctx, AbstractRayPathFilter* filter);
+  void StoreRaySegments(const CrystalContext* crystal_ctx, const AbstractRayPathFilter* filter);
   void RefreshBuffer();
 
   static constexpr int kBufferSizeFactor = 4;
 
   ProjectContextPtr context_;
   ThreadingPoolPtr threading_pool_;
+  std::vector<size_t> compact_offset_;  //!< Per-chunk offsets for stream compaction
 
-  SimulationData simulation_ray_data_;
+  SimulationData simulation_ray_data_;                         //!< The last result
+  std::unique_ptr<SimulationData> back_simulation_ray_data_;  //!< Made by the first background run
+  SimulationData* tracing_data_;                               //!< The one being traced
 
   int current_wavelength_index_;
 
@@ -222,6 +390,13 @@ class Simulator {
   BufferData buffer_;
   EntryRayData entry_ray_data_;
   size_t entry_ray_offset_;
+  uint32_t scatter_idx_;
+
+  uint32_t seed_;
+  uint32_t run_idx_;   //!< Index of next run
+  uint32_t run_seed_;  //!< Seed of current run. See RandomStream::GetRunSeed().
+
+  std::future<void> run_future_;
 };
 
 }  // namespace icehalo
@@ -3,6 +3,7 @@
 #include <opencv2/opencv.hpp>
 
 #include "context/context.hpp"
+#include "io/container.hpp"
 #include "process/render.hpp"
 #include "process/simulation.hpp"
 #include "util/arg_parser.hpp"
@@ -113,10 +114,81 @@ int main(int argc, char* argv[]) {
       split_renderer_candidates.back().SetSunContext(ctx->sun_ctx_);
       renderer_ray_set.emplace_back();
     }
+    ctx->LoadRayPathCache();
+  }
+
+  // Final rays saved in container format (by IceHaloTrace -r) are mapped and rendered in place. Compact rays
+  // (by IceHaloTrace -c) are decoded before rendering. Both are usually saved from the same simulation as data
+  // files, so only one format is used: final rays first, then compact rays, then data files. Split rendering
+  // needs full simulation data, so it always uses data files.
+  auto data_dir = ctx->GetDataDirectory();
+  auto rays_files = icehalo::ListFiles(data_dir.c_str(), ".rays");
+  auto compact_rays_files = icehalo::ListFiles(data_dir.c_str(), ".crays");
+  auto data_files = icehalo::ListDataFiles(data_dir.c_str());
+  const char* data_format = "data files (.bin)";
+  size_t ignored_file_num = 0;
+  if (split_render_ctx || (rays_files.empty() && compact_rays_files.empty())) {
+    ignored_file_num = rays_files.size() + compact_rays_files.size();
+    rays_files.clear();
+    compact_rays_files.clear();
+  } else if (!rays_files.empty()) {
+    data_format = "final rays (.rays)";
+    ignored_file_num = compact_rays_files.size() + data_files.size();
+    compact_rays_files.clear();
+    data_files.clear();
+  } else {
+    data_format = "compact rays (.crays)";
+    ignored_file_num = data_files.size();
+    data_files.clear();
+  }
+  LOG_INFO("Loading %zu files of %s.", rays_files.size() + compact_rays_files.size() + data_files.size(),
+           data_format);
+  if (ignored_file_num > 0) {
+    LOG_WARNING("%zu files of other formats in %s are ignored.", ignored_file_num, data_dir.c_str());
+  }
+
+  for (size_t i = 0; i < rays_files.size(); i++) {
+    auto t0 = std::chrono::system_clock::now();
+    icehalo::ContainerReader reader;
+    icehalo::SimpleRayData ray_data;
+    if (!reader.Open(rays_files[i].c_str()) || !ray_data.LoadFromContainer(reader)) {
+      LOG_ERROR("Cannot load final rays from %s!", rays_files[i].c_str());
+      continue;
+    }
+    auto t1 = std::chrono::system_clock::now();
+    std::chrono::duration<float, std::milli> loading_time = t1 - t0;
+
+    renderer.LoadRayData(static_cast<size_t>(ray_data.wavelength), icehalo::RayCollectionInfo{}, ray_data);
+    auto t2 = std::chrono::system_clock::now();
+    std::chrono::duration<float, std::milli> collecting_time = t2 - t1;
+
+    LOG_INFO(" Mapping data (%zu/%zu): %.2fms. Collecting rays: %.2fms. Total %zu rays, %zu pts", i + 1,
+             rays_files.size(), loading_time.count(), collecting_time.count(), ray_data.init_ray_num,
+             ray_data.buf_ray_num);
+  }
+
+  for (size_t i = 0; i < compact_rays_files.size(); i++) {
+    auto t0 = std::chrono::system_clock::now();
+    icehalo::ContainerReader reader;
+    icehalo::CompactRayData compact_data;
+    if (!reader.Open(compact_rays_files[i].c_str()) || !compact_data.LoadFromContainer(reader)) {
+      LOG_ERROR("Cannot load compact rays from %s!", compact_rays_files[i].c_str());
+      continue;
+    }
+    auto ray_data = compact_data.Decode();
+    auto t1 = std::chrono::system_clock::now();
+    std::chrono::duration<float, std::milli> loading_time = t1 - t0;
+
+    renderer.LoadRayData(static_cast<size_t>(ray_data.wavelength), icehalo::RayCollectionInfo{}, ray_data);
+    auto t2 = std::chrono::system_clock::now();
+    std::chrono::duration<float, std::milli> collecting_time = t2 - t1;
+
+    LOG_INFO(" Decoding data (%zu/%zu): %.2fms. Collecting rays: %.2fms. Total %zu rays, %zu pts", i + 1,
+             compact_rays_files.size(), loading_time.count(), collecting_time.count(), ray_data.init_ray_num,
+             ray_data.buf_ray_num);
   }
 
   icehalo::SimulationData simulation_data;
-  auto data_files = icehalo::ListDataFiles(ctx->GetDataDirectory().c_str());
   for (size_t i = 0; i < data_files.size(); i++) {
     auto t0 = std::chrono::system_clock::now();
     auto& file = data_files[i];
@@ -170,6 +242,7 @@ int main(int argc, char* argv[]) {
       std::snprintf(str_buf, kBufSize, "halo_%03zu.jpg", i);
       cv::imwrite(icehalo::PathJoin(ctx->GetDataDirectory(), str_buf), halo_img);
     }
+    ctx->SaveRayPathCache();
   }
 
   auto t1 = std::chrono::system_clock::now();
@@ -1,6 +1,7 @@
 #include <chrono>
 
 #include "context/context.hpp"
+#include "io/container.hpp"
 #include "process/simulation.hpp"
 #include "util/arg_parser.hpp"
 #include "util/log.hpp"
@@ -10,6 +11,10 @@ int main(int argc, char* argv[]) {
   icehalo::ArgParser parser;
   parser.AddArgument("-v", 0, "verbose", "make output verbose");
   parser.AddArgument("-f", 1, "config-file", "config file");
+  parser.AddArgument("-z", 0, "compress", "compress data files");
+  parser.AddArgument("-r", 0, "final-rays", "also save final rays in container format, for fast rendering");
+  parser.AddArgument("-c", 0, "compact-rays", "also save final rays in compact format, for archiving");
+  parser.AddArgument("-p", 0, "path-hash", "save path hash of every ray in compact format");
   icehalo::ArgParseResult arg_parse_result;
   try {
     arg_parse_result = parser.Parse(argc, argv);
@@ -32,6 +37,11 @@ int main(int argc, char* argv[]) {
   std::chrono::duration<float, std::milli> diff = t - start;
   LOG_INFO("Initialization: %.2fms", diff.count());
 
+  auto compression =
+      arg_parse_result.count("-z") ? icehalo::FileCompression::kLz4Block : icehalo::FileCompression::kNone;
+  bool save_final_rays = arg_parse_result.count("-r") > 0;
+  bool save_compact_rays = arg_parse_result.count("-c") > 0;
+  bool save_path_hash = arg_parse_result.count("-p") > 0;
   char filename[256];
   const auto& wavelengths = context->wavelengths_;
   for (size_t i = 0; i < wavelengths.size(); i++) {
@@ -48,8 +58,31 @@ int main(int argc, char* argv[]) {
     t0 = std::chrono::system_clock::now();
     std::sprintf(filename, "directions_%d_%lli.bin", wl.wavelength, t0.time_since_epoch().count());
     icehalo::File file(context->GetDataDirectory().c_str(), filename);
-    file.Open(icehalo::FileOpenMode::kWrite);
+    file.Open(icehalo::FileOpenMode::kWrite, compression);
     simulator.GetSimulationRayData().Serialize(file, true);
+    file.Close();
+
+    if (save_final_rays) {
+      auto simulation_data = simulator.GetSimulationRayData();
+      auto [ray_info, ray_data] = simulation_data.CollectFinalRayData();
+      std::sprintf(filename, "rays_%d_%lli.rays", wl.wavelength, t0.time_since_epoch().count());
+      icehalo::File rays_file(context->GetDataDirectory().c_str(), filename);
+      rays_file.Open(icehalo::FileOpenMode::kWrite);
+      icehalo::ContainerWriter writer;
+      ray_data.AddToContainer(&writer);
+      writer.Write(rays_file);
+    }
+
+    if (save_compact_rays) {
+      auto simulation_data = simulator.GetSimulationRayData();
+      auto compact_data = simulation_data.CollectCompactRayData(save_path_hash);
+      std::sprintf(filename, "rays_%d_%lli.crays", wl.wavelength, t0.time_since_epoch().count());
+      icehalo::File rays_file(context->GetDataDirectory().c_str(), filename);
+      rays_file.Open(icehalo::FileOpenMode::kWrite);
+      icehalo::ContainerWriter writer;
+      compact_data.AddToContainer(&writer);
+      writer.Write(rays_file);
+    }
 
     t1 = std::chrono::system_clock::now();
     diff = t1 - t0;
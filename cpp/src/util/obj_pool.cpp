@@ -1,5 +1,8 @@
 #include "util/obj_pool.hpp"
 
+#include <algorithm>
+#include <stdexcept>
+
 #include "core/optics.hpp"
 #include "util/log.hpp"
 
@@ -7,6 +10,17 @@ namespace icehalo {
 
 constexpr uint32_t kInvalidIndex = 0xffffffff;
 
+namespace {
+
+// Arenas are thread local, and are tagged with pool epochs. Epochs are unique among all pools, so that a
+// pool created at the address of a destroyed one will never take the stale arenas.
+uint32_t NextArenaEpoch() {
+  static std::atomic_uint32_t next_epoch{ 1 };
+  return next_epoch.fetch_add(1);
+}
+
+}  // namespace
+
 
 template <typename T>
 ObjectPool<T>::~ObjectPool() {
@@ -19,7 +33,8 @@ ObjectPool<T>::~ObjectPool() {
 
 template <typename T>
 void ObjectPool<T>::Clear() {
-  id_ = 0;
+  id_ = objects_.empty() ? kEmptyPoolId : 0;
+  arena_epoch_ = NextArenaEpoch();
   deserialized_chunk_size_ = 0;
 }
 
@@ -55,25 +70,22 @@ T* ObjectPool<T>::GetPointerFromSerializeData(uint32_t chunk_id, uint32_t obj_id
 
 
 template <typename T>
-std::tuple<uint32_t, uint32_t> ObjectPool<T>::GetObjectSerializeIndex(T* obj) {
+std::tuple<uint32_t, uint32_t> ObjectPool<T>::GetObjectSerializeIndex(T* obj) const {
   if (!obj) {
     return { kInvalidIndex, kInvalidIndex };
   }
 
-  uint32_t chunk_id = 0;
-  T* last_chunk = nullptr;
-  for (const auto& chunk : objects_) {
-    if (last_chunk && obj < chunk) {
-      return { chunk_id - 1, static_cast<uint32_t>(obj - last_chunk) };
-    }
-    chunk_id++;
-    last_chunk = chunk;
+  // Chunks are not allocated in address order. Find the last chunk that starts at or before obj.
+  auto iter = std::upper_bound(chunk_index_.begin(), chunk_index_.end(), obj,
+                               [](const T* p, const std::pair<const T*, uint32_t>& c) { return p < c.first; });
+  if (iter == chunk_index_.begin()) {
+    return { kInvalidIndex, kInvalidIndex };
   }
-  if (last_chunk && obj < objects_.back() + kChunkSize) {
-    return { chunk_id - 1, static_cast<uint32_t>(obj - last_chunk) };
-  } else {
+  --iter;
+  if (obj >= iter->first + kChunkSize) {
     return { kInvalidIndex, kInvalidIndex };
   }
+  return { iter->second, static_cast<uint32_t>(obj - iter->first) };
 }
 
 
@@ -90,16 +102,30 @@ void ObjectPool<T>::Map(std::function<void(T&)> f) {
 
 
 template <typename T>
-ObjectPool<T>* ObjectPool<T>::GetInstance() {
-  static auto instance = new ObjectPool<T>();
-  return instance;
+ObjectPool<T>::ObjectPool() : id_(kEmptyPoolId), arena_epoch_(NextArenaEpoch()), deserialized_chunk_size_(0) {
+  // Reserve enough space so that objects_ will not be reallocated when other threads are reading it.
+  // The first chunk is allocated on first use.
+  objects_.reserve(kMaxChunkNum);
+  chunk_index_.reserve(kMaxChunkNum);
+}
+
+
+template <typename T>
+size_t ObjectPool<T>::GetChunkNum() const {
+  return objects_.size();
 }
 
 
 template <typename T>
-ObjectPool<T>::ObjectPool() : id_(0), deserialized_chunk_size_(0) {
-  auto* pool = new T[kChunkSize];
-  objects_.emplace_back(pool);
+void ObjectPool<T>::AddChunk() {
+  // objects_ is read without lock, so it must never grow beyond its reserved capacity.
+  if (objects_.size() >= kMaxChunkNum) {
+    throw std::length_error("Object pool is full!");
+  }
+  auto* chunk = new T[kChunkSize];
+  std::pair<const T*, uint32_t> entry{ chunk, static_cast<uint32_t>(objects_.size()) };
+  chunk_index_.insert(std::upper_bound(chunk_index_.begin(), chunk_index_.end(), entry), entry);
+  objects_.emplace_back(chunk);
 }
 
 
@@ -113,11 +139,10 @@ T* ObjectPool<T>::RefreshChunkIndex(uint32_t n) {
     curr_id = id_.fetch_add(n);
     id = curr_id & kUnusedIdMask;
     c_id = (curr_id & kChunkIdMask) >> kIdOffset;
-    if (id > kChunkSize) {
+    if (id + n > kChunkSize) {
       auto seg_size = objects_.size();
       if (c_id + 1 >= seg_size) {
-        auto* curr_pool = new T[kChunkSize];
-        objects_.emplace_back(curr_pool);
+        AddChunk();
         c_id = seg_size;
       } else {
         c_id++;
@@ -131,20 +156,65 @@ T* ObjectPool<T>::RefreshChunkIndex(uint32_t n) {
 
 
 template <typename T>
-void SerializableObjectPool<T>::Serialize(File& file, bool with_boi) const {
+T* ObjectPool<T>::RefreshArena(uint32_t n) {
+  struct Arena {
+    const ObjectPool<T>* pool;
+    uint32_t epoch;
+    T* curr;
+    T* end;
+  };
+  thread_local Arena arenas[kArenaSlotNum]{};
+  thread_local size_t next_victim = 0;
+
+  if (n > kArenaSize / 4) {
+    return RefreshChunkIndex(n);
+  }
+
+  // A thread may alternate between several pools, e.g. the front and back storages of a simulator. Keep one
+  // arena for each of them, and only evict (and waste) an arena when there are more pools than slots.
+  Arena* arena = nullptr;
+  for (auto& a : arenas) {
+    if (a.pool == this) {
+      arena = &a;
+      break;
+    }
+  }
+  if (!arena) {
+    arena = &arenas[next_victim];
+    next_victim = (next_victim + 1) % kArenaSlotNum;
+    *arena = Arena{ this, 0, nullptr, nullptr };
+  }
+
+  auto epoch = arena_epoch_.load(std::memory_order_acquire);
+  if (arena->epoch != epoch || static_cast<size_t>(arena->end - arena->curr) < n) {
+    arena->epoch = epoch;
+    arena->curr = RefreshChunkIndex(kArenaSize);
+    arena->end = arena->curr + kArenaSize;
+  }
+  T* obj = arena->curr;
+  arena->curr += n;
+  return obj;
+}
+
+
+template <typename T>
+void SerializableObjectPool<T>::Serialize(File& file, bool with_boi, const RayStorage& storage) const {
   if (with_boi) {
     file.Write(ISerializable::kDefaultBoi);
   }
 
   auto next_unused_id = (ObjectPool<T>::id_ & ObjectPool<T>::kUnusedIdMask);
-  size_t total_num = ObjectPool<T>::kChunkSize * (ObjectPool<T>::objects_.size() - 1) + next_unused_id;
+  size_t total_num = 0;
+  if (!ObjectPool<T>::objects_.empty()) {
+    total_num = ObjectPool<T>::kChunkSize * (ObjectPool<T>::objects_.size() - 1) + next_unused_id;
+  }
   file.Write(total_num);
   file.Write(ObjectPool<T>::kChunkSize);
 
   for (const auto& chunk : ObjectPool<T>::objects_) {
     size_t num = (chunk == ObjectPool<T>::objects_.back() ? next_unused_id : ObjectPool<T>::kChunkSize);
     for (size_t i = 0; i < num; i++) {
-      chunk[i].Serialize(file, false);
+      chunk[i].Serialize(file, false, storage);
     }
   }
 }
@@ -154,7 +224,7 @@ template <typename T>
 void SerializableObjectPool<T>::Deserialize(File& file, endian::Endianness endianness) {
   const std::lock_guard<std::mutex> lock(ObjectPool<T>::id_mutex_);
 
-  endianness = CheckEndianness(file, endianness);
+  endianness = ISerializable::CheckEndianness(file, endianness);
   bool need_swap = (endianness != endian::kCompileEndian);
 
   size_t total_num = 0;
@@ -175,27 +245,49 @@ void SerializableObjectPool<T>::Deserialize(File& file, endian::Endianness endia
   ObjectPool<T>::Clear();
   ObjectPool<T>::deserialized_chunk_size_ = chunk_size;
   size_t chunks = total_num / ObjectPool<T>::kChunkSize + (total_num % ObjectPool<T>::kChunkSize ? 1 : 0);
+  if (chunks > ObjectPool<T>::kMaxChunkNum) {
+    throw std::invalid_argument("Object number is invalid!");
+  }
   for (size_t i = 0; i < chunks; i++) {
     if (i >= ObjectPool<T>::objects_.size()) {
-      ObjectPool<T>::objects_.emplace_back(new T[ObjectPool<T>::kChunkSize]);
+      ObjectPool<T>::AddChunk();
     }
     auto* chunk = ObjectPool<T>::objects_[i];
-    size_t curr_num = ObjectPool<T>::kChunkSize;
-    if (i + 1 == chunks) {
-      curr_num = total_num % ObjectPool<T>::kChunkSize;
-    }
+    size_t curr_num = std::min(total_num - i * ObjectPool<T>::kChunkSize, ObjectPool<T>::kChunkSize);
     for (size_t j = 0; j < curr_num; j++) {
       chunk[j].Deserialize(file, endianness);
     }
-    ObjectPool<T>::id_ = (chunks << ObjectPool<T>::kIdOffset) | curr_num;
+    ObjectPool<T>::id_ = (i << ObjectPool<T>::kIdOffset) | curr_num;
   }
 }
 
 
-template <typename T>
-SerializableObjectPool<T>* SerializableObjectPool<T>::GetInstance() {
-  static auto instance = new SerializableObjectPool<T>();
-  return instance;
+void RayStorage::Clear() {
+  ray_info_pool.Clear();
+  ray_seg_pool.Clear();
+}
+
+
+void RayStorage::Serialize(File& file) const {
+  ray_info_pool.Serialize(file, false, *this);
+  ray_seg_pool.Serialize(file, false, *this);
+}
+
+
+void RayStorage::Deserialize(File& file, endian::Endianness endianness) {
+  ray_info_pool.Deserialize(file, endianness);
+  ray_seg_pool.Deserialize(file, endianness);
+
+  ray_info_pool.Map([this](RayInfo& r) {
+    r.first_ray_segment = ray_seg_pool.GetPointerFromSerializeData(r.first_ray_segment);
+    r.prev_ray_segment = ray_seg_pool.GetPointerFromSerializeData(r.prev_ray_segment);
+  });
+  ray_seg_pool.Map([this](RaySegment& r) {
+    r.next_reflect = ray_seg_pool.GetPointerFromSerializeData(r.next_reflect);
+    r.next_refract = ray_seg_pool.GetPointerFromSerializeData(r.next_refract);
+    r.prev = ray_seg_pool.GetPointerFromSerializeData(r.prev);
+    r.root_ctx = ray_info_pool.GetPointerFromSerializeData(r.root_ctx);
+  });
 }
 
 
@@ -203,6 +295,5 @@ template class SerializableObjectPool<RaySegment>;
 template class SerializableObjectPool<RayInfo>;
 template class ObjectPool<RaySegment>;
 template class ObjectPool<RayInfo>;
-template class ObjectPool<ShortIdType>;
 
 }  // namespace icehalo
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <memory>
 #include <mutex>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "core/core_def.hpp"
@@ -15,6 +16,7 @@ namespace icehalo {
 template <typename T>
 class ObjectPool {
  public:
+  ObjectPool();
   ~ObjectPool();
 
   ObjectPool(const ObjectPool&) = delete;
@@ -34,47 +36,101 @@ class ObjectPool {
     }
   }
 
+  /**
+   * @brief Gets an object from the arena of calling thread.
+   *
+   * Every thread owns an arena in this pool, a slab of ObjectPool::kArenaSize objects cut from the pool chunks.
+   * Objects are taken from the arena without any atomic operation or lock, so it is much cheaper than
+   * ObjectPool::GetObject() when called from many threads. Since arenas live in pool chunks, objects
+   * got here are just like those from ObjectPool::GetObject(), and ObjectPool::GetObjectSerializeIndex()
+   * works for them.
+   *
+   * NOTE: Objects from one thread are not contiguous with those from others, and the unused tail of an
+   * arena is left as a gap in pool chunks. The gap is filled with default constructed (or stale) objects.
+   * All arenas are abandoned by ObjectPool::Clear().
+   */
+  template <class... Arg>
+  T* GetLocalObject(Arg&&... args) {
+    T* obj = RefreshArena(1);
+    return new (obj) T(std::forward<Arg>(args)...);
+  }
+
+  /**
+   * @brief Allocates an object array from the arena of calling thread. See ObjectPool::GetLocalObject().
+   *
+   * Arrays larger than a quarter of arena are allocated directly from pool chunks.
+   */
+  T* AllocateLocalObjectArray(size_t n) {
+    if (n > 0) {
+      return RefreshArena(n);
+    } else {
+      return nullptr;
+    }
+  }
+
   void Clear();
   void Map(std::function<void(T&)>);
 
   T* GetPointerFromSerializeData(T* dummy_ptr);
   T* GetPointerFromSerializeData(uint32_t chunk_id, uint32_t obj_id);
-  std::tuple<uint32_t, uint32_t> GetObjectSerializeIndex(T* obj);
 
-  static ObjectPool<T>* GetInstance();
+  /**
+   * @brief Gets (chunk ID, object ID) of an object, which is used to serialize pointers.
+   *
+   * Chunks are looked up by a binary search on their addresses, so it takes O(log(chunks)).
+   * It should not be called while the pool is growing, e.g. during ray tracing.
+   *
+   * @return (0xffffffff, 0xffffffff) if `obj` is nullptr or not in this pool.
+   */
+  std::tuple<uint32_t, uint32_t> GetObjectSerializeIndex(T* obj) const;
 
- protected:
-  ObjectPool();
+  /**
+   * @brief Gets the number of allocated chunks. A new pool has no chunk until the first object is taken.
+   *
+   * It should not be called while the pool is growing.
+   */
+  size_t GetChunkNum() const;
 
+ protected:
   T* RefreshChunkIndex(uint32_t n);
+  T* RefreshArena(uint32_t n);
+  void AddChunk();  //!< Must be called with id_mutex_ held. Throws std::length_error beyond kMaxChunkNum chunks
 
   static constexpr size_t kChunkSize = 1024 * 1024;
+  // The unused tail of an arena is wasted when it is abandoned, i.e. when the pool is cleared, or when a thread
+  // uses more than kArenaSlotNum pools in turn. So a pool may waste up to kArenaSize objects per thread.
+  static constexpr size_t kArenaSize = 4 * 1024;
+  static constexpr size_t kArenaSlotNum = 4;  //!< Number of arenas (for different pools) kept by a thread
+  static constexpr size_t kMaxChunkNum = 1024;
   static constexpr size_t kUnusedIdMask = 0xffffffff;
   static constexpr size_t kChunkIdMask = 0xffffffff00000000;
   static constexpr unsigned kIdOffset = 32;
+  static constexpr uint64_t kEmptyPoolId = kChunkSize;  //!< Chunk 0 looks full, so first use adds a chunk
 
   std::vector<T*> objects_;
+  std::vector<std::pair<const T*, uint32_t>> chunk_index_;  //!< (chunk address, chunk ID), sorted by address
   std::atomic_uint64_t id_;  //!< chunk_id << 32 | next_unused_id
   std::mutex id_mutex_;
+  std::atomic_uint32_t arena_epoch_;  //!< Unique among all pools. Renewed when all arenas should be abandoned.
   size_t deserialized_chunk_size_;
 };
 
 
 template <typename T>
-class SerializableObjectPool : public ObjectPool<T>, public ISerializable {
+class SerializableObjectPool : public ObjectPool<T> {
  public:
   SerializableObjectPool() = default;
   SerializableObjectPool(const SerializableObjectPool& other) = delete;
-  ~SerializableObjectPool() override = default;
+  ~SerializableObjectPool() = default;
 
   SerializableObjectPool& operator=(const SerializableObjectPool& other) = delete;
 
   /**
    * @brief Serialize self to a file.
    *
-   * This class is a template class. It has only 2 instantiations, RaySegmentPool and RayInfoPool, which
-   * all implement interface ISerializable. In fact, this method will call objects'
-   * ISerializable::Serialize(File&, bool) to serialize themselves.
+   * This class is a template class. It has only 2 instantiations, RaySegmentPool and RayInfoPool. In fact,
+   * this method will call objects' Serialize(File&, bool, const RayStorage&) to serialize themselves,
+   * where pointers are written as indices in pools of `storage`.
    *
    * If the object contains pointers, it is necessary to call ObjectPool<T>::GetPointerFromSerializeData(T*)
    * to get the real pointer. This could be done by calling ObjectPool<T>::Map(std::function<void(T&)>)
@@ -87,17 +143,53 @@ class SerializableObjectPool : public ObjectPool<T>, public ISerializable {
    *
    * @param file
    * @param with_boi
+   * @param storage The storage that this pool belongs to.
    */
-  void Serialize(File& file, bool with_boi) const override;
-  void Deserialize(File& file, endian::Endianness endianness) override;
-
-  static SerializableObjectPool<T>* GetInstance();
+  void Serialize(File& file, bool with_boi, const RayStorage& storage) const;
+  void Deserialize(File& file, endian::Endianness endianness);
 };
 
 
 using RaySegmentPool = SerializableObjectPool<RaySegment>;
 using RayInfoPool = SerializableObjectPool<RayInfo>;
-using IdPool = ObjectPool<ShortIdType>;
+
+
+/**
+ * @brief Pools of ray segments and ray infos of one simulation.
+ *
+ * Ray segments and ray infos point to each other, so they are cleared, serialized and deserialized together,
+ * and a pointer is stored as (chunk ID, object ID) in these pools. Different simulations own different
+ * storages, so that one can be read while another is being traced.
+ */
+struct RayStorage {
+  void Clear();
+
+  /**
+   * @brief Serialize both pools to a file.
+   *
+   * The file layout is:
+   * ray info pool,     // see SerializableObjectPool::Serialize()
+   * ray seg pool,      // see SerializableObjectPool::Serialize()
+   *
+   * @param file
+   */
+  void Serialize(File& file) const;
+
+  /**
+   * @brief Deserialize both pools from a file, and restore pointers between objects.
+   *
+   * @warning It will clear all existing data in both pools.
+   *
+   * @param file
+   * @param endianness
+   */
+  void Deserialize(File& file, endian::Endianness endianness);
+
+  RayInfoPool ray_info_pool;
+  RaySegmentPool ray_seg_pool;
+};
+
+using RayStoragePtr = std::shared_ptr<RayStorage>;
 
 }  // namespace icehalo
 
@@ -1,7 +1,66 @@
 #include "util/threading_pool.hpp"
 
+#include <algorithm>
+
 namespace icehalo {
 
+ChunkDeque::ChunkDeque() : top_(0), bottom_(0) {}
+
+
+void ChunkDeque::Reset(int first, int last) {
+  auto num = std::max(last - first, 0);
+  if (chunks_.size() < static_cast<size_t>(num)) {
+    chunks_.resize(num);
+  }
+  // Push in reverse order, so that the owner pops from the smallest chunk.
+  for (int i = 0; i < num; i++) {
+    chunks_[i] = last - 1 - i;
+  }
+  top_.store(0, std::memory_order_relaxed);
+  bottom_.store(num, std::memory_order_release);
+}
+
+
+bool ChunkDeque::Pop(int* chunk) {
+  auto b = bottom_.load(std::memory_order_relaxed) - 1;
+  bottom_.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto t = top_.load(std::memory_order_relaxed);
+
+  if (t > b) {
+    // Empty
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return false;
+  }
+
+  *chunk = chunks_[b];
+  if (t == b) {
+    // The last one. Race against thieves.
+    bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return won;
+  }
+  return true;
+}
+
+
+bool ChunkDeque::Steal(int* chunk) {
+  while (true) {
+    auto t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return false;
+    }
+
+    *chunk = chunks_[t];
+    if (top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+}
+
+
 #ifdef MULTI_THREAD
 const size_t ThreadingPool::kDefaultPoolSize = std::thread::hardware_concurrency();
 #else
@@ -10,7 +69,9 @@ const size_t ThreadingPool::kDefaultPoolSize = 1;
 
 
 ThreadingPool::ThreadingPool(size_t size)
-    : running_jobs_(0), pool_{}, state_(kStarting), running_workers_(0), stop_flag_(false) {
+    : running_jobs_(0), pool_{}, state_(kStarting), running_workers_(0), stop_flag_(false),
+      chunk_deques_(new ChunkDeque[size]), for_mutex_{}, for_task_{}, for_generation_(0), for_remaining_chunks_(0),
+      for_active_workers_(0) {
   StartPool(size);
 }
 
@@ -33,6 +94,12 @@ ThreadingPoolPtrU ThreadingPool::CreatePool(int size) {
 }
 
 
+ThreadingPoolPtr ThreadingPool::GetDefaultPool() {
+  static ThreadingPoolPtr pool = CreatePool();
+  return pool;
+}
+
+
 void ThreadingPool::StartPool(size_t size) {
   int n = static_cast<int>(size);
   state_ = kStarting;
@@ -75,6 +142,7 @@ void ThreadingPool::Shutdown() {
 
   // Notify
   queue_cv_.notify_all();
+  for_done_cv_.notify_all();
 
   {
     // Wait until all running workers finished.
@@ -151,6 +219,63 @@ bool ThreadingPool::CommitRangeSliceJobsAndWait(int start, int end,
 }
 
 
+bool ThreadingPool::RunParallelFor(int begin, int end, int grain, ParallelForFunc func, void* ctx) {
+  if (begin >= end) {
+    return true;
+  }
+  if (!(state_ & kCommittable) || stop_flag_) {
+    return false;
+  }
+
+  auto worker_num = static_cast<int>(pool_.size());
+  if (grain <= 0) {
+    grain = std::max((end - begin) / (worker_num * kDefaultChunksPerWorker), 1);
+  }
+  auto chunk_num = (end - begin + grain - 1) / grain;
+
+  const std::lock_guard<std::mutex> for_lock(for_mutex_);
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  for_task_ = ParallelForTask{ func, ctx, begin, end, grain };
+  for (int i = 0; i < worker_num; i++) {
+    chunk_deques_[i].Reset(chunk_num * i / worker_num, chunk_num * (i + 1) / worker_num);
+  }
+  for_remaining_chunks_ = chunk_num;
+  for_generation_++;
+  lock.unlock();
+  queue_cv_.notify_all();
+
+  lock.lock();
+  for_done_cv_.wait(lock, [=] { return (for_remaining_chunks_ <= 0 && for_active_workers_ <= 0) || stop_flag_; });
+  return !stop_flag_;
+}
+
+
+void ThreadingPool::RunParallelForChunks(int idx) {
+  auto worker_num = static_cast<int>(pool_.size());
+  const auto& task = for_task_;
+  int chunk = 0;
+  while (true) {
+    bool has_chunk = chunk_deques_[idx].Pop(&chunk);
+    for (int i = 1; i < worker_num && !has_chunk; i++) {
+      has_chunk = chunk_deques_[(idx + i) % worker_num].Steal(&chunk);
+    }
+    if (!has_chunk) {
+      break;
+    }
+
+    auto start = task.begin + chunk * task.grain;
+    auto end = std::min(start + task.grain, task.end);
+    task.func(task.ctx, idx, start, end);
+    if (--for_remaining_chunks_ == 0) {
+      // Take the lock, so that the notification will not be lost.
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      lock.unlock();
+      for_done_cv_.notify_all();
+    }
+  }
+}
+
+
 bool ThreadingPool::CommitSingleJob(std::function<void(int)> job) {
   if (!(state_ & kCommittable)) {
     // The pool is not committable, either it is on starting or on stopping.
@@ -180,14 +305,21 @@ void ThreadingPool::WorkingFunction(int idx) {
     running_workers_++;
   }
   worker_cv_.notify_one();
+  uint64_t for_generation = 0;
   while (true) {
-    // Fetch a job and run
-    auto pred = [=] { return !job_queue_.empty() || stop_flag_; };
+    // Fetch a job and run. ParallelFor() chunks go first.
+    auto has_for_chunks = [&] { return for_generation != for_generation_ && for_remaining_chunks_ > 0; };
+    auto pred = [&] { return !job_queue_.empty() || stop_flag_ || has_for_chunks(); };
     std::function<void(int)> curr_job;
+    bool run_for_chunks = false;
     {
       std::unique_lock<std::mutex> lock(queue_mutex_);
       queue_cv_.wait(lock, pred);
-      if (!stop_flag_) {
+      if (!stop_flag_ && has_for_chunks()) {
+        for_generation = for_generation_;
+        for_active_workers_++;
+        run_for_chunks = true;
+      } else if (!stop_flag_) {
         curr_job = job_queue_.front();
         job_queue_.pop();
       }
@@ -198,6 +330,16 @@ void ThreadingPool::WorkingFunction(int idx) {
       break;
     }
 
+    if (run_for_chunks) {
+      RunParallelForChunks(idx);
+      {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        for_active_workers_--;
+      }
+      for_done_cv_.notify_all();
+      continue;
+    }
+
     if (curr_job) {
       running_jobs_++;
       state_ = kRunning;
@@ -2,11 +2,14 @@
 #define UTIL_THREADING_POOL_H_
 
 #include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <future>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
 namespace icehalo {
@@ -15,9 +18,45 @@ class ThreadingPool;
 using ThreadingPoolPtr = std::shared_ptr<ThreadingPool>;
 using ThreadingPoolPtrU = std::unique_ptr<ThreadingPool>;
 
+/**
+ * @brief A Chase-Lev work stealing deque, holding chunk indices of a ThreadingPool::ParallelFor() call.
+ *
+ * The owner worker pops chunks from bottom, from small indices to large ones, so it runs through a
+ * contiguous range of data. Other workers steal chunks from top, i.e. the far end.
+ * All chunks are pushed (by ChunkDeque::Reset()) before any pop or steal.
+ */
+class alignas(64) ChunkDeque {
+ public:
+  ChunkDeque();
+
+  /**
+   * @brief Fills chunk [first, last). Must NOT be called concurrently with ChunkDeque::Pop() or ChunkDeque::Steal().
+   */
+  void Reset(int first, int last);
+
+  /**
+   * @brief Pops a chunk. Only the owner can call it.
+   * @return false if the deque is empty.
+   */
+  bool Pop(int* chunk);
+
+  /**
+   * @brief Steals a chunk. Any thread can call it.
+   * @return false if the deque is empty.
+   */
+  bool Steal(int* chunk);
+
+ private:
+  std::vector<int> chunks_;
+  std::atomic<int64_t> top_;
+  std::atomic<int64_t> bottom_;
+};
+
+
 class ThreadingPool {
  public:
   static const size_t kDefaultPoolSize;
+  static constexpr int kDefaultChunksPerWorker = 8;
 
   /**
    * @brief State of threading pool.
@@ -45,6 +84,14 @@ class ThreadingPool {
 
   static ThreadingPoolPtrU CreatePool(int size);
 
+  /**
+   * @brief Gets the process-wide pool of default size, which is created on first call.
+   *
+   * Simulator, SimulationData and Renderer use it unless another pool is set, so worker threads are
+   * started only once for a process. It is safe to share, see ThreadingPool::ParallelFor().
+   */
+  static ThreadingPoolPtr GetDefaultPool();
+
   ~ThreadingPool();
 
   /**
@@ -162,11 +209,52 @@ class ThreadingPool {
    */
   bool CommitRangeSliceJobsAndWait(int start, int end, const std::function<void(int, int, int)>& range_slice_func);
 
+  /**
+   * @brief Runs a functor over range [begin, end) in parallel, and waits until all finished.
+   *
+   * The range is cut into contiguous chunks of `grain` indices. Chunks are dealt to per-worker deques,
+   * and a worker that runs out of chunks steals from others (see ChunkDeque). Different from
+   * ThreadingPool::CommitRangeStepJobs(), there is no lock on job queue and no heap allocation for a
+   * call, unless the number of chunks grows larger than ever before.
+   *
+   * The functor can have one of the following signatures:
+   * ~~~{.cpp}
+   * void fn(int thread_id, int i);               // called for each index
+   * void fn(int thread_id, int start, int end);  // called for each chunk, [start, end)
+   * ~~~
+   *
+   * It can be called from several threads (e.g. different stages of a pipeline) sharing one pool. Calls are
+   * serialized, and each one runs on the whole pool in turn.
+   *
+   * @warning It must be called from outside of the pool.
+   * @param begin The start index for data, inclusive.
+   * @param end The end index for data, exclusive.
+   * @param grain The chunk size. If it is not positive, a default size is chosen so that every worker
+   *        gets about ThreadingPool::kDefaultChunksPerWorker chunks.
+   * @param fn The functor.
+   * @return true if all chunks finished. false if the pool is shutdown.
+   */
+  template <class F>
+  bool ParallelFor(int begin, int end, int grain, F&& fn);
+
  private:
+  using ParallelForFunc = void (*)(void* ctx, int thread_id, int start, int end);
+
+  struct ParallelForTask {
+    ParallelForFunc func;
+    void* ctx;
+    int begin;
+    int end;
+    int grain;
+  };
+
   explicit ThreadingPool(size_t size);
 
   void WorkingFunction(int idx);
 
+  bool RunParallelFor(int begin, int end, int grain, ParallelForFunc func, void* ctx);
+  void RunParallelForChunks(int idx);
+
   /**
    * @brief Starts the pool with given size.
    * @note Private use.
@@ -186,8 +274,33 @@ class ThreadingPool {
   std::atomic_bool stop_flag_;
   std::mutex worker_mutex_;
   std::condition_variable worker_cv_;
+
+  std::unique_ptr<ChunkDeque[]> chunk_deques_;
+  std::mutex for_mutex_;  //!< Serializes ParallelFor() calls from different threads.
+  ParallelForTask for_task_;
+  uint64_t for_generation_;
+  std::atomic_int for_remaining_chunks_;
+  int for_active_workers_;
+  std::condition_variable for_done_cv_;
 };
 
+
+template <class F>
+bool ThreadingPool::ParallelFor(int begin, int end, int grain, F&& fn) {
+  using Fn = std::remove_reference_t<F>;
+  auto func = [](void* ctx, int thread_id, int start, int end) {
+    auto& f = *static_cast<Fn*>(ctx);
+    if constexpr (std::is_invocable_v<Fn&, int, int, int>) {
+      f(thread_id, start, end);
+    } else {
+      for (int i = start; i < end; i++) {
+        f(thread_id, i);
+      }
+    }
+  };
+  return RunParallelFor(begin, end, grain, func, const_cast<void*>(static_cast<const void*>(std::addressof(fn))));
+}
+
 }  // namespace icehalo
 
 #endif  // UTIL_THREADING_POOL_H_
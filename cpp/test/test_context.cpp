@@ -1,4 +1,6 @@
+#include <cmath>
 #include <string>
+#include <vector>
 
 #include "context/context.hpp"
 #include "core/math.hpp"
@@ -45,6 +47,60 @@ TEST_F(ContextTest, FillSunDir) {
   }
 }
 
+
+TEST_F(ContextTest, RandomSampleFace) {
+  const auto* ctx = context->GetCrystalContext(1);
+  ASSERT_NE(ctx, nullptr);
+  const auto* crystal = ctx->GetCrystal();
+  int total_faces = crystal->TotalFaces();
+  const auto* face_norm = crystal->GetFaceNorm();
+  const auto* face_area = crystal->GetFaceArea();
+
+  float dir[3]{ 0.3f, -0.5f, -0.7f };
+  icehalo::Normalize3(dir);
+  std::vector<float> expect(total_faces, 0.0f);
+  float sum = 0;
+  for (int i = 0; i < total_faces; i++) {
+    if (!std::isnan(face_norm[i * 3]) && face_area[i] > 0) {
+      expect[i] = std::max(-icehalo::Dot3(face_norm + i * 3, dir) * face_area[i], 0.0f);
+      sum += expect[i];
+    }
+  }
+
+  constexpr size_t kRayNum = 40000;
+  std::vector<float> freq(total_faces, 0.0f);
+  for (size_t i = 0; i < kRayNum; i++) {
+    icehalo::RandomStream rng{ 1, 550, 0, i };
+    auto k = ctx->RandomSampleFace(&rng, dir);
+    ASSERT_GE(k, 0);
+    ASSERT_LT(k, total_faces);
+    freq[k] += 1.0f / kRayNum;
+  }
+  for (int i = 0; i < total_faces; i++) {
+    EXPECT_NEAR(freq[i], expect[i] / sum, 0.01);
+  }
+
+  // Batch version gives the same result as single stream
+  constexpr size_t kBatchNum = 100;
+  float dir_x[kBatchNum];
+  float dir_y[kBatchNum];
+  float dir_z[kBatchNum];
+  for (size_t i = 0; i < kBatchNum; i++) {
+    dir_x[i] = dir[0];
+    dir_y[i] = dir[1];
+    dir_z[i] = dir[2];
+  }
+  const float* batch_dir[3]{ dir_x, dir_y, dir_z };
+  int face_id[kBatchNum];
+  icehalo::RandomStreamBatch batch_rng{ 1, 550, 0, 0, kBatchNum };
+  ctx->RandomSampleFace(&batch_rng, batch_dir, face_id);
+  for (size_t i = 0; i < kBatchNum; i++) {
+    icehalo::RandomStream rng{ 1, 550, 0, i };
+    EXPECT_EQ(face_id[i], ctx->RandomSampleFace(&rng, dir));
+  }
+}
+
+
 TEST_F(ContextTest, RayPathHash01) {
   icehalo::RayPath ray_path_01{ 2, 3, 6, icehalo::kInvalidId };
   icehalo::RayPath ray_path_02{ 2, 5, 8, icehalo::kInvalidId };
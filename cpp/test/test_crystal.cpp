@@ -287,4 +287,67 @@ TEST_F(CrystalTest, IrregularHexPrismVertex1) {
   CheckCrystal(c1, c2);
 }
 
+
+TEST_F(CrystalTest, ConvexPlanes) {
+  auto c = icehalo::Crystal::CreateHexPrism(1.2f);
+  EXPECT_TRUE(c->IsConvex());
+  EXPECT_EQ(c->TotalPlanes(), 8);
+
+  c = icehalo::Crystal::CreateHexPyramid(0.3f, 1.0f, 0.3f);
+  EXPECT_TRUE(c->IsConvex());
+  EXPECT_EQ(c->TotalPlanes(), 20);
+
+  size_t total_faces = 0;
+  for (const auto& faces : c->GetPlaneFaces()) {
+    total_faces += faces.size();
+  }
+  EXPECT_EQ(total_faces, static_cast<size_t>(c->TotalFaces()));
+
+  // A chevron shaped prism, which is concave
+  // clang-format off
+  std::vector<icehalo::Vec3f> pts {
+    { 0, 0, 0 }, { 2, -1, 0 }, { 1, 0, 0 }, { 2, 1, 0 },
+    { 0, 0, 1 }, { 2, -1, 1 }, { 1, 0, 1 }, { 2, 1, 1 },
+  };
+  std::vector<icehalo::TriangleIdx> faces {
+    { 4, 5, 6 }, { 4, 6, 7 },
+    { 0, 2, 1 }, { 0, 3, 2 },
+    { 0, 1, 5 }, { 0, 5, 4 },
+    { 1, 2, 6 }, { 1, 6, 5 },
+    { 2, 3, 7 }, { 2, 7, 6 },
+    { 3, 0, 4 }, { 3, 4, 7 },
+  };
+  // clang-format on
+  c = icehalo::Crystal::CreateCustomCrystal(pts, faces);
+  EXPECT_FALSE(c->IsConvex());
+}
+
+
+TEST_F(CrystalTest, FaceAliasTable) {
+  auto c = icehalo::Crystal::CreateHexPyramid(0.3f, 1.0f, 0.3f);
+  int total_faces = c->TotalFaces();
+  const auto* area = c->GetFaceArea();
+  const auto* prob = c->GetFaceAliasProb();
+  const auto* alias = c->GetFaceAliasIndex();
+
+  float total_area = 0;
+  for (int i = 0; i < total_faces; i++) {
+    total_area += area[i];
+  }
+
+  // Probability of face k = (prob[k] + sum of (1 - prob[j]) that alias[j] == k) / N
+  std::vector<float> p(total_faces, 0.0f);
+  for (int i = 0; i < total_faces; i++) {
+    ASSERT_GE(prob[i], 0.0f);
+    ASSERT_LE(prob[i], 1.0f);
+    ASSERT_GE(alias[i], 0);
+    ASSERT_LT(alias[i], total_faces);
+    p[i] += prob[i] / total_faces;
+    p[alias[i]] += (1.0f - prob[i]) / total_faces;
+  }
+  for (int i = 0; i < total_faces; i++) {
+    EXPECT_NEAR(p[i], area[i] / total_area, 1e-5);
+  }
+}
+
 }  // namespace
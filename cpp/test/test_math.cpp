@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "core/math.hpp"
+#include "gtest/gtest.h"
+
+namespace {
+
+class MathTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    constexpr size_t kRayNum = 1000;
+    icehalo::RandomStream rng{ 1, 550, 0, 0 };
+    for (size_t i = 0; i < kRayNum; i++) {
+      float lon = rng.GetUniform() * 2 * icehalo::math::kPi;
+      float lat = std::asin(rng.GetUniform() * 2 - 1);
+      dir_.emplace_back(std::cos(lat) * std::cos(lon));
+      dir_.emplace_back(std::cos(lat) * std::sin(lon));
+      dir_.emplace_back(std::sin(lat));
+      dir_.emplace_back(1.0f);  // weight
+    }
+  }
+
+  std::vector<float> dir_;  // Uniform directions on sphere, (dx, dy, dz, w) for each
+};
+
+
+TEST_F(MathTest, EqualAreaSphereMapping) {
+  constexpr int kGridSize = 8;
+  auto ray_num = dir_.size() / 4;
+  std::vector<int> bin_cnt(kGridSize * kGridSize, 0);
+  for (size_t i = 0; i < ray_num; i++) {
+    const float* d = dir_.data() + i * 4;
+    float uv[2];
+    icehalo::SphereToEqualAreaSquare(d, uv);
+    ASSERT_GE(uv[0], 0.0f);
+    ASSERT_LE(uv[0], 1.0f);
+    ASSERT_GE(uv[1], 0.0f);
+    ASSERT_LE(uv[1], 1.0f);
+
+    float d2[3];
+    icehalo::EqualAreaSquareToSphere(uv, d2);
+    EXPECT_NEAR(d[0], d2[0], 1e-4);
+    EXPECT_NEAR(d[1], d2[1], 1e-4);
+    EXPECT_NEAR(d[2], d2[2], 1e-4);
+
+    int x = std::min(static_cast<int>(uv[0] * kGridSize), kGridSize - 1);
+    int y = std::min(static_cast<int>(uv[1] * kGridSize), kGridSize - 1);
+    bin_cnt[y * kGridSize + x]++;
+  }
+
+  // Uniform directions fall into equal-area bins uniformly. Check with 5 sigma.
+  float expect = ray_num * 1.0f / (kGridSize * kGridSize);
+  for (auto c : bin_cnt) {
+    EXPECT_NEAR(c, expect, 5 * std::sqrt(expect));
+  }
+}
+
+
+TEST_F(MathTest, OctahedralRoundTrip) {
+  std::vector<float> dirs(dir_);
+  // Axes and octant boundaries are the corner cases of folding.
+  for (float d : { 1.0f, -1.0f }) {
+    dirs.insert(dirs.end(), { d, 0, 0, 1, 0, d, 0, 1, 0, 0, d, 1, d * 0.6f, 0, -0.8f, 1 });
+  }
+  auto ray_num = dirs.size() / 4;
+  for (size_t i = 0; i < ray_num; i++) {
+    const float* d = dirs.data() + i * 4;
+    uint16_t oct[2];
+    icehalo::EncodeOctahedral(d, oct);
+    float d2[3];
+    icehalo::DecodeOctahedral(oct, d2);
+    EXPECT_NEAR(icehalo::Norm3(d2), 1.0f, 1e-6);
+    // Chord length is almost the angle, and is more accurate than std::acos near 1.
+    EXPECT_LT(icehalo::DiffNorm3(d, d2) * icehalo::math::kRadToDegree, 0.005f) << "at " << i;
+  }
+}
+
+
+TEST_F(MathTest, HalfFloat) {
+  for (float f : { 0.0f, 1.0f, -0.5f, 0.333251953125f, 65504.0f, 6.103515625e-05f, 5.9604645e-08f }) {
+    EXPECT_EQ(icehalo::HalfToFloat(icehalo::FloatToHalf(f)), f);
+  }
+  EXPECT_EQ(icehalo::FloatToHalf(1.0f), 0x3c00);
+  EXPECT_EQ(icehalo::FloatToHalf(65520.0f), 0x7c00);            // Rounded to infinity
+  EXPECT_EQ(icehalo::FloatToHalf(-1e10f), 0xfc00);              // Overflow
+  EXPECT_EQ(icehalo::FloatToHalf(1.0f + 1.0f / 2048), 0x3c00);  // Tie to even
+  EXPECT_EQ(icehalo::FloatToHalf(1.0f + 3.0f / 2048), 0x3c02);  // Tie to even
+  EXPECT_EQ(icehalo::FloatToHalf(2.0e-8f), 0);                  // Underflow
+  EXPECT_TRUE(std::isnan(icehalo::HalfToFloat(icehalo::FloatToHalf(std::numeric_limits<float>::quiet_NaN()))));
+
+  // Relative error of normal numbers is at most 2^-11.
+  icehalo::RandomStream rng{ 1, 550, 0, 0 };
+  for (int i = 0; i < 1000; i++) {
+    float f = std::exp(rng.GetUniform() * 18 - 9);
+    EXPECT_NEAR(icehalo::HalfToFloat(icehalo::FloatToHalf(f)), f, f / 2048);
+  }
+}
+
+}  // namespace
@@ -1,3 +1,6 @@
+#include <cmath>
+#include <vector>
+
 #include "core/crystal.hpp"
 #include "core/optics.hpp"
 #include "gtest/gtest.h"
@@ -160,9 +163,10 @@ TEST_F(OpticsTest, RayFaceIntersection0) {
     EXPECT_NEAR(p_out[i], p_result[i], icehalo::math::kFloatEps);
   }
 
-  icehalo::Optics::IntersectLineWithTrianglesSimd(p_in, dir_in, id_in, face_num,     // input
-                                                  face_base, face_point, face_norm,  // input
-                                                  p_result, &id_result);             // output
+  id_result = -1;
+  icehalo::Optics::IntersectLineWithTrianglesPacked(p_in, dir_in, id_in, face_num,                     // input
+                                                    c->GetFacePackedStride(), c->GetFacePackedData(),  // input
+                                                    p_result, &id_result);                             // output
 
   EXPECT_EQ(id_out, id_result);
   for (int i = 0; i < 3; i++) {
@@ -206,9 +210,9 @@ TEST_F(OpticsTest, RayFaceIntersection1) {
                                                 face_base, face_point, face_norm,                  // input
                                                 expect_pt, &expect_id);                            // output
 
-    icehalo::Optics::IntersectLineWithTrianglesSimd(p_in + i * 3, dir_in + i * 3, id_in[i], face_num,  // input
-                                                    face_base, face_point, face_norm,                  // input
-                                                    test_pt, &test_id);                                // output
+    icehalo::Optics::IntersectLineWithTrianglesPacked(p_in + i * 3, dir_in + i * 3, id_in[i], face_num,  // input
+                                                      c->GetFacePackedStride(), c->GetFacePackedData(),    // input
+                                                      test_pt, &test_id);                                  // output
     EXPECT_EQ(expect_id, test_id);
     for (int j = 0; j < 3; j++) {
       EXPECT_NEAR(test_pt[j], expect_pt[j], icehalo::math::kFloatEps);
@@ -217,6 +221,218 @@ TEST_F(OpticsTest, RayFaceIntersection1) {
 }
 
 
+TEST_F(OpticsTest, RayFaceIntersectionPacked) {
+  auto c = icehalo::Crystal::CreateHexPyramid(0.3f, 1.0f, 0.3f);
+  auto face_num = c->TotalFaces();
+  auto face_norm = c->GetFaceNorm();
+  auto face_base = c->GetFaceBaseVector();
+  auto face_point = c->GetFaceVertex();
+  auto face_stride = c->GetFacePackedStride();
+  auto face_packed = c->GetFacePackedData();
+
+  ASSERT_EQ(face_stride % icehalo::Crystal::kFacePackedAlign, 0);
+  ASSERT_GE(face_stride, face_num);
+
+  constexpr int kDirNum = 37;
+  for (int id_in = 0; id_in < face_num; id_in++) {
+    // Start from the center of incoming face, and go inside the crystal
+    float p_in[3]{};
+    for (int j = 0; j < 3; j++) {
+      p_in[j] = (face_point[id_in * 9 + j] + face_point[id_in * 9 + 3 + j] + face_point[id_in * 9 + 6 + j]) / 3;
+    }
+    for (int k = 0; k < kDirNum; k++) {
+      float lon = k * 2.0f * icehalo::math::kPi / kDirNum;
+      float lat = (k % 7 - 3) * 0.4f;
+      float dir_in[3]{ std::cos(lat) * std::cos(lon), std::cos(lat) * std::sin(lon), std::sin(lat) };
+      if (icehalo::Dot3(dir_in, face_norm + id_in * 3) > 0) {
+        for (auto& d : dir_in) {
+          d = -d;
+        }
+      }
+
+      float test_pt[]{ 0, 0, 0 };
+      float expect_pt[]{ 0, 0, 0 };
+      int test_id = -1;
+      int expect_id = -1;
+      icehalo::Optics::IntersectLineWithTriangles(p_in, dir_in, id_in, face_num,     // input
+                                                  face_base, face_point, face_norm,  // input
+                                                  expect_pt, &expect_id);            // output
+      icehalo::Optics::IntersectLineWithTrianglesPacked(p_in, dir_in, id_in, face_num,  // input
+                                                        face_stride, face_packed,       // input
+                                                        test_pt, &test_id);             // output
+      EXPECT_EQ(expect_id, test_id);
+      for (int j = 0; j < 3; j++) {
+        EXPECT_NEAR(test_pt[j], expect_pt[j], icehalo::math::kFloatEps);
+      }
+    }
+  }
+}
+
+
+TEST_F(OpticsTest, RayConvexIntersection) {
+  auto c = icehalo::Crystal::CreateHexPyramid(0.3f, 1.0f, 0.3f);
+  auto face_num = c->TotalFaces();
+  auto face_norm = c->GetFaceNorm();
+  auto face_base = c->GetFaceBaseVector();
+  auto face_point = c->GetFaceVertex();
+  ASSERT_TRUE(c->IsConvex());
+
+  constexpr int kDirNum = 37;
+  for (int id_in = 0; id_in < face_num; id_in++) {
+    float p_in[3]{};
+    for (int j = 0; j < 3; j++) {
+      p_in[j] = (face_point[id_in * 9 + j] + face_point[id_in * 9 + 3 + j] + face_point[id_in * 9 + 6 + j]) / 3;
+    }
+    for (int k = 0; k < kDirNum; k++) {
+      float lon = k * 2.0f * icehalo::math::kPi / kDirNum;
+      float lat = (k % 7 - 3) * 0.4f;
+      float dir_in[3]{ std::cos(lat) * std::cos(lon), std::cos(lat) * std::sin(lon), std::sin(lat) };
+
+      float test_pt[]{ 0, 0, 0 };
+      float expect_pt[]{ 0, 0, 0 };
+      int test_id = -1;
+      int expect_id = -1;
+      icehalo::Optics::IntersectLineWithTriangles(p_in, dir_in, id_in, face_num,     // input
+                                                  face_base, face_point, face_norm,  // input
+                                                  expect_pt, &expect_id);            // output
+      icehalo::Optics::IntersectLineWithConvexCrystal(c.get(), p_in, dir_in, id_in,  // input
+                                                      test_pt, &test_id);            // output
+      EXPECT_EQ(expect_id, test_id);
+      for (int j = 0; j < 3; j++) {
+        EXPECT_NEAR(test_pt[j], expect_pt[j], icehalo::math::kFloatEps);
+      }
+    }
+  }
+}
+
+
+void CheckPacketTracing(const icehalo::Crystal* c) {
+  constexpr float kN = 1.31;
+  constexpr int kNum = 37;  // Not a multiple of packet width, to check the tail
+  auto face_num = c->TotalFaces();
+  auto face_norm = c->GetFaceNorm();
+  auto face_point = c->GetFaceVertex();
+
+  // AoS data for normal version
+  float pt_in[kNum * 3];
+  float dir_in[kNum * 3];
+  float w_in[kNum];
+  int face_id_in[kNum];
+  float dir_out[kNum * 2 * 3];
+  float w_out[kNum * 2];
+  float pt_out[kNum * 2 * 3];
+  int face_id_out[kNum * 2];
+
+  // SoA data for packet version
+  float pt_in_soa[3][kNum];
+  float dir_in_soa[3][kNum];
+  float dir_out_soa[3][kNum * 2];
+  float w_out_soa[kNum * 2];
+  float pt_out_soa[3][kNum * 2];
+  int face_id_out_soa[kNum * 2];
+
+  for (int i = 0; i < kNum; i++) {
+    face_id_in[i] = i % face_num;
+    w_in[i] = i % 5 == 0 ? 0.0f : 1.0f;  // Some rays are absorbed
+    float lon = (i + 0.5f) * 2.0f * icehalo::math::kPi / kNum;
+    float lat = (i % 7 - 3) * 0.4f + 0.1f;
+    float* dir = dir_in + i * 3;
+    dir[0] = std::cos(lat) * std::cos(lon);
+    dir[1] = std::cos(lat) * std::sin(lon);
+    dir[2] = std::sin(lat);
+    if (icehalo::Dot3(dir, face_norm + face_id_in[i] * 3) > 0) {
+      for (int j = 0; j < 3; j++) {
+        dir[j] = -dir[j];
+      }
+    }
+    for (int j = 0; j < 3; j++) {
+      pt_in[i * 3 + j] = (face_point[face_id_in[i] * 9 + j] + face_point[face_id_in[i] * 9 + 3 + j] +
+                          face_point[face_id_in[i] * 9 + 6 + j]) /
+                         3;
+      pt_in_soa[j][i] = pt_in[i * 3 + j];
+      dir_in_soa[j][i] = dir[j];
+    }
+  }
+
+  icehalo::Optics::HitSurface(c, kN, kNum, dir_in, face_id_in, w_in, dir_out, w_out);
+  icehalo::Optics::Propagate(c, kNum * 2, pt_in, dir_out, w_out, face_id_in, pt_out, face_id_out);
+
+  const float* dir_in_ptr[3]{ dir_in_soa[0], dir_in_soa[1], dir_in_soa[2] };
+  const float* pt_in_ptr[3]{ pt_in_soa[0], pt_in_soa[1], pt_in_soa[2] };
+  float* dir_out_ptr[3]{ dir_out_soa[0], dir_out_soa[1], dir_out_soa[2] };
+  float* pt_out_ptr[3]{ pt_out_soa[0], pt_out_soa[1], pt_out_soa[2] };
+  icehalo::Optics::HitSurfacePacket(c, kN, kNum, dir_in_ptr, face_id_in, w_in, dir_out_ptr, w_out_soa);
+  icehalo::Optics::PropagatePacket(c, kNum * 2, pt_in_ptr, dir_out_ptr, w_out_soa, face_id_in,  //
+                                   pt_out_ptr, face_id_out_soa);
+
+  for (int i = 0; i < kNum * 2; i++) {
+    EXPECT_NEAR(w_out[i], w_out_soa[i], icehalo::math::kFloatEps);
+    EXPECT_EQ(face_id_out[i], face_id_out_soa[i]);
+    for (int j = 0; j < 3; j++) {
+      EXPECT_NEAR(dir_out[i * 3 + j], dir_out_soa[j][i], icehalo::math::kFloatEps);
+      if (face_id_out[i] >= 0) {
+        EXPECT_NEAR(pt_out[i * 3 + j], pt_out_soa[j][i], icehalo::math::kFloatEps);
+      }
+    }
+  }
+}
+
+
+TEST_F(OpticsTest, PacketTracing) {
+  // Convex crystal, rays are clipped by planes
+  auto c = icehalo::Crystal::CreateHexPyramid(0.3f, 1.0f, 0.3f);
+  CheckPacketTracing(c.get());
+
+  // Concave crystal, rays are tested against triangles
+  // clang-format off
+  std::vector<icehalo::Vec3f> pts {
+    { 0, 0, 0 }, { 2, -1, 0 }, { 1, 0, 0 }, { 2, 1, 0 },
+    { 0, 0, 1 }, { 2, -1, 1 }, { 1, 0, 1 }, { 2, 1, 1 },
+  };
+  std::vector<icehalo::TriangleIdx> faces {
+    { 4, 5, 6 }, { 4, 6, 7 },
+    { 0, 2, 1 }, { 0, 3, 2 },
+    { 0, 1, 5 }, { 0, 5, 4 },
+    { 1, 2, 6 }, { 1, 6, 5 },
+    { 2, 3, 7 }, { 2, 7, 6 },
+    { 3, 0, 4 }, { 3, 4, 7 },
+  };
+  // clang-format on
+  c = icehalo::Crystal::CreateCustomCrystal(pts, faces);
+  ASSERT_FALSE(c->IsConvex());
+  CheckPacketTracing(c.get());
+}
+
+
+TEST_F(OpticsTest, RayInfoAxisMatrix) {
+  const float axis[3]{ 0.3f, -1.1f, 2.5f };
+  icehalo::RayInfo info{ nullptr, 0, axis };
+
+  const float dir[4]{ 0.2f, -0.6f, 0.7746f, 0.0f };  // One more for SIMD loading
+  float expected[3];
+  float result[3];
+  icehalo::RotateZ(axis, dir, expected);
+  icehalo::RotateWithMatrix(info.axis_mat, dir, result);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(result[i], expected[i]);
+  }
+
+  icehalo::RotateZBack(axis, dir, expected);
+  icehalo::RotateBackWithMatrix(info.axis_mat, dir, result);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(result[i], expected[i]);
+  }
+
+  // Rotate back is the inverse of rotate.
+  float tmp[4]{};
+  icehalo::RotateWithMatrix(info.axis_mat, dir, tmp);
+  icehalo::RotateBackWithMatrix(info.axis_mat, tmp, result);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_NEAR(result[i], dir[i], 1e-6);
+  }
+}
+
+
 TEST_F(OpticsTest, RayPathHash) {
   icehalo::RayPathRecorder recorder1;
   icehalo::RayPathRecorder recorder2;
@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "context/context.hpp"
+#include "core/math.hpp"
+#include "gtest/gtest.h"
+#include "process/render.hpp"
+#include "process/simulation.hpp"
+#include "util/threading_pool.hpp"
+
+extern std::string config_file_name;
+
+namespace {
+
+class RenderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    constexpr size_t kRayNum = 1000;
+    icehalo::RandomStream rng{ 1, 550, 0, 0 };
+    for (size_t i = 0; i < kRayNum; i++) {
+      float lon = rng.GetUniform() * 2 * icehalo::math::kPi;
+      float lat = std::asin(rng.GetUniform() * 2 - 1);
+      dir_.emplace_back(std::cos(lat) * std::cos(lon));
+      dir_.emplace_back(std::cos(lat) * std::sin(lon));
+      dir_.emplace_back(std::sin(lat));
+      dir_.emplace_back(1.0f);  // weight
+    }
+  }
+
+  // Straightforward projection with std::atan2 / std::asin, for reference.
+  static void ReferenceProject(icehalo::LensType lens_type, icehalo::Pose3f cam_pose, float hov, int img_wid,
+                               int img_hei, icehalo::VisibleRange visible_range, const float* dir, float* img_xy) {
+    using icehalo::LensType;
+    using icehalo::math::kDegreeToRad;
+    using icehalo::math::kPi;
+
+    img_xy[0] = std::numeric_limits<float>::quiet_NaN();
+    img_xy[1] = std::numeric_limits<float>::quiet_NaN();
+    if (lens_type == LensType::kDualEqualArea || lens_type == LensType::kDualEquidistant) {
+      cam_pose = icehalo::Pose3f{ 90.0f, 90.0f, 0.0f };
+    } else if (lens_type == LensType::kEquirectangular) {
+      cam_pose = icehalo::Pose3f{ 90.0f - cam_pose.lon(), 90.0f, 0.0f };
+    } else if ((visible_range == icehalo::VisibleRange::kUpper && dir[2] > 0) ||
+               (visible_range == icehalo::VisibleRange::kLower && dir[2] < 0)) {
+      return;
+    }
+    cam_pose.ToRad();
+    float d[3];
+    icehalo::RotateZ(cam_pose.val(), dir, d);
+    if (lens_type == LensType::kLinear) {
+      if (d[2] > 0) {
+        return;
+      }
+      img_xy[0] = img_wid / 2.0f + img_wid / 2.0f * d[0] / d[2] / std::tan(hov * kDegreeToRad);
+      img_xy[1] = img_hei / 2.0f - img_wid / 2.0f * d[1] / d[2] / std::tan(hov * kDegreeToRad);
+      return;
+    }
+    if (visible_range == icehalo::VisibleRange::kFront && d[2] > 0 && lens_type != LensType::kDualEqualArea &&
+        lens_type != LensType::kDualEquidistant && lens_type != LensType::kEquirectangular) {
+      return;
+    }
+
+    float lon = std::atan2(-d[1], -d[0]);
+    float lat = std::asin(-d[2] / icehalo::Norm3(d));
+    float img_r = std::max(img_wid, img_hei) / 2.0f;
+    float dual_img_r = std::min(img_wid / 2, img_hei) / 2.0f;
+    float r = 0;
+    switch (lens_type) {
+      case LensType::kEqualArea:
+        r = img_r / std::sin(hov / 2.0f * kDegreeToRad) * std::sin((kPi / 2.0f - lat) / 2.0f);
+        break;
+      case LensType::kEquidistant:
+        r = (kPi / 2.0f - lat) / (hov * kDegreeToRad) * img_r;
+        break;
+      case LensType::kDualEqualArea:
+        r = dual_img_r / std::sin(45.0f * kDegreeToRad) * std::sin((kPi / 2.0f - std::abs(lat)) / 2.0f);
+        break;
+      case LensType::kDualEquidistant:
+        r = (1.0f - std::abs(lat) * 2.0f / kPi) * dual_img_r;
+        break;
+      case LensType::kEquirectangular:
+        img_xy[0] = static_cast<int>(img_wid / 2.0f + lon / kPi * 2 * dual_img_r - 0.5f);
+        img_xy[1] = static_cast<int>(img_hei / 2.0f - lat / kPi * 2 * dual_img_r - 0.5f);
+        return;
+      default:
+        return;
+    }
+    if (lens_type == LensType::kEqualArea || lens_type == LensType::kEquidistant) {
+      img_xy[0] = r * std::cos(lon) + img_wid / 2.0f - 0.5f;
+      img_xy[1] = -r * std::sin(lon) + img_hei / 2.0f - 0.5f;
+    } else {
+      if (lat < 0) {
+        lon = kPi - lon;
+      }
+      img_xy[0] = r * std::cos(lon) + dual_img_r + (lat > 0 ? -0.5f : 2 * dual_img_r - 0.5f);
+      img_xy[1] = -r * std::sin(lon) + dual_img_r - 0.5f;
+    }
+  }
+
+  static icehalo::ProjectContextPtr MakeContext() {
+    return icehalo::ProjectContext::CreateFromFile(config_file_name.c_str());
+  }
+
+  static icehalo::RenderContextPtr MakeRenderContext(const icehalo::ProjectContextPtr& ctx, int img_size) {
+    auto render_ctx = std::make_shared<icehalo::RenderContext>(*ctx->render_ctx_);
+    render_ctx->SetImageWidth(img_size);
+    render_ctx->SetImageHeight(img_size);
+    return render_ctx;
+  }
+
+  static icehalo::Renderer MakeRenderer(const icehalo::ProjectContextPtr& ctx, icehalo::RenderContextPtr render_ctx) {
+    icehalo::Renderer renderer;
+    renderer.SetCameraContext(ctx->cam_ctx_);
+    renderer.SetRenderContext(std::move(render_ctx));
+    renderer.SetSunContext(ctx->sun_ctx_);
+    return renderer;
+  }
+
+  // Rays around the center of view, with radius in [min_radius, max_radius] (in degree).
+  static icehalo::SimpleRayData MakeRingRays(const icehalo::ProjectContextPtr& ctx, int wavelength, size_t num,
+                                             float min_radius, float max_radius) {
+    auto cam_pose = ctx->cam_ctx_->GetCameraTargetDirection();
+    cam_pose.ToRad();
+
+    icehalo::SimpleRayData ray_data(num);
+    ray_data.wavelength = wavelength;
+    ray_data.wavelength_weight = 1.0f;
+    ray_data.buf_ray_num = num;
+    ray_data.init_ray_num = num;
+    icehalo::RandomStream rng{ 1, static_cast<uint32_t>(wavelength), 0, 0 };
+    for (size_t i = 0; i < num; i++) {
+      float radius = (min_radius + rng.GetUniform() * (max_radius - min_radius)) * icehalo::math::kDegreeToRad;
+      float phi = rng.GetUniform() * 2 * icehalo::math::kPi;
+      float local_dir[3]{ std::sin(radius) * std::cos(phi), std::sin(radius) * std::sin(phi), -std::cos(radius) };
+      icehalo::RotateZBack(cam_pose.val(), local_dir, ray_data.buf.get() + i * 4);
+      ray_data.buf[i * 4 + 3] = 1.0f;
+    }
+    return ray_data;
+  }
+
+  std::vector<float> dir_;
+};
+
+
+TEST_F(RenderTest, ProjectorSameAsReference) {
+  using icehalo::LensType;
+  constexpr int kImgWid = 1600;
+  constexpr int kImgHei = 800;
+
+  icehalo::Pose3f cam_pose{ 30.0f, 20.0f, 5.0f };
+  auto ray_num = dir_.size() / 4;
+  std::vector<float> img_xy(ray_num * 2);
+  for (auto lens_type : { LensType::kLinear, LensType::kEqualArea, LensType::kEquidistant, LensType::kDualEqualArea,
+                          LensType::kDualEquidistant, LensType::kEquirectangular }) {
+    for (auto visible_range : { icehalo::VisibleRange::kFull, icehalo::VisibleRange::kUpper,
+                                icehalo::VisibleRange::kFront }) {
+      icehalo::Projector projector{ lens_type, cam_pose, 70.0f, kImgWid, kImgHei, visible_range };
+      projector.Project(ray_num, dir_.data(), 4, img_xy.data());
+      for (size_t i = 0; i < ray_num; i++) {
+        float ref_xy[2];
+        ReferenceProject(lens_type, cam_pose, 70.0f, kImgWid, kImgHei, visible_range, dir_.data() + i * 4, ref_xy);
+        ASSERT_EQ(std::isnan(ref_xy[0]), std::isnan(img_xy[i * 2 + 0]));
+        if (std::isnan(ref_xy[0])) {
+          continue;
+        }
+        // Equirectangular is truncated to integer, thus can differ by one pixel at boundaries.
+        // Points far outside of image (e.g. near horizon of linear lens) have larger absolute errors.
+        float tol = lens_type == LensType::kEquirectangular ? 1.0f : 1e-2f;
+        EXPECT_NEAR(ref_xy[0], img_xy[i * 2 + 0], tol + std::abs(ref_xy[0]) * 1e-5f);
+        EXPECT_NEAR(ref_xy[1], img_xy[i * 2 + 1], tol + std::abs(ref_xy[1]) * 1e-5f);
+      }
+    }
+  }
+}
+
+
+TEST_F(RenderTest, ProjectorGatherAndSoA) {
+  constexpr int kImgWid = 800;
+  constexpr int kImgHei = 800;
+
+  icehalo::Pose3f cam_pose{ 0.0f, 90.0f, 0.0f };
+  icehalo::Projector projector{
+    icehalo::LensType::kEqualArea, cam_pose, 90.0f, kImgWid, kImgHei, icehalo::VisibleRange::kFull
+  };
+  auto ray_num = dir_.size() / 4;
+  std::vector<float> img_xy(ray_num * 2);
+  projector.Project(ray_num, dir_.data(), 4, img_xy.data());
+
+  // Gather every third ray, in reverse order
+  std::vector<size_t> idx;
+  for (size_t i = 0; i < ray_num; i += 3) {
+    idx.emplace_back(ray_num - 1 - i);
+  }
+  std::vector<float> gather_xy(idx.size() * 2);
+  projector.Project(idx.size(), idx.data(), dir_.data(), 4, gather_xy.data());
+  for (size_t i = 0; i < idx.size(); i++) {
+    EXPECT_FLOAT_EQ(gather_xy[i * 2 + 0], img_xy[idx[i] * 2 + 0]);
+    EXPECT_FLOAT_EQ(gather_xy[i * 2 + 1], img_xy[idx[i] * 2 + 1]);
+  }
+
+  std::vector<float> soa_dir(ray_num * 3);
+  for (size_t i = 0; i < ray_num; i++) {
+    for (int j = 0; j < 3; j++) {
+      soa_dir[j * ray_num + i] = dir_[i * 4 + j];
+    }
+  }
+  std::vector<float> soa_xy(ray_num * 2);
+  const float* soa_dir_ptr[3]{ soa_dir.data(), soa_dir.data() + ray_num, soa_dir.data() + ray_num * 2 };
+  float* soa_xy_ptr[2]{ soa_xy.data(), soa_xy.data() + ray_num };
+  projector.Project(ray_num, soa_dir_ptr, soa_xy_ptr);
+  for (size_t i = 0; i < ray_num; i++) {
+    EXPECT_FLOAT_EQ(soa_xy[i], img_xy[i * 2 + 0]);
+    EXPECT_FLOAT_EQ(soa_xy[ray_num + i], img_xy[i * 2 + 1]);
+  }
+}
+
+
+TEST_F(RenderTest, SphereHistogramCloseToDirect) {
+  constexpr int kImgSize = 256;
+  constexpr size_t kRayNum = 200000;
+
+  auto ctx = MakeContext();
+  auto direct_render_ctx = MakeRenderContext(ctx, kImgSize);
+  auto sphere_render_ctx = std::make_shared<icehalo::RenderContext>(*direct_render_ctx);
+  sphere_render_ctx->SetSphereHistogramSize(1024);
+
+  // A 22 degree ring around the center of view
+  auto ray_data = MakeRingRays(ctx, 550, kRayNum, 20.0f, 24.0f);
+  icehalo::RayCollectionInfo info{};
+  info.is_partial_data = false;
+
+  auto direct_renderer = MakeRenderer(ctx, direct_render_ctx);
+  direct_renderer.LoadRayData(ray_data.wavelength, info, ray_data);
+  direct_renderer.Render();
+
+  auto sphere_renderer = MakeRenderer(ctx, sphere_render_ctx);
+  sphere_renderer.LoadRayData(ray_data.wavelength, info, ray_data);
+  sphere_renderer.Render();
+
+  const auto* direct_img = direct_renderer.GetImageBuffer();
+  const auto* sphere_img = sphere_renderer.GetImageBuffer();
+  double total = 0;
+  double diff = 0;
+  for (int i = 0; i < kImgSize * kImgSize * 3; i++) {
+    total += direct_img[i];
+    diff += std::abs(direct_img[i] - sphere_img[i]);
+  }
+  // They differ by noise (the histogram is smoother), but should be close.
+  EXPECT_GT(total, 0);
+  EXPECT_LT(diff, total * 0.1);
+}
+
+
+TEST_F(RenderTest, SameImageForAnyThreadNum) {
+  constexpr int kImgSize = 256;
+  constexpr size_t kRayNum = 200000;
+  constexpr int kWavelength = 550;
+
+  auto ctx = MakeContext();
+  auto render_ctx = MakeRenderContext(ctx, kImgSize);
+  render_ctx->SetKeepSpectrum(true);
+
+  // All rays fall into the image, with different weights.
+  auto ray_data = MakeRingRays(ctx, kWavelength, kRayNum, 0.0f, 20.0f);
+  icehalo::RandomStream rng{ 2, kWavelength, 0, 0 };
+  double total_w = 0;
+  for (size_t i = 0; i < kRayNum; i++) {
+    ray_data.buf[i * 4 + 3] = 0.1f + rng.GetUniform();
+    total_w += ray_data.buf[i * 4 + 3];
+  }
+  icehalo::RayCollectionInfo info{};
+  info.is_partial_data = false;
+
+  auto renderer1 = MakeRenderer(ctx, render_ctx);
+  renderer1.SetThreadingPool(icehalo::ThreadingPool::CreatePool(1));
+  renderer1.LoadRayData(kWavelength, info, ray_data);
+  renderer1.Render();
+
+  auto renderer_n = MakeRenderer(ctx, render_ctx);
+  renderer_n.SetThreadingPool(icehalo::ThreadingPool::CreatePool(7));
+  renderer_n.LoadRayData(kWavelength, info, ray_data);
+  renderer_n.Render();
+
+  const auto* data1 = renderer1.GetSpectrumData(kWavelength);
+  const auto* data_n = renderer_n.GetSpectrumData(kWavelength);
+  ASSERT_NE(data1, nullptr);
+  ASSERT_NE(data_n, nullptr);
+  double accumulated_w = 0;
+  for (int i = 0; i < kImgSize * kImgSize; i++) {
+    ASSERT_EQ(data1[i], data_n[i]) << "at " << i;
+    accumulated_w += data1[i];
+  }
+  // No energy is lost.
+  EXPECT_NEAR(accumulated_w, total_w, total_w * 1e-5);
+
+  const auto* img1 = renderer1.GetImageBuffer();
+  const auto* img_n = renderer_n.GetImageBuffer();
+  for (int i = 0; i < kImgSize * kImgSize * 3; i++) {
+    ASSERT_EQ(img1[i], img_n[i]) << "at " << i;
+  }
+}
+
+
+TEST_F(RenderTest, XyzSameAsSpectrum) {
+  constexpr int kImgSize = 128;
+  constexpr size_t kRayNum = 20000;
+  constexpr int kWavelengths[]{ 450, 550, 620 };
+
+  auto ctx = MakeContext();
+  auto xyz_render_ctx = MakeRenderContext(ctx, kImgSize);
+  xyz_render_ctx->SetColorCompactLevel(icehalo::ColorCompactLevel::kTrueColor);
+  xyz_render_ctx->UseRealRayColor();
+  xyz_render_ctx->SetKeepSpectrum(false);
+  auto spec_render_ctx = std::make_shared<icehalo::RenderContext>(*xyz_render_ctx);
+  spec_render_ctx->SetKeepSpectrum(true);
+
+  auto xyz_renderer = MakeRenderer(ctx, xyz_render_ctx);
+  auto spec_renderer = MakeRenderer(ctx, spec_render_ctx);
+
+  // Rays of different wavelengths around the center of view
+  icehalo::RayCollectionInfo info{};
+  info.is_partial_data = false;
+  for (auto wl : kWavelengths) {
+    auto ray_data = MakeRingRays(ctx, wl, kRayNum, 0.0f, 30.0f);
+    xyz_renderer.LoadRayData(wl, info, ray_data);
+    spec_renderer.LoadRayData(wl, info, ray_data);
+  }
+  xyz_renderer.Render();
+  spec_renderer.Render();
+
+  const auto* xyz_img = xyz_renderer.GetImageBuffer();
+  const auto* spec_img = spec_renderer.GetImageBuffer();
+  int total = 0;
+  for (int i = 0; i < kImgSize * kImgSize * 3; i++) {
+    total += xyz_img[i];
+    // Only the order of summation differs.
+    EXPECT_NEAR(xyz_img[i], spec_img[i], 1) << "at " << i;
+  }
+  EXPECT_GT(total, 0);
+}
+
+}  // namespace
@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <cmath>
+#include <vector>
 
 #include "core/math.hpp"
 #include "gtest/gtest.h"
@@ -71,6 +72,185 @@ TEST_F(RngTest, UniformMultithreadTest) {
 }
 
 
+TEST_F(RngTest, PhiloxKnownAnswer) {
+  // Known answer tests from Random123
+  uint32_t out[4];
+  {
+    uint32_t counter[4]{ 0, 0, 0, 0 };
+    uint32_t key[2]{ 0, 0 };
+    icehalo::RandomStream::Philox4x32(counter, key, out);
+    EXPECT_EQ(out[0], 0x6627e8d5u);
+    EXPECT_EQ(out[1], 0xe169c58du);
+    EXPECT_EQ(out[2], 0xbc57ac4cu);
+    EXPECT_EQ(out[3], 0x9b00dbd8u);
+  }
+  {
+    uint32_t counter[4]{ 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff };
+    uint32_t key[2]{ 0xffffffff, 0xffffffff };
+    icehalo::RandomStream::Philox4x32(counter, key, out);
+    EXPECT_EQ(out[0], 0x408f276du);
+    EXPECT_EQ(out[1], 0x41c83b0eu);
+    EXPECT_EQ(out[2], 0xa20bc7c6u);
+    EXPECT_EQ(out[3], 0x6d5451fdu);
+  }
+}
+
+
+TEST_F(RngTest, RandomStreamReproducible) {
+  constexpr int kRayNum = 256;
+  auto get_values = [](uint64_t ray_idx) {
+    icehalo::RandomStream rng{ 1, 550, 0, ray_idx };
+    std::vector<float> values;
+    for (int i = 0; i < 7; i++) {
+      values.emplace_back(rng.GetUniform());
+      values.emplace_back(rng.GetGaussian());
+    }
+    return values;
+  };
+
+  std::vector<std::vector<float>> expected;
+  for (int i = 0; i < kRayNum; i++) {
+    expected.emplace_back(get_values(i));
+  }
+
+  // Same results with any threads, in any order.
+  auto thread_pool = icehalo::ThreadingPool::CreatePool(4);
+  std::vector<std::vector<float>> values(kRayNum);
+  thread_pool->ParallelFor(0, kRayNum, 1, [&](int /* thread_id */, int i) {
+    values[kRayNum - 1 - i] = get_values(kRayNum - 1 - i);
+  });
+  for (int i = 0; i < kRayNum; i++) {
+    ASSERT_EQ(values[i], expected[i]);
+  }
+
+  // Different keys give different streams.
+  icehalo::RandomStream rng0{ 1, 550, 0, 3 };
+  icehalo::RandomStream rng1{ 1, 551, 0, 3 };
+  icehalo::RandomStream rng2{ 1, 550, 1, 3 };
+  icehalo::RandomStream rng3{ 1, 550, 0, 3, 1 };
+  auto v0 = rng0.GetUniform();
+  EXPECT_NE(v0, rng1.GetUniform());
+  EXPECT_NE(v0, rng2.GetUniform());
+  EXPECT_NE(v0, rng3.GetUniform());
+}
+
+
+TEST_F(RngTest, RandomStreamDistribution) {
+  constexpr int kNum = 100000;
+  icehalo::RandomStream rng{ 1, 420, 2, 12345 };
+
+  double sum = 0;
+  double sum2 = 0;
+  for (int i = 0; i < kNum; i++) {
+    auto v = rng.GetUniform();
+    ASSERT_GE(v, 0.0f);
+    ASSERT_LT(v, 1.0f);
+    sum += v;
+    sum2 += v * v;
+  }
+  EXPECT_NEAR(sum / kNum, 0.5, 0.01);
+  EXPECT_NEAR(sum2 / kNum - (sum / kNum) * (sum / kNum), 1.0 / 12, 0.01);
+
+  sum = 0;
+  sum2 = 0;
+  for (int i = 0; i < kNum; i++) {
+    auto v = rng.GetGaussian();
+    ASSERT_FALSE(std::isnan(v));
+    sum += v;
+    sum2 += v * v;
+  }
+  EXPECT_NEAR(sum / kNum, 0.0, 0.02);
+  EXPECT_NEAR(sum2 / kNum - (sum / kNum) * (sum / kNum), 1.0, 0.02);
+}
+
+
+TEST_F(RngTest, RandomStreamBatchSameAsStream) {
+  constexpr size_t kRayNum = 37;
+  constexpr uint64_t kRayOffset = 1000;
+  icehalo::RandomStreamBatch batch{ 1, 550, 1, kRayOffset, kRayNum, 3 };
+  ASSERT_EQ(batch.Size(), kRayNum);
+
+  std::vector<icehalo::RandomStream> streams;
+  for (size_t i = 0; i < kRayNum; i++) {
+    streams.emplace_back(1, 550, 1, kRayOffset + i, 3);
+  }
+
+  float values[kRayNum];
+  for (int k = 0; k < 11; k++) {
+    if (k % 3 == 0) {
+      batch.GetUniform(values);
+      for (size_t i = 0; i < kRayNum; i++) {
+        ASSERT_EQ(values[i], streams[i].GetUniform());
+      }
+    } else {
+      batch.Get(icehalo::DistributionType::kGaussian, 1.0f, 2.0f, values);
+      for (size_t i = 0; i < kRayNum; i++) {
+        ASSERT_EQ(values[i], streams[i].Get(icehalo::DistributionType::kGaussian, 1.0f, 2.0f));
+      }
+    }
+  }
+}
+
+
+TEST_F(RngTest, RandomSamplerBatchSameAsStream) {
+  constexpr size_t kRayNum = 29;
+  icehalo::RandomStreamBatch batch{ 7, 480, 0, 0, kRayNum };
+  std::vector<icehalo::RandomStream> streams;
+  for (size_t i = 0; i < kRayNum; i++) {
+    streams.emplace_back(7, 480, 0, i);
+  }
+
+  float lon[kRayNum];
+  float lat[kRayNum];
+  float* sph[2]{ lon, lat };
+  icehalo::RandomSampler::SampleSphericalPointsSph(&batch, sph);
+  for (size_t i = 0; i < kRayNum; i++) {
+    float expected[3];
+    icehalo::RandomSampler::SampleSphericalPointsSph(&streams[i], expected);
+    EXPECT_EQ(lon[i], expected[0]);
+    EXPECT_EQ(lat[i], expected[1]);
+  }
+
+  const float vertexes[]{
+    0, 0, 0, 1, 0, 0, 0, 1, 0,  // triangle 0
+    0, 0, 1, 2, 0, 1, 0, 2, 1,  // triangle 1
+  };
+  int idx[kRayNum];
+  float p[kRayNum * 2];
+  for (size_t i = 0; i < kRayNum; i++) {
+    p[i * 2 + 0] = i * 1.0f / kRayNum;
+    p[i * 2 + 1] = 1.0f - p[i * 2 + 0];
+  }
+  icehalo::RandomSampler::SampleInt(&batch, p, 2, idx);
+  for (size_t i = 0; i < kRayNum; i++) {
+    EXPECT_EQ(idx[i], icehalo::RandomSampler::SampleInt(&streams[i], p + i * 2, 2));
+  }
+
+  float x[kRayNum];
+  float y[kRayNum];
+  float z[kRayNum];
+  float* pt[3]{ x, y, z };
+  icehalo::RandomSampler::SampleTriangularPoints(&batch, vertexes, idx, pt);
+  for (size_t i = 0; i < kRayNum; i++) {
+    float expected[3];
+    icehalo::RandomSampler::SampleTriangularPoints(&streams[i], vertexes + idx[i] * 9, expected);
+    EXPECT_EQ(x[i], expected[0]);
+    EXPECT_EQ(y[i], expected[1]);
+    EXPECT_EQ(z[i], expected[2]);
+  }
+
+  const float sun_dir[3]{ 0.3f, 0.1f, 0.9f };
+  icehalo::RandomSampler::SampleSphericalPointsCart(&batch, sun_dir, 0.5f, pt);
+  for (size_t i = 0; i < kRayNum; i++) {
+    float expected[4];
+    icehalo::RandomSampler::SampleSphericalPointsCart(&streams[i], sun_dir, 0.5f, expected);
+    EXPECT_EQ(x[i], expected[0]);
+    EXPECT_EQ(y[i], expected[1]);
+    EXPECT_EQ(z[i], expected[2]);
+  }
+}
+
+
 float RngTest::gaussian_values_[RngTest::kCheckSize]{
   0.15606569f,  0.30639967f,  -0.56803977f, -0.42438623f, -0.80628860f, -0.20454668f, -1.20004416f, -0.42873764f,
   -1.18775189f, 1.30547225f,  -0.15346648f, 0.64747655f,  0.13385749f,  1.19423461f,  -0.75318629f, -1.74047375f,
@@ -1,7 +1,16 @@
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include "core/math.hpp"
 #include "core/optics.hpp"
 #include "gtest/gtest.h"
+#include "io/compress.hpp"
+#include "io/container.hpp"
 #include "io/file.hpp"
+#include "process/simulation.hpp"
 #include "util/obj_pool.hpp"
+#include "util/threading_pool.hpp"
 
 extern std::string working_dir;
 
@@ -17,8 +26,8 @@ class RaySegmentSerializationTest : public ::testing::Test {
 };
 
 TEST_F(RaySegmentSerializationTest, SingleRaySegment) {
-  auto ray_seg_pool = icehalo::RaySegmentPool::GetInstance();
-  ray_seg_pool->Clear();
+  icehalo::RayStorage storage;
+  auto* ray_seg_pool = &storage.ray_seg_pool;
 
   float pt[] = { -1.0f, 0.3f,  0.5f,     // For r0
                  0.2f,  -0.8f, 0.1f,     // For r1
@@ -39,7 +48,7 @@ TEST_F(RaySegmentSerializationTest, SingleRaySegment) {
 
   icehalo::File file(working_dir.c_str(), "tmp.bin");
   file.Open(icehalo::FileOpenMode::kWrite);
-  r0->Serialize(file, true);
+  r0->Serialize(file, true, storage);
   file.Close();
 
   ray_seg_pool->Clear();
@@ -60,8 +69,8 @@ TEST_F(RaySegmentSerializationTest, SingleRaySegment) {
 }
 
 TEST_F(RaySegmentSerializationTest, RaySegPool) {
-  auto ray_seg_pool = icehalo::RaySegmentPool::GetInstance();
-  ray_seg_pool->Clear();
+  icehalo::RayStorage storage;
+  auto* ray_seg_pool = &storage.ray_seg_pool;
 
   float pt[] = { -1.0f, 0.3f,  0.5f,     // For r0
                  0.2f,  -0.8f, 0.1f,     // For r1
@@ -82,7 +91,7 @@ TEST_F(RaySegmentSerializationTest, RaySegPool) {
 
   icehalo::File file(working_dir.c_str(), "tmp.bin");
   file.Open(icehalo::FileOpenMode::kWrite);
-  ray_seg_pool->Serialize(file, true);
+  ray_seg_pool->Serialize(file, true, storage);
   file.Close();
 
   file.Open(icehalo::FileOpenMode::kRead);
@@ -127,4 +136,325 @@ TEST_F(RaySegmentSerializationTest, RaySegPool) {
   EXPECT_EQ(r2->state, icehalo::RaySegmentState::kOnGoing);
 }
 
+
+TEST_F(RaySegmentSerializationTest, RaySegPoolLocalArena) {
+  icehalo::RayStorage storage;
+  auto* ray_seg_pool = &storage.ray_seg_pool;
+
+  constexpr int kRayNum = 20000;
+  std::vector<icehalo::RaySegment*> rays(kRayNum, nullptr);
+  auto threading_pool = icehalo::ThreadingPool::CreatePool(4);
+  threading_pool->ParallelFor(0, kRayNum, 16, [&rays, ray_seg_pool](int /* thread_id */, int i) {
+    float pt[3]{ static_cast<float>(i), 0.0f, 0.0f };
+    float dir[3]{ 0.0f, 0.0f, 1.0f };
+    rays[i] = ray_seg_pool->GetLocalObject(pt, dir, 1.0f, i);
+  });
+  for (int i = 1; i < kRayNum; i++) {
+    rays[i]->prev = rays[i - 1];
+  }
+
+  std::set<std::tuple<uint32_t, uint32_t>> idx_set;
+  for (const auto r : rays) {
+    auto idx = ray_seg_pool->GetObjectSerializeIndex(r);
+    EXPECT_NE(std::get<0>(idx), 0xffffffff);
+    EXPECT_NE(std::get<1>(idx), 0xffffffff);
+    idx_set.emplace(idx);
+  }
+  EXPECT_EQ(idx_set.size(), static_cast<size_t>(kRayNum));
+
+  icehalo::File file(working_dir.c_str(), "tmp.bin");
+  file.Open(icehalo::FileOpenMode::kWrite);
+  ray_seg_pool->Serialize(file, true, storage);
+  file.Close();
+
+  file.Open(icehalo::FileOpenMode::kRead);
+  ray_seg_pool->Deserialize(file, icehalo::endian::kUnknownEndian);
+  file.Close();
+
+  using icehalo::RaySegment;
+  ray_seg_pool->Map([=](RaySegment& r) { r.prev = ray_seg_pool->GetPointerFromSerializeData(r.prev); });
+
+  const RaySegment* prev = nullptr;
+  for (int i = 0; i < kRayNum; i++) {
+    auto idx = ray_seg_pool->GetObjectSerializeIndex(rays[i]);
+    auto* r = ray_seg_pool->GetPointerFromSerializeData(std::get<0>(idx), std::get<1>(idx));
+    ASSERT_NE(r, nullptr);
+    EXPECT_EQ(r->face_id, i);
+    EXPECT_EQ(r->pt.x(), static_cast<float>(i));
+    EXPECT_EQ(r->prev, prev);
+    prev = r;
+  }
+}
+
+
+TEST(ObjectPoolTest, LocalArenaPerPool) {
+  // Front and back storages, used by one thread in turn.
+  icehalo::RayStorage storage0;
+  icehalo::RayStorage storage1;
+
+  auto* r0 = storage0.ray_seg_pool.GetLocalObject();
+  auto* r1 = storage1.ray_seg_pool.GetLocalObject();
+  EXPECT_EQ(storage0.ray_seg_pool.GetLocalObject(), r0 + 1);
+  EXPECT_EQ(storage1.ray_seg_pool.GetLocalObject(), r1 + 1);
+
+  storage0.Clear();
+  auto* r2 = storage0.ray_seg_pool.GetLocalObject();
+  EXPECT_EQ(storage0.ray_seg_pool.GetObjectSerializeIndex(r2), std::make_tuple(0u, 0u));
+  EXPECT_EQ(storage1.ray_seg_pool.GetLocalObject(), r1 + 2);
+}
+
+
+TEST(ObjectPoolTest, SerializeIndexAcrossChunks) {
+  constexpr size_t kChunkSize = 1024 * 1024;
+  icehalo::RayStorage storage;
+  auto* pool = &storage.ray_info_pool;
+
+  // Fill up the first chunk, and take some from the next ones.
+  std::vector<icehalo::RayInfo*> objs;
+  objs.emplace_back(pool->AllocateObjectArray(kChunkSize - 1));
+  objs.emplace_back(pool->GetObject());
+  objs.emplace_back(pool->GetObject());
+  objs.emplace_back(pool->AllocateObjectArray(kChunkSize));
+  objs.emplace_back(objs.back() + kChunkSize - 1);
+
+  std::vector<std::tuple<uint32_t, uint32_t>> expect_idx{ { 0, 0 }, { 0, kChunkSize - 1 }, { 1, 0 }, { 2, 0 },
+                                                          { 2, kChunkSize - 1 } };
+  for (size_t i = 0; i < objs.size(); i++) {
+    EXPECT_EQ(pool->GetObjectSerializeIndex(objs[i]), expect_idx[i]) << "at " << i;
+  }
+
+  std::tuple<uint32_t, uint32_t> invalid_idx{ 0xffffffff, 0xffffffff };
+  icehalo::RayInfo outside_obj;
+  EXPECT_EQ(pool->GetObjectSerializeIndex(nullptr), invalid_idx);
+  EXPECT_EQ(pool->GetObjectSerializeIndex(&outside_obj), invalid_idx);
+}
+
+
+TEST(ObjectPoolTest, DeserializeTooManyObjects) {
+  constexpr size_t kChunkSize = 1024 * 1024;
+  constexpr size_t kMaxChunkNum = 1024;
+
+  icehalo::File file(working_dir.c_str(), "tmp.bin");
+  file.Open(icehalo::FileOpenMode::kWrite);
+  file.Write(kChunkSize * kMaxChunkNum + 1);  // Total number
+  file.Write(kChunkSize);                     // Chunk size
+  file.Close();
+
+  icehalo::RayStorage storage;
+  file.Open(icehalo::FileOpenMode::kRead);
+  EXPECT_THROW(storage.ray_info_pool.Deserialize(file, icehalo::endian::kCompileEndian), std::invalid_argument);
+  file.Close();
+  EXPECT_EQ(storage.ray_info_pool.GetChunkNum(), 0u);
+}
+
+
+TEST(FileTest, ArrayAcrossBuffer) {
+  // Larger than the file buffer, and not aligned to it.
+  constexpr size_t kNum = 1024 * 1024 + 7;
+  std::vector<float> data(kNum);
+  for (size_t i = 0; i < kNum; i++) {
+    data[i] = static_cast<float>(i) * 0.5f;
+  }
+
+  icehalo::File file(working_dir.c_str(), "tmp.bin");
+  file.Open(icehalo::FileOpenMode::kWrite);
+  file.Write(static_cast<uint8_t>(3));
+  EXPECT_EQ(file.Write(data.data(), kNum), kNum * sizeof(float));
+  file.Write(static_cast<uint32_t>(0xdeadbeef));
+  file.Close();
+
+  std::vector<float> read_data(kNum);
+  uint8_t head = 0;
+  uint32_t tail = 0;
+  file.Open(icehalo::FileOpenMode::kRead);
+  file.Read(&head);
+  EXPECT_EQ(file.Read(read_data.data(), kNum), kNum * sizeof(float));
+  file.Read(&tail);
+  file.Close();
+
+  EXPECT_EQ(head, 3);
+  EXPECT_EQ(read_data, data);
+  EXPECT_EQ(tail, 0xdeadbeef);
+}
+
+
+TEST(FileTest, CompressedArrayAcrossBuffer) {
+  // Several frames. Repeated patterns with noise, like path records.
+  constexpr size_t kNum = 1024 * 1024 + 7;
+  std::vector<uint32_t> data(kNum);
+  icehalo::RandomStream rng{ 1, 550, 0, 0 };
+  for (size_t i = 0; i < kNum; i++) {
+    data[i] = i % 13 == 0 ? static_cast<uint32_t>(rng.GetUniform() * 1e6f) : static_cast<uint32_t>(i % 97);
+  }
+
+  icehalo::File file(working_dir.c_str(), "tmp.bin");
+  ASSERT_TRUE(file.Open(icehalo::FileOpenMode::kWrite, icehalo::FileCompression::kLz4Block));
+  file.Write(static_cast<uint8_t>(3));
+  EXPECT_EQ(file.Write(data.data(), kNum), kNum * sizeof(uint32_t));
+  file.Write(static_cast<uint32_t>(0xdeadbeef));
+  file.Close();
+  EXPECT_LT(file.GetBytes(), kNum * sizeof(uint32_t) / 2);
+
+  std::vector<uint32_t> read_data(kNum);
+  uint8_t head = 0;
+  uint32_t tail = 0;
+  ASSERT_TRUE(file.Open(icehalo::FileOpenMode::kRead));
+  EXPECT_EQ(file.GetCompression(), icehalo::FileCompression::kLz4Block);
+  file.Read(&head);
+  EXPECT_EQ(file.Read(read_data.data(), kNum), kNum * sizeof(uint32_t));
+  file.Read(&tail);
+  file.Close();
+
+  EXPECT_EQ(head, 3);
+  EXPECT_EQ(read_data, data);
+  EXPECT_EQ(tail, 0xdeadbeef);
+
+  // Raw files are sniffed as well.
+  file.Open(icehalo::FileOpenMode::kWrite);
+  file.Write(static_cast<uint32_t>(0xdeadbeef));
+  file.Close();
+  ASSERT_TRUE(file.Open(icehalo::FileOpenMode::kRead));
+  EXPECT_EQ(file.GetCompression(), icehalo::FileCompression::kNone);
+  file.Read(&tail);
+  file.Close();
+  EXPECT_EQ(tail, 0xdeadbeef);
+}
+
+
+TEST(FileTest, AppendKeepsCompression) {
+  icehalo::File file(working_dir.c_str(), "tmp.bin");
+  icehalo::FileCompression compressions[2]{ icehalo::FileCompression::kNone, icehalo::FileCompression::kLz4Block };
+  for (int i = 0; i < 2; i++) {
+    auto compression = compressions[i];
+    auto other_compression = compressions[1 - i];
+    ASSERT_TRUE(file.Open(icehalo::FileOpenMode::kWrite, compression));
+    file.Write(static_cast<uint32_t>(1));
+    file.Close();
+    ASSERT_TRUE(file.Open(icehalo::FileOpenMode::kAppend, other_compression));
+    EXPECT_EQ(file.GetCompression(), compression);
+    file.Write(static_cast<uint32_t>(2));
+    file.Close();
+
+    uint32_t data[3]{};
+    ASSERT_TRUE(file.Open(icehalo::FileOpenMode::kRead));
+    EXPECT_EQ(file.GetCompression(), compression);
+    EXPECT_EQ(file.Read(data, 3), 2 * sizeof(uint32_t));  // Stops at the end of file
+    file.Close();
+    EXPECT_EQ(data[0], 1u);
+    EXPECT_EQ(data[1], 2u);
+  }
+}
+
+
+TEST(FileTest, Lz4Block) {
+  std::vector<std::vector<uint8_t>> inputs(4);
+  for (int i = 0; i < 5; i++) {
+    inputs[1].emplace_back(static_cast<uint8_t>(i));  // Shorter than the last literals
+  }
+  inputs[2].assign(100000, 7);  // Long overlapped match
+  icehalo::RandomStream rng{ 1, 550, 0, 0 };
+  for (int i = 0; i < 100000; i++) {
+    inputs[3].emplace_back(static_cast<uint8_t>(rng.GetUniform() * 256));  // Not compressible
+  }
+
+  for (const auto& in : inputs) {
+    std::vector<uint8_t> compressed(icehalo::Lz4CompressBound(in.size()));
+    auto bytes = icehalo::Lz4Compress(in.data(), in.size(), compressed.data(), compressed.size());
+    ASSERT_GT(bytes, 0u);
+    std::vector<uint8_t> out(in.size());
+    EXPECT_TRUE(icehalo::Lz4Decompress(compressed.data(), bytes, out.data(), out.size()));
+    EXPECT_EQ(out, in);
+
+    // Corrupted inputs are detected, rather than read or written out of range.
+    if (bytes > 1) {
+      EXPECT_FALSE(icehalo::Lz4Decompress(compressed.data(), bytes - 1, out.data(), out.size()));
+    }
+    EXPECT_FALSE(icehalo::Lz4Decompress(compressed.data(), bytes, out.data(), out.size() + 1));
+  }
+
+  std::vector<uint8_t> small_buf(1000);
+  EXPECT_GT(icehalo::Lz4Compress(inputs[2].data(), inputs[2].size(), small_buf.data(), small_buf.size()), 0u);
+  EXPECT_EQ(icehalo::Lz4Compress(inputs[3].data(), inputs[3].size(), small_buf.data(), small_buf.size()), 0u);
+}
+
+
+TEST(ContainerTest, SimpleRayDataView) {
+  constexpr size_t kRayNum = 1000;
+  icehalo::SimpleRayData ray_data(kRayNum);
+  ray_data.wavelength = 550;
+  ray_data.wavelength_weight = 0.75f;
+  ray_data.init_ray_num = 2 * kRayNum;
+  for (size_t i = 0; i < kRayNum * 4; i++) {
+    ray_data.buf[i] = static_cast<float>(i) * 0.25f;
+  }
+
+  auto filename = icehalo::PathJoin(working_dir, "tmp.rays");
+  icehalo::File file(filename.c_str());
+  file.Open(icehalo::FileOpenMode::kWrite);
+  icehalo::ContainerWriter writer;
+  ray_data.AddToContainer(&writer);
+  auto bytes = writer.Write(file);
+  file.Close();
+  EXPECT_EQ(bytes % icehalo::kContainerAlignment, 0u);
+
+  icehalo::ContainerReader reader;
+  ASSERT_TRUE(reader.Open(filename.c_str()));
+  EXPECT_EQ(reader.GetVersion(), icehalo::kContainerVersion);
+  EXPECT_TRUE(reader.IsNativeEndian());
+
+  icehalo::SimpleRayData loaded_data;
+  ASSERT_TRUE(loaded_data.LoadFromContainer(reader));
+  EXPECT_EQ(loaded_data.wavelength, 550);
+  EXPECT_EQ(loaded_data.wavelength_weight, 0.75f);
+  EXPECT_EQ(loaded_data.buf_ray_num, kRayNum);
+  EXPECT_EQ(loaded_data.init_ray_num, 2 * kRayNum);
+
+  // Viewed in place, aligned, with no copy.
+  const auto* p = loaded_data.GetRayBuffer();
+  const auto* mapped_data = reader.GetMappedFile()->GetData();
+  EXPECT_EQ(loaded_data.buf, nullptr);
+  EXPECT_GE(reinterpret_cast<const uint8_t*>(p), mapped_data);
+  EXPECT_LT(reinterpret_cast<const uint8_t*>(p), mapped_data + bytes);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(p) % icehalo::kContainerAlignment, 0u);
+  for (size_t i = 0; i < kRayNum * 4; i++) {
+    ASSERT_EQ(p[i], ray_data.buf[i]);
+  }
+}
+
+
+TEST(ContainerTest, InvalidFile) {
+  icehalo::File file(working_dir.c_str(), "tmp.bin");
+  file.Open(icehalo::FileOpenMode::kWrite);
+  for (uint32_t i = 0; i < 64; i++) {
+    file.Write(i);
+  }
+  file.Close();
+
+  icehalo::ContainerReader reader;
+  EXPECT_FALSE(reader.Open(icehalo::PathJoin(working_dir, "tmp.bin").c_str()));
+  EXPECT_FALSE(reader.Open(icehalo::PathJoin(working_dir, "not_exist.rays").c_str()));
+}
+
+
+TEST(ContainerTest, MisalignedSection) {
+  constexpr uint64_t kFileBytes = 4 * icehalo::kContainerAlignment;
+  auto filename = icehalo::PathJoin(working_dir, "tmp.bin");
+  for (uint64_t offset : { icehalo::kContainerAlignment, icehalo::kContainerAlignment + 4 }) {
+    icehalo::ContainerHeader header{ icehalo::kContainerMagic, icehalo::ISerializable::kDefaultBoi,
+                                     icehalo::kContainerVersion, 1, kFileBytes, 0 };
+    icehalo::ContainerSection section{ icehalo::MakeSectionTag('T', 'E', 'S', 'T'), sizeof(float), 16, offset, 0 };
+    std::vector<uint8_t> padding(kFileBytes - sizeof(header) - sizeof(section), 0);
+
+    icehalo::File file(filename.c_str());
+    file.Open(icehalo::FileOpenMode::kWrite);
+    file.Write(header);
+    file.Write(section);
+    file.Write(padding.data(), padding.size());
+    file.Close();
+
+    icehalo::ContainerReader reader;
+    EXPECT_EQ(reader.Open(filename.c_str()), offset % icehalo::kContainerAlignment == 0) << "offset " << offset;
+  }
+}
+
 }  // namespace
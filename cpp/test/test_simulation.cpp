@@ -0,0 +1,459 @@
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "context/context.hpp"
+#include "core/crystal.hpp"
+#include "core/math.hpp"
+#include "gtest/gtest.h"
+#include "io/container.hpp"
+#include "io/file.hpp"
+#include "process/simulation.hpp"
+#include "util/threading_pool.hpp"
+
+extern std::string config_file_name;
+extern std::string working_dir;
+
+namespace {
+
+class SimulationTest : public ::testing::Test {
+ protected:
+  static icehalo::ProjectContextPtr MakeContext() {
+    auto context = icehalo::ProjectContext::CreateFromFile(config_file_name.c_str());
+    context->SetInitRayNum(icehalo::ProjectContext::kMinInitRayNum);
+    return context;
+  }
+
+  // Finished exit rays of the last scatter, (dx, dy, dz, w) for each.
+  static std::vector<float> CollectFinalRays(const icehalo::SimulationData& simulation_data) {
+    std::vector<float> rays;
+    for (const auto* r : simulation_data.GetLastExitRaySegments()) {
+      if (r->state != icehalo::RaySegmentState::kFinished) {
+        continue;
+      }
+      rays.insert(rays.end(), r->dir.val(), r->dir.val() + 3);
+      rays.emplace_back(r->w);
+    }
+    return rays;
+  }
+
+  static std::vector<std::vector<float>> RunAll(icehalo::Simulator* simulator, size_t wavelength_num) {
+    std::vector<std::vector<float>> rays;
+    for (size_t i = 0; i < wavelength_num; i++) {
+      simulator->SetCurrentWavelengthIndex(i);
+      simulator->Run();
+      rays.emplace_back(CollectFinalRays(simulator->GetSimulationRayData()));
+    }
+    return rays;
+  }
+
+  // Runs the first wavelength with a new simulator. The returned data shares the ray storage of the simulator.
+  static icehalo::SimulationData RunFirstWavelength(const icehalo::ProjectContextPtr& context) {
+    icehalo::Simulator simulator(context);
+    simulator.SetCurrentWavelengthIndex(0);
+    simulator.Run();
+    return simulator.GetSimulationRayData();
+  }
+
+  // Finished exit ray segments of the last scatter.
+  static std::vector<const icehalo::RaySegment*> GetFinishedRaySegments(const icehalo::SimulationData& data) {
+    std::vector<const icehalo::RaySegment*> rays;
+    for (const auto* r : data.GetLastExitRaySegments()) {
+      if (r->state == icehalo::RaySegmentState::kFinished) {
+        rays.emplace_back(r);
+      }
+    }
+    return rays;
+  }
+
+  // Deserializes `data` from the temporary file.
+  template <class T>
+  static void LoadTmpFile(T* data) {
+    icehalo::File file(working_dir.c_str(), kTmpFileName);
+    file.Open(icehalo::FileOpenMode::kRead);
+    data->Deserialize(file, icehalo::endian::kUnknownEndian);
+    file.Close();
+  }
+
+  // Serializes `data` to the temporary file, then deserializes it into `loaded_data`. Returns bytes of the file.
+  template <class T>
+  static size_t SaveAndLoad(const T& data, T* loaded_data,
+                            icehalo::FileCompression compression = icehalo::FileCompression::kNone) {
+    icehalo::File file(working_dir.c_str(), kTmpFileName);
+    file.Open(icehalo::FileOpenMode::kWrite, compression);
+    data.Serialize(file, true);
+    file.Close();
+    LoadTmpFile(loaded_data);
+    return file.GetBytes();
+  }
+
+  // Writes `data` to a temporary container file, then loads it into `loaded_data`. Returns bytes of the file.
+  template <class T>
+  static size_t SaveAndLoadContainer(const T& data, T* loaded_data) {
+    auto filename = icehalo::PathJoin(working_dir, kTmpContainerFileName);
+    icehalo::File file(filename.c_str());
+    file.Open(icehalo::FileOpenMode::kWrite);
+    icehalo::ContainerWriter writer;
+    data.AddToContainer(&writer);
+    auto bytes = writer.Write(file);
+    file.Close();
+
+    icehalo::ContainerReader reader;
+    EXPECT_TRUE(reader.Open(filename.c_str()));
+    EXPECT_TRUE(loaded_data->LoadFromContainer(reader));
+    return bytes;
+  }
+
+  static constexpr const char* kTmpFileName = "tmp.bin";
+  static constexpr const char* kTmpContainerFileName = "tmp.crays";
+};
+
+
+TEST_F(SimulationTest, ConcurrentSimulators) {
+  constexpr int kSimulatorNum = 3;
+  auto context = MakeContext();  // Shared by all simulators
+  auto wavelength_num = context->wavelengths_.size();
+
+  icehalo::Simulator ref_simulator(context);
+  auto ref_rays = RunAll(&ref_simulator, wavelength_num);
+
+  std::vector<std::vector<std::vector<float>>> rays(kSimulatorNum);
+  std::vector<std::thread> threads;
+  for (int k = 0; k < kSimulatorNum; k++) {
+    threads.emplace_back([&rays, &context, wavelength_num, k] {
+      icehalo::Simulator simulator(context);
+      rays[k] = RunAll(&simulator, wavelength_num);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (const auto& r : rays) {
+    ASSERT_EQ(r.size(), wavelength_num);
+    for (size_t i = 0; i < wavelength_num; i++) {
+      EXPECT_FALSE(r[i].empty());
+      EXPECT_EQ(r[i], ref_rays[i]);
+    }
+  }
+
+  // Results of the reference simulator keep valid.
+  EXPECT_EQ(CollectFinalRays(ref_simulator.GetSimulationRayData()), ref_rays.back());
+}
+
+
+TEST_F(SimulationTest, RunAsyncSameAsRun) {
+  auto context = MakeContext();
+  auto wavelength_num = context->wavelengths_.size();
+
+  icehalo::Simulator ref_simulator(context);
+  auto ref_rays = RunAll(&ref_simulator, wavelength_num);
+
+  icehalo::Simulator simulator(context);
+  simulator.SetCurrentWavelengthIndex(0);
+  simulator.RunAsync();
+  for (size_t i = 0; i < wavelength_num; i++) {
+    simulator.WaitFinish();
+    const auto& simulation_data = simulator.GetSimulationRayData();
+    if (i + 1 < wavelength_num) {
+      simulator.SetCurrentWavelengthIndex(i + 1);
+      simulator.RunAsync();
+    }
+    EXPECT_EQ(CollectFinalRays(simulation_data), ref_rays[i]);
+  }
+}
+
+
+TEST_F(SimulationTest, RepeatedRunsDiffer) {
+  auto context = MakeContext();
+  icehalo::Simulator simulator(context);
+  simulator.SetCurrentWavelengthIndex(0);
+
+  simulator.Run();
+  auto rays0 = CollectFinalRays(simulator.GetSimulationRayData());
+  simulator.RunAsync();
+  simulator.WaitFinish();
+  auto rays1 = CollectFinalRays(simulator.GetSimulationRayData());
+  EXPECT_FALSE(rays0.empty());
+  EXPECT_FALSE(rays1.empty());
+  EXPECT_NE(rays0, rays1);
+
+  // Same seed gives the same sequence of runs.
+  simulator.SetSeed(icehalo::RandomStream::GetDefaultSeed());
+  simulator.Run();
+  EXPECT_EQ(CollectFinalRays(simulator.GetSimulationRayData()), rays0);
+  simulator.Run();
+  EXPECT_EQ(CollectFinalRays(simulator.GetSimulationRayData()), rays1);
+}
+
+
+TEST_F(SimulationTest, SameResultForAnyThreadNum) {
+  auto context = MakeContext();
+  auto wavelength_num = context->wavelengths_.size();
+
+  icehalo::Simulator simulator1(context);
+  simulator1.SetThreadingPool(icehalo::ThreadingPool::CreatePool(1));
+  icehalo::Simulator simulator_n(context);
+  simulator_n.SetThreadingPool(icehalo::ThreadingPool::CreatePool(7));
+
+  for (size_t i = 0; i < wavelength_num; i++) {
+    simulator1.SetCurrentWavelengthIndex(i);
+    simulator1.Run();
+    simulator_n.SetCurrentWavelengthIndex(i);
+    simulator_n.Run();
+
+    const auto& segs1 = simulator1.GetSimulationRayData().GetLastExitRaySegments();
+    const auto& segs_n = simulator_n.GetSimulationRayData().GetLastExitRaySegments();
+    ASSERT_FALSE(segs1.empty());
+    ASSERT_EQ(segs1.size(), segs_n.size());
+    for (size_t j = 0; j < segs1.size(); j++) {
+      const auto* r1 = segs1[j];
+      const auto* r_n = segs_n[j];
+      EXPECT_EQ(r1->state, r_n->state) << "at " << j;
+      EXPECT_EQ(r1->face_id, r_n->face_id) << "at " << j;
+      EXPECT_EQ(r1->w, r_n->w) << "at " << j;
+      for (int k = 0; k < 3; k++) {
+        EXPECT_EQ(r1->pt.val()[k], r_n->pt.val()[k]) << "at " << j;
+        EXPECT_EQ(r1->dir.val()[k], r_n->dir.val()[k]) << "at " << j;
+      }
+
+      // Same path inside the crystal.
+      for (; r1 && r_n; r1 = r1->prev, r_n = r_n->prev) {
+        EXPECT_EQ(r1->face_id, r_n->face_id) << "at " << j;
+      }
+      EXPECT_EQ(r1, nullptr) << "at " << j;
+      EXPECT_EQ(r_n, nullptr) << "at " << j;
+    }
+  }
+}
+
+
+TEST_F(SimulationTest, StorageAllocatesLazily) {
+  icehalo::SimulationData simulation_data;
+  auto* storage = simulation_data.GetRayStorage();
+  EXPECT_EQ(storage->ray_info_pool.GetChunkNum(), 0u);
+  EXPECT_EQ(storage->ray_seg_pool.GetChunkNum(), 0u);
+
+  simulation_data.Clear();
+  EXPECT_EQ(storage->ray_seg_pool.GetChunkNum(), 0u);
+
+  auto* seg = storage->ray_seg_pool.GetObject();
+  EXPECT_EQ(storage->ray_seg_pool.GetChunkNum(), 1u);
+  EXPECT_EQ(storage->ray_seg_pool.GetObjectSerializeIndex(seg), std::make_tuple(0u, 0u));
+  EXPECT_EQ(storage->ray_info_pool.GetChunkNum(), 0u);
+
+  auto context = MakeContext();
+  icehalo::Simulator simulator(context);
+  EXPECT_EQ(simulator.GetSimulationRayData().GetRayStorage()->ray_seg_pool.GetChunkNum(), 0u);
+}
+
+
+TEST_F(SimulationTest, SerializeRoundTrip) {
+  auto context = MakeContext();
+  auto simulation_data = RunFirstWavelength(context);
+
+  size_t raw_bytes = 0;
+  for (auto compression : { icehalo::FileCompression::kNone, icehalo::FileCompression::kLz4Block }) {
+    icehalo::SimulationData loaded_data;
+    auto bytes = SaveAndLoad(simulation_data, &loaded_data, compression);
+    if (compression == icehalo::FileCompression::kNone) {
+      raw_bytes = bytes;
+    } else {
+      EXPECT_LT(bytes, raw_bytes);
+    }
+
+    EXPECT_EQ(loaded_data.wavelength_info_.wavelength, simulation_data.wavelength_info_.wavelength);
+    EXPECT_EQ(loaded_data.GetLastExitRaySegments().size(), simulation_data.GetLastExitRaySegments().size());
+    EXPECT_EQ(CollectFinalRays(loaded_data), CollectFinalRays(simulation_data));
+  }
+}
+
+
+TEST_F(SimulationTest, WholePathRecorder) {
+  auto context = MakeContext();
+  auto simulation_data = RunFirstWavelength(context);
+  icehalo::SimulationData loaded_data;
+  SaveAndLoad(simulation_data, &loaded_data);
+
+  // Recorders carried from previous scatters are the same as those from walking back the chain.
+  const icehalo::SimulationData* data_list[]{ &simulation_data, &loaded_data };
+  for (const auto* data : data_list) {
+    size_t multi_scatter_num = 0;
+    for (auto* r : data->GetLastExitRaySegments()) {
+      if (r->state != icehalo::RaySegmentState::kFinished) {
+        continue;
+      }
+      icehalo::RayPathRecorder walk_recorder;
+      for (auto* p = r; p; p = p->root_ctx->prev_ray_segment) {
+        p->recorder >> walk_recorder;
+      }
+      auto recorder = r->root_ctx->prev_path_recorder;
+      recorder << r->recorder;
+      EXPECT_EQ(recorder.Hash(), walk_recorder.Hash());
+      if (r->root_ctx->prev_ray_segment) {
+        multi_scatter_num++;
+      }
+    }
+    EXPECT_GT(multi_scatter_num, 0u);
+  }
+}
+
+
+TEST_F(SimulationTest, CompactRayDataRoundTrip) {
+  auto context = MakeContext();
+  auto simulation_data = RunFirstWavelength(context);
+
+  auto compact_data = simulation_data.CollectCompactRayData(true);
+  icehalo::CompactRayData loaded_data;
+  auto bytes = SaveAndLoadContainer(compact_data, &loaded_data);
+  EXPECT_LT(bytes, compact_data.ray_num * 14 + 1024);
+  EXPECT_EQ(loaded_data.wavelength, compact_data.wavelength);
+  EXPECT_EQ(loaded_data.init_ray_num, compact_data.init_ray_num);
+  EXPECT_EQ(loaded_data.dir, compact_data.dir);
+  EXPECT_EQ(loaded_data.w, compact_data.w);
+  EXPECT_EQ(loaded_data.path_hash, compact_data.path_hash);
+
+  // Compare with finished rays of full precision. Rays of the last scatter are at the end.
+  auto decoded_data = loaded_data.Decode();
+  auto last_rays = GetFinishedRaySegments(simulation_data);
+  ASSERT_FALSE(last_rays.empty());
+  ASSERT_GE(decoded_data.buf_ray_num, last_rays.size());
+  const float* d = decoded_data.buf.get() + (decoded_data.buf_ray_num - last_rays.size()) * 4;
+  for (const auto* r : last_rays) {
+    float world_dir[3];
+    icehalo::RotateBackWithMatrix(r->root_ctx->axis_mat, r->dir.val(), world_dir);
+    for (int j = 0; j < 3; j++) {
+      EXPECT_NEAR(d[j], world_dir[j], 1e-4);
+    }
+    EXPECT_NEAR(d[3], r->w, std::max(r->w / 2048, 3e-8f));  // Tiny weights are subnormal in half precision
+    d += 4;
+  }
+
+  auto [info, final_data] = simulation_data.CollectFinalRayData();
+  float total_energy = 0;
+  for (size_t i = 0; i < decoded_data.buf_ray_num; i++) {
+    total_energy += decoded_data.buf[i * 4 + 3];
+  }
+  EXPECT_NEAR(total_energy, info.total_energy, info.total_energy * 1e-3);
+}
+
+
+TEST_F(SimulationTest, SplitHaloRayData) {
+  auto context = MakeContext();
+  auto simulation_data = RunFirstWavelength(context);
+
+  icehalo::RenderSplitter splitter;
+  splitter.type = icehalo::RenderSplitterType::kTopHalo;
+  auto [collections, ray_data] = simulation_data.CollectSplitRayData(context, splitter);
+  ASSERT_FALSE(collections.empty());
+
+  // Every finished ray is in exactly one collection, and collections are sorted by energy.
+  size_t total_num = 0;
+  for (const auto& c : collections) {
+    total_num += c.idx.size();
+  }
+  std::vector<size_t> collection_of_ray(total_num, collections.size());
+  for (size_t i = 0; i < collections.size(); i++) {
+    const auto& c = collections[i];
+    EXPECT_TRUE(c.is_partial_data);
+    EXPECT_TRUE(std::is_sorted(c.idx.begin(), c.idx.end()));
+    float energy = 0;
+    for (auto idx : c.idx) {
+      ASSERT_LT(idx, total_num);
+      EXPECT_EQ(collection_of_ray[idx], collections.size());
+      collection_of_ray[idx] = i;
+      energy += ray_data.buf[idx * 4 + 3];
+    }
+    EXPECT_NEAR(energy, c.total_energy, c.total_energy * 1e-4);
+    if (i > 0) {
+      EXPECT_GE(collections[i - 1].total_energy, c.total_energy);
+    }
+  }
+
+  // Rays of the last scatter are at the end. Check their collections against normalized paths.
+  auto last_rays = GetFinishedRaySegments(simulation_data);
+  ASSERT_LE(last_rays.size(), total_num);
+  for (size_t i = 0; i < last_rays.size(); i++) {
+    auto idx = total_num - last_rays.size() + i;
+    auto ray_path = context->GetRayPath(last_rays[i]);
+    auto normalized_hash =
+        icehalo::NormalizeRayPath(ray_path, context, icehalo::RenderSplitter::kDefaultSymmetry).second;
+    EXPECT_EQ(collections[collection_of_ray[idx]].identifier, normalized_hash);
+  }
+}
+
+
+TEST_F(SimulationTest, RayPathCache) {
+  auto context = MakeContext();
+  EXPECT_EQ(context->ray_path_cache_.Size(), 0u);
+  auto simulation_data = RunFirstWavelength(context);
+
+  icehalo::RenderSplitter splitter;
+  splitter.type = icehalo::RenderSplitterType::kTopHalo;
+  auto ref_collections = std::get<0>(simulation_data.CollectSplitRayData(context, splitter));
+  auto ref_ray_path_map = simulation_data.ray_path_map_;
+  ASSERT_FALSE(ref_ray_path_map.empty());
+  EXPECT_EQ(context->ray_path_cache_.Size(), ref_ray_path_map.size());
+
+  auto check_ray_path_map = [&ref_ray_path_map](const icehalo::RayPathMap& ray_path_map) {
+    ASSERT_EQ(ray_path_map.size(), ref_ray_path_map.size());
+    for (const auto& [hash, entry] : ref_ray_path_map) {
+      ASSERT_EQ(ray_path_map.count(hash), 1u);
+      EXPECT_TRUE(ray_path_map.at(hash).first == entry.first);
+      EXPECT_EQ(ray_path_map.at(hash).second, entry.second);
+    }
+  };
+
+  // Same data again, all paths come from cache.
+  icehalo::SimulationData copied_data = simulation_data;
+  copied_data.ray_path_map_.clear();
+  auto collections = std::get<0>(copied_data.CollectSplitRayData(context, splitter));
+  check_ray_path_map(copied_data.ray_path_map_);
+  ASSERT_EQ(collections.size(), ref_collections.size());
+  for (size_t i = 0; i < collections.size(); i++) {
+    EXPECT_EQ(collections[i].identifier, ref_collections[i].identifier);
+    EXPECT_EQ(collections[i].idx, ref_collections[i].idx);
+  }
+
+  // Round trip through a file, which is rejected by different crystal settings.
+  auto loaded_context = MakeContext();
+  SaveAndLoad(context->ray_path_cache_, &loaded_context->ray_path_cache_);
+  EXPECT_EQ(loaded_context->ray_path_cache_.Size(), ref_ray_path_map.size());
+  for (const auto& [hash, entry] : ref_ray_path_map) {
+    icehalo::RayPathMap::mapped_type cached_entry;
+    ASSERT_TRUE(loaded_context->ray_path_cache_.Find(hash, &cached_entry));
+    EXPECT_TRUE(cached_entry.first == entry.first);
+    EXPECT_EQ(cached_entry.second, entry.second);
+  }
+  copied_data.ray_path_map_.clear();
+  copied_data.CollectSplitRayData(loaded_context, splitter);
+  check_ray_path_map(copied_data.ray_path_map_);
+
+  icehalo::RayPathCache other_cache;
+  other_cache.SetKey(context->ray_path_cache_.GetKey() + 1);
+  LoadTmpFile(&other_cache);
+  EXPECT_EQ(other_cache.Size(), 0u);
+
+  // Corrupted path length, and truncated entries.
+  for (uint32_t len : { 0xffffffffu, 0u }) {
+    icehalo::File file(working_dir.c_str(), kTmpFileName);
+    file.Open(icehalo::FileOpenMode::kWrite);
+    file.Write(icehalo::ISerializable::kDefaultBoi);
+    file.Write(context->ray_path_cache_.GetKey());
+    file.Write(uint64_t{ 5 });
+    if (len > 0) {
+      uint64_t h[2]{ 1, 1 };
+      file.Write(h, 2);
+      file.Write(len);
+    }
+    file.Close();
+
+    icehalo::RayPathCache bad_cache;
+    bad_cache.SetKey(context->ray_path_cache_.GetKey());
+    LoadTmpFile(&bad_cache);
+    EXPECT_EQ(bad_cache.Size(), 0u);
+  }
+}
+
+}  // namespace
@@ -0,0 +1,114 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "util/threading_pool.hpp"
+
+namespace {
+
+class ThreadingPoolTest : public ::testing::Test {
+ protected:
+  static constexpr int kDataSize = 10007;
+  static constexpr int kPoolSize = 4;
+};
+
+
+TEST_F(ThreadingPoolTest, ParallelForIndex) {
+  auto pool = icehalo::ThreadingPool::CreatePool(kPoolSize);
+  std::vector<std::atomic_int> hit_cnt(kDataSize);
+  for (auto& c : hit_cnt) {
+    c = 0;
+  }
+
+  for (int grain : { 0, 1, 7, 64, kDataSize * 2 }) {
+    ASSERT_TRUE(pool->ParallelFor(0, kDataSize, grain, [&hit_cnt](int thread_id, int i) {
+      EXPECT_GE(thread_id, 0);
+      EXPECT_LT(thread_id, kPoolSize);
+      hit_cnt[i]++;
+    }));
+  }
+  for (const auto& c : hit_cnt) {
+    ASSERT_EQ(c, 5);
+  }
+}
+
+
+TEST_F(ThreadingPoolTest, ParallelForChunk) {
+  auto pool = icehalo::ThreadingPool::CreatePool(kPoolSize);
+  constexpr int kStart = 13;
+  constexpr int kGrain = 100;
+  std::vector<int> data(kDataSize, 0);
+  std::atomic_int chunk_cnt{ 0 };
+
+  ASSERT_TRUE(pool->ParallelFor(kStart, kDataSize, kGrain, [&](int /* thread_id */, int start, int end) {
+    EXPECT_LT(start, end);
+    EXPECT_LE(end - start, kGrain);
+    EXPECT_EQ((start - kStart) % kGrain, 0);
+    for (int i = start; i < end; i++) {
+      data[i] += i;
+    }
+    chunk_cnt++;
+  }));
+  EXPECT_EQ(chunk_cnt, (kDataSize - kStart + kGrain - 1) / kGrain);
+  for (int i = 0; i < kDataSize; i++) {
+    ASSERT_EQ(data[i], i < kStart ? 0 : i);
+  }
+
+  // Empty range
+  EXPECT_TRUE(pool->ParallelFor(5, 5, 0, [&](int /* thread_id */, int /* i */) { chunk_cnt++; }));
+  EXPECT_EQ(chunk_cnt, (kDataSize - kStart + kGrain - 1) / kGrain);
+}
+
+
+TEST_F(ThreadingPoolTest, ParallelForMixedJobs) {
+  auto pool = icehalo::ThreadingPool::CreatePool(kPoolSize);
+  std::atomic_int sum{ 0 };
+  for (int k = 0; k < 200; k++) {
+    pool->CommitSingleJob([&sum](int /* thread_id */) { sum++; });
+    ASSERT_TRUE(pool->ParallelFor(0, k, 1, [&sum](int /* thread_id */, int /* i */) { sum++; }));
+  }
+  pool->WaitFinish();
+  EXPECT_EQ(sum, 200 + 199 * 200 / 2);
+
+  pool->Shutdown();
+  EXPECT_FALSE(pool->ParallelFor(0, kDataSize, 0, [](int /* thread_id */, int /* i */) {}));
+}
+
+
+TEST_F(ThreadingPoolTest, ParallelForConcurrentCallers) {
+  auto pool = icehalo::ThreadingPool::CreatePool(kPoolSize);
+  constexpr int kCallerNum = 3;
+  std::vector<std::vector<int>> data(kCallerNum, std::vector<int>(kDataSize, 0));
+  std::vector<std::thread> callers;
+  for (int c = 0; c < kCallerNum; c++) {
+    callers.emplace_back([&pool, &data, c] {
+      for (int k = 0; k < 20; k++) {
+        auto* d = data[c].data();
+        ASSERT_TRUE(pool->ParallelFor(0, kDataSize, 0, [d](int /* thread_id */, int i) { d[i]++; }));
+      }
+    });
+  }
+  for (auto& t : callers) {
+    t.join();
+  }
+  for (const auto& d : data) {
+    for (int i = 0; i < kDataSize; i++) {
+      ASSERT_EQ(d[i], 20);
+    }
+  }
+}
+
+
+TEST_F(ThreadingPoolTest, DefaultPool) {
+  auto pool = icehalo::ThreadingPool::GetDefaultPool();
+  ASSERT_NE(pool, nullptr);
+  EXPECT_EQ(pool, icehalo::ThreadingPool::GetDefaultPool());
+  EXPECT_EQ(pool->GetPoolSize(), icehalo::ThreadingPool::kDefaultPoolSize);
+
+  std::atomic_int sum{ 0 };
+  ASSERT_TRUE(pool->ParallelFor(0, kDataSize, 0, [&sum](int /* thread_id */, int i) { sum += i; }));
+  EXPECT_EQ(sum, (kDataSize - 1) * kDataSize / 2);
+}
+
+}  // namespace